@@ -17,18 +17,194 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "trace.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
+
+/* Initial polling window once polling turns out to be useful */
+#define POLL_NS_START   4000
+#define POLL_GROW_DEFAULT 2
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     int pollfds_idx;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
 };
 
+#ifdef CONFIG_EPOLL_CREATE1
+
+/* Below this number of handlers, a single ppoll() is cheaper than
+ * epoll_wait() plus the ppoll() on the epoll file descriptor.
+ */
+#define EPOLL_ENABLE_THRESHOLD 64
+
+/* Number of events that aio_epoll() fetches at a time */
+#define EPOLL_MAX_EVENTS 128
+
+static void aio_epoll_disable(AioContext *ctx)
+{
+    ctx->epoll_available = false;
+    ctx->epoll_enabled = false;
+}
+
+static int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static int pfd_events_from_epoll(int epoll_events)
+{
+    return (epoll_events & EPOLLIN ? G_IO_IN : 0) |
+           (epoll_events & EPOLLOUT ? G_IO_OUT : 0) |
+           (epoll_events & EPOLLHUP ? G_IO_HUP : 0) |
+           (epoll_events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+/* Registers all handlers with epoll.  Called once, when there are enough
+ * handlers that walking all of them in each aio_poll() gets expensive.
+ */
+static void aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event event;
+    int n = 0;
+
+    if (!ctx->epoll_available || ctx->epoll_enabled) {
+        return;
+    }
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->pfd.events) {
+            n++;
+        }
+    }
+    if (n < EPOLL_ENABLE_THRESHOLD) {
+        return;
+    }
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !node->pfd.events) {
+            continue;
+        }
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        if (epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event)) {
+            aio_epoll_disable(ctx);
+            return;
+        }
+    }
+    ctx->epoll_enabled = true;
+}
+
+/* Keeps the epoll registration of a handler in sync with its events */
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event;
+    int r;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+    if (!node->pfd.events) {
+        r = epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, &event);
+    } else {
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        r = epoll_ctl(ctx->epollfd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                      node->pfd.fd, &event);
+    }
+    if (r) {
+        aio_epoll_disable(ctx);
+    }
+}
+
+/* Waits on the epoll file descriptor, which is the only entry in pfds, and
+ * sets revents of the handlers that are ready.
+ */
+static int aio_epoll(AioContext *ctx, GPollFD *pfds, unsigned npfd,
+                     int64_t timeout)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    AioHandler *node;
+    int i, ret;
+
+    assert(npfd == 1);
+    if (timeout != 0) {
+        /* epoll_wait() only has a resolution of milliseconds */
+        ret = qemu_poll_ns(pfds, npfd, timeout);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+
+    ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events), 0);
+    for (i = 0; i < ret; i++) {
+        node = events[i].data.ptr;
+        node->pfd.revents = pfd_events_from_epoll(events[i].events);
+    }
+    return ret;
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->epoll_available = ctx->epollfd >= 0;
+    ctx->epoll_enabled = false;
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+    }
+}
+
+#else
+
+static void aio_epoll_try_enable(AioContext *ctx)
+{
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+static int aio_epoll(AioContext *ctx, GPollFD *pfds, unsigned npfd,
+                     int64_t timeout)
+{
+    abort();
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+}
+
+#endif
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    return ctx->epoll_enabled;
+#else
+    return false;
+#endif
+}
+
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
@@ -57,6 +233,10 @@ void aio_set_fd_handler(AioContext *ctx,
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
 
+            /* Stop watching the fd before its owner closes it */
+            node->pfd.events = 0;
+            aio_epoll_update(ctx, node, false);
+
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
                 node->deleted = 1;
@@ -71,6 +251,8 @@ void aio_set_fd_handler(AioContext *ctx,
             }
         }
     } else {
+        bool is_new = false;
+
         if (node == NULL) {
             /* Alloc and insert if it's not already there */
             node = g_malloc0(sizeof(AioHandler));
@@ -78,8 +260,9 @@ void aio_set_fd_handler(AioContext *ctx,
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
             g_source_add_poll(&ctx->source, &node->pfd);
+            is_new = true;
         }
-        /* Update handler with latest information */
+        /* Update handler with latest information, io_poll stays as is */
         node->io_read = io_read;
         node->io_write = io_write;
         node->opaque = opaque;
@@ -87,6 +270,11 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+
+        aio_epoll_update(ctx, node, is_new);
+        if (is_new) {
+            aio_epoll_try_enable(ctx);
+        }
     }
 
     aio_notify(ctx);
@@ -100,6 +288,19 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    AioHandler *node;
+
+    node = find_aio_handler(ctx, event_notifier_get_fd(notifier));
+    assert(node);
+    node->io_poll = io_poll;
+
+    aio_notify(ctx);
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
@@ -172,13 +373,87 @@ static bool aio_dispatch(AioContext *ctx)
     return progress;
 }
 
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    ctx->walking_handlers++;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            node->io_poll(node->opaque)) {
+            progress = true;
+        }
+    }
+
+    ctx->walking_handlers--;
+
+    return progress;
+}
+
+/* Busy wait for up to max_ns, or until aio_notify() is called.  Returns true
+ * if a poll function found work.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    int64_t end_time;
+    bool progress;
+
+    end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+
+    do {
+        progress = run_poll_handlers_once(ctx);
+        smp_mb();
+    } while (!progress && !ctx->notified &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    return progress;
+}
+
+/* Adjusts the polling window to the time that the last aio_poll() had to
+ * wait for an event.
+ */
+static void adjust_poll_ns(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        if (ctx->poll_ns == 0) {
+            ctx->poll_ns = POLL_NS_START;
+        } else {
+            ctx->poll_ns *= ctx->poll_grow ? ctx->poll_grow
+                                           : POLL_GROW_DEFAULT;
+        }
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+    }
+
+    if (ctx->poll_ns != old) {
+        trace_aio_poll_adjust(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int ret;
     bool progress;
+    int64_t timeout, start = 0;
 
     progress = false;
+    ctx->notified = false;
 
     /*
      * If there are callbacks left that have been queued, we need to call them.
@@ -203,24 +478,70 @@ bool aio_poll(AioContext *ctx, bool blocking)
     g_array_set_size(ctx->pollfds, 0);
 
     /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        node->pollfds_idx = -1;
-        if (!node->deleted && node->pfd.events) {
-            GPollFD pfd = {
-                .fd = node->pfd.fd,
-                .events = node->pfd.events,
-            };
-            node->pollfds_idx = ctx->pollfds->len;
-            g_array_append_val(ctx->pollfds, pfd);
+    if (aio_epoll_enabled(ctx)) {
+#ifdef CONFIG_EPOLL_CREATE1
+        GPollFD pfd = {
+            .fd = ctx->epollfd,
+            .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
+        };
+        g_array_append_val(ctx->pollfds, pfd);
+#endif
+    } else {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            node->pollfds_idx = -1;
+            if (!node->deleted && node->pfd.events) {
+                GPollFD pfd = {
+                    .fd = node->pfd.fd,
+                    .events = node->pfd.events,
+                };
+                node->pollfds_idx = ctx->pollfds->len;
+                g_array_append_val(ctx->pollfds, pfd);
+            }
         }
     }
 
     ctx->walking_handlers--;
 
+    timeout = blocking ? timerlistgroup_deadline_ns(&ctx->tlg) : 0;
+
+    /* Busy poll for a while before going to sleep.  Completions that arrive
+     * within the window avoid the latency of an eventfd wakeup.
+     */
+    if (timeout && ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        if (ctx->poll_ns) {
+            int64_t max_ns = ctx->poll_ns;
+
+            if (timeout > 0 && timeout < max_ns) {
+                max_ns = timeout;
+            }
+            if (run_poll_handlers(ctx, max_ns)) {
+                ctx->poll_hits++;
+                progress = true;
+                timeout = 0;
+            } else {
+                ctx->poll_misses++;
+            }
+            trace_aio_poll_window(ctx, max_ns, progress);
+        }
+    }
+
     /* wait until next event */
-    ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
-                         ctx->pollfds->len,
-                         blocking ? timerlistgroup_deadline_ns(&ctx->tlg) : 0);
+    if (aio_epoll_enabled(ctx)) {
+        /* aio_epoll() sets revents itself */
+        aio_epoll(ctx, (GPollFD *)ctx->pollfds->data, ctx->pollfds->len,
+                  timeout);
+        ret = 0;
+    } else {
+        ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
+                           ctx->pollfds->len,
+                           timeout);
+    }
+
+    if (start) {
+        adjust_poll_ns(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
 
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
@@ -76,6 +76,21 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    /* Busy polling is not implemented, aio_poll() always waits */
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
@@ -44,6 +44,9 @@
 #include "exec/address-spaces.h"
 #include "hw/audio/pcspk.h"
 #include "migration/page_cache.h"
+#include "migration/page_compress.h"
+#include "migration/auto_converge.h"
+#include "hw/xen/xen.h"
 #include "qemu/config-file.h"
 #include "qmp-commands.h"
 #include "trace.h"
@@ -51,6 +54,7 @@
 #include "exec/ram_addr.h"
 #include "hw/acpi/acpi.h"
 #include "qemu/host-utils.h"
+#include "qemu/sockets.h"
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -106,8 +110,7 @@ int graphic_depth = 32;
 #endif
 
 const uint32_t arch_type = QEMU_ARCH;
-static bool mig_throttle_on;
-static int dirty_rate_high_cnt;
+static int mig_throttle_pct;
 static void check_guest_throttling(void);
 
 /***********************************************************/
@@ -120,7 +123,9 @@ static void check_guest_throttling(void);
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
-/* 0x80 is reserved in migration.h start with 0x100 next */
+/* 0x80 is reserved in migration.h */
+#define RAM_SAVE_FLAG_CHANNEL_SYNC 0x100
+#define RAM_SAVE_FLAG_POSTCOPY 0x200
 
 static struct defconfig_file {
     const char *filename;
@@ -157,19 +162,50 @@ static inline bool is_zero_range(uint8_t *p, uint64_t size)
     return buffer_find_nonzero_offset(p, size) == size;
 }
 
-/* struct contains XBZRLE cache and a static page
-   used by the compression */
-static struct {
+/* Scratch state for XBZRLE encoding and compression.  Each thread that
+   encodes pages has its own set. */
+typedef struct XBZRLEBuffers {
     /* buffer used for XBZRLE encoding */
     uint8_t *encoded_buf;
-    /* buffer for storing page content */
+    /* copy of the page being sent */
     uint8_t *current_buf;
+    /* copy of the cached contents of that page */
+    uint8_t *cached_buf;
+    /* NULL unless the compress capability is on */
+    PageCompressor *compressor;
+} XBZRLEBuffers;
+
+static int xbzrle_buffers_init(XBZRLEBuffers *bufs)
+{
+    /* We prefer not to abort if there is no memory */
+    bufs->encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
+    bufs->current_buf = g_try_malloc(TARGET_PAGE_SIZE);
+    bufs->cached_buf = g_try_malloc(TARGET_PAGE_SIZE);
+    if (!bufs->encoded_buf || !bufs->current_buf || !bufs->cached_buf) {
+        DPRINTF("Error allocating XBZRLE buffers\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void xbzrle_buffers_free(XBZRLEBuffers *bufs)
+{
+    g_free(bufs->encoded_buf);
+    g_free(bufs->current_buf);
+    g_free(bufs->cached_buf);
+    bufs->encoded_buf = NULL;
+    bufs->current_buf = NULL;
+    bufs->cached_buf = NULL;
+}
+
+/* struct contains XBZRLE cache and the buffers used by the
+   migration thread for the compression */
+static struct {
+    XBZRLEBuffers bufs;
     /* Cache for XBZRLE, Protected by lock. */
     PageCache *cache;
     QemuMutex lock;
 } XBZRLE = {
-    .encoded_buf = NULL,
-    .current_buf = NULL,
     .cache = NULL,
 };
 /* buffer used for XBZRLE decoding */
@@ -189,39 +225,24 @@ static void XBZRLE_cache_unlock(void)
 
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache, *cache_to_free;
+    int64_t ret = new_size & TARGET_PAGE_MASK;
 
     if (new_size < TARGET_PAGE_SIZE) {
         return -1;
     }
 
-    /* no need to lock, the current thread holds qemu big lock */
+    /* the cached pages are kept, so this is cheap enough to do while
+       the migration thread waits */
+    XBZRLE_cache_lock();
     if (XBZRLE.cache != NULL) {
-        /* check XBZRLE.cache again later */
-        if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
-            return pow2floor(new_size);
-        }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            DPRINTF("Error creating cache\n");
-            return -1;
+        ret = cache_resize(XBZRLE.cache, new_size);
+        if (ret < 0) {
+            DPRINTF("Error resizing cache\n");
         }
-
-        XBZRLE_cache_lock();
-        /* the XBZRLE.cache may have be destroyed, check it again */
-        if (XBZRLE.cache != NULL) {
-            cache_to_free = XBZRLE.cache;
-            XBZRLE.cache = new_cache;
-        } else {
-            cache_to_free = new_cache;
-        }
-        XBZRLE_cache_unlock();
-
-        cache_fini(cache_to_free);
     }
+    XBZRLE_cache_unlock();
 
-    return pow2floor(new_size);
+    return ret;
 }
 
 /* accounting for migration statistics */
@@ -232,8 +253,16 @@ typedef struct AccountingInfo {
     uint64_t iterations;
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
+    uint64_t xbzrle_cache_hit;
     uint64_t xbzrle_cache_miss;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
+    uint64_t thread_pages;
+    uint64_t thread_bytes;
+    uint64_t thread_wait_ns;
+    uint64_t sync_count;
+    uint64_t sync_ns;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -243,6 +272,21 @@ static void acct_clear(void)
     memset(&acct_info, 0, sizeof(acct_info));
 }
 
+/* Fold the counters of a RAM save thread into the global ones */
+static void acct_merge(AccountingInfo *acct)
+{
+    acct_info.dup_pages += acct->dup_pages;
+    acct_info.norm_pages += acct->norm_pages;
+    acct_info.xbzrle_bytes += acct->xbzrle_bytes;
+    acct_info.xbzrle_pages += acct->xbzrle_pages;
+    acct_info.xbzrle_cache_hit += acct->xbzrle_cache_hit;
+    acct_info.xbzrle_cache_miss += acct->xbzrle_cache_miss;
+    acct_info.xbzrle_overflows += acct->xbzrle_overflows;
+    acct_info.compress_pages += acct->compress_pages;
+    acct_info.compress_bytes += acct->compress_bytes;
+    memset(acct, 0, sizeof(*acct));
+}
+
 uint64_t dup_mig_bytes_transferred(void)
 {
     return acct_info.dup_pages * TARGET_PAGE_SIZE;
@@ -283,6 +327,11 @@ uint64_t xbzrle_mig_pages_transferred(void)
     return acct_info.xbzrle_pages;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
 uint64_t xbzrle_mig_pages_cache_miss(void)
 {
     return acct_info.xbzrle_cache_miss;
@@ -293,6 +342,50 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
+double compress_mig_rate(void)
+{
+    if (!acct_info.compress_bytes) {
+        return 0;
+    }
+    return (double)(acct_info.compress_pages * TARGET_PAGE_SIZE) /
+           acct_info.compress_bytes;
+}
+
+uint64_t ram_thread_pages_transferred(void)
+{
+    return acct_info.thread_pages;
+}
+
+uint64_t ram_thread_bytes_transferred(void)
+{
+    return acct_info.thread_bytes;
+}
+
+uint64_t ram_thread_wait_time(void)
+{
+    return acct_info.thread_wait_ns / 1000000;
+}
+
+uint64_t ram_dirty_sync_count(void)
+{
+    return acct_info.sync_count;
+}
+
+uint64_t ram_dirty_sync_time(void)
+{
+    return acct_info.sync_ns / 1000000;
+}
+
 static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                              int cont, int flag)
 {
@@ -327,69 +420,133 @@ static bool ram_bulk_stage;
  * As a bonus, if the page wasn't in the cache it gets added so that
  * when a small write is made into the 0'd page it gets XBZRLE sent
  */
-static void xbzrle_cache_zero_page(ram_addr_t current_addr)
+static void xbzrle_cache_zero_page(ram_addr_t current_addr, bool bulk_stage)
 {
-    if (ram_bulk_stage || !migrate_use_xbzrle()) {
+    if (bulk_stage || !migrate_use_xbzrle()) {
         return;
     }
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
+    XBZRLE_cache_lock();
     cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE);
+    XBZRLE_cache_unlock();
 }
 
+/* The byte following an XBZRLE record header says how the data is
+ * encoded.  Compressed pages have no flag of their own, there is no bit
+ * left for one, so they use the same record.
+ */
 #define ENCODING_FLAG_XBZRLE 0x1
+/* plus the PageCompressMethod */
+#define ENCODING_FLAG_COMPRESS 0x2
+
+static PageCompressor *ram_compressor_new(void)
+{
+    QEMU_BUILD_BUG_ON((int)MIGRATION_COMPRESS_METHOD_ZLIB != PAGE_COMPRESS_ZLIB);
+    QEMU_BUILD_BUG_ON((int)MIGRATION_COMPRESS_METHOD_LZO != PAGE_COMPRESS_LZO);
+    QEMU_BUILD_BUG_ON((int)MIGRATION_COMPRESS_METHOD_SNAPPY !=
+                      PAGE_COMPRESS_SNAPPY);
+
+    return page_compressor_new(migrate_compress_method(),
+                               migrate_compress_level(), TARGET_PAGE_SIZE);
+}
+
+/* Returns -1 if the page has to be sent in full */
+static int save_compressed_page(QEMUFile *f, uint8_t *p, RAMBlock *block,
+                                ram_addr_t offset, int cont,
+                                XBZRLEBuffers *bufs, AccountingInfo *acct)
+{
+    const uint8_t *out;
+    int len, bytes_sent;
+
+    len = page_compress(bufs->compressor, p, &out);
+    if (len < 0) {
+        return -1;
+    }
+
+    bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_XBZRLE);
+    qemu_put_byte(f, ENCODING_FLAG_COMPRESS +
+                  page_compressor_method(bufs->compressor));
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, out, len);
+    bytes_sent += len + 1 + 2;
+    acct->compress_pages++;
+    acct->compress_bytes += bytes_sent;
+
+    return bytes_sent;
+}
 
+/* The page is copied into BUFS->current_buf first, and on success that
+ * copy is what the cache ends up holding.  Returns -1 if the page has to
+ * be sent in full; unless LAST_STAGE, the caller must then send the copy
+ * so that the destination matches the cache.
+ *
+ * The cache lock is only held while the cache is accessed, so several
+ * threads can encode pages at the same time.
+ */
 static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
                             ram_addr_t current_addr, RAMBlock *block,
-                            ram_addr_t offset, int cont, bool last_stage)
+                            ram_addr_t offset, int cont, bool last_stage,
+                            XBZRLEBuffers *bufs, AccountingInfo *acct)
 {
     int encoded_len = 0, bytes_sent = -1;
-    uint8_t *prev_cached_page;
+    int ret = 0;
+
+    /* save current buffer into memory */
+    memcpy(bufs->current_buf, current_data, TARGET_PAGE_SIZE);
 
+    XBZRLE_cache_lock();
     if (!cache_is_cached(XBZRLE.cache, current_addr)) {
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, current_data) == -1) {
-                return -1;
-            }
+            ret = cache_insert(XBZRLE.cache, current_addr, bufs->current_buf);
+        }
+        XBZRLE_cache_unlock();
+        if (ret == -1) {
+            return -1;
         }
-        acct_info.xbzrle_cache_miss++;
+        acct->xbzrle_cache_miss++;
         return -1;
     }
-
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
-
-    /* save current buffer into memory */
-    memcpy(XBZRLE.current_buf, current_data, TARGET_PAGE_SIZE);
+    memcpy(bufs->cached_buf, get_cached_data(XBZRLE.cache, current_addr),
+           TARGET_PAGE_SIZE);
+    XBZRLE_cache_unlock();
+    acct->xbzrle_cache_hit++;
 
     /* XBZRLE encoding (if there is no overflow) */
-    encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
-                                       TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
+    encoded_len = xbzrle_encode_buffer(bufs->cached_buf, bufs->current_buf,
+                                       TARGET_PAGE_SIZE, bufs->encoded_buf,
                                        TARGET_PAGE_SIZE);
     if (encoded_len == 0) {
         DPRINTF("Skipping unmodified page\n");
         return 0;
-    } else if (encoded_len == -1) {
-        DPRINTF("Overflow\n");
-        acct_info.xbzrle_overflows++;
-        /* update data in the cache */
-        memcpy(prev_cached_page, current_data, TARGET_PAGE_SIZE);
-        return -1;
     }
 
-    /* we need to update the data in the cache, in order to get the same data */
-    if (!last_stage) {
-        memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+    /* we need to update the data in the cache, in order to get the same
+     * data; another thread may have evicted the page meanwhile */
+    if (encoded_len == -1 || !last_stage) {
+        XBZRLE_cache_lock();
+        if (cache_is_cached(XBZRLE.cache, current_addr)) {
+            memcpy(get_cached_data(XBZRLE.cache, current_addr),
+                   bufs->current_buf, TARGET_PAGE_SIZE);
+        }
+        XBZRLE_cache_unlock();
+    }
+
+    if (encoded_len == -1) {
+        DPRINTF("Overflow\n");
+        acct->xbzrle_overflows++;
+        return -1;
     }
 
     /* Send XBZRLE based compressed page */
     bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_XBZRLE);
     qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
     qemu_put_be16(f, encoded_len);
-    qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
+    qemu_put_buffer(f, bufs->encoded_buf, encoded_len);
     bytes_sent += encoded_len + 1 + 2;
-    acct_info.xbzrle_pages++;
-    acct_info.xbzrle_bytes += bytes_sent;
+    acct->xbzrle_pages++;
+    acct->xbzrle_bytes += bytes_sent;
 
     return bytes_sent;
 }
@@ -418,58 +575,186 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_set_dirty(ram_addr_t addr)
+/*
+ * Dirty bitmap sync
+ *
+ * RAMBlocks start on a word of the dirty bitmaps (see find_ram_offset),
+ * so the dirty log of the migration client is harvested a word at a
+ * time: each word is swapped with zero and merged into migration_bitmap.
+ * Writers of the dirty log use atomic operations as well, so only
+ * fetching the log from the accelerator needs the iothread lock.  The
+ * rest runs in chunks, which the idle RAM save threads take their share
+ * of, so that no thread has to be started for each sync.
+ */
+
+#define SYNC_CHUNK_WORDS 4096
+
+typedef struct SyncChunk {
+    unsigned long start;        /* first word */
+    unsigned long nr;           /* number of words */
+    int block;                  /* index in dirty_rate.blocks */
+    uint64_t dirty_pages;       /* pages found dirty */
+} SyncChunk;
+
+static struct {
+    SyncChunk *chunks;
+    int nb_chunks;
+    int next_chunk;
+    int64_t start_time;
+} bitmap_sync;
+
+static uint64_t ram_save_threads_sync_chunks(void);
+
+static uint64_t migration_bitmap_sync_chunks(void)
+{
+    unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+    uint64_t num_dirty_pages = 0;
+    int i;
+
+    while ((i = atomic_fetch_inc(&bitmap_sync.next_chunk)) <
+           bitmap_sync.nb_chunks) {
+        SyncChunk *chunk = &bitmap_sync.chunks[i];
+        unsigned long k, dirty;
+
+        chunk->dirty_pages = 0;
+        for (k = chunk->start; k < chunk->start + chunk->nr; k++) {
+            if (atomic_read(&src[k])) {
+                dirty = atomic_xchg(&src[k], 0);
+                chunk->dirty_pages += ctpopl(dirty);
+                num_dirty_pages += ctpopl(dirty & ~migration_bitmap[k]);
+                migration_bitmap[k] |= dirty;
+            }
+        }
+    }
+    return num_dirty_pages;
+}
+
+/*
+ * Dirty rate estimation and throttling
+ *
+ * Every sync counts the pages found dirty in each RAMBlock.  Once a
+ * second or so, that gives the dirty rate of each block and of the
+ * whole guest, and with auto-converge, the share of time the vCPUs are
+ * kept out of the guest is adjusted (see auto_converge.c).
+ */
+
+#define THROTTLE_TIMESLICE_MS 10
+
+typedef struct BlockDirtyRate {
+    char idstr[256];
+    ram_addr_t length;
+    uint64_t dirty_pages;       /* since the start of the period */
+    int64_t rate;               /* pages per second, last period */
+} BlockDirtyRate;
+
+/* Protected by the ramlist lock */
+static struct {
+    BlockDirtyRate *blocks;
+    int nb_blocks;
+    uint32_t version;
+    int64_t rate;
+} dirty_rate;
+
+/* The blocks are in the order of ram_list.blocks */
+static void dirty_rate_blocks_refresh(void)
 {
-    bool ret;
-    int nr = addr >> TARGET_PAGE_BITS;
+    RAMBlock *block;
+    int n = 0;
 
-    ret = test_and_set_bit(nr, migration_bitmap);
+    if (dirty_rate.blocks && dirty_rate.version == ram_list.version) {
+        return;
+    }
 
-    if (!ret) {
-        migration_dirty_pages++;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        n++;
+    }
+    g_free(dirty_rate.blocks);
+    dirty_rate.blocks = g_new0(BlockDirtyRate, n);
+    dirty_rate.nb_blocks = n;
+    dirty_rate.version = ram_list.version;
+
+    n = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        pstrcpy(dirty_rate.blocks[n].idstr, sizeof(dirty_rate.blocks[n].idstr),
+                block->idstr);
+        dirty_rate.blocks[n].length = block->length;
+        n++;
     }
-    return ret;
 }
 
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+static void dirty_rate_update(int64_t period_ms)
 {
-    ram_addr_t addr;
-    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
-
-    /* start address is aligned at the start of a word? */
-    if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
-
-        for (k = page; k < page + nr; k++) {
-            if (src[k]) {
-                unsigned long new_dirty;
-                new_dirty = ~migration_bitmap[k];
-                migration_bitmap[k] |= src[k];
-                new_dirty &= src[k];
-                migration_dirty_pages += ctpopl(new_dirty);
-                src[k] = 0;
-            }
-        }
-    } else {
-        for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(start + addr,
-                                              TARGET_PAGE_SIZE,
-                                              DIRTY_MEMORY_MIGRATION)) {
-                cpu_physical_memory_reset_dirty(start + addr,
-                                                TARGET_PAGE_SIZE,
-                                                DIRTY_MEMORY_MIGRATION);
-                migration_bitmap_set_dirty(start + addr);
-            }
-        }
+    int i;
+
+    for (i = 0; i < dirty_rate.nb_blocks; i++) {
+        BlockDirtyRate *b = &dirty_rate.blocks[i];
+
+        b->rate = b->dirty_pages * 1000 / period_ms;
+        b->dirty_pages = 0;
+    }
+}
+
+static void mig_throttle_update(int64_t dirty_bytes, int64_t xfer_bytes,
+                                int64_t period_ms)
+{
+    int pct;
+
+    if (!migrate_auto_converge()) {
+        atomic_set(&mig_throttle_pct, 0);
+        return;
+    }
+    if (xfer_bytes <= 0) {
+        return;
     }
+
+    pct = auto_converge_throttle(mig_throttle_pct,
+                                 (double)dirty_bytes / xfer_bytes,
+                                 auto_converge_target(migrate_max_downtime(),
+                                                      period_ms));
+    if (pct != mig_throttle_pct) {
+        trace_migration_throttle(pct);
+    }
+    atomic_set(&mig_throttle_pct, pct);
 }
 
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_malloc0(sizeof(*info));
+    RamBlockDirtyRateList *head = NULL, *entry;
+    int i;
+
+    qemu_mutex_lock_ramlist();
+    info->dirty_pages_rate = dirty_rate.rate;
+    info->throttle_percentage = atomic_read(&mig_throttle_pct);
+    for (i = dirty_rate.nb_blocks - 1; i >= 0; i--) {
+        BlockDirtyRate *b = &dirty_rate.blocks[i];
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->id = g_strdup(b->idstr);
+        entry->value->size = b->length;
+        entry->value->dirty_pages_rate = b->rate;
+        entry->next = head;
+        head = entry;
+    }
+    qemu_mutex_unlock_ramlist();
+
+    info->blocks = head;
+    return info;
+}
 
 /* Needs iothread lock! */
 
-static void migration_bitmap_sync(void)
+static void migration_bitmap_sync_begin(void)
+{
+    trace_migration_bitmap_sync_start();
+    bitmap_sync.start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    address_space_sync_dirty_bitmap(&address_space_memory);
+}
+
+/* Needs ramlist lock, but not the iothread lock */
+
+static void migration_bitmap_sync_end(void)
 {
     RAMBlock *block;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
@@ -479,6 +764,7 @@ static void migration_bitmap_sync(void)
     static int64_t num_dirty_pages_period;
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int nb_chunks = 0, nb_blocks = 0, i;
 
     if (!bytes_xfer_prev) {
         bytes_xfer_prev = ram_bytes_transferred();
@@ -488,46 +774,207 @@ static void migration_bitmap_sync(void)
         start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     }
 
-    trace_migration_bitmap_sync_start();
-    address_space_sync_dirty_bitmap(&address_space_memory);
-
+    dirty_rate_blocks_refresh();
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        nb_chunks += DIV_ROUND_UP(BITS_TO_LONGS(block->length >>
+                                                TARGET_PAGE_BITS),
+                                  SYNC_CHUNK_WORDS);
+    }
+    bitmap_sync.chunks = g_renew(SyncChunk, bitmap_sync.chunks, nb_chunks);
+    bitmap_sync.nb_chunks = 0;
+    bitmap_sync.next_chunk = 0;
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->mr->ram_addr, block->length);
+        unsigned long start = BIT_WORD(block->offset >> TARGET_PAGE_BITS);
+        unsigned long end = start + BITS_TO_LONGS(block->length >>
+                                                  TARGET_PAGE_BITS);
+
+        assert(((start * BITS_PER_LONG) << TARGET_PAGE_BITS) == block->offset);
+        for (; start < end; start += SYNC_CHUNK_WORDS) {
+            SyncChunk *chunk = &bitmap_sync.chunks[bitmap_sync.nb_chunks++];
+
+            chunk->start = start;
+            chunk->nr = MIN(end - start, SYNC_CHUNK_WORDS);
+            chunk->block = nb_blocks;
+        }
+        nb_blocks++;
+    }
+
+    migration_dirty_pages += ram_save_threads_sync_chunks();
+    for (i = 0; i < bitmap_sync.nb_chunks; i++) {
+        SyncChunk *chunk = &bitmap_sync.chunks[i];
+
+        dirty_rate.blocks[chunk->block].dirty_pages += chunk->dirty_pages;
     }
+
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
+    acct_info.sync_count++;
+    acct_info.sync_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                         bitmap_sync.start_time;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
-        if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
-            bytes_xfer_now = ram_bytes_transferred();
-            if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
-                    mig_throttle_on = true;
-                    dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
-        } else {
-             mig_throttle_on = false;
-        }
+        bytes_xfer_now = ram_bytes_transferred();
+        mig_throttle_update(num_dirty_pages_period * TARGET_PAGE_SIZE,
+                            bytes_xfer_now - bytes_xfer_prev,
+                            end_time - start_time);
+        bytes_xfer_prev = bytes_xfer_now;
+        dirty_rate_update(end_time - start_time);
         s->dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
         s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
+        dirty_rate.rate = s->dirty_pages_rate;
         start_time = end_time;
         num_dirty_pages_period = 0;
     }
 }
 
+/* Needs iothread lock and ramlist lock! */
+
+static void migration_bitmap_sync(void)
+{
+    migration_bitmap_sync_begin();
+    migration_bitmap_sync_end();
+}
+
+/* RAM that goes to fixed offsets of a file instead of the stream, see
+   migration-file.c.  The page at a ram_addr_t is at base plus that
+   offset, on both sides. */
+static struct {
+    int fd;
+    uint64_t base;
+    int error;
+    /* the file guest RAM was mapped from on load, which must not be
+       truncated while the guest runs */
+    bool mapped;
+    dev_t dev;
+    ino_t ino;
+} ram_file = {
+    .fd = -1,
+};
+
+/* Pages dirtied again are simply written again over their old copy */
+static int ram_file_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                              bool bulk_stage, AccountingInfo *acct)
+{
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+    off_t pos = ram_file.base + block->offset + offset;
+    ssize_t ret;
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct->dup_pages++;
+        /* the file starts out as zeroes */
+        if (bulk_stage) {
+            return 0;
+        }
+        p = (uint8_t *)ZERO_TARGET_PAGE;
+    } else {
+        acct->norm_pages++;
+    }
+
+    do {
+        ret = pwrite(ram_file.fd, p, TARGET_PAGE_SIZE, pos);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != TARGET_PAGE_SIZE) {
+        atomic_cmpxchg(&ram_file.error, 0, ret < 0 ? -errno : -EIO);
+        return 0;
+    }
+
+    /* so that the bandwidth estimate includes the page */
+    qemu_update_position(f, TARGET_PAGE_SIZE);
+    qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+    return TARGET_PAGE_SIZE;
+}
+
+/*
+ * ram_save_page: Writes the page at offset in block to the stream f
+ *
+ * bulk_stage is the value of ram_bulk_stage when the page was picked;
+ * encoding threads get it with their chunk instead of reading the global.
+ *
+ * Returns:  The number of bytes written.
+ *           0 means the page was unmodified and has been skipped
+ */
+
+static int ram_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                         int cont, bool last_stage, bool bulk_stage,
+                         XBZRLEBuffers *bufs, AccountingInfo *acct)
+{
+    int ret;
+    int bytes_sent;
+    uint8_t *p;
+    bool send_async = true;
+    ram_addr_t current_addr;
+
+    if (ram_file.fd >= 0) {
+        return ram_file_save_page(f, block, offset, bulk_stage, acct);
+    }
+
+    p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    /* In doubt sent page as normal */
+    bytes_sent = -1;
+    ret = ram_control_save_page(f, block->offset,
+                                offset, TARGET_PAGE_SIZE, &bytes_sent);
+
+    current_addr = block->offset + offset;
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_sent > 0) {
+                acct->norm_pages++;
+            } else if (bytes_sent == 0) {
+                acct->dup_pages++;
+            }
+        }
+    } else if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct->dup_pages++;
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent++;
+        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
+         * page would be stale
+         */
+        xbzrle_cache_zero_page(current_addr, bulk_stage);
+    } else if (!bulk_stage && migrate_use_xbzrle()) {
+        bytes_sent = save_xbzrle_page(f, p, current_addr, block,
+                                      offset, cont, last_stage, bufs, acct);
+        if (!last_stage) {
+            /* We must send exactly what's in the xbzrle cache
+             * even if the page wasn't xbzrle compressed, so that
+             * it's right next time.
+             */
+            p = bufs->current_buf;
+
+            /* Can't send this copy async, since it is reused for
+             * the next page before it gets to the wire
+             */
+            send_async = false;
+        }
+    }
+
+    if (bytes_sent == -1 && bufs->compressor) {
+        bytes_sent = save_compressed_page(f, p, block, offset, cont,
+                                          bufs, acct);
+    }
+
+    /* XBZRLE overflow or normal page */
+    if (bytes_sent == -1) {
+        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        if (send_async) {
+            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        } else {
+            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        }
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct->norm_pages++;
+    }
+
+    return bytes_sent;
+}
+
 /*
  * ram_save_block: Writes a page of memory to the stream f
  *
@@ -542,7 +989,6 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     bool complete_round = false;
     int bytes_sent = 0;
     MemoryRegion *mr;
-    ram_addr_t current_addr;
 
     if (!block)
         block = QTAILQ_FIRST(&ram_list.blocks);
@@ -563,70 +1009,13 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
                 ram_bulk_stage = false;
             }
         } else {
-            int ret;
-            uint8_t *p;
-            bool send_async = true;
             int cont = (block == last_sent_block) ?
                 RAM_SAVE_FLAG_CONTINUE : 0;
 
-            p = memory_region_get_ram_ptr(mr) + offset;
-
-            /* In doubt sent page as normal */
-            bytes_sent = -1;
-            ret = ram_control_save_page(f, block->offset,
-                               offset, TARGET_PAGE_SIZE, &bytes_sent);
-
-            XBZRLE_cache_lock();
-
-            current_addr = block->offset + offset;
-            if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
-                if (ret != RAM_SAVE_CONTROL_DELAYED) {
-                    if (bytes_sent > 0) {
-                        acct_info.norm_pages++;
-                    } else if (bytes_sent == 0) {
-                        acct_info.dup_pages++;
-                    }
-                }
-            } else if (is_zero_range(p, TARGET_PAGE_SIZE)) {
-                acct_info.dup_pages++;
-                bytes_sent = save_block_hdr(f, block, offset, cont,
-                                            RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, 0);
-                bytes_sent++;
-                /* Must let xbzrle know, otherwise a previous (now 0'd) cached
-                 * page would be stale
-                 */
-                xbzrle_cache_zero_page(current_addr);
-            } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    /* We must send exactly what's in the xbzrle cache
-                     * even if the page wasn't xbzrle compressed, so that
-                     * it's right next time.
-                     */
-                    p = get_cached_data(XBZRLE.cache, current_addr);
-
-                    /* Can't send this cached data async, since the cache page
-                     * might get updated before it gets to the wire
-                     */
-                    send_async = false;
-                }
-            }
-
-            /* XBZRLE overflow or normal page */
-            if (bytes_sent == -1) {
-                bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                if (send_async) {
-                    qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
-                } else {
-                    qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                }
-                bytes_sent += TARGET_PAGE_SIZE;
-                acct_info.norm_pages++;
-            }
+            bytes_sent = ram_save_page(f, block, offset, cont, last_stage,
+                                       ram_bulk_stage, &XBZRLE.bufs,
+                                       &acct_info);
 
-            XBZRLE_cache_unlock();
             /* if page is unmodified, continue to the next */
             if (bytes_sent > 0) {
                 last_sent_block = block;
@@ -640,15 +1029,533 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     return bytes_sent;
 }
 
-static uint64_t bytes_transferred;
+/*
+ * RAM channels
+ *
+ * When the migration transport opened extra channels, the RAM save
+ * threads write their chunks to those instead of the main stream.  Every
+ * chunk starts with a full block header, so the destination can load
+ * each channel on its own.  At the end of each section a sync record goes
+ * on every channel and on the main stream; the destination does not get
+ * past the one on the main stream before it has seen it on all channels.
+ * As a page is sent at most once per section, this keeps every page's
+ * updates in order.
+ */
 
-void acct_update_position(QEMUFile *f, size_t size, bool zero)
+typedef struct RamChannel {
+    QEMUFile *file;
+    /* source: serialises the threads sharing the channel */
+    QemuMutex lock;
+    /* destination: the loading thread and its state */
+    QemuThread thread;
+    RAMBlock *block;
+    uint8_t *buf;
+    uint64_t syncs;
+    int error;
+    bool done;
+} RamChannel;
+
+static struct {
+    RamChannel **channels;
+    int nb_channels;
+    /* destination: protects syncs, error and done */
+    QemuMutex lock;
+    QemuCond sync_cond;
+    uint64_t syncs;
+} ram_channels;
+
+static void ram_channels_init(void)
 {
-    uint64_t pages = size / TARGET_PAGE_SIZE;
-    if (zero) {
-        acct_info.dup_pages += pages;
-    } else {
-        acct_info.norm_pages += pages;
+    if (!ram_channels.channels) {
+        qemu_mutex_init(&ram_channels.lock);
+        qemu_cond_init(&ram_channels.sync_cond);
+        ram_channels.syncs = 0;
+    }
+}
+
+static RamChannel *ram_channel_add(QEMUFile *f)
+{
+    RamChannel *c = g_new0(RamChannel, 1);
+
+    ram_channels_init();
+    c->file = f;
+    qemu_mutex_init(&c->lock);
+    ram_channels.channels = g_renew(RamChannel *, ram_channels.channels,
+                                    ram_channels.nb_channels + 1);
+    ram_channels.channels[ram_channels.nb_channels++] = c;
+    return c;
+}
+
+static void ram_channels_free(void)
+{
+    int i;
+
+    if (!ram_channels.channels) {
+        return;
+    }
+    for (i = 0; i < ram_channels.nb_channels; i++) {
+        qemu_mutex_destroy(&ram_channels.channels[i]->lock);
+        g_free(ram_channels.channels[i]->buf);
+        g_free(ram_channels.channels[i]);
+    }
+    qemu_cond_destroy(&ram_channels.sync_cond);
+    qemu_mutex_destroy(&ram_channels.lock);
+    g_free(ram_channels.channels);
+    ram_channels.channels = NULL;
+    ram_channels.nb_channels = 0;
+}
+
+/* The source side; the files belong to the MigrationState */
+static void ram_channels_setup(QEMUFile **files, int nb_files)
+{
+    int i;
+
+    for (i = 0; i < nb_files; i++) {
+        ram_channel_add(files[i]);
+    }
+}
+
+/* Write a sync record on every channel and on f, followed on the channels
+   by an end of stream record if last.  Returns a channel's error, if any. */
+static int ram_channels_sync(QEMUFile *f, bool last)
+{
+    int i, ret = 0;
+
+    if (!ram_channels.channels) {
+        return 0;
+    }
+
+    for (i = 0; i < ram_channels.nb_channels; i++) {
+        RamChannel *c = ram_channels.channels[i];
+
+        qemu_mutex_lock(&c->lock);
+        qemu_put_be64(c->file, RAM_SAVE_FLAG_CHANNEL_SYNC);
+        if (last) {
+            qemu_put_be64(c->file, RAM_SAVE_FLAG_EOS);
+        }
+        qemu_fflush(c->file);
+        if (!ret) {
+            ret = qemu_file_get_error(c->file);
+        }
+        qemu_mutex_unlock(&c->lock);
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHANNEL_SYNC);
+
+    return ret;
+}
+
+/*
+ * RAM save threads
+ *
+ * With more than one thread configured, the migration thread only walks
+ * the dirty bitmap.  It hands chunks of dirty pages from one RAMBlock to
+ * a pool of threads, each of which checks them for zero pages, encodes
+ * them with XBZRLE and writes the records into a buffer of its own.  The
+ * first record of a chunk always names its RAMBlock, so the migration
+ * thread can copy the buffers into the stream in whatever order the
+ * chunks complete and the stream format does not change.  Between
+ * rounds, the idle threads also help sync the dirty bitmap.
+ */
+
+#define RAM_SAVE_CHUNK_PAGES 64
+
+enum {
+    RAM_SAVE_THREAD_IDLE,
+    RAM_SAVE_THREAD_BUSY,
+    RAM_SAVE_THREAD_DONE,
+    RAM_SAVE_THREAD_SYNC,       /* harvesting dirty bitmap chunks */
+};
+
+typedef struct RamSaveThread {
+    QemuThread thread;
+    QemuCond cond;
+    int state;
+    /* the chunk to encode */
+    RAMBlock *block;
+    ram_addr_t pages[RAM_SAVE_CHUNK_PAGES];
+    int nb_pages;
+    bool last_stage;
+    bool bulk_stage;
+    /* the encoded records, collected through file */
+    QEMUFile *file;
+    uint8_t *buf;
+    size_t buf_len;
+    size_t buf_size;
+    int bytes_sent;
+    /* where the records go, if not to the main stream */
+    RamChannel *channel;
+    int channel_error;
+    XBZRLEBuffers bufs;
+    AccountingInfo acct;
+} RamSaveThread;
+
+static struct {
+    RamSaveThread *threads;
+    int nb_threads;
+    QemuMutex lock;
+    QemuCond done_cond;
+    bool quit;
+    /* threads still in RAM_SAVE_THREAD_SYNC, and what they found */
+    int nb_syncing;
+    uint64_t sync_dirty_pages;
+} ram_save_pool;
+
+static int ram_save_thread_put_buffer(void *opaque, const uint8_t *buf,
+                                      int64_t pos, int size)
+{
+    RamSaveThread *t = opaque;
+
+    if (t->buf_len + size > t->buf_size) {
+        t->buf_size = MAX(t->buf_size * 2, t->buf_len + size);
+        t->buf = g_realloc(t->buf, t->buf_size);
+    }
+    memcpy(t->buf + t->buf_len, buf, size);
+    t->buf_len += size;
+    return size;
+}
+
+static const QEMUFileOps ram_save_thread_ops = {
+    .put_buffer = ram_save_thread_put_buffer,
+};
+
+static void *ram_save_thread(void *opaque)
+{
+    RamSaveThread *t = opaque;
+    uint64_t num_dirty_pages;
+    int i, bytes_sent, cont;
+
+    qemu_mutex_lock(&ram_save_pool.lock);
+    while (true) {
+        while (t->state != RAM_SAVE_THREAD_BUSY &&
+               t->state != RAM_SAVE_THREAD_SYNC && !ram_save_pool.quit) {
+            qemu_cond_wait(&t->cond, &ram_save_pool.lock);
+        }
+        if (ram_save_pool.quit) {
+            break;
+        }
+        qemu_mutex_unlock(&ram_save_pool.lock);
+
+        if (t->state == RAM_SAVE_THREAD_SYNC) {
+            num_dirty_pages = migration_bitmap_sync_chunks();
+
+            qemu_mutex_lock(&ram_save_pool.lock);
+            ram_save_pool.sync_dirty_pages += num_dirty_pages;
+            ram_save_pool.nb_syncing--;
+            t->state = RAM_SAVE_THREAD_IDLE;
+            qemu_cond_signal(&ram_save_pool.done_cond);
+            continue;
+        }
+
+        cont = 0;
+        t->bytes_sent = 0;
+        for (i = 0; i < t->nb_pages; i++) {
+            bytes_sent = ram_save_page(t->file, t->block, t->pages[i], cont,
+                                       t->last_stage, t->bulk_stage,
+                                       &t->bufs, &t->acct);
+            if (bytes_sent > 0) {
+                t->bytes_sent += bytes_sent;
+                cont = RAM_SAVE_FLAG_CONTINUE;
+            }
+        }
+        qemu_fflush(t->file);
+
+        if (t->channel) {
+            qemu_mutex_lock(&t->channel->lock);
+            qemu_put_buffer(t->channel->file, t->buf, t->buf_len);
+            t->channel_error = qemu_file_get_error(t->channel->file);
+            qemu_mutex_unlock(&t->channel->lock);
+        }
+
+        qemu_mutex_lock(&ram_save_pool.lock);
+        t->state = RAM_SAVE_THREAD_DONE;
+        qemu_cond_signal(&ram_save_pool.done_cond);
+    }
+    qemu_mutex_unlock(&ram_save_pool.lock);
+
+    return NULL;
+}
+
+static void ram_save_threads_stop(void)
+{
+    int i;
+
+    if (!ram_save_pool.threads) {
+        return;
+    }
+
+    qemu_mutex_lock(&ram_save_pool.lock);
+    ram_save_pool.quit = true;
+    for (i = 0; i < ram_save_pool.nb_threads; i++) {
+        qemu_cond_signal(&ram_save_pool.threads[i].cond);
+    }
+    qemu_mutex_unlock(&ram_save_pool.lock);
+
+    for (i = 0; i < ram_save_pool.nb_threads; i++) {
+        RamSaveThread *t = &ram_save_pool.threads[i];
+
+        qemu_thread_join(&t->thread);
+        qemu_cond_destroy(&t->cond);
+        qemu_fclose(t->file);
+        g_free(t->buf);
+        xbzrle_buffers_free(&t->bufs);
+        page_compressor_free(t->bufs.compressor);
+    }
+    qemu_cond_destroy(&ram_save_pool.done_cond);
+    qemu_mutex_destroy(&ram_save_pool.lock);
+    g_free(ram_save_pool.threads);
+    ram_save_pool.threads = NULL;
+    ram_save_pool.nb_threads = 0;
+}
+
+static int ram_save_threads_start(int nb_threads)
+{
+    int i;
+
+    qemu_mutex_init(&ram_save_pool.lock);
+    qemu_cond_init(&ram_save_pool.done_cond);
+    ram_save_pool.quit = false;
+    ram_save_pool.threads = g_new0(RamSaveThread, nb_threads);
+    ram_save_pool.nb_threads = nb_threads;
+
+    for (i = 0; i < nb_threads; i++) {
+        RamSaveThread *t = &ram_save_pool.threads[i];
+
+        if (migrate_use_compression()) {
+            t->bufs.compressor = ram_compressor_new();
+        }
+        if ((migrate_use_xbzrle() && xbzrle_buffers_init(&t->bufs) < 0) ||
+            (migrate_use_compression() && !t->bufs.compressor)) {
+            xbzrle_buffers_free(&t->bufs);
+            page_compressor_free(t->bufs.compressor);
+            ram_save_pool.nb_threads = i;
+            ram_save_threads_stop();
+            return -1;
+        }
+        qemu_cond_init(&t->cond);
+        t->file = qemu_fopen_ops(t, &ram_save_thread_ops);
+        if (ram_channels.nb_channels) {
+            t->channel = ram_channels.channels[i % ram_channels.nb_channels];
+        }
+        qemu_thread_create(&t->thread, "ram_save", ram_save_thread, t,
+                           QEMU_THREAD_JOINABLE);
+    }
+    return 0;
+}
+
+/*
+ * Harvest the dirty bitmap chunks set up by migration_bitmap_sync_end,
+ * with the help of the idle RAM save threads if there are any.  The
+ * calling thread takes chunks too, so nothing waits on a thread that has
+ * yet to be scheduled before the work starts.
+ *
+ * Returns:  The number of pages newly dirty in migration_bitmap.
+ */
+static uint64_t ram_save_threads_sync_chunks(void)
+{
+    uint64_t num_dirty_pages;
+    int i, nb_helpers;
+
+    if (!ram_save_pool.threads || bitmap_sync.nb_chunks < 2) {
+        return migration_bitmap_sync_chunks();
+    }
+
+    qemu_mutex_lock(&ram_save_pool.lock);
+    nb_helpers = MIN(ram_save_pool.nb_threads, bitmap_sync.nb_chunks - 1);
+    for (i = 0; i < ram_save_pool.nb_threads && nb_helpers; i++) {
+        RamSaveThread *t = &ram_save_pool.threads[i];
+
+        if (t->state == RAM_SAVE_THREAD_IDLE) {
+            t->state = RAM_SAVE_THREAD_SYNC;
+            ram_save_pool.nb_syncing++;
+            nb_helpers--;
+            qemu_cond_signal(&t->cond);
+        }
+    }
+    qemu_mutex_unlock(&ram_save_pool.lock);
+
+    num_dirty_pages = migration_bitmap_sync_chunks();
+
+    qemu_mutex_lock(&ram_save_pool.lock);
+    while (ram_save_pool.nb_syncing) {
+        qemu_cond_wait(&ram_save_pool.done_cond, &ram_save_pool.lock);
+    }
+    num_dirty_pages += ram_save_pool.sync_dirty_pages;
+    ram_save_pool.sync_dirty_pages = 0;
+    qemu_mutex_unlock(&ram_save_pool.lock);
+
+    return num_dirty_pages;
+}
+
+/*
+ * Collects up to RAM_SAVE_CHUNK_PAGES dirty pages of one RAMBlock into
+ * pages, clearing their dirty bits, and continues from there next time.
+ *
+ * Returns:  The number of pages found.
+ *           0 means no dirty pages
+ */
+
+static int ram_find_dirty_chunk(RAMBlock **pblock, ram_addr_t *pages)
+{
+    RAMBlock *block = last_seen_block;
+    ram_addr_t offset = last_offset;
+    bool complete_round = false;
+    int nb_pages = 0;
+
+    if (!block)
+        block = QTAILQ_FIRST(&ram_list.blocks);
+
+    while (true) {
+        offset = migration_bitmap_find_and_reset_dirty(block->mr, offset);
+        if (complete_round && block == last_seen_block &&
+            offset >= last_offset) {
+            break;
+        }
+        if (offset >= block->length) {
+            /* a chunk does not span RAMBlocks */
+            if (nb_pages) {
+                break;
+            }
+            offset = 0;
+            block = QTAILQ_NEXT(block, next);
+            if (!block) {
+                block = QTAILQ_FIRST(&ram_list.blocks);
+                complete_round = true;
+                ram_bulk_stage = false;
+            }
+        } else {
+            pages[nb_pages++] = offset;
+            if (nb_pages == RAM_SAVE_CHUNK_PAGES) {
+                break;
+            }
+        }
+    }
+    last_seen_block = block;
+    last_offset = offset;
+
+    *pblock = block;
+    return nb_pages;
+}
+
+/* Copy the records of a finished chunk into the stream, or account for
+   them if the thread sent them on its channel.  Called with the pool lock
+   held. */
+static int ram_save_thread_collect(QEMUFile *f, RamSaveThread *t)
+{
+    int bytes_sent = t->bytes_sent;
+
+    if (t->channel) {
+        qemu_update_position(f, t->buf_len);
+        qemu_file_update_transfer(f, t->buf_len);
+        if (t->channel_error) {
+            qemu_file_set_error(f, t->channel_error);
+        }
+    } else {
+        qemu_put_buffer(f, t->buf, t->buf_len);
+        if (ram_file.fd >= 0) {
+            /* the pages went straight to the file */
+            qemu_update_position(f, bytes_sent);
+            qemu_file_update_transfer(f, bytes_sent);
+        }
+    }
+    t->buf_len = 0;
+    acct_info.thread_pages += t->nb_pages;
+    acct_info.thread_bytes += bytes_sent;
+    acct_merge(&t->acct);
+    t->state = RAM_SAVE_THREAD_IDLE;
+    return bytes_sent;
+}
+
+/*
+ * ram_save_block_threaded: Like ram_save_block, but hands dirty pages to
+ * the RAM save threads.  Chunks still being encoded when this returns are
+ * written by a later call or by ram_save_threads_flush.
+ *
+ * Returns:  The number of bytes written.
+ *           0 means no dirty pages and nothing left in flight
+ */
+
+static int ram_save_block_threaded(QEMUFile *f, bool last_stage)
+{
+    bool found_dirty = true;
+    int bytes_sent = 0;
+    int64_t t0;
+    int i;
+
+    qemu_mutex_lock(&ram_save_pool.lock);
+    while (true) {
+        bool busy = false;
+
+        for (i = 0; i < ram_save_pool.nb_threads; i++) {
+            RamSaveThread *t = &ram_save_pool.threads[i];
+
+            if (t->state == RAM_SAVE_THREAD_DONE) {
+                bytes_sent += ram_save_thread_collect(f, t);
+            }
+            if (t->state == RAM_SAVE_THREAD_IDLE && found_dirty) {
+                t->nb_pages = ram_find_dirty_chunk(&t->block, t->pages);
+                if (t->nb_pages) {
+                    t->last_stage = last_stage;
+                    t->bulk_stage = ram_bulk_stage;
+                    t->state = RAM_SAVE_THREAD_BUSY;
+                    qemu_cond_signal(&t->cond);
+                } else {
+                    found_dirty = false;
+                }
+            }
+            busy |= t->state == RAM_SAVE_THREAD_BUSY;
+        }
+        last_sent_block = NULL;
+
+        if (bytes_sent > 0 || !busy) {
+            break;
+        }
+        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        qemu_cond_wait(&ram_save_pool.done_cond, &ram_save_pool.lock);
+        acct_info.thread_wait_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0;
+    }
+    qemu_mutex_unlock(&ram_save_pool.lock);
+
+    return bytes_sent;
+}
+
+/* Wait for the chunks in flight and write them out */
+static int ram_save_threads_flush(QEMUFile *f)
+{
+    int bytes_sent = 0;
+    int64_t t0;
+    int i;
+
+    if (!ram_save_pool.threads) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&ram_save_pool.lock);
+    for (i = 0; i < ram_save_pool.nb_threads; i++) {
+        RamSaveThread *t = &ram_save_pool.threads[i];
+
+        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        while (t->state == RAM_SAVE_THREAD_BUSY) {
+            qemu_cond_wait(&ram_save_pool.done_cond, &ram_save_pool.lock);
+        }
+        acct_info.thread_wait_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0;
+        if (t->state == RAM_SAVE_THREAD_DONE) {
+            bytes_sent += ram_save_thread_collect(f, t);
+        }
+    }
+    qemu_mutex_unlock(&ram_save_pool.lock);
+
+    return bytes_sent;
+}
+
+static uint64_t bytes_transferred;
+
+void acct_update_position(QEMUFile *f, size_t size, bool zero)
+{
+    uint64_t pages = size / TARGET_PAGE_SIZE;
+    if (zero) {
+        acct_info.dup_pages += pages;
+    } else {
+        acct_info.norm_pages += pages;
         bytes_transferred += size;
         qemu_update_position(f, size);
     }
@@ -680,31 +1587,41 @@ uint64_t ram_bytes_total(void)
     return total;
 }
 
-void free_xbzrle_decoded_buf(void)
+/* Room needed for the RAM image of a file migration */
+uint64_t ram_file_area_size(void)
 {
-    g_free(xbzrle_decoded_buf);
-    xbzrle_decoded_buf = NULL;
+    return last_ram_offset();
 }
 
 static void migration_end(void)
 {
+    ram_save_threads_stop();
+    ram_channels_free();
+    if (ram_file.fd >= 0) {
+        close(ram_file.fd);
+        ram_file.fd = -1;
+    }
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
         migration_bitmap = NULL;
     }
+    g_free(bitmap_sync.chunks);
+    bitmap_sync.chunks = NULL;
+    atomic_set(&mig_throttle_pct, 0);
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
         cache_fini(XBZRLE.cache);
         g_free(XBZRLE.cache);
-        g_free(XBZRLE.encoded_buf);
-        g_free(XBZRLE.current_buf);
+        xbzrle_buffers_free(&XBZRLE.bufs);
         XBZRLE.cache = NULL;
-        XBZRLE.encoded_buf = NULL;
-        XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    page_compressor_free(XBZRLE.bufs.compressor);
+    XBZRLE.bufs.compressor = NULL;
 }
 
 static void ram_migration_cancel(void *opaque)
@@ -721,23 +1638,259 @@ static void reset_ram_globals(void)
     ram_bulk_stage = true;
 }
 
+/*
+ * Post-copy, source side
+ *
+ * On a switch to post-copy, the last section of RAM carries the dirty
+ * bitmap instead of the dirty pages, and the device state follows in a
+ * package.  The pages still dirty come after that, outside of any
+ * section: first those the destination asks for on the return path, as
+ * its guest touched them, and the others in the background.  The guest
+ * stays stopped here, so every page is sent exactly once.
+ */
+
+typedef struct RamPostcopyRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(RamPostcopyRequest) next;
+} RamPostcopyRequest;
+
+static struct {
+    bool active;
+    QEMUFile *rp;
+    QemuThread thread;
+    /* protects requests */
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, RamPostcopyRequest) requests;
+    uint64_t nb_requests;
+} postcopy_save;
+
+/* Whether pre-copy went through all of RAM once */
+bool ram_postcopy_ready(void)
+{
+    return !ram_bulk_stage;
+}
+
+/* Makes the next ram_save_complete switch to post-copy */
+void ram_postcopy_begin(void)
+{
+    postcopy_save.active = true;
+    postcopy_save.nb_requests = 0;
+}
+
+uint64_t ram_postcopy_requests(void)
+{
+    return postcopy_save.nb_requests;
+}
+
+/* Sends the dirty bitmap, block by block, as 64-bit words */
+static void ram_postcopy_send_bitmap(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long base = block->offset >> TARGET_PAGE_BITS;
+        unsigned long pages = block->length >> TARGET_PAGE_BITS;
+        uint64_t word = 0;
+        unsigned long i;
+
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        for (i = 0; i < pages; i++) {
+            if (test_bit(base + i, migration_bitmap)) {
+                word |= 1ULL << (i % 64);
+            }
+            if (i % 64 == 63 || i == pages - 1) {
+                qemu_put_be64(f, word);
+                word = 0;
+            }
+        }
+    }
+    qemu_put_byte(f, 0);
+
+    /* from now on, only the bitmap tells which pages are left */
+    ram_bulk_stage = false;
+    /* and they go to a new loader on the destination */
+    last_sent_block = NULL;
+}
+
+static void *ram_postcopy_rp_thread(void *opaque)
+{
+    QEMUFile *rp = postcopy_save.rp;
+    RamPostcopyRequest *req;
+    RAMBlock *block;
+    ram_addr_t offset;
+    char id[256];
+    uint8_t len;
+
+    while (true) {
+        len = qemu_get_byte(rp);
+        qemu_get_buffer(rp, (uint8_t *)id, len);
+        id[len] = 0;
+        offset = qemu_get_be64(rp);
+        if (qemu_file_get_error(rp)) {
+            break;
+        }
+
+        /* The migration thread holds the ramlist lock, so the list does
+           not change under our feet */
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block || offset >= block->length) {
+            fprintf(stderr, "Bad post-copy page request for %s!\n", id);
+            break;
+        }
+
+        req = g_new(RamPostcopyRequest, 1);
+        req->block = block;
+        req->offset = offset & TARGET_PAGE_MASK;
+        qemu_mutex_lock(&postcopy_save.lock);
+        QSIMPLEQ_INSERT_TAIL(&postcopy_save.requests, req, next);
+        postcopy_save.nb_requests++;
+        qemu_mutex_unlock(&postcopy_save.lock);
+    }
+
+    return NULL;
+}
+
+/* Sends a page the destination asked for, unless it is already on its
+   way, and carries on with the background pages from there */
+static int ram_postcopy_send_page(QEMUFile *f, RAMBlock *block,
+                                  ram_addr_t offset)
+{
+    unsigned long nr = (block->offset + offset) >> TARGET_PAGE_BITS;
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    int bytes_sent;
+
+    if (!test_and_clear_bit(nr, migration_bitmap)) {
+        return 0;
+    }
+    migration_dirty_pages--;
+
+    bytes_sent = ram_save_page(f, block, offset, cont, true, ram_bulk_stage,
+                               &XBZRLE.bufs, &acct_info);
+    last_sent_block = block;
+    last_seen_block = block;
+    last_offset = offset;
+
+    return bytes_sent;
+}
+
+/*
+ * ram_postcopy_save: Sends the pages left once the device state is out,
+ * and serves the requests that come back on rp meanwhile.  Called without
+ * the iothread lock, the guest being stopped for good.
+ *
+ * Returns:  0 once the destination has all pages
+ *           a negative errno otherwise
+ */
+
+int ram_postcopy_save(QEMUFile *f, QEMUFile *rp)
+{
+    RamPostcopyRequest *req;
+    int bytes_sent, ret;
+
+    postcopy_save.rp = rp;
+    qemu_mutex_init(&postcopy_save.lock);
+    QSIMPLEQ_INIT(&postcopy_save.requests);
+    qemu_thread_create(&postcopy_save.thread, "postcopy_rp",
+                       ram_postcopy_rp_thread, NULL, QEMU_THREAD_JOINABLE);
+
+    qemu_mutex_lock_ramlist();
+    while (!qemu_file_get_error(f)) {
+        qemu_mutex_lock(&postcopy_save.lock);
+        req = QSIMPLEQ_FIRST(&postcopy_save.requests);
+        if (req) {
+            QSIMPLEQ_REMOVE_HEAD(&postcopy_save.requests, next);
+        }
+        qemu_mutex_unlock(&postcopy_save.lock);
+
+        if (req) {
+            bytes_sent = ram_postcopy_send_page(f, req->block, req->offset);
+            g_free(req);
+            if (bytes_sent > 0) {
+                /* a vCPU is waiting for it */
+                qemu_fflush(f);
+            }
+        } else {
+            bytes_sent = ram_save_block(f, true);
+            if (bytes_sent == 0) {
+                break;
+            }
+        }
+        bytes_transferred += bytes_sent;
+    }
+    qemu_mutex_unlock_ramlist();
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(f);
+    ret = qemu_file_get_error(f);
+
+    /* The destination closes the return path once it has every page; a
+       broken connection ends it as well */
+    qemu_thread_join(&postcopy_save.thread);
+    while ((req = QSIMPLEQ_FIRST(&postcopy_save.requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&postcopy_save.requests, next);
+        g_free(req);
+    }
+    qemu_mutex_destroy(&postcopy_save.lock);
+
+    postcopy_save.active = false;
+    migration_end();
+
+    return ret;
+}
+
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
 
 static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMBlock *block;
     int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    QEMUFile **channels;
+    int nb_channels, nb_threads;
+    uint64_t file_size;
+    int fd;
 
     migration_bitmap = bitmap_new(ram_pages);
     bitmap_set(migration_bitmap, 0, ram_pages);
     migration_dirty_pages = ram_pages;
-    mig_throttle_on = false;
-    dirty_rate_high_cnt = 0;
+    mig_throttle_pct = 0;
+    postcopy_save.active = false;
+    acct_info.sync_count = 0;
+    acct_info.sync_ns = 0;
+    acct_info.compress_pages = 0;
+    acct_info.compress_bytes = 0;
+
+    fd = migrate_get_ram_file(f, &ram_file.base, &file_size);
+    if (fd >= 0) {
+        if (last_ram_offset() > file_size) {
+            DPRINTF("RAM grew since the file was laid out\n");
+            return -1;
+        }
+        ram_file.fd = dup(fd);
+        ram_file.error = 0;
+        if (ram_file.fd < 0) {
+            return -1;
+        }
+    }
+
+    if (migrate_use_compression()) {
+        XBZRLE.bufs.compressor = ram_compressor_new();
+        if (!XBZRLE.bufs.compressor) {
+            DPRINTF("Error creating the page compressor\n");
+            return -1;
+        }
+    }
 
     if (migrate_use_xbzrle()) {
         qemu_mutex_lock_iothread();
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
-                                  TARGET_PAGE_SIZE,
+        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size(),
                                   TARGET_PAGE_SIZE);
         if (!XBZRLE.cache) {
             qemu_mutex_unlock_iothread();
@@ -747,24 +1900,27 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_mutex_init(&XBZRLE.lock);
         qemu_mutex_unlock_iothread();
 
-        /* We prefer not to abort if there is no memory */
-        XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
-        if (!XBZRLE.encoded_buf) {
-            DPRINTF("Error allocating encoded_buf\n");
-            return -1;
-        }
-
-        XBZRLE.current_buf = g_try_malloc(TARGET_PAGE_SIZE);
-        if (!XBZRLE.current_buf) {
-            DPRINTF("Error allocating current_buf\n");
-            g_free(XBZRLE.encoded_buf);
-            XBZRLE.encoded_buf = NULL;
+        if (xbzrle_buffers_init(&XBZRLE.bufs) < 0) {
+            xbzrle_buffers_free(&XBZRLE.bufs);
             return -1;
         }
 
         acct_clear();
     }
 
+    nb_channels = migrate_get_ram_channels(f, &channels);
+    if (nb_channels) {
+        ram_channels_setup(channels, nb_channels);
+    }
+
+    /* RDMA sends pages from its own hook, which needs the real stream */
+    nb_threads = MAX(migrate_ram_threads(), nb_channels);
+    if (nb_threads > 1 && !ram_control_has_save_page(f) &&
+        ram_save_threads_start(nb_threads) < 0) {
+        DPRINTF("Error starting RAM save threads\n");
+        return -1;
+    }
+
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
@@ -780,6 +1936,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->length);
+        if (ram_file.fd >= 0) {
+            qemu_put_be64(f, block->offset);
+        }
     }
 
     qemu_mutex_unlock_ramlist();
@@ -812,7 +1971,11 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     while ((ret = qemu_file_rate_limit(f)) == 0) {
         int bytes_sent;
 
-        bytes_sent = ram_save_block(f, false);
+        if (ram_save_pool.threads) {
+            bytes_sent = ram_save_block_threaded(f, false);
+        } else {
+            bytes_sent = ram_save_block(f, false);
+        }
         /* no more blocks to sent */
         if (bytes_sent == 0) {
             break;
@@ -835,6 +1998,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         i++;
     }
+    total_sent += ram_save_threads_flush(f);
 
     qemu_mutex_unlock_ramlist();
 
@@ -844,6 +2008,14 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
      */
     ram_control_after_iterate(f, RAM_CONTROL_ROUND);
 
+    ret = ram_channels_sync(f, false);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    if (ram_file.error) {
+        qemu_file_set_error(f, ram_file.error);
+    }
+
     bytes_transferred += total_sent;
 
     /*
@@ -863,64 +2035,272 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    int ret;
+
     qemu_mutex_lock_ramlist();
     migration_bitmap_sync();
 
-    ram_control_before_iterate(f, RAM_CONTROL_FINISH);
+    ram_control_before_iterate(f, RAM_CONTROL_FINISH);
+
+    if (postcopy_save.active) {
+        /* the pages go after the device state, see ram_postcopy_save */
+        ram_postcopy_send_bitmap(f);
+    } else {
+        /* try transferring iterative blocks of memory */
+
+        /* flush all remaining blocks regardless of rate limiting */
+        while (true) {
+            int bytes_sent;
+
+            if (ram_save_pool.threads) {
+                bytes_sent = ram_save_block_threaded(f, true);
+            } else {
+                bytes_sent = ram_save_block(f, true);
+            }
+            /* no more blocks to sent */
+            if (bytes_sent == 0) {
+                break;
+            }
+            bytes_transferred += bytes_sent;
+        }
+    }
+
+    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+    ret = ram_channels_sync(f, true);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    if (ram_file.error) {
+        qemu_file_set_error(f, ram_file.error);
+    }
+    if (postcopy_save.active) {
+        /* the rest goes through the main stream only */
+        ram_save_threads_stop();
+        ram_channels_free();
+    } else {
+        migration_end();
+    }
+
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+{
+    uint64_t remaining_size;
+
+    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+
+    if (remaining_size < max_size) {
+        qemu_mutex_lock_iothread();
+        qemu_mutex_lock_ramlist();
+        migration_bitmap_sync_begin();
+        qemu_mutex_unlock_iothread();
+        migration_bitmap_sync_end();
+        qemu_mutex_unlock_ramlist();
+        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    }
+    return remaining_size;
+}
+
+/*
+ * RAM load threads
+ *
+ * With more than one thread configured on the destination, XBZRLE pages
+ * are decoded by a pool of threads while the incoming coroutine goes on
+ * parsing the stream.  A page appears at most once in a section, so
+ * waiting for the pool at the end of each section keeps every page's
+ * updates in order.
+ */
+
+#define RAM_LOAD_QUEUE_LEN 64
+
+typedef struct RamLoadJob {
+    void *host;
+    int encoding;
+    int len;
+    bool busy;
+    uint8_t buf[TARGET_PAGE_SIZE];
+} RamLoadJob;
+
+static struct {
+    QemuThread *threads;
+    int nb_threads;
+    QemuMutex lock;
+    QemuCond job_cond;
+    QemuCond done_cond;
+    RamLoadJob *jobs;
+    unsigned int head;          /* next job to decode */
+    unsigned int tail;          /* next slot to fill */
+    int pending;
+    int error;
+    bool quit;
+} ram_load_pool;
+
+/* Decode len bytes of data with the given encoding into the page at host */
+static int decode_page(int encoding, uint8_t *buf, int len, void *host)
+{
+    int ret;
+
+    if (encoding == ENCODING_FLAG_XBZRLE) {
+        ret = xbzrle_decode_buffer(buf, len, host, TARGET_PAGE_SIZE);
+        return ret == -1 || ret > TARGET_PAGE_SIZE ? -1 : 0;
+    }
+    return page_decompress(encoding - ENCODING_FLAG_COMPRESS, buf, len,
+                           host, TARGET_PAGE_SIZE);
+}
+
+static void *ram_load_thread(void *opaque)
+{
+    RamLoadJob *job;
+    int ret;
+
+    qemu_mutex_lock(&ram_load_pool.lock);
+    while (true) {
+        while (ram_load_pool.head == ram_load_pool.tail &&
+               !ram_load_pool.quit) {
+            qemu_cond_wait(&ram_load_pool.job_cond, &ram_load_pool.lock);
+        }
+        if (ram_load_pool.head == ram_load_pool.tail) {
+            break;
+        }
+        job = &ram_load_pool.jobs[ram_load_pool.head++ % RAM_LOAD_QUEUE_LEN];
+        qemu_mutex_unlock(&ram_load_pool.lock);
+
+        ret = decode_page(job->encoding, job->buf, job->len, job->host);
+
+        qemu_mutex_lock(&ram_load_pool.lock);
+        if (ret < 0) {
+            ram_load_pool.error = -EINVAL;
+        }
+        job->busy = false;
+        ram_load_pool.pending--;
+        qemu_cond_broadcast(&ram_load_pool.done_cond);
+    }
+    qemu_mutex_unlock(&ram_load_pool.lock);
+
+    return NULL;
+}
+
+static void ram_load_threads_start(int nb_threads)
+{
+    int i;
+
+    qemu_mutex_init(&ram_load_pool.lock);
+    qemu_cond_init(&ram_load_pool.job_cond);
+    qemu_cond_init(&ram_load_pool.done_cond);
+    ram_load_pool.jobs = g_new0(RamLoadJob, RAM_LOAD_QUEUE_LEN);
+    ram_load_pool.head = ram_load_pool.tail = 0;
+    ram_load_pool.pending = 0;
+    ram_load_pool.error = 0;
+    ram_load_pool.quit = false;
+    ram_load_pool.threads = g_new0(QemuThread, nb_threads);
+    ram_load_pool.nb_threads = nb_threads;
+
+    for (i = 0; i < nb_threads; i++) {
+        qemu_thread_create(&ram_load_pool.threads[i], "ram_load",
+                           ram_load_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void ram_load_threads_stop(void)
+{
+    int i;
 
-    /* try transferring iterative blocks of memory */
+    if (!ram_load_pool.threads) {
+        return;
+    }
 
-    /* flush all remaining blocks regardless of rate limiting */
-    while (true) {
-        int bytes_sent;
+    qemu_mutex_lock(&ram_load_pool.lock);
+    ram_load_pool.quit = true;
+    qemu_cond_broadcast(&ram_load_pool.job_cond);
+    qemu_mutex_unlock(&ram_load_pool.lock);
 
-        bytes_sent = ram_save_block(f, true);
-        /* no more blocks to sent */
-        if (bytes_sent == 0) {
-            break;
-        }
-        bytes_transferred += bytes_sent;
+    for (i = 0; i < ram_load_pool.nb_threads; i++) {
+        qemu_thread_join(&ram_load_pool.threads[i]);
     }
+    qemu_cond_destroy(&ram_load_pool.job_cond);
+    qemu_cond_destroy(&ram_load_pool.done_cond);
+    qemu_mutex_destroy(&ram_load_pool.lock);
+    g_free(ram_load_pool.jobs);
+    g_free(ram_load_pool.threads);
+    ram_load_pool.jobs = NULL;
+    ram_load_pool.threads = NULL;
+}
 
-    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
-    migration_end();
+/* Wait until every queued page has been decoded */
+static int ram_load_threads_wait(void)
+{
+    int ret;
 
-    qemu_mutex_unlock_ramlist();
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_mutex_lock(&ram_load_pool.lock);
+    while (ram_load_pool.pending) {
+        qemu_cond_wait(&ram_load_pool.done_cond, &ram_load_pool.lock);
+    }
+    ret = ram_load_pool.error;
+    ram_load_pool.error = 0;
+    qemu_mutex_unlock(&ram_load_pool.lock);
 
-    return 0;
+    return ret;
 }
 
-static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+/* Read len bytes of encoded data and queue them for decoding into host */
+static void ram_load_queue_encoded(QEMUFile *f, void *host, int encoding,
+                                   int len)
 {
-    uint64_t remaining_size;
+    RamLoadJob *job;
 
-    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    qemu_mutex_lock(&ram_load_pool.lock);
+    job = &ram_load_pool.jobs[ram_load_pool.tail % RAM_LOAD_QUEUE_LEN];
+    while (job->busy) {
+        qemu_cond_wait(&ram_load_pool.done_cond, &ram_load_pool.lock);
+    }
+    qemu_mutex_unlock(&ram_load_pool.lock);
+
+    qemu_get_buffer(f, job->buf, len);
+    job->host = host;
+    job->encoding = encoding;
+    job->len = len;
+
+    qemu_mutex_lock(&ram_load_pool.lock);
+    job->busy = true;
+    ram_load_pool.tail++;
+    ram_load_pool.pending++;
+    qemu_cond_signal(&ram_load_pool.job_cond);
+    qemu_mutex_unlock(&ram_load_pool.lock);
+}
 
-    if (remaining_size < max_size) {
-        qemu_mutex_lock_iothread();
-        migration_bitmap_sync();
-        qemu_mutex_unlock_iothread();
-        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+static void ram_channels_stop(void);
+
+void ram_load_cleanup(void)
+{
+    ram_load_threads_stop();
+    ram_channels_stop();
+    g_free(xbzrle_decoded_buf);
+    xbzrle_decoded_buf = NULL;
+    if (ram_file.fd >= 0) {
+        close(ram_file.fd);
+        ram_file.fd = -1;
     }
-    return remaining_size;
 }
 
-static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+/* Load an XBZRLE or compressed page into host, through buf or, if async,
+   the RAM load threads */
+static int load_encoded_page(QEMUFile *f, void *host, uint8_t *buf,
+                             bool async)
 {
-    int ret, rc = 0;
     unsigned int xh_len;
     int xh_flags;
 
-    if (!xbzrle_decoded_buf) {
-        xbzrle_decoded_buf = g_malloc(TARGET_PAGE_SIZE);
-    }
-
     /* extract RLE header */
     xh_flags = qemu_get_byte(f);
     xh_len = qemu_get_be16(f);
 
-    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+    if (xh_flags != ENCODING_FLAG_XBZRLE &&
+        (xh_flags < ENCODING_FLAG_COMPRESS ||
+         !page_compress_supported(xh_flags - ENCODING_FLAG_COMPRESS))) {
         fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
         return -1;
     }
@@ -929,29 +2309,29 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
         fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
         return -1;
     }
+
+    if (async) {
+        ram_load_queue_encoded(f, host, xh_flags, xh_len);
+        return 0;
+    }
+
     /* load data and decode */
-    qemu_get_buffer(f, xbzrle_decoded_buf, xh_len);
+    qemu_get_buffer(f, buf, xh_len);
 
-    /* decode RLE */
-    ret = xbzrle_decode_buffer(xbzrle_decoded_buf, xh_len, host,
-                               TARGET_PAGE_SIZE);
-    if (ret == -1) {
+    if (decode_page(xh_flags, buf, xh_len, host) < 0) {
         fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
-        rc = -1;
-    } else  if (ret > TARGET_PAGE_SIZE) {
-        fprintf(stderr, "Failed to load XBZRLE page - size %d exceeds %d!\n",
-                ret, TARGET_PAGE_SIZE);
-        abort();
+        return -1;
     }
-
-    return rc;
+    return 0;
 }
 
+/* pblock holds the block of the previous page of the stream */
 static inline void *host_from_stream_offset(QEMUFile *f,
                                             ram_addr_t offset,
-                                            int flags)
+                                            int flags,
+                                            RAMBlock **pblock)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block = *pblock;
     char id[256];
     uint8_t len;
 
@@ -969,10 +2349,13 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     id[len] = 0;
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            *pblock = block;
             return memory_region_get_ram_ptr(block->mr) + offset;
+        }
     }
 
+    *pblock = NULL;
     fprintf(stderr, "Can't find block %s!\n", id);
     return NULL;
 }
@@ -988,12 +2371,441 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+/*
+ * ram_load_page: Loads the page record at addr with the given flags.
+ * XBZRLE and compressed data is decoded through buf, or by the RAM load
+ * threads if async.
+ *
+ * Returns:  0 on success
+ *           -EINVAL on a malformed record, or one that holds no page
+ */
+
+static int ram_load_page(QEMUFile *f, ram_addr_t addr, int flags,
+                         RAMBlock **pblock, uint8_t *buf, bool async)
+{
+    void *host;
+
+    if (!(flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
+                   RAM_SAVE_FLAG_XBZRLE))) {
+        fprintf(stderr, "Unexpected RAM record flags %#x!\n", flags);
+        return -EINVAL;
+    }
+
+    host = host_from_stream_offset(f, addr, flags, pblock);
+    if (!host) {
+        return -EINVAL;
+    }
+
+    if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        uint8_t ch = qemu_get_byte(f);
+        ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+    } else if (flags & RAM_SAVE_FLAG_PAGE) {
+        qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+    } else if (load_encoded_page(f, host, buf, async) < 0) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void *ram_channel_thread(void *opaque)
+{
+    RamChannel *c = opaque;
+    ram_addr_t addr;
+    int flags, ret = 0;
+
+    while (true) {
+        addr = qemu_get_be64(c->file);
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_CHANNEL_SYNC) {
+            qemu_mutex_lock(&ram_channels.lock);
+            c->syncs++;
+            qemu_cond_broadcast(&ram_channels.sync_cond);
+            qemu_mutex_unlock(&ram_channels.lock);
+        } else if (flags & RAM_SAVE_FLAG_EOS) {
+            break;
+        } else {
+            ret = ram_load_page(c->file, addr, flags, &c->block, c->buf,
+                                false);
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(c->file);
+        }
+        if (ret) {
+            break;
+        }
+    }
+
+    qemu_mutex_lock(&ram_channels.lock);
+    c->error = ret;
+    c->done = true;
+    qemu_cond_broadcast(&ram_channels.sync_cond);
+    qemu_mutex_unlock(&ram_channels.lock);
+
+    return NULL;
+}
+
+/* The incoming stream is part of a file with an image of RAM at base */
+void ram_file_incoming(int fd, uint64_t base)
+{
+    struct stat st;
+
+    ram_file.fd = dup(fd);
+    ram_file.base = base;
+    if (fstat(fd, &st) == 0) {
+        ram_file.dev = st.st_dev;
+        ram_file.ino = st.st_ino;
+    } else {
+        /* without its identity the file cannot be protected from being
+           truncated, so it is read instead of mapped */
+        ram_file.ino = 0;
+    }
+}
+
+/* Whether guest RAM is mapped from the file described by st */
+bool ram_file_is_mapped(const struct stat *st)
+{
+    return ram_file.mapped && ram_file.dev == st->st_dev &&
+           ram_file.ino == st->st_ino;
+}
+
+/*
+ * Load a block from its image at pos in the file.  Where possible the
+ * image is mapped over the block, so that pages are only read when the
+ * guest first touches them; writes go to private copies.  Otherwise it
+ * is read at once.
+ */
+static int ram_file_load_block(RAMBlock *block, uint64_t pos)
+{
+    uintptr_t mask = getpagesize() - 1;
+    ram_addr_t done;
+    ssize_t ret;
+
+    if (block->fd < 0 && !(block->flags & RAM_PREALLOC_MASK) &&
+        !xen_enabled() && ram_file.ino &&
+        !((pos | (uintptr_t)block->host | block->length) & mask)) {
+        void *host = mmap(block->host, block->length, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_FIXED, ram_file.fd, pos);
+        if (host != MAP_FAILED) {
+            /* the new mapping lost the advice given to the old one */
+            qemu_ram_setup_host(block->host, block->length);
+            ram_file.mapped = true;
+            return 0;
+        }
+        DPRINTF("Cannot map %s, reading it\n", block->idstr);
+    }
+
+    for (done = 0; done < block->length; done += ret) {
+        ret = pread(ram_file.fd, block->host + done, block->length - done,
+                    pos + done);
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+        } else if (ret <= 0) {
+            fprintf(stderr, "Failed to read RAM block %s from file\n",
+                    block->idstr);
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/* Take over f, an incoming RAM channel, and start loading from it */
+void ram_channel_incoming(QEMUFile *f)
+{
+    RamChannel *c = ram_channel_add(f);
+
+    c->buf = g_malloc(TARGET_PAGE_SIZE);
+    qemu_thread_create(&c->thread, "ram_channel", ram_channel_thread, c,
+                       QEMU_THREAD_JOINABLE);
+}
+
+/* Called on a sync record in the main stream: wait until every channel
+   has loaded the pages that preceded its own sync record */
+static int ram_channels_wait_sync(void)
+{
+    int i, ret = 0;
+
+    if (!ram_channels.channels) {
+        fprintf(stderr, "RAM channel sync without channels!\n");
+        return -EINVAL;
+    }
+
+    qemu_mutex_lock(&ram_channels.lock);
+    ram_channels.syncs++;
+    for (i = 0; i < ram_channels.nb_channels; i++) {
+        RamChannel *c = ram_channels.channels[i];
+
+        while (c->syncs < ram_channels.syncs && !c->done) {
+            qemu_cond_wait(&ram_channels.sync_cond, &ram_channels.lock);
+        }
+        if (c->syncs < ram_channels.syncs) {
+            fprintf(stderr, "RAM channel %d failed!\n", i);
+            ret = c->error ? c->error : -EIO;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&ram_channels.lock);
+
+    return ret;
+}
+
+static void ram_channels_stop(void)
+{
+    int i;
+
+    if (!ram_channels.channels) {
+        return;
+    }
+
+    for (i = 0; i < ram_channels.nb_channels; i++) {
+        RamChannel *c = ram_channels.channels[i];
+
+        /* unblock a thread whose source went quiet */
+        shutdown(qemu_get_fd(c->file), 2);
+        qemu_thread_join(&c->thread);
+        qemu_fclose(c->file);
+    }
+    ram_channels_free();
+}
+
+/*
+ * Post-copy, destination side
+ *
+ * The bitmap in the last section of RAM tells which pages the source has
+ * still to send.  Once the device state package is in, a thread loads
+ * them from the rest of the stream while the guest runs.  Accesses to
+ * guest RAM go through ram_postcopy_fault() first, which asks the source
+ * for a missing page on the return path and waits for it.  That covers
+ * the softmmu TLB and the emulator's own accesses, but not KVM, so
+ * post-copy needs TCG here.
+ */
+
+bool ram_postcopy_incoming;
+
+static struct {
+    bool started;
+    QEMUFile *file;
+    QEMUFile *rp;
+    QemuThread thread;
+    /* protects the bitmaps, rp and error */
+    QemuMutex lock;
+    QemuCond page_cond;
+    unsigned long *missing;
+    unsigned long *requested;
+    uint8_t *buf;
+    int error;
+} postcopy_load;
+
+static int ram_postcopy_load_bitmap(QEMUFile *f)
+{
+    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    char id[256];
+    uint8_t len;
+
+    if (kvm_enabled()) {
+        fprintf(stderr, "Post-copy migration needs TCG!\n");
+        return -ENOTSUP;
+    }
+
+    postcopy_load.rp = qemu_file_get_return_path(f);
+    if (!postcopy_load.rp) {
+        fprintf(stderr, "Post-copy migration needs a return path!\n");
+        return -ENOTSUP;
+    }
+    postcopy_load.missing = bitmap_new(ram_pages);
+    postcopy_load.requested = bitmap_new(ram_pages);
+
+    while ((len = qemu_get_byte(f))) {
+        RAMBlock *block;
+        unsigned long base, pages, i;
+        uint64_t word = 0;
+
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block) {
+            fprintf(stderr, "Can't find block %s!\n", id);
+            return -EINVAL;
+        }
+
+        base = block->offset >> TARGET_PAGE_BITS;
+        pages = block->length >> TARGET_PAGE_BITS;
+        for (i = 0; i < pages; i++) {
+            if (i % 64 == 0) {
+                word = qemu_get_be64(f);
+            }
+            if (word & (1ULL << (i % 64))) {
+                set_bit(base + i, postcopy_load.missing);
+            }
+        }
+    }
+
+    return qemu_file_get_error(f);
+}
+
+static void *ram_postcopy_load_thread(void *opaque)
+{
+    QEMUFile *f = postcopy_load.file;
+    RAMBlock *block = NULL;
+    ram_addr_t addr;
+    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    int flags, ret = 0;
+
+    while (true) {
+        addr = qemu_get_be64(f);
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+        ret = ram_load_page(f, addr, flags, &block, postcopy_load.buf, false);
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+        if (ret) {
+            break;
+        }
+
+        qemu_mutex_lock(&postcopy_load.lock);
+        clear_bit((block->offset + addr) >> TARGET_PAGE_BITS,
+                  postcopy_load.missing);
+        qemu_cond_broadcast(&postcopy_load.page_cond);
+        qemu_mutex_unlock(&postcopy_load.lock);
+    }
+
+    if (!ret && find_first_bit(postcopy_load.missing, ram_pages) < ram_pages) {
+        fprintf(stderr, "Post-copy migration ended with pages missing!\n");
+        ret = -EINVAL;
+    }
+
+    qemu_mutex_lock(&postcopy_load.lock);
+    if (ret) {
+        /* the guest goes on until it touches a page that is lost */
+        error_report("post-copy migration failed: %s", strerror(-ret));
+        postcopy_load.error = ret;
+    } else {
+        ram_postcopy_incoming = false;
+        g_free(postcopy_load.missing);
+        g_free(postcopy_load.requested);
+        postcopy_load.missing = NULL;
+        postcopy_load.requested = NULL;
+    }
+    qemu_cond_broadcast(&postcopy_load.page_cond);
+    qemu_fclose(postcopy_load.rp);
+    postcopy_load.rp = NULL;
+    qemu_mutex_unlock(&postcopy_load.lock);
+
+    qemu_fclose(f);
+    g_free(postcopy_load.buf);
+    postcopy_load.buf = NULL;
+
+    return NULL;
+}
+
+/* Takes over f, from which the pages left come after the device state,
+   and starts serving page faults */
+int ram_postcopy_incoming_start(QEMUFile *f)
+{
+    if (!postcopy_load.rp) {
+        fprintf(stderr, "Post-copy package without a RAM bitmap!\n");
+        return -EINVAL;
+    }
+
+    /* the thread reads it outside of the incoming coroutine */
+    qemu_set_block(qemu_get_fd(f));
+
+    postcopy_load.started = true;
+    postcopy_load.file = f;
+    postcopy_load.buf = g_malloc(TARGET_PAGE_SIZE);
+    postcopy_load.error = 0;
+    qemu_mutex_init(&postcopy_load.lock);
+    qemu_cond_init(&postcopy_load.page_cond);
+    ram_postcopy_incoming = true;
+
+    qemu_thread_create(&postcopy_load.thread, "postcopy_load",
+                       ram_postcopy_load_thread, NULL, QEMU_THREAD_DETACHED);
+    return 0;
+}
+
+/* Whether the incoming stream was handed over to post-copy */
+bool ram_postcopy_incoming_started(void)
+{
+    return postcopy_load.started;
+}
+
+/* Asks the source for the page at addr.  Called with the lock held. */
+static void ram_postcopy_request(ram_addr_t addr)
+{
+    QEMUFile *rp = postcopy_load.rp;
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (addr - block->offset < block->length) {
+            qemu_put_byte(rp, strlen(block->idstr));
+            qemu_put_buffer(rp, (uint8_t *)block->idstr,
+                            strlen(block->idstr));
+            qemu_put_be64(rp, addr - block->offset);
+            qemu_fflush(rp);
+            if (qemu_file_get_error(rp)) {
+                postcopy_load.error = qemu_file_get_error(rp);
+            }
+            return;
+        }
+    }
+}
+
+void ram_postcopy_wait(ram_addr_t start, ram_addr_t length)
+{
+    unsigned long page, end;
+
+    if (!length) {
+        return;
+    }
+
+    qemu_mutex_lock(&postcopy_load.lock);
+    /* the pages may all have come in since the caller looked */
+    if (!ram_postcopy_incoming) {
+        qemu_mutex_unlock(&postcopy_load.lock);
+        return;
+    }
+
+    end = (start + length - 1) >> TARGET_PAGE_BITS;
+    for (page = start >> TARGET_PAGE_BITS; page <= end; page++) {
+        if (!test_bit(page, postcopy_load.missing)) {
+            continue;
+        }
+        if (!test_and_set_bit(page, postcopy_load.requested) &&
+            !postcopy_load.error) {
+            ram_postcopy_request((ram_addr_t)page << TARGET_PAGE_BITS);
+        }
+        while (test_bit(page, postcopy_load.missing) && !postcopy_load.error) {
+            qemu_cond_wait(&postcopy_load.page_cond, &postcopy_load.lock);
+        }
+        if (test_bit(page, postcopy_load.missing)) {
+            error_report("post-copy migration failed, guest RAM at "
+                         RAM_ADDR_FMT " is lost",
+                         (ram_addr_t)page << TARGET_PAGE_BITS);
+            exit(EXIT_FAILURE);
+        }
+    }
+    qemu_mutex_unlock(&postcopy_load.lock);
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
     int flags, ret = 0;
     int error;
     static uint64_t seq_iter;
+    static RAMBlock *load_block;
 
     seq_iter++;
 
@@ -1001,6 +2813,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         return -EINVAL;
     }
 
+    if (!xbzrle_decoded_buf) {
+        xbzrle_decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+
+    if (migrate_ram_threads() > 1 && !ram_load_pool.threads) {
+        ram_load_threads_start(migrate_ram_threads());
+    }
+
     do {
         addr = qemu_get_be64(f);
 
@@ -1044,43 +2864,40 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                         goto done;
                     }
 
+                    if (ram_file.fd >= 0) {
+                        ram_addr_t offset = qemu_get_be64(f);
+
+                        ret = ram_file_load_block(block,
+                                                  ram_file.base + offset);
+                        if (ret < 0) {
+                            goto done;
+                        }
+                    }
+
                     total_ram_bytes -= length;
                 }
             }
         }
 
-        if (flags & RAM_SAVE_FLAG_COMPRESS) {
-            void *host;
-            uint8_t ch;
-
-            host = host_from_stream_offset(f, addr, flags);
-            if (!host) {
-                return -EINVAL;
-            }
-
-            ch = qemu_get_byte(f);
-            ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
-        } else if (flags & RAM_SAVE_FLAG_PAGE) {
-            void *host;
-
-            host = host_from_stream_offset(f, addr, flags);
-            if (!host) {
-                return -EINVAL;
-            }
-
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
-        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
-            void *host = host_from_stream_offset(f, addr, flags);
-            if (!host) {
-                return -EINVAL;
-            }
-
-            if (load_xbzrle(f, addr, host) < 0) {
-                ret = -EINVAL;
+        if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
+                     RAM_SAVE_FLAG_XBZRLE)) {
+            ret = ram_load_page(f, addr, flags, &load_block, xbzrle_decoded_buf,
+                                ram_load_pool.threads != NULL);
+            if (ret < 0) {
                 goto done;
             }
         } else if (flags & RAM_SAVE_FLAG_HOOK) {
             ram_control_load_hook(f, flags);
+        } else if (flags & RAM_SAVE_FLAG_CHANNEL_SYNC) {
+            ret = ram_channels_wait_sync();
+            if (ret < 0) {
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            ret = ram_postcopy_load_bitmap(f);
+            if (ret < 0) {
+                goto done;
+            }
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -1090,6 +2907,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    if (ram_load_pool.threads) {
+        error = ram_load_threads_wait();
+        if (error && !ret) {
+            fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
+            ret = error;
+        }
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -1314,14 +3138,17 @@ TargetInfo *qmp_query_target(Error **errp)
    VM to run inside qemu via async_run_on_cpu()*/
 static void mig_sleep_cpu(void *opq)
 {
+    int pct = atomic_read(&mig_throttle_pct);
+
     qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
+    g_usleep(THROTTLE_TIMESLICE_MS * 1000 * pct / (100 - pct));
     qemu_mutex_lock_iothread();
 }
 
 /* To reduce the dirty rate explicitly disallow the VCPUs from spending
    much time in the VM. The migration thread will try to catchup.
-   Workload will experience a performance drop.
+   Workload will experience a performance drop, in proportion to
+   mig_throttle_pct.
 */
 static void mig_throttle_guest_down(void)
 {
@@ -1338,8 +3165,10 @@ static void check_guest_throttling(void)
 {
     static int64_t t0;
     int64_t        t1;
+    int pct = atomic_read(&mig_throttle_pct);
 
-    if (!mig_throttle_on) {
+    if (!pct) {
+        t0 = 0;
         return;
     }
 
@@ -1350,10 +3179,10 @@ static void check_guest_throttling(void)
 
     t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
+    /* Once the guest has run for a timeslice since it was last put to
+     * sleep, do it again.
      */
-    if (40 < (t1-t0)/1000000) {
+    if ((t1 - t0) / 1000000 >= THROTTLE_TIMESLICE_MS * 100 / (100 - pct)) {
         mig_throttle_guest_down();
         t0 = t1;
     }
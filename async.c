@@ -218,6 +218,7 @@ aio_ctx_finalize(GSource     *source)
     qemu_mutex_destroy(&ctx->bh_lock);
     g_array_free(ctx->pollfds, TRUE);
     timerlistgroup_deinit(&ctx->tlg);
+    aio_context_cleanup(ctx);
 }
 
 static GSourceFuncs aio_source_funcs = {
@@ -243,9 +244,23 @@ ThreadPool *aio_get_thread_pool(AioContext *ctx)
 
 void aio_notify(AioContext *ctx)
 {
+    ctx->notified = true;
+    /* Make sure that a busy polling aio_poll() sees the flag */
+    smp_mb();
     event_notifier_set(&ctx->notifier);
 }
 
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink)
+{
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
+
 static void aio_timerlist_notify(void *opaque)
 {
     aio_notify(opaque);
@@ -263,6 +278,7 @@ AioContext *aio_context_new(void)
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
     ctx->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
     ctx->thread_pool = NULL;
+    aio_context_setup(ctx);
     qemu_mutex_init(&ctx->bh_lock);
     rfifolock_init(&ctx->lock, aio_rfifolock_cb, ctx);
     event_notifier_init(&ctx->notifier, false);
@@ -0,0 +1,45 @@
+/*
+ * Auto-converge throttle controller for QEMU migration
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <math.h>
+
+#include "qemu-common.h"
+#include "migration/auto_converge.h"
+
+#define AUTO_CONVERGE_TARGET_RATIO 0.5
+
+double auto_converge_target(uint64_t max_downtime_ns, int64_t period_ms)
+{
+    double target = (double)max_downtime_ns / 1000000 / period_ms;
+
+    return MIN(MAX(target, AUTO_CONVERGE_TARGET_RATIO), 1);
+}
+
+/* Slowing the guest down by some share is assumed to scale its dirty rate
+ * by the same share.  Running (100 - pct)% of the time gave RATIO, so
+ * running (100 - pct) * target / ratio % of the time would give TARGET.
+ * That raises the throttle when the guest dirties memory too fast, holds
+ * it once the target is met, and eases it off in proportion to the margin
+ * when the guest calms down.  The controller moves half way towards it
+ * each period, so that one noisy measurement does not swing it too far.
+ */
+int auto_converge_throttle(int pct, double ratio, double target)
+{
+    double ideal, next;
+
+    ideal = 0;
+    if (ratio > 0) {
+        ideal = MAX(100 - (100 - pct) * target / ratio, 0);
+    }
+    next = pct + (ideal - pct) / 2;
+
+    /* round halves down, so that an idle guest gets back to zero */
+    return MIN((int)ceil(next - 0.5), AUTO_CONVERGE_MAX_PCT);
+}
@@ -310,22 +310,34 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
 /* Called with iothread lock taken.  */
 
-static void set_dirty_tracking(void)
+static void unset_dirty_tracking(void)
 {
     BlkMigDevState *bmds;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        bmds->dirty_bitmap = bdrv_create_dirty_bitmap(bmds->bs, BLOCK_SIZE);
+        if (bmds->dirty_bitmap) {
+            bdrv_release_dirty_bitmap(bmds->bs, bmds->dirty_bitmap);
+            bmds->dirty_bitmap = NULL;
+        }
     }
 }
 
-static void unset_dirty_tracking(void)
+static int set_dirty_tracking(void)
 {
     BlkMigDevState *bmds;
+    Error *local_err = NULL;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        bdrv_release_dirty_bitmap(bmds->bs, bmds->dirty_bitmap);
+        bmds->dirty_bitmap = bdrv_create_dirty_bitmap(bmds->bs, BLOCK_SIZE,
+                                                      NULL, &local_err);
+        if (!bmds->dirty_bitmap) {
+            error_report("%s", error_get_pretty(local_err));
+            error_free(local_err);
+            unset_dirty_tracking();
+            return -EIO;
+        }
     }
+    return 0;
 }
 
 static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
@@ -614,8 +626,11 @@ static int block_save_setup(QEMUFile *f, void *opaque)
     init_blk_migration(f);
 
     /* start track dirty blocks */
-    set_dirty_tracking();
+    ret = set_dirty_tracking();
     qemu_mutex_unlock_iothread();
+    if (ret) {
+        return ret;
+    }
 
     ret = flush_blks(f);
     blk_mig_reset_dirty_cursor();
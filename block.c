@@ -52,12 +52,16 @@
 
 struct BdrvDirtyBitmap {
     HBitmap *bitmap;
+    BdrvDirtyBitmap *successor; /* if set, the bitmap is frozen */
+    char *name;                 /* NULL for bitmaps used internally */
+    bool persistent;            /* stored in the image on close */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
+static void bdrv_release_named_dirty_bitmaps(BlockDriverState *bs);
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
@@ -951,6 +955,8 @@ static int bdrv_open_common(BlockDriverState *bs, BlockDriverState *file,
     return 0;
 
 free_and_fail:
+    /* The driver may have loaded persistent dirty bitmaps */
+    bdrv_release_named_dirty_bitmaps(bs);
     bs->file = NULL;
     g_free(bs->opaque);
     bs->opaque = NULL;
@@ -1703,6 +1709,7 @@ void bdrv_close(BlockDriverState *bs)
             bs->backing_hd = NULL;
         }
         bs->drv->bdrv_close(bs);
+        bdrv_release_named_dirty_bitmaps(bs);
         g_free(bs->opaque);
 #ifdef _WIN32
         if (bs->is_temporary) {
@@ -1798,6 +1805,7 @@ void bdrv_drain_all(void)
 
     while (busy) {
         QTAILQ_FOREACH(bs, &bdrv_states, device_list) {
+            bdrv_flush_io_queue(bs);
             bdrv_start_throttled_reqs(bs);
         }
 
@@ -1973,9 +1981,9 @@ static void bdrv_delete(BlockDriverState *bs)
     assert(!bs->job);
     assert(!bs->in_use);
     assert(!bs->refcnt);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
     bdrv_close(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
@@ -3964,10 +3972,40 @@ void bdrv_get_backing_filename(BlockDriverState *bs,
     pstrcpy(filename, filename_size, bs->backing_file);
 }
 
+typedef struct BdrvWriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+} BdrvWriteCompressedCo;
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    BdrvWriteCompressedCo *co = opaque;
+
+    co->ret = co->bs->drv->bdrv_write_compressed(co->bs, co->sector_num,
+                                                 co->buf, co->nb_sectors);
+}
+
+/*
+ * Write one compressed cluster, or align the end of the image if nb_sectors
+ * is 0.  Drivers are always called in coroutine context, so that callers
+ * running in coroutines can have several compressed writes in flight.
+ */
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    Coroutine *co;
+    BdrvWriteCompressedCo data = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .buf = buf,
+        .nb_sectors = nb_sectors,
+        .ret = NOT_DONE,
+    };
+
     if (!drv)
         return -ENOMEDIUM;
     if (!drv->bdrv_write_compressed)
@@ -3975,9 +4013,19 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_write_compressed_co_entry(&data);
+    } else {
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &data);
+        while (data.ret == NOT_DONE) {
+            qemu_aio_wait();
+        }
+    }
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
+    return data.ret;
 }
 
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -4000,6 +4048,45 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_get_specific_stats) {
+        return drv->bdrv_get_specific_stats(bs);
+    }
+    return NULL;
+}
+
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
+void bdrv_flush_io_queue(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_flush_io_queue) {
+        drv->bdrv_flush_io_queue(bs);
+    } else if (bs->file) {
+        bdrv_flush_io_queue(bs->file);
+    }
+}
+
 int bdrv_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
                       int64_t pos, int size)
 {
@@ -4900,7 +4987,8 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
         return -EROFS;
     }
 
-    bdrv_reset_dirty(bs, sector_num, nb_sectors);
+    /* Discarded sectors may read differently afterwards */
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
 
     /* Do nothing if disabled.  */
     if (!(bs->open_flags & BDRV_O_UNMAP)) {
@@ -5076,6 +5164,19 @@ void *qemu_blockalign(BlockDriverState *bs, size_t size)
     return qemu_memalign(bdrv_opt_mem_align(bs), size);
 }
 
+void *qemu_try_blockalign(BlockDriverState *bs, size_t size)
+{
+    size_t align = bdrv_opt_mem_align(bs);
+
+    /* Ensure that NULL is never returned on success */
+    assert(align > 0);
+    if (size == 0) {
+        size = align;
+    }
+
+    return qemu_try_memalign(align, size);
+}
+
 /*
  * Check if all memory in this vector is sector aligned.
  */
@@ -5096,35 +5197,230 @@ bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
     return true;
 }
 
-BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity)
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity,
+                                          const char *name, Error **errp)
 {
     int64_t bitmap_size;
     BdrvDirtyBitmap *bitmap;
 
     assert((granularity & (granularity - 1)) == 0);
 
+    if (name && bdrv_find_dirty_bitmap(bs, name)) {
+        error_setg(errp, "Bitmap already exists: %s", name);
+        return NULL;
+    }
+
     granularity >>= BDRV_SECTOR_BITS;
     assert(granularity);
-    bitmap_size = (bdrv_getlength(bs) >> BDRV_SECTOR_BITS);
+    bitmap_size = bdrv_getlength(bs);
+    if (bitmap_size < 0) {
+        error_setg_errno(errp, -bitmap_size, "could not get length of device");
+        return NULL;
+    }
+    bitmap_size >>= BDRV_SECTOR_BITS;
     bitmap = g_malloc0(sizeof(BdrvDirtyBitmap));
     bitmap->bitmap = hbitmap_alloc(bitmap_size, ffs(granularity) - 1);
+    bitmap->name = g_strdup(name);
     QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
     return bitmap;
 }
 
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs, const char *name)
+{
+    BdrvDirtyBitmap *bm;
+
+    assert(name);
+    QLIST_FOREACH(bm, &bs->dirty_bitmaps, list) {
+        if (bm->name && !strcmp(name, bm->name)) {
+            return bm;
+        }
+    }
+    return NULL;
+}
+
+BdrvDirtyBitmap *bdrv_dirty_bitmap_next(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    return bitmap ? QLIST_NEXT(bitmap, list) : QLIST_FIRST(&bs->dirty_bitmaps);
+}
+
+const char *bdrv_dirty_bitmap_name(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+int64_t bdrv_dirty_bitmap_granularity(BdrvDirtyBitmap *bitmap)
+{
+    return (int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bitmap->bitmap);
+}
+
+bool bdrv_dirty_bitmap_frozen(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->successor != NULL;
+}
+
+void bdrv_dirty_bitmap_set_persistent(BdrvDirtyBitmap *bitmap, bool persistent)
+{
+    bitmap->persistent = persistent;
+}
+
+bool bdrv_dirty_bitmap_get_persistent(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+bool bdrv_has_persistent_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bm;
+
+    QLIST_FOREACH(bm, &bs->dirty_bitmaps, list) {
+        if (bm->persistent) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool bdrv_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                 int64_t granularity, Error **errp)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        error_setg(errp, "Device has no medium");
+        return false;
+    }
+    if (!drv->bdrv_can_store_dirty_bitmap) {
+        error_setg(errp, "Block format '%s' does not support persistent "
+                   "dirty bitmaps", drv->format_name);
+        return false;
+    }
+    return drv->bdrv_can_store_dirty_bitmap(bs, name, granularity, errp);
+}
+
+void bdrv_store_dirty_bitmaps_all(void)
+{
+    BlockDriverState *bs;
+
+    QTAILQ_FOREACH(bs, &bdrv_states, device_list) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+        Error *local_err = NULL;
+
+        aio_context_acquire(aio_context);
+        if (bs->drv && bs->drv->bdrv_store_dirty_bitmaps &&
+            bdrv_has_persistent_dirty_bitmaps(bs)) {
+            bs->drv->bdrv_store_dirty_bitmaps(bs, &local_err);
+        }
+        aio_context_release(aio_context);
+
+        if (local_err) {
+            error_report("Could not store dirty bitmaps of '%s': %s",
+                         bdrv_get_device_name(bs),
+                         error_get_pretty(local_err));
+            error_free(local_err);
+        }
+    }
+}
+
+/*
+ * Freezes @bitmap while an operation such as an incremental backup works
+ * on its content.  Writes are tracked in an anonymous successor bitmap
+ * until the operation calls bdrv_dirty_bitmap_abdicate() on success or
+ * bdrv_reclaim_dirty_bitmap() on failure.
+ */
+int bdrv_dirty_bitmap_create_successor(BlockDriverState *bs,
+                                       BdrvDirtyBitmap *bitmap, Error **errp)
+{
+    BdrvDirtyBitmap *child;
+
+    if (bdrv_dirty_bitmap_frozen(bitmap)) {
+        error_setg(errp, "Cannot create a successor for a bitmap that is "
+                   "already in use by another operation");
+        return -1;
+    }
+
+    child = bdrv_create_dirty_bitmap(bs, bdrv_dirty_bitmap_granularity(bitmap),
+                                     NULL, errp);
+    if (!child) {
+        return -1;
+    }
+    bitmap->successor = child;
+    return 0;
+}
+
+/*
+ * The successor takes the place of @bitmap, which is released.  Returns
+ * the successor.
+ */
+BdrvDirtyBitmap *bdrv_dirty_bitmap_abdicate(BlockDriverState *bs,
+                                            BdrvDirtyBitmap *bitmap)
+{
+    BdrvDirtyBitmap *successor = bitmap->successor;
+
+    assert(successor);
+    successor->name = bitmap->name;
+    successor->persistent = bitmap->persistent;
+    bitmap->name = NULL;
+    bitmap->successor = NULL;
+    bdrv_release_dirty_bitmap(bs, bitmap);
+
+    return successor;
+}
+
+/*
+ * Merges the writes tracked by the successor back into @bitmap, which is
+ * unfrozen.  Returns @bitmap.
+ */
+BdrvDirtyBitmap *bdrv_reclaim_dirty_bitmap(BlockDriverState *bs,
+                                           BdrvDirtyBitmap *bitmap)
+{
+    BdrvDirtyBitmap *successor = bitmap->successor;
+    bool ret;
+
+    assert(successor);
+    ret = hbitmap_merge(bitmap->bitmap, successor->bitmap);
+    assert(ret);
+    bitmap->successor = NULL;
+    bdrv_release_dirty_bitmap(bs, successor);
+
+    return bitmap;
+}
+
 void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
     BdrvDirtyBitmap *bm, *next;
     QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
         if (bm == bitmap) {
+            assert(!bdrv_dirty_bitmap_frozen(bm));
             QLIST_REMOVE(bitmap, list);
             hbitmap_free(bitmap->bitmap);
+            g_free(bitmap->name);
             g_free(bitmap);
             return;
         }
     }
 }
 
+/* Named bitmaps belong to the user rather than to a job, so they go away
+ * together with the medium.
+ */
+static void bdrv_release_named_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bm, *next;
+
+    QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
+        if (bm->name) {
+            bdrv_release_dirty_bitmap(bs, bm);
+        }
+    }
+}
+
+void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap)
+{
+    assert(!bdrv_dirty_bitmap_frozen(bitmap));
+    hbitmap_reset_all(bitmap->bitmap);
+}
+
 BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
 {
     BdrvDirtyBitmap *bm;
@@ -5135,8 +5431,11 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         BlockDirtyInfo *info = g_malloc0(sizeof(BlockDirtyInfo));
         BlockDirtyInfoList *entry = g_malloc0(sizeof(BlockDirtyInfoList));
         info->count = bdrv_get_dirty_count(bs, bm);
-        info->granularity =
-            ((int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bm->bitmap));
+        info->granularity = bdrv_dirty_bitmap_granularity(bm);
+        info->has_name = !!bm->name;
+        info->name = g_strdup(bm->name);
+        info->persistent = bm->persistent;
+        info->frozen = bdrv_dirty_bitmap_frozen(bm);
         entry->value = info;
         *plist = entry;
         plist = &entry->next;
@@ -5165,7 +5464,10 @@ void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
 {
     BdrvDirtyBitmap *bitmap;
     QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
-        hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+        /* The successor of a frozen bitmap tracks the writes instead */
+        if (!bdrv_dirty_bitmap_frozen(bitmap)) {
+            hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+        }
     }
 }
 
@@ -5173,10 +5475,41 @@ void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors)
 {
     BdrvDirtyBitmap *bitmap;
     QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
-        hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+        if (!bdrv_dirty_bitmap_frozen(bitmap)) {
+            hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+        }
     }
 }
 
+uint64_t bdrv_dirty_bitmap_serialization_size(BdrvDirtyBitmap *bitmap,
+                                              uint64_t start, uint64_t count)
+{
+    return hbitmap_serialization_size(bitmap->bitmap, start, count);
+}
+
+uint64_t bdrv_dirty_bitmap_serialization_align(BdrvDirtyBitmap *bitmap)
+{
+    return hbitmap_serialization_granularity(bitmap->bitmap);
+}
+
+void bdrv_dirty_bitmap_serialize_part(BdrvDirtyBitmap *bitmap, uint8_t *buf,
+                                      uint64_t start, uint64_t count)
+{
+    hbitmap_serialize_part(bitmap->bitmap, buf, start, count);
+}
+
+void bdrv_dirty_bitmap_deserialize_part(BdrvDirtyBitmap *bitmap, uint8_t *buf,
+                                        uint64_t start, uint64_t count,
+                                        bool finish)
+{
+    hbitmap_deserialize_part(bitmap->bitmap, buf, start, count, finish);
+}
+
+void bdrv_dirty_bitmap_deserialize_finish(BdrvDirtyBitmap *bitmap)
+{
+    hbitmap_deserialize_finish(bitmap->bitmap);
+}
+
 int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
     return hbitmap_count(bitmap->bitmap);
@@ -38,6 +38,7 @@ typedef struct BackupBlockJob {
     BlockJob common;
     BlockDriverState *target;
     MirrorSyncMode sync_mode;
+    BdrvDirtyBitmap *sync_bitmap;
     RateLimit limit;
     BlockdevOnError on_source_error;
     BlockdevOnError on_target_error;
@@ -227,6 +228,69 @@ static BlockErrorAction backup_error_action(BackupBlockJob *job,
     }
 }
 
+static bool coroutine_fn backup_yield(BackupBlockJob *job)
+{
+    /* we need to yield so that qemu_aio_flush() returns.
+     * (without, VM does not reboot)
+     */
+    if (job->common.speed) {
+        uint64_t delay_ns = ratelimit_calculate_delay(&job->limit,
+                                                      job->sectors_read);
+        job->sectors_read = 0;
+        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
+    } else {
+        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
+    }
+
+    return block_job_is_cancelled(&job->common);
+}
+
+/* Copy the clusters that are dirty in the frozen sync bitmap */
+static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap) >>
+                          BDRV_SECTOR_BITS;
+    int64_t clusters_per_iter = MAX(granularity / BACKUP_SECTORS_PER_CLUSTER,
+                                    1);
+    int64_t end = DIV_ROUND_UP(job->common.len / BDRV_SECTOR_SIZE,
+                               BACKUP_SECTORS_PER_CLUSTER);
+    int64_t sector, cluster, last_cluster = -1;
+    HBitmapIter hbi;
+    int i, ret = 0;
+
+    bdrv_dirty_iter_init(bs, job->sync_bitmap, &hbi);
+    while ((sector = hbitmap_iter_next(&hbi)) != -1) {
+        cluster = sector / BACKUP_SECTORS_PER_CLUSTER;
+
+        /* A cluster may span several bitmap granules */
+        if (cluster <= last_cluster) {
+            continue;
+        }
+
+        for (i = 0; i < clusters_per_iter && cluster < end; i++, cluster++) {
+            bool error_is_read;
+
+            do {
+                if (backup_yield(job)) {
+                    return ret;
+                }
+                ret = backup_do_cow(bs, cluster * BACKUP_SECTORS_PER_CLUSTER,
+                                    BACKUP_SECTORS_PER_CLUSTER,
+                                    &error_is_read);
+                if (ret < 0 &&
+                    backup_error_action(job, error_is_read, -ret) ==
+                    BDRV_ACTION_REPORT) {
+                    return ret;
+                }
+            } while (ret < 0);
+        }
+        last_cluster = cluster - 1;
+    }
+
+    return ret;
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -254,7 +318,9 @@ static void coroutine_fn backup_run(void *opaque)
 
     bdrv_add_before_write_notifier(bs, &before_write);
 
-    if (job->sync_mode == MIRROR_SYNC_MODE_NONE) {
+    if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        ret = backup_run_incremental(job);
+    } else if (job->sync_mode == MIRROR_SYNC_MODE_NONE) {
         while (!block_job_is_cancelled(&job->common)) {
             /* Yield until the job is cancelled.  We just let our before_write
              * notify callback service CoW requests. */
@@ -271,19 +337,7 @@ static void coroutine_fn backup_run(void *opaque)
                 break;
             }
 
-            /* we need to yield so that qemu_aio_flush() returns.
-             * (without, VM does not reboot)
-             */
-            if (job->common.speed) {
-                uint64_t delay_ns = ratelimit_calculate_delay(
-                        &job->limit, job->sectors_read);
-                job->sectors_read = 0;
-                block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
-            } else {
-                block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
-            }
-
-            if (block_job_is_cancelled(&job->common)) {
+            if (backup_yield(job)) {
                 break;
             }
 
@@ -343,6 +397,16 @@ static void coroutine_fn backup_run(void *opaque)
 
     hbitmap_free(job->bitmap);
 
+    if (job->sync_bitmap) {
+        /* The backup contains what the bitmap described only if the job
+         * ran to completion; otherwise the bitmap must keep its content */
+        if (ret == 0 && !block_job_is_cancelled(&job->common)) {
+            bdrv_dirty_bitmap_abdicate(bs, job->sync_bitmap);
+        } else {
+            bdrv_reclaim_dirty_bitmap(bs, job->sync_bitmap);
+        }
+    }
+
     bdrv_iostatus_disable(target);
     bdrv_unref(target);
 
@@ -351,6 +415,7 @@ static void coroutine_fn backup_run(void *opaque)
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
@@ -376,9 +441,28 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    if (sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        if (!sync_bitmap) {
+            error_setg(errp, "must provide a valid bitmap name for "
+                       "\"incremental\" sync mode");
+            return;
+        }
+        /* Freeze the bitmap; writes from now on go to its successor */
+        if (bdrv_dirty_bitmap_create_successor(bs, sync_bitmap, errp) < 0) {
+            return;
+        }
+    } else if (sync_bitmap) {
+        error_setg(errp, "a sync bitmap was provided to backup_start, "
+                   "but the sync mode is not \"incremental\"");
+        return;
+    }
+
     BackupBlockJob *job = block_job_create(&backup_job_driver, bs, speed,
                                            cb, opaque, errp);
     if (!job) {
+        if (sync_bitmap) {
+            bdrv_reclaim_dirty_bitmap(bs, sync_bitmap);
+        }
         return;
     }
 
@@ -386,6 +470,7 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+    job->sync_bitmap = sync_bitmap;
     job->common.len = len;
     job->common.co = qemu_coroutine_create(backup_run);
     qemu_coroutine_enter(job->common.co, job);
@@ -12,6 +12,7 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/main-loop.h"
 
 #include <libaio.h>
 
@@ -25,6 +26,9 @@
  */
 #define MAX_EVENTS 128
 
+/* Requests are queued while plugged and submitted with one io_submit() */
+#define MAX_QUEUED_IO  128
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -36,9 +40,18 @@ struct qemu_laiocb {
     QLIST_ENTRY(qemu_laiocb) node;
 };
 
+typedef struct {
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    int plugged;
+    unsigned int idx;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
+
+    /* io queue for submit at batch */
+    LaioQueue io_q;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -74,17 +87,16 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
-static void qemu_laio_completion_cb(EventNotifier *e)
+/* Reaps everything that has completed so far, not just one batch */
+static void qemu_laio_process_completions(struct qemu_laio_state *s)
 {
-    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
-
-    while (event_notifier_test_and_clear(&s->e)) {
-        struct io_event events[MAX_EVENTS];
-        struct timespec ts = { 0 };
-        int nevents, i;
+    struct io_event events[MAX_EVENTS];
+    struct timespec ts = { 0 };
+    int nevents, i;
 
+    do {
         do {
-            nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
+            nevents = io_getevents(s->ctx, 0, MAX_EVENTS, events, &ts);
         } while (nevents == -EINTR);
 
         for (i = 0; i < nevents; i++) {
@@ -95,7 +107,103 @@ static void qemu_laio_completion_cb(EventNotifier *e)
             laiocb->ret = io_event_ret(&events[i]);
             qemu_laio_process_completion(s, laiocb);
         }
+    } while (nevents == MAX_EVENTS);
+}
+
+static void qemu_laio_completion_cb(EventNotifier *e)
+{
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+
+    while (event_notifier_test_and_clear(&s->e)) {
+        qemu_laio_process_completions(s);
+    }
+}
+
+/*
+ * The completion ring that the kernel maps into our address space, see
+ * fs/aio.c.  io_context_t points to it.
+ */
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+};
+
+#define AIO_RING_MAGIC  0xa10a10a1
+
+/* Polls the completion ring without a system call */
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    if (ring->magic != AIO_RING_MAGIC ||
+        atomic_read(&ring->head) == atomic_read(&ring->tail)) {
+        return false;
+    }
+
+    smp_rmb();
+    qemu_laio_process_completions(s);
+    return true;
+}
+
+static void ioq_init(LaioQueue *io_q)
+{
+    io_q->idx = 0;
+    io_q->plugged = 0;
+}
+
+/*
+ * Submits all queued requests. Requests that the kernel doesn't accept are
+ * completed with an error.
+ */
+static int ioq_submit(struct qemu_laio_state *s)
+{
+    int ret = 0, i, retries = 0;
+    int done = 0, len = s->io_q.idx;
+
+    while (done < len) {
+        ret = io_submit(s->ctx, len - done, &s->io_q.iocbs[done]);
+        if (ret == -EAGAIN && retries++ < 3) {
+            continue;
+        } else if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+
+    /* empty io queue */
+    s->io_q.idx = 0;
+
+    for (i = done; i < len; i++) {
+        struct qemu_laiocb *laiocb =
+            container_of(s->io_q.iocbs[i], struct qemu_laiocb, iocb);
+
+        laiocb->ret = (ret < 0) ? ret : -EIO;
+        qemu_laio_process_completion(s, laiocb);
+    }
+    return ret < 0 ? ret : 0;
+}
+
+static bool ioq_remove(LaioQueue *io_q, struct iocb *iocb)
+{
+    unsigned int i;
+
+    for (i = 0; i < io_q->idx; i++) {
+        if (io_q->iocbs[i] == iocb) {
+            memmove(&io_q->iocbs[i], &io_q->iocbs[i + 1],
+                    (io_q->idx - i - 1) * sizeof(io_q->iocbs[0]));
+            io_q->idx--;
+            return true;
+        }
     }
+    return false;
 }
 
 static void laio_cancel(BlockDriverAIOCB *blockacb)
@@ -107,6 +215,12 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* A request that is still queued hasn't reached the kernel yet */
+    if (ioq_remove(&laiocb->ctx->io_q, &laiocb->iocb)) {
+        qemu_aio_release(laiocb);
+        return;
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -135,6 +249,31 @@ static const AIOCBInfo laio_aiocb_info = {
     .cancel             = laio_cancel,
 };
 
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+int laio_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    struct qemu_laio_state *s = aio_ctx;
+    int ret = 0;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return 0;
+    }
+
+    if (s->io_q.idx > 0) {
+        ret = ioq_submit(s);
+    }
+
+    return ret;
+}
+
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
@@ -168,8 +307,18 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     }
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_free_aiocb;
+    if (!s->io_q.plugged) {
+        if (io_submit(s->ctx, 1, &iocbs) < 0) {
+            goto out_free_aiocb;
+        }
+    } else {
+        /* Make room first, so that a failed batch never completes the
+         * request that is only being submitted now */
+        if (s->io_q.idx == MAX_QUEUED_IO) {
+            ioq_submit(s);
+        }
+        s->io_q.iocbs[s->io_q.idx++] = iocbs;
+    }
     return &laiocb->common;
 
 out_free_aiocb:
@@ -190,7 +339,11 @@ void *laio_init(void)
         goto out_close_efd;
     }
 
+    ioq_init(&s->io_q);
+
     qemu_aio_set_event_notifier(&s->e, qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(qemu_get_aio_context(), &s->e,
+                                qemu_laio_poll_cb);
 
     return s;
 
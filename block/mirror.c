@@ -569,6 +569,7 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
                             bool is_none_mode, BlockDriverState *base)
 {
     MirrorBlockJob *s;
+    BdrvDirtyBitmap *dirty_bitmap;
 
     if (granularity == 0) {
         /* Choose the default granularity based on the target file's cluster
@@ -591,9 +592,14 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
+    if (!dirty_bitmap) {
+        return;
+    }
 
     s = block_job_create(driver, bs, speed, cb, opaque, errp);
     if (!s) {
+        bdrv_release_dirty_bitmap(bs, dirty_bitmap);
         return;
     }
 
@@ -605,7 +611,7 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
 
-    s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity);
+    s->dirty_bitmap = dirty_bitmap;
     bdrv_set_enable_write_cache(s->target, true);
     bdrv_set_on_error(s->target, on_target_error, on_target_error);
     bdrv_iostatus_enable(s->target);
@@ -60,12 +60,19 @@ static void nbd_reply_ready(void *opaque)
     uint64_t i;
     int ret;
 
-    if (s->reply.handle == 0) {
+    if (s->reply.handle == 0 || s->reply_partial) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
-         * the socket is not readable anymore.
+         * the socket is not readable anymore.  A structured chunk header
+         * can also stop short of its length field; keep what was read
+         * and finish it on the next call.
          */
-        ret = nbd_receive_reply(s->sock, &s->reply);
+        if (s->reply_partial) {
+            ret = nbd_receive_chunk_length(s->sock, &s->reply);
+        } else {
+            ret = nbd_receive_reply(s->sock, &s->reply);
+        }
+        s->reply_partial = (ret == -EAGAIN && s->reply.handle != 0);
         if (ret == -EAGAIN) {
             return;
         }
@@ -132,29 +139,157 @@ static int nbd_co_send_request(NbdClientSession *s,
     return rc;
 }
 
+static int nbd_co_drain(NbdClientSession *s, uint32_t length)
+{
+    char buf[256];
+    uint32_t len;
+
+    while (length) {
+        len = MIN(length, sizeof(buf));
+        if (qemu_co_recv(s->sock, buf, len) != len) {
+            return -EIO;
+        }
+        length -= len;
+    }
+    return 0;
+}
+
+/* Consume the payload of a structured reply chunk.  Returns zero or a
+ * positive errno reported by the server, or a negative errno if the chunk
+ * was malformed and the stream cannot be trusted anymore.  The bytes
+ * described by data and hole chunks are added to *covered.
+ */
+static int nbd_co_receive_chunk(NbdClientSession *s,
+    struct nbd_request *request, struct nbd_reply *chunk,
+    QEMUIOVector *qiov, int offset, uint32_t *covered)
+{
+    uint8_t buf[8 + 4];
+    uint64_t from;
+    uint32_t len;
+    int ret;
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return chunk->length ? -EINVAL : 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov) {
+            return -EINVAL;
+        }
+        if (chunk->type == NBD_REPLY_TYPE_OFFSET_DATA) {
+            if (chunk->length < 8) {
+                return -EINVAL;
+            }
+            len = chunk->length - 8;
+            if (qemu_co_recv(s->sock, buf, 8) != 8) {
+                return -EIO;
+            }
+        } else {
+            if (chunk->length != 8 + 4) {
+                return -EINVAL;
+            }
+            if (qemu_co_recv(s->sock, buf, 8 + 4) != 8 + 4) {
+                return -EIO;
+            }
+            len = be32_to_cpup((uint32_t *)(buf + 8));
+        }
+
+        from = be64_to_cpup((uint64_t *)buf);
+        if (from < request->from || len > request->len ||
+            from - request->from > request->len - len) {
+            return -EINVAL;
+        }
+
+        /* Chunks may not overlap, so more than the request is bogus.  */
+        if (len > request->len - *covered) {
+            return -EINVAL;
+        }
+        *covered += len;
+
+        offset += from - request->from;
+        if (chunk->type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            qemu_iovec_memset(qiov, offset, 0, len);
+        } else if (qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                                 offset, len) != len) {
+            return -EIO;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_ERROR:
+        if (chunk->length < 4 + 2) {
+            return -EINVAL;
+        }
+        if (qemu_co_recv(s->sock, buf, 4 + 2) != 4 + 2) {
+            return -EIO;
+        }
+        if (chunk->length != 4 + 2 + be16_to_cpup((uint16_t *)(buf + 4))) {
+            return -EINVAL;
+        }
+        /* The message is only meant for humans; drop it.  */
+        ret = nbd_co_drain(s, chunk->length - (4 + 2));
+        if (ret < 0) {
+            return ret;
+        }
+        return be32_to_cpup((uint32_t *)buf) ?: EIO;
+
+    default:
+        return -EINVAL;
+    }
+}
+
 static void nbd_co_receive_reply(NbdClientSession *s,
     struct nbd_request *request, struct nbd_reply *reply,
     QEMUIOVector *qiov, int offset)
 {
+    struct nbd_reply chunk;
+    uint32_t covered = 0;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
+    reply->error = 0;
+    do {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        chunk = s->reply;
+        if (chunk.handle != request->handle) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (chunk.magic == NBD_STRUCTURED_REPLY_MAGIC) {
+            ret = nbd_co_receive_chunk(s, request, &chunk, qiov, offset,
+                                       &covered);
+            if (ret < 0) {
+                /* Further chunks for this handle could end up in a
+                 * request that reuses it; let the read handler tear
+                 * the connection down instead.  */
+                shutdown(s->sock, 2);
                 reply->error = EIO;
+                return;
+            }
+        } else {
+            ret = chunk.error;
+            if (qiov && ret == 0) {
+                if (qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                                  offset, request->len) != request->len) {
+                    ret = EIO;
+                }
+                covered = request->len;
             }
         }
+        if (ret && !reply->error) {
+            reply->error = ret;
+        }
 
         /* Tell the read handler to read another header.  */
         s->reply.handle = 0;
+    } while (!(chunk.flags & NBD_REPLY_FLAG_DONE));
+
+    /* A successful read must have described every byte; anything else
+     * would leave stale data in the buffer.  */
+    if (qiov && !reply->error && covered != request->len) {
+        reply->error = EIO;
     }
 }
 
@@ -366,7 +501,7 @@ int nbd_client_session_init(NbdClientSession *client, BlockDriverState *bs,
     qemu_set_block(sock);
     ret = nbd_receive_negotiate(sock, export,
                                 &client->nbdflags, &client->size,
-                                &client->blocksize);
+                                &client->blocksize, &client->structured_reply);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         closesocket(sock);
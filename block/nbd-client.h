@@ -29,8 +29,10 @@ typedef struct NbdClientSession {
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+    bool reply_partial;     /* reply holds a chunk header minus its length */
 
     bool is_unix;
+    bool structured_reply;
 
     BlockDriverState *bs;
 } NbdClientSession;
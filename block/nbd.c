@@ -40,16 +40,36 @@
 #define EN_OPTSTR ":exportname="
 
 typedef struct BDRVNBDState {
-    NbdClientSession client;
+    /* One session per connection; requests are striped across them */
+    NbdClientSession *client;
+    int num_clients;
+    int next_client;
+
+    bool is_unix;
     QemuOpts *socket_opts;
 } BDRVNBDState;
 
+static QemuOptsList runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open to the server",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int nbd_parse_uri(const char *filename, QDict *options)
 {
     URI *uri;
     const char *p;
+    const char *socket = NULL;
     QueryParams *qp = NULL;
     int ret = 0;
+    int i;
     bool is_unix;
 
     uri = uri_parse(filename);
@@ -76,21 +96,28 @@ static int nbd_parse_uri(const char *filename, QDict *options)
     }
 
     qp = query_params_parse(uri->query);
-    if (qp->n > 1 || (is_unix && !qp->n) || (!is_unix && qp->n)) {
-        ret = -EINVAL;
-        goto out;
+    for (i = 0; i < qp->n; i++) {
+        if (!strcmp(qp->p[i].name, "connections")) {
+            qdict_put(options, "connections",
+                      qstring_from_str(qp->p[i].value));
+        } else if (is_unix && !socket && !strcmp(qp->p[i].name, "socket")) {
+            socket = qp->p[i].value;
+        } else {
+            ret = -EINVAL;
+            goto out;
+        }
     }
 
     if (is_unix) {
-        /* nbd+unix:///export?socket=path */
-        if (uri->server || uri->port || strcmp(qp->p[0].name, "socket")) {
+        /* nbd+unix:///export?socket=path[&connections=n] */
+        if (uri->server || uri->port || !socket) {
             ret = -EINVAL;
             goto out;
         }
-        qdict_put(options, "path", qstring_from_str(qp->p[0].value));
+        qdict_put(options, "path", qstring_from_str(socket));
     } else {
         QString *host;
-        /* nbd[+tcp]://host[:port]/export */
+        /* nbd[+tcp]://host[:port]/export[?connections=n] */
         if (!uri->server) {
             ret = -EINVAL;
             goto out;
@@ -191,6 +218,7 @@ out:
 static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
                        Error **errp)
 {
+    QemuOpts *opts;
     Error *local_err = NULL;
 
     if (qdict_haskey(options, "path") == qdict_haskey(options, "host")) {
@@ -202,7 +230,21 @@ static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
         return;
     }
 
-    s->client.is_unix = qdict_haskey(options, "path");
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return;
+    }
+    s->num_clients = qemu_opt_get_number(opts, "connections", 1);
+    qemu_opts_del(opts);
+    if (s->num_clients < 1 || s->num_clients > 64) {
+        error_setg(errp, "connections must be between 1 and 64");
+        return;
+    }
+
+    s->is_unix = qdict_haskey(options, "path");
     s->socket_opts = qemu_opts_create(&socket_optslist, NULL, 0,
                                       &error_abort);
 
@@ -227,7 +269,7 @@ static int nbd_establish_connection(BlockDriverState *bs, Error **errp)
     BDRVNBDState *s = bs->opaque;
     int sock;
 
-    if (s->client.is_unix) {
+    if (s->is_unix) {
         sock = unix_connect_opts(s->socket_opts, errp, NULL, NULL);
     } else {
         sock = inet_connect_opts(s->socket_opts, errp, NULL, NULL);
@@ -249,8 +291,10 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
     BDRVNBDState *s = bs->opaque;
+    NbdClientSession *client;
     char *export = NULL;
     int result, sock;
+    int i;
     Error *local_err = NULL;
 
     /* Pop the config into our state object. Exit if invalid. */
@@ -260,26 +304,82 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         return -EINVAL;
     }
 
-    /* establish TCP connection, return error if it fails
-     * TODO: Configurable retry-until-timeout behaviour.
-     */
-    sock = nbd_establish_connection(bs, errp);
-    if (sock < 0) {
-        return sock;
+    s->client = g_new0(NbdClientSession, s->num_clients);
+    for (i = 0; i < s->num_clients; i++) {
+        client = &s->client[i];
+
+        /* establish TCP connection, return error if it fails
+         * TODO: Configurable retry-until-timeout behaviour.
+         */
+        sock = nbd_establish_connection(bs, errp);
+        if (sock < 0) {
+            result = sock;
+            goto fail;
+        }
+
+        /* NBD handshake */
+        client->is_unix = s->is_unix;
+        result = nbd_client_session_init(client, bs, sock, export);
+        if (result < 0) {
+            goto fail;
+        }
+
+        if (i == 0 && !(client->nbdflags & NBD_FLAG_CAN_MULTI_CONN)) {
+            /* Writes on one connection might not be visible on the
+             * others; stick to a single one.  */
+            logout("Server does not support multiple connections\n");
+            s->num_clients = 1;
+        } else if (i > 0 && (client->size != s->client[0].size ||
+                             client->nbdflags != s->client[0].nbdflags)) {
+            error_setg(errp, "NBD server exported inconsistent data "
+                       "on multiple connections");
+            nbd_client_session_close(client);
+            result = -EINVAL;
+            goto fail;
+        }
     }
 
-    /* NBD handshake */
-    result = nbd_client_session_init(&s->client, bs, sock, export);
+    g_free(export);
+    return 0;
+
+fail:
+    while (--i >= 0) {
+        nbd_client_session_close(&s->client[i]);
+    }
+    g_free(s->client);
+    s->client = NULL;
     g_free(export);
     return result;
 }
 
+/* Pick the connection for the next request: the least busy one, starting
+ * from a different connection each time so that ties are spread evenly.
+ */
+static NbdClientSession *nbd_get_client(BDRVNBDState *s)
+{
+    NbdClientSession *client, *best = NULL;
+    int i;
+
+    for (i = 0; i < s->num_clients; i++) {
+        client = &s->client[(s->next_client + i) % s->num_clients];
+        if (client->sock == -1) {
+            continue;
+        }
+        if (!best || client->in_flight < best->in_flight) {
+            best = client;
+        }
+    }
+    s->next_client = (s->next_client + 1) % s->num_clients;
+
+    return best ? best : &s->client[0];
+}
+
 static int nbd_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return nbd_client_session_co_readv(&s->client, sector_num,
+    return nbd_client_session_co_readv(nbd_get_client(s), sector_num,
                                        nb_sectors, qiov);
 }
 
@@ -288,7 +388,7 @@ static int nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
 
-    return nbd_client_session_co_writev(&s->client, sector_num,
+    return nbd_client_session_co_writev(nbd_get_client(s), sector_num,
                                         nb_sectors, qiov);
 }
 
@@ -296,7 +396,9 @@ static int nbd_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return nbd_client_session_co_flush(&s->client);
+    /* NBD_FLAG_CAN_MULTI_CONN guarantees that a flush on any connection
+     * covers the writes completed on all of them.  */
+    return nbd_client_session_co_flush(nbd_get_client(s));
 }
 
 static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -304,23 +406,27 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
 
-    return nbd_client_session_co_discard(&s->client, sector_num,
+    return nbd_client_session_co_discard(nbd_get_client(s), sector_num,
                                          nb_sectors);
 }
 
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+    int i;
 
     qemu_opts_del(s->socket_opts);
-    nbd_client_session_close(&s->client);
+    for (i = 0; i < s->num_clients; i++) {
+        nbd_client_session_close(&s->client[i]);
+    }
+    g_free(s->client);
 }
 
 static int64_t nbd_getlength(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return s->client.size;
+    return s->client[0].size;
 }
 
 static BlockDriver bdrv_nbd = {
@@ -795,8 +795,10 @@ static int qcow_make_empty(BlockDriverState *bs)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                 const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow_write_compressed(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              const uint8_t *buf,
+                                              int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
@@ -854,15 +856,18 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
             goto fail;
         }
     } else {
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
                                             out_len, 0, 0);
         if (cluster_offset == 0) {
+            qemu_co_mutex_unlock(&s->lock);
             ret = -EIO;
             goto fail;
         }
 
         cluster_offset &= s->cluster_offset_mask;
         ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
@@ -0,0 +1,694 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+
+/*
+ * The bitmaps are stored in the image only while it is closed, or handed
+ * over to a migration destination.  When the image is opened read-write,
+ * they are loaded into bs->dirty_bitmaps and removed from the image, so
+ * that a crash or an older version writing to the image can never leave
+ * behind a bitmap that misses some writes.  On close, the persistent ones
+ * are written back and protected by an autoclear bit.
+ *
+ * Each bitmap is stored as a table of cluster offsets, one entry for each
+ * cluster's worth of serialized bitmap data; 0 stands for a cluster of
+ * zeroes.  See docs/specs/qcow2.txt for the on-disk format.
+ */
+
+/* Type of the bitmaps in the directory */
+#define BT_DIRTY_TRACKING_BITMAP 1
+
+/* Granularity of the bitmaps, in bytes */
+#define BME_MIN_GRANULARITY_BITS 9
+#define BME_MAX_GRANULARITY_BITS 26
+
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    uint64_t bitmap_table_offset;
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* name follows, padded to a multiple of 8 bytes */
+} Qcow2BitmapDirEntry;
+
+typedef struct Qcow2Bitmap {
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint8_t granularity_bits;
+    char *name;
+} Qcow2Bitmap;
+
+static size_t dir_entry_size(size_t name_size)
+{
+    return align_offset(sizeof(Qcow2BitmapDirEntry) + name_size, 8);
+}
+
+/* Number of sectors described by one cluster of the bitmap table */
+static uint64_t bitmap_sectors_per_cluster(BDRVQcowState *s,
+                                           int granularity_bits)
+{
+    return (uint64_t)s->cluster_size * 8 <<
+           (granularity_bits - BDRV_SECTOR_BITS);
+}
+
+static uint32_t bitmap_table_size(BlockDriverState *bs, int granularity_bits)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return DIV_ROUND_UP(bs->total_sectors,
+                        bitmap_sectors_per_cluster(s, granularity_bits));
+}
+
+static void bitmap_list_free(Qcow2Bitmap *bitmaps, int nb_bitmaps)
+{
+    int i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+    }
+    g_free(bitmaps);
+}
+
+/* Read and check the bitmap directory of the image */
+static int bitmap_read_directory(BlockDriverState *bs, Qcow2Bitmap **pbitmaps,
+                                 Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapDirEntry *e;
+    Qcow2Bitmap *bitmaps;
+    uint8_t *dir;
+    uint64_t offset;
+    int i, ret;
+
+    dir = g_malloc(s->bitmap_directory_size);
+    ret = bdrv_pread(bs->file, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap directory");
+        g_free(dir);
+        return ret;
+    }
+
+    bitmaps = g_new0(Qcow2Bitmap, s->nb_bitmaps);
+    offset = 0;
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+
+        if (s->bitmap_directory_size - offset < sizeof(*e)) {
+            goto invalid;
+        }
+        e = (Qcow2BitmapDirEntry *)(dir + offset);
+        be64_to_cpus(&e->bitmap_table_offset);
+        be32_to_cpus(&e->bitmap_table_size);
+        be32_to_cpus(&e->flags);
+        be16_to_cpus(&e->name_size);
+        be32_to_cpus(&e->extra_data_size);
+
+        if (e->type != BT_DIRTY_TRACKING_BITMAP || e->flags != 0 ||
+            e->extra_data_size != 0 || e->name_size == 0 ||
+            e->name_size > QCOW2_MAX_BITMAP_NAME_SIZE ||
+            e->granularity_bits < BME_MIN_GRANULARITY_BITS ||
+            e->granularity_bits > BME_MAX_GRANULARITY_BITS ||
+            s->bitmap_directory_size - offset < dir_entry_size(e->name_size) ||
+            (e->bitmap_table_offset & (s->cluster_size - 1)) ||
+            e->bitmap_table_size !=
+                bitmap_table_size(bs, e->granularity_bits)) {
+            goto invalid;
+        }
+
+        bm->table_offset = e->bitmap_table_offset;
+        bm->table_size = e->bitmap_table_size;
+        bm->granularity_bits = e->granularity_bits;
+        bm->name = g_strndup((char *)(e + 1), e->name_size);
+        offset += dir_entry_size(e->name_size);
+    }
+
+    g_free(dir);
+    *pbitmaps = bitmaps;
+    return 0;
+
+invalid:
+    error_setg(errp, "Invalid entry in bitmap directory");
+    bitmap_list_free(bitmaps, s->nb_bitmaps);
+    g_free(dir);
+    return -EINVAL;
+}
+
+static int bitmap_read_table(BlockDriverState *bs, Qcow2Bitmap *bm,
+                             uint64_t **ptable)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *table;
+    int i, ret;
+
+    table = g_new(uint64_t, bm->table_size);
+    ret = bdrv_pread(bs->file, bm->table_offset, table,
+                     bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        g_free(table);
+        return ret;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        be64_to_cpus(&table[i]);
+        if (table[i] & (s->cluster_size - 1)) {
+            g_free(table);
+            return -EINVAL;
+        }
+    }
+
+    *ptable = table;
+    return 0;
+}
+
+/* Free the data clusters in @table and the table itself */
+static void bitmap_free_clusters(BlockDriverState *bs, uint64_t table_offset,
+                                 uint64_t *table, uint32_t table_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < table_size; i++) {
+        if (table[i]) {
+            qcow2_free_clusters(bs, table[i], s->cluster_size,
+                                QCOW2_DISCARD_ALWAYS);
+        }
+    }
+    if (table_offset) {
+        qcow2_free_clusters(bs, table_offset, table_size * sizeof(uint64_t),
+                            QCOW2_DISCARD_ALWAYS);
+    }
+}
+
+static int bitmap_load_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                            int granularity_bits, uint64_t *table,
+                            uint32_t table_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t chunk = bitmap_sectors_per_cluster(s, granularity_bits);
+    uint64_t start, count;
+    uint8_t *buf;
+    int i, ret = 0;
+
+    buf = qemu_blockalign(bs, s->cluster_size);
+    for (i = 0; i < table_size; i++) {
+        /* The bitmap is new, so its zero parts are already there */
+        if (!table[i]) {
+            continue;
+        }
+
+        ret = bdrv_pread(bs->file, table[i], buf, s->cluster_size);
+        if (ret < 0) {
+            break;
+        }
+
+        start = i * chunk;
+        count = MIN(chunk, bs->total_sectors - start);
+        bdrv_dirty_bitmap_deserialize_part(bitmap, buf, start, count, false);
+    }
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+    qemu_vfree(buf);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Move the bitmaps of the image to bs->dirty_bitmaps and remove them from
+ * the image.  From now on, the image is responsible for storing them again
+ * on close.
+ */
+int qcow2_load_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    BdrvDirtyBitmap **loaded;
+    uint64_t **tables;
+    uint32_t nb_bitmaps = s->nb_bitmaps;
+    uint64_t dir_offset = s->bitmap_directory_offset;
+    uint64_t dir_size = s->bitmap_directory_size;
+    int i, ret;
+
+    s->owns_bitmaps = true;
+    if (!nb_bitmaps) {
+        return 0;
+    }
+
+    ret = bitmap_read_directory(bs, &bitmaps, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    loaded = g_new0(BdrvDirtyBitmap *, nb_bitmaps);
+    tables = g_new0(uint64_t *, nb_bitmaps);
+    for (i = 0; i < nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+
+        ret = bitmap_read_table(bs, bm, &tables[i]);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read table of bitmap "
+                             "'%s'", bm->name);
+            goto fail;
+        }
+
+        /* After qcow2_invalidate_cache(), the bitmaps were never released */
+        if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+            continue;
+        }
+
+        loaded[i] = bdrv_create_dirty_bitmap(bs, 1 << bm->granularity_bits,
+                                             bm->name, errp);
+        if (!loaded[i]) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        bdrv_dirty_bitmap_set_persistent(loaded[i], true);
+
+        ret = bitmap_load_data(bs, loaded[i], bm->granularity_bits,
+                               tables[i], bm->table_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read bitmap '%s'",
+                             bm->name);
+            goto fail;
+        }
+    }
+
+    /* Drop the extension before freeing the clusters, so that a crash
+     * leaks them at worst */
+    s->nb_bitmaps = 0;
+    s->bitmap_directory_offset = 0;
+    s->bitmap_directory_size = 0;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        s->nb_bitmaps = nb_bitmaps;
+        s->bitmap_directory_offset = dir_offset;
+        s->bitmap_directory_size = dir_size;
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+        goto fail;
+    }
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        bitmap_free_clusters(bs, bitmaps[i].table_offset, tables[i],
+                             bitmaps[i].table_size);
+    }
+    qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_ALWAYS);
+    ret = 0;
+
+fail:
+    for (i = 0; i < nb_bitmaps; i++) {
+        if (ret < 0 && loaded[i]) {
+            bdrv_release_dirty_bitmap(bs, loaded[i]);
+        }
+        g_free(tables[i]);
+    }
+    g_free(tables);
+    g_free(loaded);
+    bitmap_list_free(bitmaps, nb_bitmaps);
+    return ret;
+}
+
+/*
+ * Write the data and table of @bitmap to newly allocated clusters.  On
+ * failure, nothing stays allocated.
+ */
+static int bitmap_store_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             Qcow2Bitmap *bm)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t chunk = bitmap_sectors_per_cluster(s, bm->granularity_bits);
+    uint64_t start, count;
+    uint64_t *table;
+    int64_t offset;
+    uint8_t *buf;
+    int i, ret;
+
+    table = g_new0(uint64_t, bm->table_size);
+    buf = qemu_blockalign(bs, s->cluster_size);
+
+    for (i = 0; i < bm->table_size; i++) {
+        start = i * chunk;
+        count = MIN(chunk, bs->total_sectors - start);
+
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, start, count);
+        if (buffer_is_zero(buf, s->cluster_size)) {
+            continue;
+        }
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            ret = offset;
+            goto fail;
+        }
+        table[i] = offset;
+
+        ret = bdrv_pwrite(bs->file, offset, buf, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    if (!bm->table_size) {
+        /* Empty image */
+        ret = 0;
+        goto out;
+    }
+
+    offset = qcow2_alloc_clusters(bs, bm->table_size * sizeof(uint64_t));
+    if (offset < 0) {
+        ret = offset;
+        goto fail;
+    }
+    bm->table_offset = offset;
+
+    for (i = 0; i < bm->table_size; i++) {
+        cpu_to_be64s(&table[i]);
+    }
+    ret = bdrv_pwrite(bs->file, bm->table_offset, table,
+                      bm->table_size * sizeof(uint64_t));
+    for (i = 0; i < bm->table_size; i++) {
+        be64_to_cpus(&table[i]);
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = 0;
+    goto out;
+
+fail:
+    bitmap_free_clusters(bs, bm->table_offset, table, bm->table_size);
+    bm->table_offset = 0;
+out:
+    qemu_vfree(buf);
+    g_free(table);
+    return ret;
+}
+
+static void bitmap_free_stored(BlockDriverState *bs, Qcow2Bitmap *bitmaps,
+                               int nb_bitmaps)
+{
+    uint64_t *table;
+    int i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        if (bitmap_read_table(bs, &bitmaps[i], &table) < 0) {
+            /* Leaked, qemu-img check can reclaim it */
+            continue;
+        }
+        bitmap_free_clusters(bs, bitmaps[i].table_offset, table,
+                             bitmaps[i].table_size);
+        g_free(table);
+    }
+}
+
+/*
+ * Store the persistent bitmaps of bs->dirty_bitmaps in the image.  They
+ * stay in memory and keep tracking writes.
+ */
+int qcow2_store_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = NULL;
+    Qcow2Bitmap *bitmaps = NULL;
+    Qcow2BitmapDirEntry *e;
+    uint8_t *dir = NULL;
+    uint64_t dir_size = 0;
+    int64_t dir_offset;
+    int nb_bitmaps = 0, nb_stored = 0;
+    int i, ret;
+
+    assert(s->owns_bitmaps && !s->bitmaps_stored && !s->nb_bitmaps);
+
+    while ((bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) != NULL) {
+        if (bdrv_dirty_bitmap_get_persistent(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+    if (!nb_bitmaps) {
+        return 0;
+    }
+
+    /* Write the bitmaps themselves */
+    bitmaps = g_new0(Qcow2Bitmap, nb_bitmaps);
+    while ((bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) != NULL) {
+        Qcow2Bitmap *bm = &bitmaps[nb_stored];
+
+        if (!bdrv_dirty_bitmap_get_persistent(bitmap)) {
+            continue;
+        }
+
+        bm->name = g_strdup(bdrv_dirty_bitmap_name(bitmap));
+        bm->granularity_bits =
+            ctz64(bdrv_dirty_bitmap_granularity(bitmap));
+        bm->table_size = bitmap_table_size(bs, bm->granularity_bits);
+
+        ret = bitmap_store_data(bs, bitmap, bm);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write bitmap '%s'",
+                             bm->name);
+            goto fail;
+        }
+        nb_stored++;
+        dir_size += dir_entry_size(strlen(bm->name));
+    }
+
+    if (dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "Bitmap directory too large");
+        ret = -EFBIG;
+        goto fail;
+    }
+
+    /* And the directory that points to them */
+    dir = g_malloc0(dir_size);
+    e = (Qcow2BitmapDirEntry *)dir;
+    for (i = 0; i < nb_bitmaps; i++) {
+        size_t name_size = strlen(bitmaps[i].name);
+
+        *e = (Qcow2BitmapDirEntry) {
+            .bitmap_table_offset = cpu_to_be64(bitmaps[i].table_offset),
+            .bitmap_table_size = cpu_to_be32(bitmaps[i].table_size),
+            .type = BT_DIRTY_TRACKING_BITMAP,
+            .granularity_bits = bitmaps[i].granularity_bits,
+            .name_size = cpu_to_be16(name_size),
+        };
+        memcpy(e + 1, bitmaps[i].name, name_size);
+        e = (Qcow2BitmapDirEntry *)((uint8_t *)e + dir_entry_size(name_size));
+    }
+
+    dir_offset = qcow2_alloc_clusters(bs, dir_size);
+    if (dir_offset < 0) {
+        ret = dir_offset;
+        error_setg_errno(errp, -ret, "Could not allocate bitmap directory");
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write bitmap directory");
+        goto fail_dir;
+    }
+
+    /* The header may only point to the bitmaps once they and their
+     * refcounts are stable on disk */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret == 0) {
+        ret = bdrv_flush(bs->file);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush bitmaps");
+        goto fail_dir;
+    }
+
+    s->nb_bitmaps = nb_bitmaps;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        s->nb_bitmaps = 0;
+        s->bitmap_directory_offset = 0;
+        s->bitmap_directory_size = 0;
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+        goto fail_dir;
+    }
+
+    g_free(dir);
+    bitmap_list_free(bitmaps, nb_bitmaps);
+    return 0;
+
+fail_dir:
+    qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_ALWAYS);
+fail:
+    bitmap_free_stored(bs, bitmaps, nb_stored);
+    g_free(dir);
+    bitmap_list_free(bitmaps, nb_bitmaps);
+    return ret;
+}
+
+/*
+ * Remove the bitmaps stored by qcow2_store_dirty_bitmaps() from the image
+ * before it is modified, the copy in memory is the only valid one again.
+ */
+int qcow2_drop_stored_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps = NULL;
+    uint32_t nb_bitmaps = s->nb_bitmaps;
+    uint64_t dir_offset = s->bitmap_directory_offset;
+    uint64_t dir_size = s->bitmap_directory_size;
+    int ret;
+
+    assert(s->bitmaps_stored);
+    if (!nb_bitmaps) {
+        s->bitmaps_stored = false;
+        return 0;
+    }
+
+    ret = bitmap_read_directory(bs, &bitmaps, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->nb_bitmaps = 0;
+    s->bitmap_directory_offset = 0;
+    s->bitmap_directory_size = 0;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->nb_bitmaps = nb_bitmaps;
+        s->bitmap_directory_offset = dir_offset;
+        s->bitmap_directory_size = dir_size;
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+        bitmap_list_free(bitmaps, nb_bitmaps);
+        return ret;
+    }
+    s->bitmaps_stored = false;
+
+    bitmap_free_stored(bs, bitmaps, nb_bitmaps);
+    qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_ALWAYS);
+    bitmap_list_free(bitmaps, nb_bitmaps);
+    return 0;
+}
+
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                  int64_t granularity, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = NULL;
+    int nb_bitmaps = 0;
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Persistent dirty bitmaps require a qcow2 image "
+                   "with at least qemu 1.1 compatibility level");
+        return false;
+    }
+    if (!s->owns_bitmaps) {
+        error_setg(errp, "Cannot store dirty bitmaps in an image that is "
+                   "read-only or used by an incoming migration");
+        return false;
+    }
+    if (strlen(name) > QCOW2_MAX_BITMAP_NAME_SIZE) {
+        error_setg(errp, "Bitmap name is longer than %d bytes",
+                   QCOW2_MAX_BITMAP_NAME_SIZE);
+        return false;
+    }
+    if (granularity < (1 << BME_MIN_GRANULARITY_BITS) ||
+        granularity > (1 << BME_MAX_GRANULARITY_BITS)) {
+        error_setg(errp, "Bitmap granularity must be between %d and %d "
+                   "bytes", 1 << BME_MIN_GRANULARITY_BITS,
+                   1 << BME_MAX_GRANULARITY_BITS);
+        return false;
+    }
+
+    while ((bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) != NULL) {
+        if (bdrv_dirty_bitmap_get_persistent(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many persistent dirty bitmaps");
+        return false;
+    }
+
+    return true;
+}
+
+/* Hand the bitmaps over to whoever opens the image next */
+void qcow2_store_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (!s->owns_bitmaps || s->bitmaps_stored) {
+        return;
+    }
+
+    if (qcow2_store_bitmaps(bs, errp) == 0) {
+        s->bitmaps_stored = true;
+    }
+}
+
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  uint16_t *refcount_table,
+                                  int refcount_table_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    uint64_t *table;
+    int i, j, ret;
+
+    if (!s->nb_bitmaps) {
+        return 0;
+    }
+
+    qcow2_inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                        s->bitmap_directory_offset, s->bitmap_directory_size);
+
+    ret = bitmap_read_directory(bs, &bitmaps, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "ERROR bitmap directory is invalid\n");
+        res->corruptions++;
+        return 0;
+    }
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+
+        qcow2_inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                            bm->table_offset,
+                            bm->table_size * sizeof(uint64_t));
+
+        ret = bitmap_read_table(bs, bm, &table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR table of bitmap '%s' is invalid\n",
+                    bm->name);
+            res->corruptions++;
+            continue;
+        }
+        for (j = 0; j < bm->table_size; j++) {
+            if (table[j]) {
+                qcow2_inc_refcounts(bs, res, refcount_table,
+                                    refcount_table_size,
+                                    table[j], s->cluster_size);
+            }
+        }
+        g_free(table);
+    }
+
+    bitmap_list_free(bitmaps, s->nb_bitmaps);
+    return 0;
+}
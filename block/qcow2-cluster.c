@@ -200,7 +200,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->cluster_size);
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -223,7 +223,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->cluster_size);
     } else {
         uint64_t* old_table;
 
@@ -273,7 +273,7 @@ fail:
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -286,12 +286,12 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcowState *s, uint64_t nb_clusters,
+        uint64_t *l2_table, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_table, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset)
@@ -300,8 +300,8 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
     assert(qcow2_get_cluster_type(first_entry) != QCOW2_CLUSTER_COMPRESSED);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i) & mask;
+        if (offset + (uint64_t) i * s->cluster_size != l2_entry) {
             break;
         }
     }
@@ -309,12 +309,14 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
 	return i;
 }
 
-static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_table)
+static int count_contiguous_free_clusters(BDRVQcowState *s,
+        uint64_t nb_clusters, uint64_t *l2_table, int l2_index)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+        int type = qcow2_get_cluster_type(l2_entry);
 
         if (type != QCOW2_CLUSTER_UNALLOCATED) {
             break;
@@ -324,6 +326,57 @@ static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_tab
     return i;
 }
 
+/*
+ * With extended L2 entries, counts how many subclusters starting at
+ * sc_index of cluster l2_index have the same type as the first one. For
+ * allocated subclusters, the host clusters must also be contiguous.
+ *
+ * Returns the number of subclusters, or -EIO if an invalid L2 bitmap is
+ * found. The type of the first subcluster is stored in *type.
+ */
+static int count_contiguous_subclusters(BDRVQcowState *s,
+        uint64_t nb_subclusters, uint64_t *l2_table, int l2_index,
+        int sc_index, int *type)
+{
+    uint64_t first_entry = get_l2_entry(s, l2_table, l2_index);
+    uint64_t expected_offset = first_entry & L2E_OFFSET_MASK;
+    int i, count = 0;
+
+    *type = qcow2_get_subcluster_type(first_entry,
+                                      get_l2_bitmap(s, l2_table, l2_index),
+                                      sc_index);
+    if (*type < 0) {
+        return *type;
+    }
+
+    for (i = 0; count < nb_subclusters && i < s->l2_size - l2_index; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+        int j;
+
+        if (*type == QCOW2_CLUSTER_NORMAL &&
+            (l2_entry & L2E_OFFSET_MASK) != expected_offset) {
+            break;
+        }
+
+        for (j = (i == 0 ? sc_index : 0);
+             j < s->subclusters_per_cluster && count < nb_subclusters; j++) {
+            int ret = qcow2_get_subcluster_type(l2_entry, l2_bitmap, j);
+            if (ret < 0) {
+                return ret;
+            }
+            if (ret != *type) {
+                return count;
+            }
+            count++;
+        }
+
+        expected_offset += s->cluster_size;
+    }
+
+    return count;
+}
+
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
@@ -409,6 +462,49 @@ out:
 }
 
 
+/*
+ * The part of qcow2_get_cluster_offset() for images with extended L2
+ * entries: the returned type and the number of available sectors are
+ * those of a run of subclusters of the same type, starting at offset.
+ */
+static int get_subcluster_offset(BlockDriverState *bs, uint64_t *l2_table,
+    int l2_index, uint64_t offset, uint64_t nb_needed,
+    uint64_t *cluster_offset, uint64_t *nb_available)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_entry = *cluster_offset;
+    int sc_index = offset_to_sc_index(s, offset);
+    uint64_t nb_subclusters;
+    int ret, type;
+
+    *cluster_offset = 0;
+
+    if (qcow2_get_cluster_type(l2_entry) == QCOW2_CLUSTER_COMPRESSED) {
+        if (get_l2_bitmap(s, l2_table, l2_index) != 0) {
+            return -EIO;
+        }
+        /* Compressed clusters can only be processed one by one */
+        *cluster_offset = l2_entry & L2E_COMPRESSED_OFFSET_SIZE_MASK;
+        *nb_available = s->cluster_sectors;
+        return QCOW2_CLUSTER_COMPRESSED;
+    }
+
+    nb_subclusters = DIV_ROUND_UP(nb_needed, s->subcluster_sectors)
+                   - sc_index;
+    ret = count_contiguous_subclusters(s, nb_subclusters, l2_table, l2_index,
+                                       sc_index, &type);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (type == QCOW2_CLUSTER_NORMAL) {
+        *cluster_offset = l2_entry & L2E_OFFSET_MASK;
+    }
+    *nb_available = (uint64_t) (sc_index + ret) * s->subcluster_sectors;
+
+    return type;
+}
+
 /*
  * get_cluster_offset
  *
@@ -479,9 +575,19 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
+    if (has_subclusters(s)) {
+        ret = get_subcluster_offset(bs, l2_table, l2_index, offset,
+                                    nb_needed, cluster_offset, &nb_available);
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        if (ret < 0) {
+            return ret;
+        }
+        goto out;
+    }
+
     ret = qcow2_get_cluster_type(*cluster_offset);
     switch (ret) {
     case QCOW2_CLUSTER_COMPRESSED:
@@ -494,19 +600,19 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
             qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
             return -EIO;
         }
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                QCOW_OFLAG_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+        c = count_contiguous_free_clusters(s, nb_clusters, l2_table, l2_index);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         break;
     default:
@@ -577,7 +683,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                                 QCOW2_DISCARD_OTHER);
         }
     }
@@ -622,7 +728,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -646,7 +752,10 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        set_l2_bitmap(s, l2_table, l2_index, 0);
+    }
     ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     if (ret < 0) {
         return 0;
@@ -684,6 +793,31 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
     return 0;
 }
 
+/*
+ * Returns the subclusters of the i-th cluster of an allocation that are
+ * written either by the guest or by COW, as allocation bits of an L2 bitmap
+ */
+static uint64_t l2meta_alloc_bitmap(BDRVQcowState *s, QCowL2Meta *m, int i)
+{
+    uint64_t start = m->cow_start.offset;
+    uint64_t end = m->cow_end.offset +
+                   (m->cow_end.nb_sectors << BDRV_SECTOR_BITS);
+    uint64_t cluster_start = (uint64_t) i << s->cluster_bits;
+    uint64_t cluster_end = cluster_start + s->cluster_size;
+    int first_sc, last_sc;
+
+    start = MAX(start, cluster_start) - cluster_start;
+    end = MIN(end, cluster_end) - cluster_start;
+    if (start >= end) {
+        return 0;
+    }
+
+    first_sc = start >> s->subcluster_bits;
+    last_sc = DIV_ROUND_UP(end, s->subcluster_size);
+
+    return QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc);
+}
+
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
@@ -730,11 +864,26 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
+
+        if (old_entry != 0 && !m->keep_old_clusters) {
+            old_cluster[j++] = old_entry;
+        }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+        set_l2_entry(s, l2_table, l2_index + i, (cluster_offset +
+                     (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+
+        if (has_subclusters(s)) {
+            uint64_t bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            uint64_t alloc = l2meta_alloc_bitmap(s, m, i);
+
+            /* Only a cluster that is kept has allocated subclusters */
+            if (!m->keep_old_clusters) {
+                bitmap &= QCOW_L2_BITMAP_ALL_ZEROES;
+            }
+            bitmap = (bitmap & ~(alloc << 32)) | alloc;
+            set_l2_bitmap(s, l2_table, l2_index + i, bitmap);
+        }
      }
 
 
@@ -752,7 +901,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -774,7 +923,7 @@ static int count_cow_clusters(BDRVQcowState *s, int nb_clusters,
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -797,6 +946,35 @@ out:
     return i;
 }
 
+/*
+ * With extended L2 entries, returns how many of the nb_clusters clusters
+ * starting at l2_index have all subclusters allocated that the write of
+ * bytes at guest_offset touches.
+ */
+static int count_allocated_subclusters(BDRVQcowState *s, int nb_clusters,
+    uint64_t *l2_table, int l2_index, uint64_t guest_offset, uint64_t bytes)
+{
+    uint64_t start = offset_into_cluster(s, guest_offset);
+    uint64_t end = start + bytes;
+    int i;
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t cluster_start = (uint64_t) i << s->cluster_bits;
+        uint64_t sc_start = MAX(start, cluster_start) - cluster_start;
+        uint64_t sc_end = MIN(end, cluster_start + s->cluster_size)
+                        - cluster_start;
+        uint64_t mask = QCOW_OFLAG_SUB_ALLOC_RANGE(
+                            sc_start >> s->subcluster_bits,
+                            DIV_ROUND_UP(sc_end, s->subcluster_size));
+
+        if ((get_l2_bitmap(s, l2_table, l2_index + i) & mask) != mask) {
+            break;
+        }
+    }
+
+    return i;
+}
+
 /*
  * Check if there already is an AIO write request in flight which allocates
  * the same cluster. In this case we need to wait until the previous
@@ -825,6 +1003,11 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        /* With subclusters, the COW may not cover whole clusters, but the
+         * L2 entry and bitmap of all of them are still being updated */
+        old_start = start_of_cluster(s, old_start);
+        old_end = align_offset(old_end, s->cluster_size);
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -917,7 +1100,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -935,11 +1118,20 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
+            count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
+        /* ...as long as the written subclusters are allocated in them */
+        if (has_subclusters(s)) {
+            keep_clusters = count_allocated_subclusters(s, keep_clusters,
+                                l2_table, l2_index, guest_offset, *bytes);
+            if (keep_clusters == 0) {
+                ret = 0;
+                goto out;
+            }
+        }
+
         *bytes = MIN(*bytes,
                  keep_clusters * s->cluster_size
                  - offset_into_cluster(s, guest_offset));
@@ -988,29 +1180,19 @@ out:
 static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *host_offset, unsigned int *nb_clusters)
 {
-    BDRVQcowState *s = bs->opaque;
+    int64_t cluster_offset;
 
     trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
                                          *host_offset, *nb_clusters);
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == 0) {
-        int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
-        if (cluster_offset < 0) {
-            return cluster_offset;
-        }
-        *host_offset = cluster_offset;
-        return 0;
-    } else {
-        int ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
-        if (ret < 0) {
-            return ret;
-        }
-        *nb_clusters = ret;
-        return 0;
+    cluster_offset = qcow2_alloc_data_clusters(bs, *host_offset, nb_clusters);
+    if (cluster_offset < 0) {
+        return cluster_offset;
     }
+    *host_offset = cluster_offset;
+    return 0;
 }
 
 /*
@@ -1039,8 +1221,10 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     BDRVQcowState *s = bs->opaque;
     int l2_index;
     uint64_t *l2_table;
-    uint64_t entry;
+    uint64_t entry, l2_bitmap;
     unsigned int nb_clusters;
+    bool keep_old = false;
+    bool partial_cow;
     int ret;
 
     uint64_t alloc_cluster_offset;
@@ -1065,11 +1249,32 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_table, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+
+    if (has_subclusters(s) &&
+        qcow2_get_subcluster_type(entry, l2_bitmap, 0) < 0)
+    {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        return -EIO;
+    }
 
     /* For the moment, overwrite compressed clusters one by one */
     if (entry & QCOW_OFLAG_COMPRESSED) {
         nb_clusters = 1;
+    } else if (has_subclusters(s)) {
+        /*
+         * Unallocated subclusters of a cluster that isn't shared are
+         * allocated in place, one cluster at a time. New clusters are only
+         * allocated for a run of clusters without any host cluster.
+         */
+        if (entry & L2E_OFFSET_MASK) {
+            nb_clusters = 1;
+            keep_old = (entry & QCOW_OFLAG_COPIED) != 0;
+        } else {
+            nb_clusters = count_contiguous_free_clusters(s, nb_clusters,
+                                                         l2_table, l2_index);
+        }
     } else {
         nb_clusters = count_cow_clusters(s, nb_clusters, l2_table, l2_index);
     }
@@ -1084,12 +1289,22 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    /* Allocate, if necessary at a given offset in the image file */
-    alloc_cluster_offset = start_of_cluster(s, *host_offset);
-    ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
-                                  &nb_clusters);
-    if (ret < 0) {
-        goto fail;
+    if (keep_old) {
+        alloc_cluster_offset = entry & L2E_OFFSET_MASK;
+        if (*host_offset != 0 &&
+            start_of_cluster(s, *host_offset) != alloc_cluster_offset)
+        {
+            *bytes = 0;
+            return 0;
+        }
+    } else {
+        /* Allocate, if necessary at a given offset in the image file */
+        alloc_cluster_offset = start_of_cluster(s, *host_offset);
+        ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
+                                      &nb_clusters);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     /* Can't extend contiguous allocation */
@@ -1131,6 +1346,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .offset         = start_of_cluster(s, guest_offset),
         .nb_clusters    = nb_clusters,
         .nb_available   = nb_sectors,
+        .keep_old_clusters = keep_old,
 
         .cow_start = {
             .offset     = 0,
@@ -1141,6 +1357,37 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
             .nb_sectors = avail_sectors - nb_sectors,
         },
     };
+
+    /*
+     * With subclusters, only the touched subclusters need to be filled, and
+     * those that are allocated in a kept cluster already have their data.
+     * A shared or compressed cluster is still copied as a whole.
+     */
+    partial_cow = has_subclusters(s) && !(entry & QCOW_OFLAG_COMPRESSED) &&
+                  (keep_old || !(entry & L2E_OFFSET_MASK));
+    if (partial_cow) {
+        int sc_start = (alloc_n_start * BDRV_SECTOR_SIZE)
+                       & ~(s->subcluster_size - 1);
+        int sc_end = align_offset(nb_sectors * BDRV_SECTOR_SIZE,
+                                  s->subcluster_size);
+
+        (*m)->cow_start.offset = sc_start;
+        (*m)->cow_start.nb_sectors = alloc_n_start
+                                     - (sc_start >> BDRV_SECTOR_BITS);
+        (*m)->cow_end.nb_sectors = (sc_end >> BDRV_SECTOR_BITS) - nb_sectors;
+
+        if (keep_old) {
+            if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_start
+                                                 >> s->subcluster_bits)) {
+                (*m)->cow_start.nb_sectors = 0;
+            }
+            if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC((sc_end - 1)
+                                                 >> s->subcluster_bits)) {
+                (*m)->cow_end.nb_sectors = 0;
+            }
+        }
+    }
+
     qemu_co_queue_init(&(*m)->dependent_requests);
     QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
 
@@ -1362,7 +1609,25 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
+
+        if (has_subclusters(s)) {
+            uint64_t old_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+
+            /* Same as below, but zero clusters are described by the bitmap */
+            if ((old_offset & (L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED)) == 0
+                && (!bs->backing_hd || old_bitmap == QCOW_L2_BITMAP_ALL_ZEROES))
+            {
+                continue;
+            }
+
+            qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+            set_l2_entry(s, l2_table, l2_index + i, 0);
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
+            qcow2_free_any_clusters(bs, old_offset, 1, type);
+            continue;
+        }
 
         /*
          * Make sure that a discarded area reads back as zeroes for v3 images
@@ -1384,9 +1649,9 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
         if (s->qcow_version >= 3) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
         } else {
-            l2_table[l2_index + i] = cpu_to_be64(0);
+            set_l2_entry(s, l2_table, l2_index + i, 0);
         }
 
         /* Then decrease the refcount */
@@ -1467,15 +1732,26 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+        if (has_subclusters(s)) {
+            /* A host cluster stays allocated for the subclusters, unless it
+             * is compressed */
+            if (old_offset & QCOW_OFLAG_COMPRESSED) {
+                set_l2_entry(s, l2_table, l2_index + i, 0);
+                qcow2_free_any_clusters(bs, old_offset, 1,
+                                        QCOW2_DISCARD_REQUEST);
+            }
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
+        } else if (old_offset & QCOW_OFLAG_COMPRESSED) {
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
@@ -1570,7 +1846,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             int64_t offset = l2_entry & L2E_OFFSET_MASK, cluster_index;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
             bool preallocated = offset != 0;
@@ -1590,7 +1866,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                     }
                     /* Since we just increased the refcount, the COPIED flag may
                      * no longer be set. */
-                    l2_table[j] = cpu_to_be64(l2_entry & ~QCOW_OFLAG_COPIED);
+                    set_l2_entry(s, l2_table, j, l2_entry & ~QCOW_OFLAG_COPIED);
                     l2_dirty = true;
                 }
                 continue;
@@ -1603,7 +1879,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                 if (!bs->backing_hd) {
                     /* not backed; therefore we can simply deallocate the
                      * cluster */
-                    l2_table[j] = 0;
+                    set_l2_entry(s, l2_table, j, 0);
                     l2_dirty = true;
                     continue;
                 }
@@ -1634,7 +1910,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                 goto fail;
             }
 
-            l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+            set_l2_entry(s, l2_table, j, offset | QCOW_OFLAG_COPIED);
             l2_dirty = true;
 
             cluster_index = offset >> s->cluster_bits;
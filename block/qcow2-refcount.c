@@ -721,6 +721,90 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocates clusters for guest data.  While other allocating writes are in
+ * flight, a chunk of up to QCOW2_PREALLOC_SIZE is allocated at once and
+ * the following allocations are served from it, so that the refcounts are
+ * only updated once per chunk.  A single writer allocates exactly what it
+ * needs and gets the same image layout as without chunks.
+ *
+ * If offset is non-zero, only clusters starting at offset are allocated, in
+ * order to extend a contiguous allocation.
+ *
+ * Returns the offset of the first allocated cluster or -errno, and sets
+ * *nb_clusters to the number of clusters that were allocated.  This may be
+ * less than requested, and 0 if offset was given and is not free.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+                                  unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t chunk;
+    int64_t ret;
+
+    if (offset != 0 &&
+        (offset != s->prealloc_offset || s->prealloc_clusters == 0)) {
+        ret = qcow2_alloc_clusters_at(bs, offset, *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+        *nb_clusters = ret;
+        return offset;
+    }
+
+    if (s->prealloc_clusters == 0) {
+        if (QLIST_EMPTY(&s->cluster_allocs)) {
+            return qcow2_alloc_clusters(bs, (uint64_t) *nb_clusters <<
+                                            s->cluster_bits);
+        }
+        /* Take the first free clusters like a single writer would, so
+         * that holes in the image are still reused, and then extend the
+         * chunk with whatever follows them contiguously */
+        ret = qcow2_alloc_clusters(bs, (uint64_t) *nb_clusters <<
+                                       s->cluster_bits);
+        if (ret < 0) {
+            return ret;
+        }
+        offset = ret;
+        chunk = QCOW2_PREALLOC_SIZE >> s->cluster_bits;
+        if (chunk <= *nb_clusters) {
+            return offset;
+        }
+        ret = qcow2_alloc_clusters_at(bs, offset + ((uint64_t) *nb_clusters <<
+                                                    s->cluster_bits),
+                                      chunk - *nb_clusters);
+        if (ret < 0) {
+            /* The request itself is allocated, only the chunk is missing */
+            return offset;
+        }
+        s->prealloc_offset = offset;
+        s->prealloc_clusters = *nb_clusters + ret;
+    }
+
+    offset = s->prealloc_offset;
+    *nb_clusters = MIN(*nb_clusters, s->prealloc_clusters);
+    s->prealloc_offset += (uint64_t) *nb_clusters << s->cluster_bits;
+    s->prealloc_clusters -= *nb_clusters;
+
+    return offset;
+}
+
+/*
+ * Frees the clusters that qcow2_alloc_data_clusters() allocated in advance,
+ * so that they don't leak when the image is closed or checked.
+ */
+void qcow2_free_prealloc(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->prealloc_clusters) {
+        qcow2_free_clusters(bs, s->prealloc_offset,
+                            s->prealloc_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+        s->prealloc_clusters = 0;
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -883,7 +967,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             for(j = 0; j < s->l2_size; j++) {
                 uint64_t cluster_index;
 
-                offset = be64_to_cpu(l2_table[j]);
+                offset = get_l2_entry(s, l2_table, j);
                 old_offset = offset;
                 offset &= ~QCOW_OFLAG_COPIED;
 
@@ -942,7 +1026,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         qcow2_cache_set_dependency(bs, s->l2_table_cache,
                             s->refcount_block_cache);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
+                    set_l2_entry(s, l2_table, j, offset);
                     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                 }
             }
@@ -1013,11 +1097,11 @@ fail:
  *
  * Modifies the number of errors in res.
  */
-static void inc_refcounts(BlockDriverState *bs,
-                          BdrvCheckResult *res,
-                          uint16_t *refcount_table,
-                          int refcount_table_size,
-                          int64_t offset, int64_t size)
+void qcow2_inc_refcounts(BlockDriverState *bs,
+                         BdrvCheckResult *res,
+                         uint16_t *refcount_table,
+                         int refcount_table_size,
+                         int64_t offset, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t start, last, cluster_offset, k;
@@ -1068,7 +1152,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     int i, l2_size, nb_csectors;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_size = s->cluster_size;
     l2_table = g_malloc(l2_size);
 
     if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
@@ -1076,7 +1160,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1093,7 +1177,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
+            qcow2_inc_refcounts(bs, res, refcount_table, refcount_table_size,
                 l2_entry & ~511, nb_csectors * 512);
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1129,7 +1213,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            inc_refcounts(bs, res, refcount_table,refcount_table_size,
+            qcow2_inc_refcounts(bs, res, refcount_table,refcount_table_size,
                 offset, s->cluster_size);
 
             /* Correct offsets are cluster aligned */
@@ -1180,7 +1264,7 @@ static int check_refcounts_l1(BlockDriverState *bs,
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    inc_refcounts(bs, res, refcount_table, refcount_table_size,
+    qcow2_inc_refcounts(bs, res, refcount_table, refcount_table_size,
         l1_table_offset, l1_size2);
 
     /* Read L1 table entries from disk */
@@ -1201,7 +1285,7 @@ static int check_refcounts_l1(BlockDriverState *bs,
         if (l2_offset) {
             /* Mark L2 table as used */
             l2_offset &= L1E_OFFSET_MASK;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
+            qcow2_inc_refcounts(bs, res, refcount_table, refcount_table_size,
                 l2_offset, s->cluster_size);
 
             /* L2 tables are cluster aligned */
@@ -1230,7 +1314,42 @@ fail:
 }
 
 /*
- * Checks the OFLAG_COPIED flag for all L1 and L2 entries.
+ * Makes an extended L2 entry and its bitmap consistent, keeping allocated
+ * data where possible. Returns true if anything had to be changed.
+ */
+static bool repair_l2_bitmap(uint64_t *l2_entry, uint64_t *l2_bitmap)
+{
+    uint64_t entry = *l2_entry;
+    uint64_t bitmap = *l2_bitmap;
+    uint64_t alloc;
+
+    if (entry & QCOW_OFLAG_COMPRESSED) {
+        bitmap = 0;
+    } else {
+        if (entry & QCOW_OFLAG_ZERO) {
+            /* Zero clusters are described by the bitmap */
+            entry &= ~QCOW_OFLAG_ZERO;
+            bitmap = QCOW_L2_BITMAP_ALL_ZEROES;
+        }
+        if (!(entry & L2E_OFFSET_MASK)) {
+            bitmap &= QCOW_L2_BITMAP_ALL_ZEROES;
+        }
+        alloc = bitmap & QCOW_L2_BITMAP_ALL_ALLOC;
+        bitmap &= ~(alloc << 32);
+    }
+
+    if (entry == *l2_entry && bitmap == *l2_bitmap) {
+        return false;
+    }
+
+    *l2_entry = entry;
+    *l2_bitmap = bitmap;
+    return true;
+}
+
+/*
+ * Checks the OFLAG_COPIED flag for all L1 and L2 entries, and the L2
+ * bitmaps if the image has extended L2 entries.
  *
  * This function does not print an error message nor does it increment
  * check_errors if get_refcount fails (this is because such an error will have
@@ -1281,8 +1400,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+        ret = bdrv_pread(bs->file, l2_offset, l2_table, s->cluster_size);
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1291,9 +1409,35 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
-            int cluster_type = qcow2_get_cluster_type(l2_entry);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
+            uint64_t data_offset;
+            int cluster_type;
+
+            if (has_subclusters(s)) {
+                uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, j);
+                uint64_t new_entry = l2_entry;
+                uint64_t new_bitmap = l2_bitmap;
+
+                if (repair_l2_bitmap(&new_entry, &new_bitmap)) {
+                    fprintf(stderr, "%s invalid L2 bitmap: l2_entry=%" PRIx64
+                            " l2_bitmap=%" PRIx64 "\n",
+                            fix & BDRV_FIX_ERRORS ? "Repairing" :
+                                                    "ERROR",
+                            l2_entry, l2_bitmap);
+                    if (fix & BDRV_FIX_ERRORS) {
+                        set_l2_entry(s, l2_table, j, new_entry);
+                        set_l2_bitmap(s, l2_table, j, new_bitmap);
+                        l2_entry = new_entry;
+                        l2_dirty = true;
+                        res->corruptions_fixed++;
+                    } else {
+                        res->corruptions++;
+                    }
+                }
+            }
+
+            data_offset = l2_entry & L2E_OFFSET_MASK;
+            cluster_type = qcow2_get_cluster_type(l2_entry);
 
             if ((cluster_type == QCOW2_CLUSTER_NORMAL) ||
                 ((cluster_type == QCOW2_CLUSTER_ZERO) && (data_offset != 0))) {
@@ -1309,9 +1453,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
                         res->corruptions_fixed++;
                     } else {
@@ -1479,6 +1623,9 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     uint16_t *refcount_table;
     int ret;
 
+    /* Unused preallocated clusters would otherwise count as leaks */
+    qcow2_free_prealloc(bs);
+
     size = bdrv_getlength(bs->file);
     nb_clusters = size_to_clusters(s, size);
     if (nb_clusters > INT_MAX) {
@@ -1492,7 +1639,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
     /* header */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
         0, s->cluster_size);
 
     /* current L1 table */
@@ -1511,11 +1658,17 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             goto fail;
         }
     }
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->snapshots_offset, s->snapshots_size);
 
+    /* persistent dirty bitmaps */
+    ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /* refcount data */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->refcount_table_offset,
         s->refcount_table_size * sizeof(uint64_t));
 
@@ -1540,7 +1693,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         if (offset != 0) {
-            inc_refcounts(bs, res, refcount_table, nb_clusters,
+            qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
                 offset, s->cluster_size);
             if (refcount_table[cluster] != 1) {
                 fprintf(stderr, "%s refcount block %" PRId64
@@ -1569,7 +1722,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                 - old_nb_clusters) * sizeof(uint16_t));
                     }
                     refcount_table[cluster]--;
-                    inc_refcounts(bs, res, refcount_table, nb_clusters,
+                    qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
                             new_offset, s->cluster_size);
 
                     res->corruptions_fixed++;
@@ -30,6 +30,8 @@
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
+#include "qapi/qmp/qint.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 /*
@@ -57,6 +59,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -70,6 +73,32 @@ static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
         return 0;
 }
 
+static int validate_table_offset(BlockDriverState *bs, uint64_t offset,
+                                 uint64_t entries, size_t entry_len)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t size;
+
+    /* Use signed INT64_MAX as the maximum even for uint64_t header fields,
+     * because values will be passed to qemu functions taking int64_t. */
+    if (entries > INT64_MAX / entry_len) {
+        return -EINVAL;
+    }
+
+    size = entries * entry_len;
+
+    if (INT64_MAX - size < offset) {
+        return -EINVAL;
+    }
+
+    /* Tables must be cluster aligned */
+    if (offset & (s->cluster_size - 1)) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
 
 /* 
  * read qcow2 extension and fill bs
@@ -154,6 +183,52 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS: {
+            Qcow2BitmapHeaderExt bitmaps_ext;
+
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: ext_bitmaps: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                /* An older version has written to the image since the
+                 * bitmaps were stored, so they are out of date.  The
+                 * extension is dropped on the next header update. */
+                break;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_bitmaps: "
+                                 "Could not read extension");
+                return ret;
+            }
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.reserved32 != 0 ||
+                bitmaps_ext.nb_bitmaps == 0 ||
+                bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS ||
+                bitmaps_ext.bitmap_directory_size >
+                    QCOW2_MAX_BITMAP_DIRECTORY_SIZE ||
+                validate_table_offset(bs,
+                                      bitmaps_ext.bitmap_directory_offset,
+                                      bitmaps_ext.bitmap_directory_size,
+                                      1) < 0) {
+                error_setg(errp, "ERROR: ext_bitmaps: Invalid bitmap "
+                           "directory");
+                return -EINVAL;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_size = bitmaps_ext.bitmap_directory_size;
+            s->bitmap_directory_offset = bitmaps_ext.bitmap_directory_offset;
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -332,32 +407,6 @@ static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
     return ret;
 }
 
-static int validate_table_offset(BlockDriverState *bs, uint64_t offset,
-                                 uint64_t entries, size_t entry_len)
-{
-    BDRVQcowState *s = bs->opaque;
-    uint64_t size;
-
-    /* Use signed INT64_MAX as the maximum even for uint64_t header fields,
-     * because values will be passed to qemu functions taking int64_t. */
-    if (entries > INT64_MAX / entry_len) {
-        return -EINVAL;
-    }
-
-    size = entries * entry_len;
-
-    if (INT64_MAX - size < offset) {
-        return -EINVAL;
-    }
-
-    /* Tables must be cluster aligned */
-    if (offset & (s->cluster_size - 1)) {
-        return -EINVAL;
-    }
-
-    return 0;
-}
-
 static QemuOptsList qcow2_runtime_opts = {
     .name = "qcow2",
     .head = QTAILQ_HEAD_INITIALIZER(qcow2_runtime_opts.head),
@@ -429,6 +478,16 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Check for unintended writes into an inactive L2 table",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        {
+            .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum refcount block cache size",
+        },
         { /* end of list */ }
     },
 };
@@ -451,12 +510,13 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     unsigned int len, i;
     int ret = 0;
     QCowHeader header;
-    QemuOpts *opts;
+    QemuOpts *opts = NULL;
     Error *local_err = NULL;
     uint64_t ext_end;
     uint64_t l1_vm_state_index;
     const char *opt_overlap_check;
     int overlap_check_template = 0;
+    uint64_t l2_cache_size, refcount_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -601,7 +661,23 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         bs->encrypted = 1;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (has_subclusters(s)) {
+        if (s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+            error_setg(errp, "Unsupported cluster size for extended L2 "
+                       "entries: 2^%i", s->cluster_bits);
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->subclusters_per_cluster = QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+    } else {
+        s->subclusters_per_cluster = 1;
+    }
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_sectors = s->subcluster_size >> BDRV_SECTOR_BITS;
+    s->subcluster_bits = ffs(s->subcluster_size) - 1;
+
+    /* L2 is always one cluster, extended entries are twice as large */
+    s->l2_bits = s->cluster_bits - 3 - (has_subclusters(s) ? 1 : 0);
     s->l2_size = 1 << s->l2_bits;
     bs->total_sectors = header.size / 512;
     s->csize_shift = (62 - (s->cluster_bits - 8));
@@ -687,9 +763,37 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    opts = qemu_opts_create(&qcow2_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE,
+                                      L2_CACHE_SIZE * s->cluster_size);
+    refcount_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+                          REFCOUNT_CACHE_SIZE * s->cluster_size);
+    l2_cache_size /= s->cluster_size;
+    refcount_cache_size /= s->cluster_size;
+    if (l2_cache_size > INT_MAX || refcount_cache_size > INT_MAX) {
+        error_setg(errp, "Cache size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->l2_table_cache =
+        qcow2_cache_create(bs, MAX(l2_cache_size, MIN_L2_CACHE_SIZE));
+    s->refcount_block_cache =
+        qcow2_cache_create(bs, MAX(refcount_cache_size,
+                                   MIN_REFCOUNT_CACHE_SIZE));
+    if (s->l2_table_cache == NULL || s->refcount_block_cache == NULL) {
+        error_setg(errp, "Could not allocate metadata caches");
+        ret = -ENOMEM;
+        goto fail;
+    }
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -743,8 +847,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INCOMING) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -768,14 +873,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Enable lazy_refcounts according to image and command line options */
-    opts = qemu_opts_create(&qcow2_runtime_opts, NULL, 0, &error_abort);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        ret = -EINVAL;
-        goto fail;
-    }
-
     s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
 
@@ -802,7 +899,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         error_setg(errp, "Unsupported value '%s' for qcow2 option "
                    "'overlap-check'. Allowed are either of the following: "
                    "none, constant, cached, all", opt_overlap_check);
-        qemu_opts_del(opts);
         ret = -EINVAL;
         goto fail;
     }
@@ -817,6 +913,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     qemu_opts_del(opts);
+    opts = NULL;
 
     if (s->use_lazy_refcounts && s->qcow_version < 3) {
         error_setg(errp, "Lazy refcounts require a qcow2 image with at least "
@@ -825,6 +922,17 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* Take over the persistent dirty bitmaps unless another process still
+     * owns the image (incoming migration) or it is only being checked */
+    if (!bs->read_only && !(bs->open_flags & BDRV_O_INCOMING) &&
+        !(flags & BDRV_O_CHECK)) {
+        ret = qcow2_load_bitmaps(bs, &local_err);
+        if (ret < 0) {
+            error_propagate(errp, local_err);
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -834,6 +942,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     return ret;
 
  fail:
+    if (opts) {
+        qemu_opts_del(opts);
+    }
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
@@ -1133,6 +1244,13 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     qemu_co_mutex_lock(&s->lock);
 
+    if (s->bitmaps_stored) {
+        ret = qcow2_drop_stored_bitmaps(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     while (remaining_sectors != 0) {
 
         l2meta = NULL;
@@ -1249,6 +1367,16 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    Error *local_err = NULL;
+
+    qcow2_free_prealloc(bs);
+
+    if (s->owns_bitmaps && !s->bitmaps_stored &&
+        qcow2_store_bitmaps(bs, &local_err) < 0) {
+        error_report("%s", error_get_pretty(local_err));
+        error_free(local_err);
+    }
+
     g_free(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -1279,6 +1407,9 @@ static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
     AES_KEY aes_encrypt_key;
     AES_KEY aes_decrypt_key;
     uint32_t crypt_method = 0;
+    int l2_tables, refcount_tables;
+    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t hits, misses;
     QDict *options;
     Error *local_err = NULL;
     int ret;
@@ -1294,6 +1425,13 @@ static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
         memcpy(&aes_decrypt_key, &s->aes_decrypt_key, sizeof(aes_decrypt_key));
     }
 
+    /* The caches come back with the size the user gave them */
+    qcow2_cache_get_stats(s->l2_table_cache, &l2_tables, &hits, &misses);
+    qcow2_cache_get_stats(s->refcount_block_cache, &refcount_tables, &hits,
+                          &misses);
+    l2_cache_size = (uint64_t)l2_tables * s->cluster_size;
+    refcount_cache_size = (uint64_t)refcount_tables * s->cluster_size;
+
     qcow2_close(bs);
 
     bdrv_invalidate_cache(bs->file, &local_err);
@@ -1304,8 +1442,12 @@ static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
 
     memset(s, 0, sizeof(BDRVQcowState));
     options = qdict_clone_shallow(bs->options);
+    qdict_put(options, QCOW2_OPT_L2_CACHE_SIZE, qint_from_int(l2_cache_size));
+    qdict_put(options, QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+              qint_from_int(refcount_cache_size));
 
     ret = qcow2_open(bs, options, flags, &local_err);
+    QDECREF(options);
     if (local_err) {
         error_setg(errp, "Could not reopen qcow2 layer: %s",
                    error_get_pretty(local_err));
@@ -1316,8 +1458,6 @@ static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
         return;
     }
 
-    QDECREF(options);
-
     if (crypt_method) {
         s->crypt_method = crypt_method;
         memcpy(&s->aes_encrypt_key, &aes_encrypt_key, sizeof(aes_encrypt_key));
@@ -1456,11 +1596,21 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
             .name = "corrupt bit",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+            .name = "extended L2 entries",
+        },
         {
             .type = QCOW2_FEAT_TYPE_COMPATIBLE,
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+            .name = "persistent dirty bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1471,6 +1621,24 @@ int qcow2_update_header(BlockDriverState *bs)
     buf += ret;
     buflen -= ret;
 
+    /* Persistent dirty bitmaps */
+    if (s->nb_bitmaps) {
+        Qcow2BitmapHeaderExt bitmaps_ext = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size = cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                cpu_to_be64(s->bitmap_directory_offset),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_ext, sizeof(bitmaps_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -1553,8 +1721,11 @@ static int preallocate(BlockDriverState *bs)
 
             ret = qcow2_alloc_cluster_link_l2(bs, meta);
             if (ret < 0) {
-                qcow2_free_any_clusters(bs, meta->alloc_offset,
-                                        meta->nb_clusters, QCOW2_DISCARD_NEVER);
+                if (!meta->keep_old_clusters) {
+                    qcow2_free_any_clusters(bs, meta->alloc_offset,
+                                            meta->nb_clusters,
+                                            QCOW2_DISCARD_NEVER);
+                }
                 return ret;
             }
 
@@ -1666,6 +1837,10 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        header->incompatible_features |= cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = bdrv_pwrite(bs, 0, header, cluster_size);
     g_free(header);
     if (ret < 0) {
@@ -1812,6 +1987,8 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options,
             }
         } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_EXTL2)) {
+            flags |= options->value.n ? BLOCK_FLAG_EXTL2 : 0;
         }
         options++;
     }
@@ -1828,6 +2005,20 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options,
         return -EINVAL;
     }
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries only supported with "
+                       "compatibility level 1.1 and above (use compat=1.1 or "
+                       "greater)");
+            return -EINVAL;
+        }
+        if (cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries need a cluster size of at "
+                       "least %dk", 1 << (MIN_EXTL2_CLUSTER_BITS - 10));
+            return -EINVAL;
+        }
+    }
+
     ret = qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, options, version, &local_err);
     if (local_err) {
@@ -1849,8 +2040,11 @@ static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
 
     /* Whatever is left can use real zero clusters */
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors);
+    ret = s->bitmaps_stored ? qcow2_drop_stored_bitmaps(bs) : 0;
+    if (ret == 0) {
+        ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+                                  nb_sectors);
+    }
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -1863,8 +2057,11 @@ static coroutine_fn int qcow2_co_discard(BlockDriverState *bs,
     BDRVQcowState *s = bs->opaque;
 
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors, QCOW2_DISCARD_REQUEST);
+    ret = s->bitmaps_stored ? qcow2_drop_stored_bitmaps(bs) : 0;
+    if (ret == 0) {
+        ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+                                     nb_sectors, QCOW2_DISCARD_REQUEST);
+    }
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -1886,6 +2083,13 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
         return -ENOTSUP;
     }
 
+    /* the stored bitmaps cover the old size */
+    if (s->nb_bitmaps || bdrv_has_persistent_dirty_bitmaps(bs)) {
+        error_report("Can't resize an image which has persistent dirty "
+                     "bitmaps");
+        return -ENOTSUP;
+    }
+
     /* shrinking is currently not supported */
     if (offset < bs->total_sectors * 512) {
         error_report("qcow2 doesn't support shrinking images yet");
@@ -1912,12 +2116,63 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+typedef struct Qcow2CompressData {
+    const uint8_t *buf;
+    uint8_t *out_buf;
+    int size;
+} Qcow2CompressData;
+
+/*
+ * Compress one cluster.  Runs in a worker thread, so that the clusters of
+ * several compressed writes in flight are compressed in parallel.
+ *
+ * Returns the compressed size, -ENOSPC if the cluster does not get smaller,
+ * or -EINVAL on error.
+ */
+static int qcow2_compress_cluster(void *opaque)
 {
-    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressData *data = opaque;
     z_stream strm;
     int ret, out_len;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = data->size;
+    strm.next_in = (uint8_t *)data->buf;
+    strm.avail_out = data->size;
+    strm.next_out = data->out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        deflateEnd(&strm);
+        return -EINVAL;
+    }
+    out_len = strm.next_out - data->out_buf;
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || out_len >= data->size) {
+        return -ENOSPC;
+    }
+    return out_len;
+}
+
+static coroutine_fn int qcow2_write_compressed(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               const uint8_t *buf,
+                                               int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    ThreadPool *pool;
+    Qcow2CompressData data;
+    int ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
@@ -1948,47 +2203,46 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
+    data = (Qcow2CompressData) {
+        .buf        = buf,
+        .out_buf    = out_buf,
+        .size       = s->cluster_size,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    out_len = thread_pool_submit_co(pool, qcow2_compress_cluster, &data);
+    if (out_len == -EINVAL) {
+        ret = out_len;
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (out_len < 0) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
     } else {
+        /* Only the allocation needs the lock, the compressed data goes to
+         * a new place in the image file that nobody else writes to */
+        qemu_co_mutex_lock(&s->lock);
+        if (s->bitmaps_stored) {
+            ret = qcow2_drop_stored_bitmaps(bs);
+            if (ret < 0) {
+                qemu_co_mutex_unlock(&s->lock);
+                goto fail;
+            }
+        }
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
         if (!cluster_offset) {
+            qemu_co_mutex_unlock(&s->lock);
             ret = -EIO;
             goto fail;
         }
         cluster_offset &= s->cluster_offset_mask;
 
         ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
@@ -2061,12 +2315,46 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
             .lazy_refcounts     = s->compatible_features &
                                   QCOW2_COMPAT_LAZY_REFCOUNTS,
             .has_lazy_refcounts = true,
+            .extended_l2        = has_subclusters(s),
+            .has_extended_l2    = has_subclusters(s),
         };
     }
 
     return spec_info;
 }
 
+static BlockCacheStats *qcow2_cache_stats(BDRVQcowState *s, Qcow2Cache *c)
+{
+    BlockCacheStats *stats = g_new0(BlockCacheStats, 1);
+    uint64_t hits, misses;
+    int num_tables;
+
+    qcow2_cache_get_stats(c, &num_tables, &hits, &misses);
+    stats->size = (int64_t)num_tables * s->cluster_size;
+    stats->hits = hits;
+    stats->misses = misses;
+    return stats;
+}
+
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockStatsSpecific *spec_stats = g_new(BlockStatsSpecific, 1);
+
+    *spec_stats = (BlockStatsSpecific){
+        .kind  = BLOCK_STATS_SPECIFIC_KIND_QCOW2,
+        {
+            .qcow2 = g_new(BlockStatsSpecificQCow2, 1),
+        },
+    };
+    *spec_stats->qcow2 = (BlockStatsSpecificQCow2){
+        .l2_cache       = qcow2_cache_stats(s, s->l2_table_cache),
+        .refcount_cache = qcow2_cache_stats(s, s->refcount_block_cache),
+    };
+
+    return spec_stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2159,6 +2447,20 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version)
         return -ENOTSUP;
     }
 
+    if (has_subclusters(s)) {
+        /* the L2 tables would have to be rewritten with normal entries */
+        error_report("qcow2_downgrade: Images with extended L2 entries "
+                     "cannot be downgraded.");
+        return -ENOTSUP;
+    }
+
+    if (s->nb_bitmaps || bdrv_has_persistent_dirty_bitmaps(bs)) {
+        /* version 2 images have no autoclear bits to protect the bitmaps */
+        error_report("qcow2_downgrade: Images with persistent dirty bitmaps "
+                     "cannot be downgraded.");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -2250,6 +2552,12 @@ static int qcow2_amend_options(BlockDriverState *bs,
             }
         } else if (!strcmp(options[i].name, "lazy_refcounts")) {
             lazy_refcounts = options[i].value.n;
+        } else if (!strcmp(options[i].name, "extended_l2")) {
+            if (options[i].value.n != has_subclusters(s)) {
+                fprintf(stderr, "Changing the L2 entry size is not "
+                        "supported.\n");
+                return -ENOTSUP;
+            }
         } else {
             /* if this assertion fails, this probably means a new option was
              * added without having it covered here */
@@ -2365,6 +2673,11 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_FLAG,
         .help = "Postpone refcount updates",
     },
+    {
+        .name = BLOCK_OPT_EXTL2,
+        .type = OPT_FLAG,
+        .help = "Allocate 1/32 cluster subclusters to reduce copy on write",
+    },
     { NULL }
 };
 
@@ -2396,6 +2709,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -2405,6 +2719,9 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_refresh_limits        = qcow2_refresh_limits,
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
 
+    .bdrv_can_store_dirty_bitmap = qcow2_can_store_dirty_bitmap,
+    .bdrv_store_dirty_bitmaps    = qcow2_store_dirty_bitmaps,
+
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
     .bdrv_amend_options = qcow2_amend_options,
@@ -52,6 +52,11 @@
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
 
+/* Persistent dirty bitmaps, with the same 1k average per directory entry */
+#define QCOW2_MAX_BITMAPS 65535
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
+#define QCOW2_MAX_BITMAP_NAME_SIZE 1023
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -59,15 +64,43 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/*
+ * With extended L2 entries, each L2 entry is followed by a bitmap that
+ * describes the subclusters of the cluster. The low 32 bits say which
+ * subclusters are allocated in the host cluster, the high 32 bits which
+ * ones read as zeroes.
+ */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+#define QCOW_OFLAG_SUB_ALLOC(X)   (1ULL << (X))
+#define QCOW_OFLAG_SUB_ZERO(X)    (QCOW_OFLAG_SUB_ALLOC(X) << 32)
+/* Bits of subclusters [X, Y) */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC(Y) - QCOW_OFLAG_SUB_ALLOC(X))
+#define QCOW_OFLAG_SUB_ZERO_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) << 32)
+#define QCOW_L2_BITMAP_ALL_ALLOC  (QCOW_OFLAG_SUB_ALLOC_RANGE(0, 32))
+#define QCOW_L2_BITMAP_ALL_ZEROES (QCOW_OFLAG_SUB_ZERO_RANGE(0, 32))
+
 #define REFCOUNT_SHIFT 1 /* refcount size is 2 bytes */
 
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Subclusters must be at least 512 bytes */
+#define MIN_EXTL2_CLUSTER_BITS 14
+
+/* Default number of cached L2 tables and refcount blocks; the sizes can be
+ * set with the l2-cache-size and refcount-cache-size options */
 #define L2_CACHE_SIZE 16
+#define MIN_L2_CACHE_SIZE 2
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
+#define MIN_REFCOUNT_CACHE_SIZE 4
+
+/* Data clusters are allocated in chunks of at least this size, so that
+ * allocating writes only update the refcounts once per chunk */
+#define QCOW2_PREALLOC_SIZE (1024 * 1024)
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
@@ -85,6 +118,8 @@
 #define QCOW2_OPT_OVERLAP_SNAPSHOT_TABLE "overlap-check.snapshot-table"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L1 "overlap-check.inactive-l1"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
+#define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -168,11 +203,14 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 2,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -183,6 +221,14 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_BITMAPS       = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK          = QCOW2_AUTOCLEAR_BITMAPS,
+};
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -198,6 +244,13 @@ typedef struct Qcow2Feature {
     char    name[46];
 } QEMU_PACKED Qcow2Feature;
 
+typedef struct Qcow2BitmapHeaderExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} QEMU_PACKED Qcow2BitmapHeaderExt;
+
 typedef struct Qcow2DiscardRegion {
     BlockDriverState *bs;
     uint64_t offset;
@@ -212,6 +265,10 @@ typedef struct BDRVQcowState {
     int l2_bits;
     int l2_size;
     int l1_size;
+    int subclusters_per_cluster;
+    int subcluster_size;
+    int subcluster_sectors;
+    int subcluster_bits;
     int l1_vm_state_index;
     int csize_shift;
     int csize_mask;
@@ -232,6 +289,9 @@ typedef struct BDRVQcowState {
     uint32_t refcount_table_size;
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
+    /* Data clusters that are allocated but not yet used */
+    uint64_t prealloc_offset;
+    uint64_t prealloc_clusters;
 
     CoMutex lock;
 
@@ -262,6 +322,17 @@ typedef struct BDRVQcowState {
     QLIST_HEAD(, Qcow2UnknownHeaderExtension) unknown_header_ext;
     QTAILQ_HEAD (, Qcow2DiscardRegion) discards;
     bool cache_discards;
+
+    /* Bitmap directory from the header extension, see qcow2-bitmap.c */
+    uint32_t nb_bitmaps;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+    /* The persistent bitmaps live in bs->dirty_bitmaps while the image is
+     * open, and are written back on close */
+    bool owns_bitmaps;
+    /* ... or earlier, for a migration; the copy is dropped on the next
+     * write */
+    bool bitmaps_stored;
 } BDRVQcowState;
 
 /* XXX: use std qcow open function ? */
@@ -309,6 +380,12 @@ typedef struct QCowL2Meta
     /** Number of newly allocated clusters */
     int nb_clusters;
 
+    /**
+     * The write goes to subclusters of an existing cluster that are not
+     * allocated yet, so there is no old cluster to free when linking
+     */
+    bool keep_old_clusters;
+
     /**
      * Requests that overlap with this allocation and wait to be restarted
      * when the allocating request has completed.
@@ -427,6 +504,51 @@ static inline uint64_t qcow2_max_refcount_clusters(BDRVQcowState *s)
     return QCOW_MAX_REFTABLE_SIZE >> s->cluster_bits;
 }
 
+static inline bool has_subclusters(BDRVQcowState *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+/* Size of an L2 entry in units of uint64_t */
+static inline int l2_entry_size(BDRVQcowState *s)
+{
+    return has_subclusters(s) ? 2 : 1;
+}
+
+static inline uint64_t get_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                    int idx)
+{
+    return be64_to_cpu(l2_table[idx * l2_entry_size(s)]);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                     int idx)
+{
+    if (has_subclusters(s)) {
+        return be64_to_cpu(l2_table[idx * 2 + 1]);
+    } else {
+        return 0;
+    }
+}
+
+static inline void set_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                int idx, uint64_t entry)
+{
+    l2_table[idx * l2_entry_size(s)] = cpu_to_be64(entry);
+}
+
+static inline void set_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    l2_table[idx * 2 + 1] = cpu_to_be64(bitmap);
+}
+
+static inline int offset_to_sc_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset & (s->cluster_size - 1)) >> s->subcluster_bits;
+}
+
 static inline int qcow2_get_cluster_type(uint64_t l2_entry)
 {
     if (l2_entry & QCOW_OFLAG_COMPRESSED) {
@@ -440,6 +562,33 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Returns the type of subcluster sc_index of a cluster with extended L2
+ * entries, or -EIO if the L2 entry and bitmap contradict each other.
+ */
+static inline int qcow2_get_subcluster_type(uint64_t l2_entry,
+                                            uint64_t l2_bitmap, int sc_index)
+{
+    uint64_t alloc = l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC;
+    uint64_t zero = (l2_bitmap & QCOW_L2_BITMAP_ALL_ZEROES) >> 32;
+
+    if ((l2_entry & QCOW_OFLAG_ZERO) || (alloc & zero)) {
+        return -EIO;
+    }
+
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return l2_bitmap ? -EIO : QCOW2_CLUSTER_COMPRESSED;
+    } else if (alloc && !(l2_entry & L2E_OFFSET_MASK)) {
+        return -EIO;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index)) {
+        return QCOW2_CLUSTER_NORMAL;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+        return QCOW2_CLUSTER_ZERO;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
 {
@@ -479,6 +628,9 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+                                  unsigned int *nb_clusters);
+void qcow2_free_prealloc(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type);
@@ -490,6 +642,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix);
+void qcow2_inc_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                         uint16_t *refcount_table, int refcount_table_size,
+                         int64_t offset, int64_t size);
 
 void qcow2_process_discards(BlockDriverState *bs, int ret);
 
@@ -540,6 +695,17 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_load_bitmaps(BlockDriverState *bs, Error **errp);
+int qcow2_store_bitmaps(BlockDriverState *bs, Error **errp);
+int qcow2_drop_stored_bitmaps(BlockDriverState *bs);
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                  int64_t granularity, Error **errp);
+void qcow2_store_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  uint16_t *refcount_table,
+                                  int refcount_table_size);
+
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
@@ -557,5 +723,7 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_get_stats(Qcow2Cache *c, int *num_tables, uint64_t *hits,
+                           uint64_t *misses);
 
 #endif
@@ -1384,6 +1384,7 @@ static void drive_backup_prepare(BlkTransactionState *common, Error **errp)
                      backup->sync,
                      backup->has_mode, backup->mode,
                      backup->has_speed, backup->speed,
+                     backup->has_bitmap, backup->bitmap,
                      backup->has_on_source_error, backup->on_source_error,
                      backup->has_on_target_error, backup->on_target_error,
                      &local_err);
@@ -1932,6 +1933,7 @@ void qmp_drive_backup(const char *device, const char *target,
                       enum MirrorSyncMode sync,
                       bool has_mode, enum NewImageMode mode,
                       bool has_speed, int64_t speed,
+                      bool has_bitmap, const char *bitmap,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
                       Error **errp)
@@ -1939,6 +1941,7 @@ void qmp_drive_backup(const char *device, const char *target,
     BlockDriverState *bs;
     BlockDriverState *target_bs;
     BlockDriverState *source = NULL;
+    BdrvDirtyBitmap *sync_bitmap = NULL;
     BlockDriver *drv = NULL;
     Error *local_err = NULL;
     int flags;
@@ -1985,6 +1988,19 @@ void qmp_drive_backup(const char *device, const char *target,
         return;
     }
 
+    if (has_bitmap) {
+        sync_bitmap = bdrv_find_dirty_bitmap(bs, bitmap);
+        if (!sync_bitmap) {
+            error_setg(errp, "Dirty bitmap '%s' not found", bitmap);
+            return;
+        }
+    }
+    if ((sync == MIRROR_SYNC_MODE_INCREMENTAL) != !!sync_bitmap) {
+        error_setg(errp, "The bitmap parameter must be given if and only if "
+                   "sync is 'incremental'");
+        return;
+    }
+
     flags = bs->open_flags | BDRV_O_RDWR;
 
     /* See if we have a backing HD we can use to create our new image
@@ -2029,8 +2045,8 @@ void qmp_drive_backup(const char *device, const char *target,
         return;
     }
 
-    backup_start(bs, target_bs, speed, sync, on_source_error, on_target_error,
-                 block_job_cb, bs, &local_err);
+    backup_start(bs, target_bs, speed, sync, sync_bitmap,
+                 on_source_error, on_target_error, block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
         error_propagate(errp, local_err);
@@ -2038,6 +2054,109 @@ void qmp_drive_backup(const char *device, const char *target,
     }
 }
 
+/* Default granularity of named dirty bitmaps, in bytes */
+#define DEFAULT_DIRTY_BITMAP_GRANULARITY (64 * 1024)
+
+static BdrvDirtyBitmap *block_dirty_bitmap_lookup(const char *node,
+                                                  const char *name,
+                                                  BlockDriverState **pbs,
+                                                  Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    Error *local_err = NULL;
+
+    bs = bdrv_lookup_bs(node, node, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found", name);
+        return NULL;
+    }
+    if (bdrv_dirty_bitmap_frozen(bitmap)) {
+        error_setg(errp, "Dirty bitmap '%s' is currently in use by a backup",
+                   name);
+        return NULL;
+    }
+
+    *pbs = bs;
+    return bitmap;
+}
+
+void qmp_block_dirty_bitmap_add(const char *node, const char *name,
+                                bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    BlockDriverInfo bdi;
+    Error *local_err = NULL;
+
+    bs = bdrv_lookup_bs(node, node, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, node);
+        return;
+    }
+
+    if (has_granularity) {
+        if (granularity < 512 || granularity > 1048576 * 64 ||
+            (granularity & (granularity - 1))) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
+                      "a power of 2 between 512 and 64M");
+            return;
+        }
+    } else {
+        granularity = DEFAULT_DIRTY_BITMAP_GRANULARITY;
+        if (bdrv_get_info(bs, &bdi) >= 0 && bdi.cluster_size > granularity) {
+            granularity = bdi.cluster_size;
+        }
+    }
+
+    if (has_persistent && persistent &&
+        !bdrv_can_store_dirty_bitmap(bs, name, granularity, errp)) {
+        return;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap && has_persistent) {
+        bdrv_dirty_bitmap_set_persistent(bitmap, persistent);
+    }
+}
+
+void qmp_block_dirty_bitmap_remove(const char *node, const char *name,
+                                   Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = block_dirty_bitmap_lookup(node, name, &bs, errp);
+    if (bitmap) {
+        bdrv_release_dirty_bitmap(bs, bitmap);
+    }
+}
+
+void qmp_block_dirty_bitmap_clear(const char *node, const char *name,
+                                  Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = block_dirty_bitmap_lookup(node, name, &bs, errp);
+    if (bitmap) {
+        bdrv_clear_dirty_bitmap(bitmap);
+    }
+}
+
 BlockDeviceInfoList *qmp_query_named_block_nodes(Error **errp)
 {
     return bdrv_named_nodes_list();
@@ -2091,6 +2210,11 @@ void qmp_drive_mirror(const char *device, const char *target,
         error_set(errp, QERR_INVALID_PARAMETER, device);
         return;
     }
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        error_setg(errp, "drive-mirror does not support sync mode "
+                   "'incremental'");
+        return;
+    }
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -134,6 +134,18 @@ void *g_realloc(void *ptr, size_t size)
     return new_ptr;
 }
 
+/* File mappings are always read in when they are created, so no page
+   is ever PAGE_LAZY.  */
+int mmap_populate(target_ulong start, target_ulong len)
+{
+    return 0;
+}
+
+bool mmap_populate_fault(target_ulong address, int is_write)
+{
+    return false;
+}
+
 /* NOTE: all the constants are the HOST ones, but addresses are target. */
 int target_mprotect(abi_ulong start, abi_ulong len, int prot)
 {
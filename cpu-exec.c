@@ -168,6 +168,32 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
     return tb;
 }
 
+/* Look the current state up in the CPU's jump cache only, without
+   holding tb_lock.  Invalidations only ever clear entries, but a
+   concurrent tb_flush() may hand the TB slots out again while we look
+   at them, so retry if the flush count changed during the probe.  */
+static inline TranslationBlock *tb_find_cached(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags, flush_count;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    do {
+        flush_count = atomic_read(&tcg_ctx.tb_ctx.tb_flush_count);
+        smp_rmb();
+        tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+        if (tb && (tb->pc != pc || tb->cs_base != cs_base ||
+                   tb->flags != flags)) {
+            tb = NULL;
+        }
+        smp_rmb();
+    } while (unlikely(flush_count !=
+                      atomic_read(&tcg_ctx.tb_ctx.tb_flush_count)));
+    return tb;
+}
+
 static inline TranslationBlock *tb_find_fast(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -601,33 +627,41 @@ int cpu_exec(CPUArchState *env)
                     cpu->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(cpu);
                 }
-                spin_lock(&tcg_ctx.tb_ctx.tb_lock);
-                have_tb_lock = true;
-                tb = tb_find_fast(env);
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
-                    next_tb = 0;
-                    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+                /* Returns through an indirect branch have nothing to
+                   chain, so a jump cache hit is all they need.  Keeping
+                   them off tb_lock stops threads of a multithreaded
+                   guest from serializing on every such lookup.  */
+                tb = next_tb == 0 ? tb_find_cached(env) : NULL;
+                if (tb == NULL) {
+                    spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+                    have_tb_lock = true;
+                    tb = tb_find_fast(env);
+                    /* Note: we do it here to avoid a gcc bug on Mac OS X
+                       when doing it in tb_find_slow */
+                    if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
+                        /* as some TB could have been invalidated because
+                           of memory exceptions while generating the code,
+                           we must recompute the hash index here */
+                        next_tb = 0;
+                        tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+                    }
+#ifndef HAS_TRACEWRAP
+                    /* see if we can patch the calling TB. When the TB
+                       spans two pages, we cannot safely do a direct
+                       jump. */
+                    if (next_tb != 0 && tb->page_addr[1] == -1) {
+                        tb_add_jump((TranslationBlock *)
+                                    (next_tb & ~TB_EXIT_MASK),
+                                    next_tb & TB_EXIT_MASK, tb);
+                    }
+#endif //HAS_TRACEWRAP
+                    have_tb_lock = false;
+                    spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
                 }
                 if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
                     qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
                 }
-#ifndef HAS_TRACEWRAP
-                /* see if we can patch the calling TB. When the TB
-                   spans two pages, we cannot safely do a direct
-                   jump. */
-                if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
-                }
-#endif //HAS_TRACEWRAP
-                have_tb_lock = false;
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -257,6 +257,8 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
         addend = 0;
     } else {
         /* TLB_MMIO for rom/romd handled below */
+        ram_postcopy_fault(memory_region_get_ram_addr(section->mr) + xlat,
+                           TARGET_PAGE_SIZE);
         addend = (uintptr_t)memory_region_get_ram_ptr(section->mr) + xlat;
     }
 
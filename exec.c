@@ -1140,6 +1140,10 @@ static void *file_ram_alloc(RAMBlock *block,
 }
 #endif
 
+/* Blocks start on a word of the dirty bitmaps, so that they can be
+ * scanned and cleared a word at a time.  */
+#define RAM_OFFSET_ALIGN ((ram_addr_t)BITS_PER_LONG << TARGET_PAGE_BITS)
+
 static ram_addr_t find_ram_offset(ram_addr_t size)
 {
     RAMBlock *block, *next_block;
@@ -1160,7 +1164,8 @@ static ram_addr_t find_ram_offset(ram_addr_t size)
                 next = MIN(next, next_block->offset);
             }
         }
-        if (next - end >= size && next - end < mingap) {
+        end = ROUND_UP(end, RAM_OFFSET_ALIGN);
+        if (next >= end && next - end >= size && next - end < mingap) {
             offset = end;
             mingap = next - end;
         }
@@ -1247,6 +1252,20 @@ static int memory_try_enable_merging(void *addr, size_t len)
     return qemu_madvise(addr, len, QEMU_MADV_MERGEABLE);
 }
 
+/* Give host memory that replaced part of a RAM block, for example a file
+   mapped over it, the same advice as qemu_ram_alloc gave the original */
+void qemu_ram_setup_host(void *addr, ram_addr_t length)
+{
+    memory_try_enable_merging(addr, length);
+    qemu_ram_setup_dump(addr, length);
+    qemu_madvise(addr, length, QEMU_MADV_HUGEPAGE);
+    qemu_madvise(addr, length, QEMU_MADV_DONTFORK);
+
+    if (kvm_enabled()) {
+        kvm_setup_guest_memory(addr, length);
+    }
+}
+
 ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    MemoryRegion *mr)
 {
@@ -1312,8 +1331,8 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     ram_list.mru_block = NULL;
 
     ram_list.version++;
-    qemu_mutex_unlock_ramlist();
 
+    /* Under the ramlist lock, as migration may be reading them */
     new_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
 
     if (new_ram_size > old_ram_size) {
@@ -1324,6 +1343,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    old_ram_size, new_ram_size);
        }
     }
+    qemu_mutex_unlock_ramlist();
     cpu_physical_memory_set_dirty_range(new_block->offset, size);
 
     qemu_ram_setup_dump(new_block->host, size);
@@ -1488,6 +1508,7 @@ static void *qemu_ram_ptr_length(ram_addr_t addr, hwaddr *size)
             if (addr - block->offset < block->length) {
                 if (addr - block->offset + *size > block->length)
                     *size = block->length - addr + block->offset;
+                ram_postcopy_fault(addr, *size);
                 return block->host + (addr - block->offset);
             }
         }
@@ -2039,6 +2060,7 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
             } else {
                 addr1 += memory_region_get_ram_addr(mr);
                 /* RAM case */
+                ram_postcopy_fault(addr1, l);
                 ptr = qemu_get_ram_ptr(addr1);
                 memcpy(ptr, buf, l);
                 invalidate_and_set_dirty(addr1, l);
@@ -2073,6 +2095,7 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                 }
             } else {
                 /* RAM case */
+                ram_postcopy_fault(mr->ram_addr + addr1, l);
                 ptr = qemu_get_ram_ptr(mr->ram_addr + addr1);
                 memcpy(buf, ptr, l);
             }
@@ -2126,6 +2149,7 @@ static inline void cpu_physical_memory_write_rom_internal(AddressSpace *as,
         } else {
             addr1 += memory_region_get_ram_addr(mr);
             /* ROM/RAM case */
+            ram_postcopy_fault(addr1, l);
             ptr = qemu_get_ram_ptr(addr1);
             switch (type) {
             case WRITE_DATA:
@@ -2378,9 +2402,9 @@ static inline uint32_t ldl_phys_internal(AddressSpace *as, hwaddr addr,
 #endif
     } else {
         /* RAM case */
-        ptr = qemu_get_ram_ptr((memory_region_get_ram_addr(mr)
-                                & TARGET_PAGE_MASK)
-                               + addr1);
+        addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
+        ram_postcopy_fault(addr1, 4);
+        ptr = qemu_get_ram_ptr(addr1);
         switch (endian) {
         case DEVICE_LITTLE_ENDIAN:
             val = ldl_le_p(ptr);
@@ -2437,9 +2461,9 @@ static inline uint64_t ldq_phys_internal(AddressSpace *as, hwaddr addr,
 #endif
     } else {
         /* RAM case */
-        ptr = qemu_get_ram_ptr((memory_region_get_ram_addr(mr)
-                                & TARGET_PAGE_MASK)
-                               + addr1);
+        addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
+        ram_postcopy_fault(addr1, 8);
+        ptr = qemu_get_ram_ptr(addr1);
         switch (endian) {
         case DEVICE_LITTLE_ENDIAN:
             val = ldq_le_p(ptr);
@@ -2504,9 +2528,9 @@ static inline uint32_t lduw_phys_internal(AddressSpace *as, hwaddr addr,
 #endif
     } else {
         /* RAM case */
-        ptr = qemu_get_ram_ptr((memory_region_get_ram_addr(mr)
-                                & TARGET_PAGE_MASK)
-                               + addr1);
+        addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
+        ram_postcopy_fault(addr1, 2);
+        ptr = qemu_get_ram_ptr(addr1);
         switch (endian) {
         case DEVICE_LITTLE_ENDIAN:
             val = lduw_le_p(ptr);
@@ -2553,6 +2577,7 @@ void stl_phys_notdirty(AddressSpace *as, hwaddr addr, uint32_t val)
         io_mem_write(mr, addr1, val, 4);
     } else {
         addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
+        ram_postcopy_fault(addr1, 4);
         ptr = qemu_get_ram_ptr(addr1);
         stl_p(ptr, val);
 
@@ -2595,6 +2620,7 @@ static inline void stl_phys_internal(AddressSpace *as,
     } else {
         /* RAM case */
         addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
+        ram_postcopy_fault(addr1, 4);
         ptr = qemu_get_ram_ptr(addr1);
         switch (endian) {
         case DEVICE_LITTLE_ENDIAN:
@@ -2658,6 +2684,7 @@ static inline void stw_phys_internal(AddressSpace *as,
     } else {
         /* RAM case */
         addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
+        ram_postcopy_fault(addr1, 2);
         ptr = qemu_get_ram_ptr(addr1);
         switch (endian) {
         case DEVICE_LITTLE_ENDIAN:
@@ -914,6 +914,22 @@ STEXI
 @findex migrate_cancel
 Cancel the current VM migration.
 
+ETEXI
+
+    {
+        .name       = "migrate_start_postcopy",
+        .args_type  = "",
+        .params     = "",
+        .help       = "switch the current VM migration to post-copy",
+        .mhandler.cmd = hmp_migrate_start_postcopy,
+    },
+
+STEXI
+@item migrate_start_postcopy
+@findex migrate_start_postcopy
+Switch the current VM migration to post-copy without waiting for the end
+of the first pass over guest RAM.  The postcopy-ram capability must be set.
+
 ETEXI
 
     {
@@ -921,8 +937,8 @@ ETEXI
         .args_type  = "value:o",
         .params     = "value",
         .help       = "set cache size (in bytes) for XBZRLE migrations,"
-                      "the cache size will be rounded down to the nearest "
-                      "power of 2.\n"
+                      "the cache size will be rounded down to a multiple "
+                      "of 8 pages.\n"
                       "The cache size affects the number of cache misses."
                       "In case of a high cache miss ratio you need to increase"
                       " the cache size",
@@ -933,6 +949,39 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_threads",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of threads encoding and decoding "
+                      "RAM pages for migrations",
+        .mhandler.cmd = hmp_migrate_set_threads,
+    },
+
+STEXI
+@item migrate_set_threads @var{value}
+@findex migrate_set_threads
+Set the number of threads encoding RAM pages on the source, and decoding
+them on the destination, of a migration to @var{value}.
+ETEXI
+
+    {
+        .name       = "migrate_set_channels",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of TCP connections carrying "
+                      "RAM pages for migrations",
+        .mhandler.cmd = hmp_migrate_set_channels,
+    },
+
+STEXI
+@item migrate_set_channels @var{value}
+@findex migrate_set_channels
+Set the number of channels carrying RAM pages in a TCP migration to
+@var{value}.  With more than one, that many extra connections are opened
+for RAM pages.  Both sides must use the same value.
 ETEXI
 
     {
@@ -976,6 +1025,21 @@ STEXI
 @item migrate_set_capability @var{capability} @var{state}
 @findex migrate_set_capability
 Enable/Disable the usage of a capability @var{capability} for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:s",
+        .params     = "parameter value",
+        .help       = "Set the parameter for migration",
+        .mhandler.cmd = hmp_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the migration parameter @var{parameter} (compress-level,
+compress-method or threads) to @var{value}.
 ETEXI
 
     {
@@ -1744,6 +1808,10 @@ show migration status
 show current migration capabilities
 @item info migrate_cache_size
 show current migration XBZRLE cache size
+@item info migrate_parameters
+show current migration parameters
+@item info dirty_rate
+show the dirty page rate measured by migration
 @item info balloon
 show balloon information
 @item info qtree
@@ -192,6 +192,14 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
         }
+        monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
+                       info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " milliseconds\n",
+                       info->ram->dirty_sync_time);
+        if (info->ram->has_postcopy_requests) {
+            monitor_printf(mon, "postcopy requests: %" PRIu64 " pages\n",
+                           info->ram->postcopy_requests);
+        }
     }
 
     if (info->has_disk) {
@@ -210,12 +218,36 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->bytes >> 10);
         monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
                        info->xbzrle_cache->pages);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
+        monitor_printf(mon, "xbzrle cache hit rate: %0.2f\n",
+                       info->xbzrle_cache->cache_hit_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_ram_threads) {
+        monitor_printf(mon, "ram threads: %" PRIu64 "\n",
+                       info->ram_threads->threads);
+        monitor_printf(mon, "ram thread pages: %" PRIu64 " pages\n",
+                       info->ram_threads->pages);
+        monitor_printf(mon, "ram thread transferred: %" PRIu64 " kbytes\n",
+                       info->ram_threads->bytes >> 10);
+        monitor_printf(mon, "ram thread wait time: %" PRIu64
+                       " milliseconds\n", info->ram_threads->wait_time);
+    }
+
+    if (info->has_compression) {
+        monitor_printf(mon, "compressed pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compressed transferred: %" PRIu64 " kbytes\n",
+                       info->compression->bytes >> 10);
+        monitor_printf(mon, "compression rate: %0.2f\n",
+                       info->compression->compression_rate);
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -239,12 +271,47 @@ void hmp_info_migrate_capabilities(Monitor *mon, const QDict *qdict)
     qapi_free_MigrationCapabilityStatusList(caps);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    monitor_printf(mon, "parameters: compress-level: %" PRId64
+                   " compress-method: %s threads: %" PRId64 "\n",
+                   params->compress_level,
+                   MigrationCompressMethod_lookup[params->compress_method],
+                   params->threads);
+
+    qapi_free_MigrationParameters(params);
+}
+
 void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
 {
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info;
+    RamBlockDirtyRateList *block;
+
+    info = qmp_query_dirty_rate(NULL);
+
+    monitor_printf(mon, "dirty pages rate: %" PRId64 " pages\n",
+                   info->dirty_pages_rate);
+    monitor_printf(mon, "throttle: %" PRId64 "%%\n",
+                   info->throttle_percentage);
+    for (block = info->blocks; block; block = block->next) {
+        monitor_printf(mon, "%s: %" PRId64 " kbytes, %" PRId64 " pages\n",
+                       block->value->id, block->value->size >> 10,
+                       block->value->dirty_pages_rate);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -950,7 +1017,8 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
 
     qmp_drive_backup(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
-                     true, mode, false, 0, false, 0, false, 0, &errp);
+                     true, mode, false, 0, false, NULL,
+                     false, 0, false, 0, &errp);
     hmp_handle_error(mon, &errp);
 }
 
@@ -1006,6 +1074,14 @@ void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
     qmp_migrate_cancel(NULL);
 }
 
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
     double value = qdict_get_double(qdict, "value");
@@ -1025,6 +1101,32 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_threads(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_threads(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
+void hmp_migrate_set_channels(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_channels(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -1063,6 +1165,49 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    const char *str = qdict_get_str(qdict, "value");
+    Error *err = NULL;
+    int64_t value = 0;
+    char *end;
+    int i;
+
+    if (strcmp(param, "compress-method") == 0) {
+        for (i = 0; i < MIGRATION_COMPRESS_METHOD_MAX; i++) {
+            if (strcmp(str, MigrationCompressMethod_lookup[i]) == 0) {
+                qmp_migrate_set_parameters(false, 0, true, i, false, 0, &err);
+                break;
+            }
+        }
+        if (i == MIGRATION_COMPRESS_METHOD_MAX) {
+            error_set(&err, QERR_INVALID_PARAMETER_VALUE, param,
+                      "zlib, lzo or snappy");
+        }
+    } else if (strcmp(param, "compress-level") == 0 ||
+               strcmp(param, "threads") == 0) {
+        bool is_level = strcmp(param, "compress-level") == 0;
+
+        errno = 0;
+        value = strtoll(str, &end, 10);
+        if (errno || end == str || *end) {
+            error_set(&err, QERR_INVALID_PARAMETER_VALUE, param, "a number");
+        } else {
+            qmp_migrate_set_parameters(is_level, value, false, 0,
+                                       !is_level, value, &err);
+        }
+    } else {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -1235,6 +1380,7 @@ static void hmp_migrate_status_cb(void *opaque)
 
     info = qmp_query_migrate(NULL);
     if (!info->has_status || strcmp(info->status, "active") == 0 ||
+        strcmp(info->status, "postcopy-active") == 0 ||
         strcmp(info->status, "setup") == 0) {
         if (info->has_disk) {
             int progress;
@@ -324,6 +324,23 @@ static void handle_notify(EventNotifier *e)
     }
 }
 
+/* Checks the avail index of the virtqueue while the AioContext busy polls */
+static bool handle_notify_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
+                                           host_notifier);
+    unsigned int num_reqs = s->num_reqs;
+
+    if (s->vring.broken || !vring_more_avail(&s->vring)) {
+        return false;
+    }
+
+    /* Without free iovecs nothing is submitted until requests complete */
+    handle_notify(e);
+    return s->num_reqs != num_reqs;
+}
+
 static void handle_io(EventNotifier *e)
 {
     VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
@@ -481,6 +498,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     /* Get this show started by hooking up our callbacks */
     aio_context_acquire(s->ctx);
     aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
+    aio_set_event_notifier_poll(s->ctx, &s->host_notifier, handle_notify_poll);
     aio_set_event_notifier(s->ctx, &s->io_notifier, handle_io);
     aio_context_release(s->ctx);
 }
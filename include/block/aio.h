@@ -44,6 +44,10 @@ void qemu_aio_release(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+/* Checks for and processes events without blocking.  Returns true if there
+ * was something to do.
+ */
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -81,8 +85,49 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Set by aio_notify() so that busy polling stops for new work */
+    bool notified;
+
+    /* Adaptive polling: aio_poll() busy waits for up to poll_ns before
+     * blocking.  The window grows while events arrive just after it expired
+     * and shrinks when waits are longer than poll_max_ns.  0 disables it.
+     */
+    int64_t poll_max_ns;
+    int64_t poll_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Number of poll windows that found work, or expired without it */
+    uint64_t poll_hits;
+    uint64_t poll_misses;
+
+#ifdef CONFIG_EPOLL_CREATE1
+    /* epoll(7) file descriptor, or -1 if epoll is not available */
+    int epollfd;
+    /* Handlers are registered with epollfd and aio_poll() waits on it */
+    bool epoll_enabled;
+    /* Cleared when an epoll_ctl() call fails, aio_poll() keeps polling
+     * each file descriptor then
+     */
+    bool epoll_available;
+#endif
 };
 
+/**
+ * aio_context_setup: Initialize the platform specific parts of an AioContext.
+ *
+ * This is an internal function used by aio_context_new().
+ */
+void aio_context_setup(AioContext *ctx);
+
+/**
+ * aio_context_cleanup: Free what aio_context_setup() allocated.
+ *
+ * This is an internal function used when the AioContext is freed.
+ */
+void aio_context_cleanup(AioContext *ctx);
+
 /**
  * aio_context_new: Allocate a new AioContext.
  *
@@ -243,6 +288,31 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Register a function that aio_poll() calls repeatedly while busy polling, in
+ * addition to the existing handler of the event notifier.  Polling is not
+ * implemented on Windows, where this does nothing.
+ *
+ * The handler must already be registered with aio_set_event_notifier(), and
+ * the poll function is removed together with it.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: upper limit of the polling window in nanoseconds, 0 disables it
+ * @grow: factor by which the window grows, 0 selects the default of 2
+ * @shrink: divisor by which the window shrinks, 0 resets it to 0 instead
+ *
+ * Configure adaptive busy polling in aio_poll().  This trades CPU time for
+ * lower latency of completions that arrive shortly after aio_poll() was
+ * called.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -36,14 +36,29 @@ struct nbd_reply {
     uint32_t magic;
     uint32_t error;
     uint64_t handle;
+    /* Only valid for structured reply chunks (magic is
+     * NBD_STRUCTURED_REPLY_MAGIC); error is then always zero and the
+     * chunk payload of length bytes follows the header.
+     */
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;
 } QEMU_PACKED;
 
+#define NBD_SIMPLE_REPLY_MAGIC      0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
 #define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Multiple connections are coherent */
+
+/* Handshake flags sent by the server and by the client (newstyle only) */
+#define NBD_FLAG_FIXED_NEWSTYLE   (1 << 0)      /* Server supports option replies */
+#define NBD_FLAG_C_FIXED_NEWSTYLE (1 << 0)      /* Client understands them */
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
@@ -56,6 +71,16 @@ enum {
     NBD_CMD_TRIM = 4
 };
 
+/* Structured reply chunk flags and types */
+#define NBD_REPLY_FLAG_DONE         (1 << 0)    /* Last chunk of the reply */
+
+enum {
+    NBD_REPLY_TYPE_NONE = 0,
+    NBD_REPLY_TYPE_OFFSET_DATA = 1,
+    NBD_REPLY_TYPE_OFFSET_HOLE = 2,
+    NBD_REPLY_TYPE_ERROR = (1 << 15) + 1,
+};
+
 #define NBD_DEFAULT_PORT	10809
 
 /* Maximum size of a single READ/WRITE data buffer */
@@ -63,10 +88,12 @@ enum {
 
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize);
+                          off_t *size, size_t *blocksize,
+                          bool *structured_reply);
 int nbd_init(int fd, int csock, uint32_t flags, off_t size, size_t blocksize);
 ssize_t nbd_send_request(int csock, struct nbd_request *request);
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply);
+ssize_t nbd_receive_chunk_length(int csock, struct nbd_reply *reply);
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
@@ -28,9 +28,29 @@ typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
 
+#define THREAD_POOL_MAX_THREADS         64
+#define THREAD_POOL_IDLE_TIMEOUT_MS     10000
+
 ThreadPool *thread_pool_new(struct AioContext *ctx);
 void thread_pool_free(ThreadPool *pool);
 
+/**
+ * thread_pool_set_params:
+ * @pool: the thread pool
+ * @max_threads: maximum number of worker threads, 0 for the default
+ * @idle_timeout_ms: how long an idle worker waits for requests before
+ *                   exiting, 0 for the default
+ *
+ * A shorter idle timeout gives back the threads of a pool sooner after a
+ * burst of requests, a longer one avoids creating them again.
+ *
+ * There is no CPU affinity setting.  Workers are created from the pool's
+ * AioContext, so they inherit the affinity of the thread that runs it;
+ * pin the iothread to place the workers of its pool.
+ */
+void thread_pool_set_params(ThreadPool *pool, int max_threads,
+                            int idle_timeout_ms);
+
 BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg,
         BlockDriverCompletionFunc *cb, void *opaque);
@@ -345,9 +345,13 @@ extern uintptr_t qemu_host_page_mask;
 /* FIXME: Code that sets/uses this is broken and needs to go away.  */
 #define PAGE_RESERVED  0x0020
 #endif
+/* the page is file-backed but its contents have not been read in yet;
+   it is inaccessible on the host until mmap_populate() loads it */
+#define PAGE_LAZY      0x0040
 
 #if defined(CONFIG_USER_ONLY)
 void page_dump(FILE *f);
+void dump_tb_stats(FILE *f, fprintf_function cpu_fprintf);
 
 typedef int (*walk_memory_regions_fn)(void *, abi_ulong,
                                       abi_ulong, unsigned long);
@@ -356,6 +360,8 @@ int walk_memory_regions(void *, walk_memory_regions_fn);
 int page_get_flags(target_ulong address);
 void page_set_flags(target_ulong start, target_ulong end, int flags);
 int page_check_range(target_ulong start, target_ulong len, int flags);
+int mmap_populate(target_ulong start, target_ulong len);
+bool mmap_populate_fault(target_ulong address, int is_write);
 #endif
 
 CPUArchState *cpu_copy(CPUArchState *env);
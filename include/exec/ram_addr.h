@@ -59,11 +59,13 @@ static inline bool cpu_physical_memory_is_clean(ram_addr_t addr)
     return !(vga && code && migration);
 }
 
+/* Dirty bits are set atomically: migration harvests its bitmap without
+ * holding the iothread lock.  */
 static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
                                                       unsigned client)
 {
     assert(client < DIRTY_MEMORY_NUM);
-    set_bit(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
+    set_bit_atomic(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
 }
 
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
@@ -73,9 +75,12 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_CODE], page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION],
+                      page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_VGA],
+                      page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_CODE],
+                      page, end - page);
     xen_modified_memory(start, length);
 }
 
@@ -102,9 +107,12 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
             if (bitmap[k]) {
                 unsigned long temp = leul_to_cpu(bitmap[k]);
 
-                ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION][page + k] |= temp;
-                ram_list.dirty_memory[DIRTY_MEMORY_VGA][page + k] |= temp;
-                ram_list.dirty_memory[DIRTY_MEMORY_CODE][page + k] |= temp;
+                atomic_or(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION][page + k],
+                          temp);
+                atomic_or(&ram_list.dirty_memory[DIRTY_MEMORY_VGA][page + k],
+                          temp);
+                atomic_or(&ram_list.dirty_memory[DIRTY_MEMORY_CODE][page + k],
+                          temp);
             }
         }
         xen_modified_memory(start, pages);
@@ -146,5 +154,18 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
                                      unsigned client);
 
+extern bool ram_postcopy_incoming;
+void ram_postcopy_wait(ram_addr_t start, ram_addr_t length);
+
+/* To be called before guest RAM is accessed, through the TLB or by the
+ * emulator: while a post-copy migration is coming in, waits for the pages
+ * in the range that the source has not sent yet. */
+static inline void ram_postcopy_fault(ram_addr_t start, ram_addr_t length)
+{
+    if (unlikely(ram_postcopy_incoming)) {
+        ram_postcopy_wait(start, length);
+    }
+}
+
 #endif
 #endif
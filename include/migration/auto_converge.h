@@ -0,0 +1,40 @@
+/*
+ * Auto-converge throttle controller for QEMU migration
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef AUTO_CONVERGE_H
+#define AUTO_CONVERGE_H
+
+/* Highest share of time, in percent, that the vCPUs are kept out */
+#define AUTO_CONVERGE_MAX_PCT 99
+
+/**
+ * auto_converge_target: Compute the dirty ratio to aim for
+ *
+ * Returns the ratio of bytes dirtied to bytes sent that a period should
+ * not exceed: at most half as many, so that what is left to send shrinks
+ * geometrically, or more if that already fits in the allowed downtime.
+ *
+ * @max_downtime_ns: the allowed downtime
+ * @period_ms: length of the measurement period
+ */
+double auto_converge_target(uint64_t max_downtime_ns, int64_t period_ms);
+
+/**
+ * auto_converge_throttle: Compute the throttle for the next period
+ *
+ * Returns the new throttle, from 0 to AUTO_CONVERGE_MAX_PCT
+ *
+ * @pct: throttle in effect during the last period
+ * @ratio: bytes dirtied during the last period over bytes sent
+ * @target: ratio to aim for, from auto_converge_target()
+ */
+int auto_converge_throttle(int pct, double ratio, double target);
+
+#endif
@@ -33,6 +33,11 @@
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+/* The device state, in one block; post-copy RAM pages follow */
+#define QEMU_VM_POSTCOPY_PACKAGE     0x06
+
+/* Starts each extra RAM channel, followed by the channel's index */
+#define QEMU_VM_CHANNEL_MAGIC        0x5145434e
 
 struct MigrationParams {
     bool blk;
@@ -60,7 +65,18 @@ struct MigrationState
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int ram_threads;
+    int channels;
+    int compress_level;
+    MigrationCompressMethod compress_method;
+    QEMUFile **ram_channels;
+    int nb_ram_channels;
+    /* -1 unless RAM goes to fixed offsets of a file, see migration-file.c */
+    int ram_file_fd;
+    uint64_t ram_file_base;
+    uint64_t ram_file_size;
     int64_t setup_time;
+    bool start_postcopy;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -89,6 +105,11 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -98,6 +119,7 @@ void migrate_fd_error(MigrationState *s);
 void migrate_fd_connect(MigrationState *s);
 
 int migrate_fd_close(MigrationState *s);
+void migrate_close_ram_channels(MigrationState *s);
 
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
@@ -109,7 +131,18 @@ MigrationState *migrate_get_current(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
-void free_xbzrle_decoded_buf(void);
+void ram_load_cleanup(void);
+void ram_channel_incoming(QEMUFile *f);
+uint64_t ram_file_area_size(void);
+void ram_file_incoming(int fd, uint64_t base);
+bool ram_file_is_mapped(const struct stat *st);
+
+bool ram_postcopy_ready(void);
+void ram_postcopy_begin(void);
+int ram_postcopy_save(QEMUFile *f, QEMUFile *rp);
+uint64_t ram_postcopy_requests(void);
+int ram_postcopy_incoming_start(QEMUFile *f);
+bool ram_postcopy_incoming_started(void);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 
@@ -124,7 +157,16 @@ uint64_t norm_mig_pages_transferred(void);
 uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_bytes_transferred(void);
+double compress_mig_rate(void);
+uint64_t ram_thread_pages_transferred(void);
+uint64_t ram_thread_bytes_transferred(void);
+uint64_t ram_thread_wait_time(void);
+uint64_t ram_dirty_sync_count(void);
+uint64_t ram_dirty_sync_time(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
@@ -146,6 +188,11 @@ bool migrate_rdma_pin_all(void);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
+bool migrate_postcopy_ram(void);
+bool migrate_zero_copy_send(void);
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
@@ -153,6 +200,10 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
+int migrate_ram_threads(void);
+int migrate_channels(void);
+int migrate_get_ram_channels(QEMUFile *f, QEMUFile ***channels);
+int migrate_get_ram_file(QEMUFile *f, uint64_t *base, uint64_t *size);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
@@ -173,5 +224,6 @@ void ram_control_load_hook(QEMUFile *f, uint64_t flags);
 size_t ram_control_save_page(QEMUFile *f, ram_addr_t block_offset,
                              ram_addr_t offset, size_t size,
                              int *bytes_sent);
+bool ram_control_has_save_page(QEMUFile *f);
 
 #endif
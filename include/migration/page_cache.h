@@ -24,11 +24,10 @@ typedef struct PageCache PageCache;
  *
  * Returns new allocated cache or NULL on error
  *
- * @cache pointer to the PageCache struct
- * @num_pages: cache maximal number of cached pages
+ * @size: cache size in bytes, rounded down to a whole number of sets
  * @page_size: cache page size
  */
-PageCache *cache_init(int64_t num_pages, unsigned int page_size);
+PageCache *cache_init(int64_t size, size_t page_size);
 
 /**
  * cache_fini: free all cache resources
@@ -37,14 +36,15 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size);
 void cache_fini(PageCache *cache);
 
 /**
- * cache_is_cached: Checks to see if the page is cached
+ * cache_is_cached: Checks to see if the page is cached, and marks it as
+ * recently used if so
  *
  * Returns %true if page is cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr);
+bool cache_is_cached(PageCache *cache, uint64_t addr);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -58,7 +58,9 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten.
+ * If the page's set is full, the oldest page that was not looked up
+ * again is evicted.
  *
  * Returns -1 on error
  *
@@ -69,14 +71,15 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
 
 /**
- * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * cache_resize: resize the page cache, keeping the cached pages.  When a
+ * set overflows, which is bound to happen in case of size reduction, the
+ * pages that were not used recently are freed first
  *
- * Returns -1 on error new cache size on success
+ * Returns -1 on error new cache size (in bytes) on success
  *
  * @cache pointer to the PageCache struct
- * @num_pages: new page cache size (in pages)
+ * @size: new page cache size (in bytes)
  */
-int64_t cache_resize(PageCache *cache, int64_t num_pages);
+int64_t cache_resize(PageCache *cache, int64_t size);
 
 #endif
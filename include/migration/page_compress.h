@@ -0,0 +1,84 @@
+/*
+ * Page compression for QEMU migration
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef PAGE_COMPRESS_H
+#define PAGE_COMPRESS_H
+
+/* In the order of MigrationCompressMethod */
+typedef enum PageCompressMethod {
+    PAGE_COMPRESS_ZLIB,
+    PAGE_COMPRESS_LZO,
+    PAGE_COMPRESS_SNAPPY,
+} PageCompressMethod;
+
+/* State of one thread compressing pages */
+typedef struct PageCompressor PageCompressor;
+
+/**
+ * page_compress_supported: Checks whether QEMU was built with a method
+ *
+ * @method: the compression method
+ */
+bool page_compress_supported(PageCompressMethod method);
+
+/**
+ * page_compressor_new: Allocate the state for compressing pages
+ *
+ * Returns new allocated compressor or NULL on error
+ *
+ * @method: the compression method, which must be supported
+ * @level: compression level from 1 to 9, only used by zlib
+ * @page_size: size of the pages to compress
+ */
+PageCompressor *page_compressor_new(PageCompressMethod method, int level,
+                                    size_t page_size);
+
+/**
+ * page_compressor_free: free a compressor
+ *
+ * @c: the compressor, may be NULL
+ */
+void page_compressor_free(PageCompressor *c);
+
+/**
+ * page_compressor_method: Returns the method of a compressor
+ *
+ * @c: the compressor
+ */
+PageCompressMethod page_compressor_method(PageCompressor *c);
+
+/**
+ * page_compress: Compress a page
+ *
+ * Returns the compressed length, or -1 if the page did not get smaller.
+ * The compressed data is in *out until the next call.
+ *
+ * @c: the compressor
+ * @page: the page to compress, which may change meanwhile
+ * @out: where to return the compressed data
+ */
+int page_compress(PageCompressor *c, const uint8_t *page, const uint8_t **out);
+
+/**
+ * page_decompress: Decompress a page
+ *
+ * Returns 0 on success, or -1 if the data is not a page compressed with
+ * that method.
+ *
+ * @method: the compression method
+ * @src: the compressed data
+ * @slen: length of the compressed data
+ * @page: the page to decompress into
+ * @page_size: size of the page
+ */
+int page_decompress(PageCompressMethod method, const uint8_t *src, int slen,
+                    uint8_t *page, size_t page_size);
+
+#endif
@@ -52,12 +52,28 @@ typedef int (QEMUFileCloseFunc)(void *opaque);
  */
 typedef int (QEMUFileGetFD)(void *opaque);
 
+/* Called to return a QEMUFile for the opposite direction of the same
+ * connection, or NULL if the transport has no such thing.
+ */
+typedef QEMUFile *(QEMUFileGetReturnPathFunc)(void *opaque);
+
 /*
  * This function writes an iovec to file.
  */
 typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
                                            int iovcnt, int64_t pos);
 
+/* Called to have writev_buffer send the data without copying it, if the
+ * transport can.  Returns whether it does.  The data may then be read
+ * after writev_buffer has returned.
+ */
+typedef bool (QEMUFileEnableZerocopyFunc)(void *opaque);
+
+/* Called with a g_malloc'ed buffer that the data written so far refers
+ * to, for the transport to free once it is done with that data.
+ */
+typedef void (QEMUFileHoldBufferFunc)(void *opaque, void *buf);
+
 /*
  * This function provides hooks around different
  * stages of RAM migration.
@@ -87,7 +103,10 @@ typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
     QEMUFileGetFD *get_fd;
+    QEMUFileGetReturnPathFunc *get_return_path;
     QEMUFileWritevBufferFunc *writev_buffer;
+    QEMUFileEnableZerocopyFunc *enable_zerocopy;
+    QEMUFileHoldBufferFunc *hold_buffer;
     QEMURamHookFunc *before_ram_iterate;
     QEMURamHookFunc *after_ram_iterate;
     QEMURamHookFunc *hook_ram_load;
@@ -100,6 +119,7 @@ QEMUFile *qemu_fdopen(int fd, const char *mode);
 QEMUFile *qemu_fopen_socket(int fd, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 int qemu_get_fd(QEMUFile *f);
+QEMUFile *qemu_file_get_return_path(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
@@ -109,6 +129,12 @@ void qemu_put_byte(QEMUFile *f, int v);
  * The buffer should be available till it is sent asynchronously.
  */
 void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
+/*
+ * Have the buffers passed to qemu_put_buffer_async sent without copying
+ * them at all, if the transport can.  They must then stay valid even after
+ * the next flush; writes to them may or may not make it to the stream.
+ */
+bool qemu_file_enable_zerocopy(QEMUFile *f);
 bool qemu_file_mode_is_not_valid(const char *mode);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
@@ -127,6 +153,7 @@ int qemu_peek_byte(QEMUFile *f, int offset);
 int qemu_get_byte(QEMUFile *f);
 void qemu_file_skip(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_update_transfer(QEMUFile *f, int64_t len);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
 {
@@ -269,6 +269,7 @@ typedef struct PCIHostDeviceAddress {
 } PCIHostDeviceAddress;
 
 void tcg_exec_init(unsigned long tb_size);
+void tcg_exec_text_hint(unsigned long text_size);
 bool tcg_enabled(void);
 
 void cpu_exec_init_all(void);
@@ -466,6 +467,7 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
             && ((uintptr_t) buf) % sizeof(VECTYPE) == 0);
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
+bool host_cpu_has_avx2(void);
 
 /*
  * helper to parse debug environment variables
@@ -108,6 +108,14 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count);
  */
 void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
 
+/**
+ * hbitmap_reset_all:
+ * @hb: HBitmap to operate on.
+ *
+ * Reset all bits in an HBitmap.
+ */
+void hbitmap_reset_all(HBitmap *hb);
+
 /**
  * hbitmap_get:
  * @hb: HBitmap to operate on.
@@ -125,6 +133,77 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item);
  */
 void hbitmap_free(HBitmap *hb);
 
+/**
+ * hbitmap_merge:
+ * @a: HBitmap to merge into.
+ * @b: HBitmap to merge from.
+ *
+ * Set in @a all the bits that are set in @b.  Return false, without
+ * changing @a, if the two bitmaps have a different size or granularity.
+ */
+bool hbitmap_merge(HBitmap *a, const HBitmap *b);
+
+/**
+ * hbitmap_serialization_granularity:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the granularity of serialized chunks, in items.  The start of
+ * each chunk must be aligned to it, and so must its size unless the chunk
+ * ends at the end of the bitmap.
+ */
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ * @start: First item in the chunk.
+ * @count: Number of items in the chunk.
+ *
+ * Return the number of bytes that hbitmap_serialize_part needs for the
+ * chunk.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_serialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size() bytes.
+ * @start: First item in the chunk.
+ * @count: Number of items in the chunk.
+ *
+ * Store the bits for a chunk of the bitmap in @buf, the first one in the
+ * least significant bit of the first byte.  The result does not depend
+ * on the endianness or word size of the host.
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Data written by hbitmap_serialize_part.
+ * @start: First item in the chunk.
+ * @count: Number of items in the chunk.
+ * @finish: Whether to call hbitmap_deserialize_finish.
+ *
+ * Load the bits for a chunk of the bitmap from @buf.  Until
+ * hbitmap_deserialize_finish is called, only the bits themselves are
+ * updated and the bitmap must not be used otherwise.
+ */
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count,
+                              bool finish);
+
+/**
+ * hbitmap_deserialize_finish:
+ * @hb: HBitmap to operate on.
+ *
+ * Make the bitmap usable again after a series of hbitmap_deserialize_part
+ * calls.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb);
+
 /**
  * hbitmap_iter_init:
  * @hbi: HBitmapIter to initialize.
@@ -613,6 +613,7 @@ void cpu_single_step(CPUState *cpu, int enabled);
 #define BP_WATCHPOINT_HIT     0x08
 #define BP_GDB                0x10
 #define BP_CPU                0x20
+#define BP_LIBCALL            0x40
 
 int cpu_breakpoint_insert(CPUState *cpu, vaddr pc, int flags,
                           CPUBreakpoint **breakpoint);
@@ -15,8 +15,10 @@
 #include "qom/object_interfaces.h"
 #include "qemu/module.h"
 #include "block/aio.h"
+#include "block/thread-pool.h"
 #include "sysemu/iothread.h"
 #include "qmp-commands.h"
+#include "qapi/visitor.h"
 
 #define IOTHREADS_PATH "/objects"
 
@@ -58,6 +60,16 @@ static void iothread_instance_finalize(Object *obj)
     aio_context_unref(iothread->ctx);
 }
 
+static void iothread_update_thread_pool(IOThread *iothread)
+{
+    /* Only create the pool early if it is not the default one */
+    if (iothread->thread_pool_max || iothread->thread_pool_idle_ms) {
+        thread_pool_set_params(aio_get_thread_pool(iothread->ctx),
+                               iothread->thread_pool_max,
+                               iothread->thread_pool_idle_ms);
+    }
+}
+
 static void iothread_complete(UserCreatable *obj, Error **errp)
 {
     IOThread *iothread = IOTHREAD(obj);
@@ -69,6 +81,10 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
     qemu_mutex_init(&iothread->init_done_lock);
     qemu_cond_init(&iothread->init_done_cond);
 
+    aio_context_set_poll_params(iothread->ctx, iothread->poll_max_ns,
+                                iothread->poll_grow, iothread->poll_shrink);
+    iothread_update_thread_pool(iothread);
+
     /* This assumes we are called from a thread with useful CPU affinity for us
      * to inherit.
      */
@@ -84,6 +100,106 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
     qemu_mutex_unlock(&iothread->init_done_lock);
 }
 
+typedef struct {
+    const char *name;
+    ptrdiff_t offset; /* field's byte offset in IOThread struct */
+    int64_t max;
+} IOThreadParamInfo;
+
+static IOThreadParamInfo poll_max_ns_info = {
+    "poll-max-ns", offsetof(IOThread, poll_max_ns), INT64_MAX,
+};
+static IOThreadParamInfo poll_grow_info = {
+    "poll-grow", offsetof(IOThread, poll_grow), INT64_MAX,
+};
+static IOThreadParamInfo poll_shrink_info = {
+    "poll-shrink", offsetof(IOThread, poll_shrink), INT64_MAX,
+};
+static IOThreadParamInfo thread_pool_max_info = {
+    "thread-pool-max", offsetof(IOThread, thread_pool_max), INT_MAX,
+};
+static IOThreadParamInfo thread_pool_idle_ms_info = {
+    "thread-pool-idle-ms", offsetof(IOThread, thread_pool_idle_ms), INT_MAX,
+};
+
+static void iothread_get_param(Object *obj, Visitor *v,
+        void *opaque, const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+
+    visit_type_int64(v, field, name, errp);
+}
+
+static bool iothread_set_param(Object *obj, Visitor *v,
+        void *opaque, const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, &value, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return false;
+    }
+
+    if (value < 0 || value > info->max) {
+        error_setg(errp, "%s value must be in range [0, %"PRId64"]",
+                   info->name, info->max);
+        return false;
+    }
+
+    *field = value;
+    return true;
+}
+
+static void iothread_set_poll_param(Object *obj, Visitor *v,
+        void *opaque, const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread_set_param(obj, v, opaque, name, errp) && iothread->ctx) {
+        aio_context_set_poll_params(iothread->ctx, iothread->poll_max_ns,
+                                    iothread->poll_grow,
+                                    iothread->poll_shrink);
+    }
+}
+
+static void iothread_set_thread_pool_param(Object *obj, Visitor *v,
+        void *opaque, const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread_set_param(obj, v, opaque, name, errp) && iothread->ctx) {
+        aio_context_acquire(iothread->ctx);
+        iothread_update_thread_pool(iothread);
+        aio_context_release(iothread->ctx);
+    }
+}
+
+static void iothread_instance_init(Object *obj)
+{
+    object_property_add(obj, "poll-max-ns", "int",
+                        iothread_get_param, iothread_set_poll_param,
+                        NULL, &poll_max_ns_info, &error_abort);
+    object_property_add(obj, "poll-grow", "int",
+                        iothread_get_param, iothread_set_poll_param,
+                        NULL, &poll_grow_info, &error_abort);
+    object_property_add(obj, "poll-shrink", "int",
+                        iothread_get_param, iothread_set_poll_param,
+                        NULL, &poll_shrink_info, &error_abort);
+    object_property_add(obj, "thread-pool-max", "int",
+                        iothread_get_param, iothread_set_thread_pool_param,
+                        NULL, &thread_pool_max_info, &error_abort);
+    object_property_add(obj, "thread-pool-idle-ms", "int",
+                        iothread_get_param, iothread_set_thread_pool_param,
+                        NULL, &thread_pool_idle_ms_info, &error_abort);
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -95,6 +211,7 @@ static const TypeInfo iothread_info = {
     .parent = TYPE_OBJECT,
     .class_init = iothread_class_init,
     .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
     .instance_finalize = iothread_instance_finalize,
     .interfaces = (InterfaceInfo[]) {
         {TYPE_USER_CREATABLE},
@@ -146,6 +263,10 @@ static int query_one_iothread(Object *object, void *opaque)
     info = g_new0(IOThreadInfo, 1);
     info->id = iothread_get_id(iothread);
     info->thread_id = iothread->thread_id;
+    info->poll_max_ns = iothread->ctx->poll_max_ns;
+    info->poll_ns = iothread->ctx->poll_ns;
+    info->poll_hits = iothread->ctx->poll_hits;
+    info->poll_misses = iothread->ctx->poll_misses;
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
@@ -1312,6 +1312,7 @@ static void zero_bss(abi_ulong elf_bss, abi_ulong last_bss, int prot)
     }
 
     if (host_start < host_map_start) {
+        mmap_populate(elf_bss, host_map_start - host_start);
         memset((void *)host_start, 0, host_map_start - host_start);
     }
 }
@@ -1758,6 +1759,7 @@ static void load_elf_image(const char *image_name, int image_fd,
 
             /* Find the full program boundaries.  */
             if (elf_prot & PROT_EXEC) {
+                tcg_exec_text_hint(eppnt->p_filesz);
                 if (vaddr < info->start_code) {
                     info->start_code = vaddr;
                 }
@@ -1812,7 +1814,7 @@ static void load_elf_image(const char *image_name, int image_fd,
         info->brk = info->end_code;
     }
 
-    if (qemu_log_enabled()) {
+    if (qemu_log_enabled() || libcall_enabled) {
         load_symbols(ehdr, image_fd, load_bias);
     }
 
@@ -1962,6 +1964,10 @@ static void load_symbols(struct elfhdr *hdr, int fd, abi_ulong load_bias)
             syms[i].st_value &= ~(target_ulong)1;
 #endif
             syms[i].st_value += load_bias;
+            if (libcall_enabled) {
+                libcall_register_symbol(strings + syms[i].st_name,
+                                        syms[i].st_value);
+            }
             i++;
         }
     }
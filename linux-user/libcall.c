@@ -0,0 +1,331 @@
+/*
+ *  Host implementations of guest C library string and memory routines
+ *
+ *  Copyright (c) 2014 QEMU contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* When enabled with -libcall, the entry points of memcpy, memmove,
+ * memset, strlen and memcmp found in the symbol tables of the program
+ * and its interpreter get a breakpoint.  Hitting one stops the CPU with
+ * EXCP_DEBUG; cpu_loop() then calls libcall_dispatch(), which reads the
+ * arguments according to the guest ABI, performs the operation on host
+ * memory and returns to the caller as the guest routine would have.
+ *
+ * Guest buffers are validated with lock_user() first, so page protections
+ * are honoured and pages holding translated code are unprotected (and
+ * their TBs invalidated) before they are written.  An access that would
+ * have faulted raises SIGSEGV at the entry point instead.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "qemu.h"
+
+#if defined(TARGET_I386) || (defined(TARGET_ARM) && !defined(TARGET_AARCH64))
+#define LIBCALL_SUPPORTED
+#endif
+
+enum {
+    LIBCALL_MEMMOVE,
+    LIBCALL_MEMSET,
+    LIBCALL_STRLEN,
+    LIBCALL_MEMCMP,
+};
+
+/* Each name matches itself and the "__<name>_<variant>" implementations
+   that glibc selects through IFUNCs, except for the _chk variants, which
+   take an extra argument.  */
+static const struct {
+    const char *name;
+    int op;
+} libcall_names[] = {
+    { "memcpy",  LIBCALL_MEMMOVE },
+    { "memmove", LIBCALL_MEMMOVE },
+    { "memset",  LIBCALL_MEMSET },
+    { "strlen",  LIBCALL_STRLEN },
+    { "memcmp",  LIBCALL_MEMCMP },
+};
+
+typedef struct LibcallEntry {
+    abi_ulong addr;
+    int op;
+} LibcallEntry;
+
+/* Static glibc has well over a hundred IFUNC variants of these routines,
+   so the table grows as needed.  It is sorted by address, without
+   duplicates, once libcall_insert_breakpoints() has run.  */
+static LibcallEntry *libcall_entries;
+static int libcall_nb_entries;
+static int libcall_max_entries;
+
+int libcall_enabled;
+
+static int libcall_match(const char *sym)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(libcall_names); i++) {
+        const char *name = libcall_names[i].name;
+        size_t len = strlen(name);
+
+        if (strcmp(sym, name) == 0) {
+            return libcall_names[i].op;
+        }
+        if (strncmp(sym, "__", 2) == 0 && strncmp(sym + 2, name, len) == 0
+            && sym[2 + len] == '_' && strstr(sym, "_chk") == NULL) {
+            return libcall_names[i].op;
+        }
+    }
+    return -1;
+}
+
+void libcall_register_symbol(const char *name, abi_ulong addr)
+{
+    int op = libcall_match(name);
+
+    if (op < 0) {
+        return;
+    }
+    if (libcall_nb_entries == libcall_max_entries) {
+        libcall_max_entries = MAX(libcall_max_entries * 2, 64);
+        libcall_entries = g_renew(LibcallEntry, libcall_entries,
+                                  libcall_max_entries);
+    }
+    libcall_entries[libcall_nb_entries].addr = addr;
+    libcall_entries[libcall_nb_entries].op = op;
+    libcall_nb_entries++;
+}
+
+static int libcall_entry_cmp(const void *a, const void *b)
+{
+    const LibcallEntry *x = a, *y = b;
+
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+void libcall_insert_breakpoints(CPUState *cpu)
+{
+    int i, n;
+
+    /* Aliases such as memcpy and memmove can share an entry point.  */
+    qsort(libcall_entries, libcall_nb_entries, sizeof(LibcallEntry),
+          libcall_entry_cmp);
+    for (i = n = 0; i < libcall_nb_entries; i++) {
+        if (n == 0 || libcall_entries[n - 1].addr != libcall_entries[i].addr) {
+            libcall_entries[n++] = libcall_entries[i];
+        }
+    }
+    libcall_nb_entries = n;
+
+    for (i = 0; i < libcall_nb_entries; i++) {
+        cpu_breakpoint_insert(cpu, libcall_entries[i].addr, BP_LIBCALL, NULL);
+    }
+}
+
+bool libcall_supported(void)
+{
+#ifdef LIBCALL_SUPPORTED
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef LIBCALL_SUPPORTED
+
+#if defined(TARGET_I386)
+static abi_ulong libcall_pc(CPUArchState *env)
+{
+    return env->eip;
+}
+
+static int libcall_get_args(CPUArchState *env, abi_ulong *args, int n,
+                            abi_ulong *fault)
+{
+#ifdef TARGET_X86_64
+    static const int arg_regs[] = { R_EDI, R_ESI, R_EDX };
+    int i;
+
+    for (i = 0; i < n; i++) {
+        args[i] = env->regs[arg_regs[i]];
+    }
+#else
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (get_user_ual(args[i], env->regs[R_ESP] + (i + 1) * 4)) {
+            *fault = env->regs[R_ESP];
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+static int libcall_return(CPUArchState *env, abi_ulong ret, abi_ulong *fault)
+{
+    abi_ulong ra;
+
+    if (get_user_ual(ra, env->regs[R_ESP])) {
+        *fault = env->regs[R_ESP];
+        return -1;
+    }
+    env->regs[R_ESP] += sizeof(abi_ulong);
+    env->regs[R_EAX] = ret;
+    env->eip = ra;
+    return 0;
+}
+#elif defined(TARGET_ARM)
+static abi_ulong libcall_pc(CPUArchState *env)
+{
+    return env->regs[15];
+}
+
+static int libcall_get_args(CPUArchState *env, abi_ulong *args, int n,
+                            abi_ulong *fault)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        args[i] = env->regs[i];
+    }
+    return 0;
+}
+
+static int libcall_return(CPUArchState *env, abi_ulong ret, abi_ulong *fault)
+{
+    env->regs[0] = ret;
+    env->regs[15] = env->regs[14] & ~(abi_ulong)1;
+    env->thumb = env->regs[14] & 1;
+    return 0;
+}
+#endif
+
+/* Return the first address from ADDR on that cannot be accessed as TYPE.
+   Only called once an access starting at ADDR has been refused.  */
+static abi_ulong libcall_fault_addr(int type, abi_ulong addr)
+{
+    abi_ulong page = addr & TARGET_PAGE_MASK;
+
+    while (access_ok(type, page, TARGET_PAGE_SIZE)) {
+        page += TARGET_PAGE_SIZE;
+    }
+    return MAX(page, addr);
+}
+
+static void libcall_segv(CPUArchState *env, abi_ulong addr)
+{
+    target_siginfo_t info;
+
+    info.si_signo = TARGET_SIGSEGV;
+    info.si_errno = 0;
+    info.si_code = TARGET_SEGV_MAPERR;
+    info._sifields._sigfault._addr = addr;
+    queue_signal(env, info.si_signo, &info);
+}
+
+/* Perform OP on host memory.  Returns 0 and sets *RET on success, or
+   returns -1 and sets *FAULT to the address the guest would fault on.  */
+static int libcall_run(int op, abi_ulong *args, abi_ulong *ret,
+                       abi_ulong *fault)
+{
+    void *p, *q;
+    abi_long len;
+    int cmp;
+
+    switch (op) {
+    case LIBCALL_MEMMOVE:
+        if (!(q = lock_user(VERIFY_READ, args[1], args[2], 1))) {
+            *fault = libcall_fault_addr(VERIFY_READ, args[1]);
+            return -1;
+        }
+        if (!(p = lock_user(VERIFY_WRITE, args[0], args[2], 0))) {
+            unlock_user(q, args[1], 0);
+            *fault = libcall_fault_addr(VERIFY_WRITE, args[0]);
+            return -1;
+        }
+        memmove(p, q, args[2]);
+        unlock_user(p, args[0], args[2]);
+        unlock_user(q, args[1], 0);
+        *ret = args[0];
+        break;
+    case LIBCALL_MEMSET:
+        if (!(p = lock_user(VERIFY_WRITE, args[0], args[2], 0))) {
+            *fault = libcall_fault_addr(VERIFY_WRITE, args[0]);
+            return -1;
+        }
+        memset(p, (int)args[1], args[2]);
+        unlock_user(p, args[0], args[2]);
+        *ret = args[0];
+        break;
+    case LIBCALL_STRLEN:
+        len = target_strlen(args[0]);
+        if (len < 0) {
+            *fault = libcall_fault_addr(VERIFY_READ, args[0]);
+            return -1;
+        }
+        *ret = len;
+        break;
+    case LIBCALL_MEMCMP:
+        if (!(p = lock_user(VERIFY_READ, args[0], args[2], 1))) {
+            *fault = libcall_fault_addr(VERIFY_READ, args[0]);
+            return -1;
+        }
+        if (!(q = lock_user(VERIFY_READ, args[1], args[2], 1))) {
+            unlock_user(p, args[0], 0);
+            *fault = libcall_fault_addr(VERIFY_READ, args[1]);
+            return -1;
+        }
+        cmp = memcmp(p, q, args[2]);
+        unlock_user(q, args[1], 0);
+        unlock_user(p, args[0], 0);
+        *ret = (abi_long)(cmp < 0 ? -1 : cmp > 0);
+        break;
+    default:
+        abort();
+    }
+    return 0;
+}
+
+bool libcall_dispatch(CPUArchState *env)
+{
+    LibcallEntry key, *e;
+    abi_ulong args[3], ret, fault;
+
+    key.addr = libcall_pc(env);
+    e = bsearch(&key, libcall_entries, libcall_nb_entries,
+                sizeof(LibcallEntry), libcall_entry_cmp);
+    if (!e) {
+        return false;
+    }
+
+    if (libcall_get_args(env, args, ARRAY_SIZE(args), &fault) < 0 ||
+        libcall_run(e->op, args, &ret, &fault) < 0 ||
+        libcall_return(env, ret, &fault) < 0) {
+        libcall_segv(env, fault);
+    }
+    return true;
+}
+
+#else
+
+bool libcall_dispatch(CPUArchState *env)
+{
+    return false;
+}
+
+#endif
@@ -80,6 +80,9 @@ const char *qemu_uname_release = CONFIG_UNAME_RELEASE;
    by remapping the process stack directly at the right place */
 unsigned long guest_stack_size = 8 * 1024 * 1024UL;
 
+/* Size of the translation buffer in MiB; zero lets it grow on demand.  */
+static unsigned long tb_size;
+
 void gemu_log(const char *fmt, ...)
 {
     va_list ap;
@@ -411,6 +414,9 @@ void cpu_loop(CPUX86State *env)
             /* just indicate that signals should be handled asap */
             break;
         case EXCP_DEBUG:
+            if (libcall_enabled && libcall_dispatch(env)) {
+                break;
+            }
             {
                 int sig;
 
@@ -852,6 +858,9 @@ void cpu_loop(CPUARMState *env)
             }
             break;
         case EXCP_DEBUG:
+            if (libcall_enabled && libcall_dispatch(env)) {
+                break;
+            }
             {
                 int sig;
 
@@ -3455,8 +3464,8 @@ CPUArchState *cpu_copy(CPUArchState *env)
     /* Clone all break/watchpoints.
        Note: Once we support ptrace with hw-debug register access, make sure
        BP_CPU break/watchpoints are handled correctly on clone. */
-    QTAILQ_INIT(&cpu->breakpoints);
-    QTAILQ_INIT(&cpu->watchpoints);
+    QTAILQ_INIT(&new_cpu->breakpoints);
+    QTAILQ_INIT(&new_cpu->watchpoints);
 #if defined(TARGET_HAS_ICE)
     QTAILQ_FOREACH(bp, &cpu->breakpoints, entry) {
         cpu_breakpoint_insert(new_cpu, bp->pc, bp->flags, NULL);
@@ -3536,6 +3545,15 @@ static void handle_arg_stack_size(const char *arg)
     }
 }
 
+static void handle_arg_tb_size(const char *arg)
+{
+    char *p;
+    tb_size = strtoul(arg, &p, 0);
+    if (tb_size == 0 || *p != '\0') {
+        usage();
+    }
+}
+
 static void handle_arg_ld_prefix(const char *arg)
 {
     interp_prefix = strdup(arg);
@@ -3627,6 +3645,15 @@ static void handle_arg_strace(const char *arg)
     do_strace = 1;
 }
 
+static void handle_arg_libcall(const char *arg)
+{
+    if (!libcall_supported()) {
+        fprintf(stderr, "-libcall is not supported for this target\n");
+        exit(1);
+    }
+    libcall_enabled = 1;
+}
+
 #ifdef HAS_TRACEWRAP
 static void handle_trace_filename(const char *arg)
 {
@@ -3661,6 +3688,9 @@ static const struct qemu_argument arg_table[] = {
      "size",       "set the stack size to 'size' bytes"},
     {"cpu",        "QEMU_CPU",         true,  handle_arg_cpu,
      "model",      "select CPU (-cpu help for list)"},
+    {"tb-size",    "QEMU_TB_SIZE",     true,  handle_arg_tb_size,
+     "size",       "set TB translation cache size to 'size' MiB "
+     "(default: grow as needed)"},
     {"E",          "QEMU_SET_ENV",     true,  handle_arg_set_env,
      "var=value",  "sets targets environment variable (see below)"},
     {"U",          "QEMU_UNSET_ENV",   true,  handle_arg_unset_env,
@@ -3686,6 +3716,9 @@ static const struct qemu_argument arg_table[] = {
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+    {"libcall",    "QEMU_LIBCALL",     false, handle_arg_libcall,
+     "",           "run the guest's memcpy, memset, strlen and memcmp "
+     "on the host (static, unstripped programs only)"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
 #ifdef HAS_TRACEWRAP
@@ -3877,6 +3910,15 @@ int main(int argc, char **argv, char **envp)
 
     optind = parse_args(argc, argv);
 
+    /* Calls run on the host are invisible to instruction level logging,
+       tracing and the debugger, so don't skip guest code when any of
+       them is in use.  */
+#ifdef HAS_TRACEWRAP
+    libcall_enabled = 0;
+#endif
+    if (qemu_log_enabled() || gdbstub_port) {
+        libcall_enabled = 0;
+    }
 
     /* Zero out regs */
     memset(regs, 0, sizeof(struct target_pt_regs));
@@ -3928,7 +3970,7 @@ int main(int argc, char **argv, char **envp)
         cpu_model = "any";
 #endif
     }
-    tcg_exec_init(0);
+    tcg_exec_init(tb_size * 1024 * 1024);
     cpu_exec_init_all();
     /* NOTE: we need to init the CPU at this stage to get
        qemu_host_page_size */
@@ -4044,6 +4086,10 @@ int main(int argc, char **argv, char **envp)
         _exit(1);
     }
 
+    if (libcall_enabled) {
+        libcall_insert_breakpoints(cpu);
+    }
+
     for (wrk = target_environ; *wrk; wrk++) {
         free(*wrk);
     }
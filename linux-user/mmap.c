@@ -66,6 +66,236 @@ void mmap_fork_end(int child)
         pthread_mutex_unlock(&mmap_mutex);
 }
 
+/* A file mapping whose offset is not congruent with its address modulo
+   the host page size cannot be mapped directly.  Instead of reading the
+   whole range in when it is mapped, the host pages lying entirely inside
+   it are left inaccessible and flagged PAGE_LAZY, and the file is mapped
+   privately elsewhere.  Each such page is copied from there the first
+   time it is touched, either from the SIGSEGV handler or when
+   page_check_range() validates a buffer.  The copy is made in a staging
+   page that then replaces the guest page in one step, so other threads
+   never see it half filled.
+
+   Regions are kept newest first, so the first one covering a lazy page
+   is the one it belongs to.  */
+typedef struct MmapLazyRegion {
+    abi_ulong start;            /* host page aligned */
+    abi_ulong end;              /* host page aligned */
+    abi_ulong data_end;         /* pages past the end of file stay zero */
+    void *file_map;             /* private mapping of the file range */
+    size_t file_map_len;
+    char *file_data;            /* file data for guest address START */
+    unsigned long nb_lazy;      /* pages not read in yet */
+    QLIST_ENTRY(MmapLazyRegion) next;
+} MmapLazyRegion;
+
+static QLIST_HEAD(, MmapLazyRegion) mmap_lazy_regions =
+    QLIST_HEAD_INITIALIZER(mmap_lazy_regions);
+
+static MmapLazyRegion *mmap_lazy_find(abi_ulong addr)
+{
+    MmapLazyRegion *r;
+
+    QLIST_FOREACH(r, &mmap_lazy_regions, next) {
+        if (addr >= r->start && addr < r->end) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static void mmap_lazy_release(MmapLazyRegion *r)
+{
+    if (r->file_map) {
+        munmap(r->file_map, r->file_map_len);
+        r->file_map = NULL;
+    }
+}
+
+/* Prepare lazy loading of the host pages in [start, end) from FD at
+   OFFSET.  Returns NULL if the file cannot be mapped, in which case the
+   caller has to read the data itself.  */
+static MmapLazyRegion *mmap_lazy_new(abi_ulong start, abi_ulong end,
+                                     int fd, abi_ulong offset)
+{
+    MmapLazyRegion *r;
+    struct stat sb;
+    abi_ulong map_offset, data_end;
+    void *p;
+
+    if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) ||
+        sb.st_size <= offset) {
+        return NULL;
+    }
+    data_end = end;
+    if (sb.st_size - offset < end - start) {
+        data_end = start + (sb.st_size - offset);
+    }
+
+    map_offset = offset & ~(qemu_real_host_page_size - 1);
+    r = g_malloc0(sizeof(*r));
+    r->file_map_len = data_end - start + offset - map_offset;
+    p = mmap(NULL, r->file_map_len, PROT_READ, MAP_PRIVATE, fd, map_offset);
+    if (p == MAP_FAILED) {
+        g_free(r);
+        return NULL;
+    }
+    r->start = start;
+    r->end = end;
+    r->data_end = data_end;
+    r->file_map = p;
+    r->file_data = (char *)p + offset - map_offset;
+    return r;
+}
+
+/* Make the pages of R inaccessible until they are read in.  PROT is the
+   protection the guest asked for; the pages must already have it.  */
+static void mmap_lazy_install(MmapLazyRegion *r, int prot)
+{
+    mprotect(g2h(r->start), r->end - r->start, PROT_NONE);
+    page_set_flags(r->start, r->end, prot | PAGE_VALID | PAGE_LAZY);
+    r->nb_lazy = (r->end - r->start) / qemu_host_page_size;
+    QLIST_INSERT_HEAD(&mmap_lazy_regions, r, next);
+}
+
+/* Read in the host page at PAGE, which belongs to R.  */
+static int mmap_lazy_load(MmapLazyRegion *r, abi_ulong page)
+{
+    abi_ulong page_end = page + qemu_host_page_size;
+    abi_ulong addr;
+    int prot, flags;
+    void *p;
+
+    if (!r->file_map) {
+        return -1;
+    }
+    prot = 0;
+    for (addr = page; addr < page_end; addr += TARGET_PAGE_SIZE) {
+        prot |= page_get_flags(addr);
+    }
+    p = mmap(NULL, qemu_host_page_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    if (page < r->data_end) {
+        memcpy(p, r->file_data + (page - r->start),
+               MIN(page_end, r->data_end) - page);
+    }
+    if (mprotect(p, qemu_host_page_size, prot & PAGE_BITS) != 0 ||
+        mremap(p, qemu_host_page_size, qemu_host_page_size,
+               MREMAP_MAYMOVE | MREMAP_FIXED, g2h(page)) == MAP_FAILED) {
+        munmap(p, qemu_host_page_size);
+        return -1;
+    }
+
+    for (addr = page; addr < page_end; addr += TARGET_PAGE_SIZE) {
+        flags = page_get_flags(addr);
+        if (flags & PAGE_LAZY) {
+            page_set_flags(addr, addr + TARGET_PAGE_SIZE, flags & ~PAGE_LAZY);
+        }
+    }
+    if (--r->nb_lazy == 0) {
+        mmap_lazy_release(r);
+    }
+    return 0;
+}
+
+/* Read in the pages of [start, start + len) whose loading was deferred.
+   Must be called before anything accesses them other than through the
+   guest MMU, which is caught by mmap_populate_fault().  */
+int mmap_populate(target_ulong start, target_ulong len)
+{
+    abi_ulong addr, end;
+    MmapLazyRegion *r;
+    int ret = 0;
+
+    if (QLIST_EMPTY(&mmap_lazy_regions) || len == 0) {
+        return 0;
+    }
+    mmap_lock();
+    end = HOST_PAGE_ALIGN(start + len);
+    for (addr = start & qemu_host_page_mask; addr != end;
+         addr += qemu_host_page_size) {
+        if (!(page_get_flags(addr) & PAGE_LAZY)) {
+            continue;
+        }
+        r = mmap_lazy_find(addr);
+        if (!r || mmap_lazy_load(r, addr) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    mmap_unlock();
+    return ret;
+}
+
+/* Called from the SIGSEGV handler.  Returns true if ADDRESS was in a page
+   that has now been read in, so the faulting access can be restarted.  */
+bool mmap_populate_fault(target_ulong address, int is_write)
+{
+    MmapLazyRegion *r;
+    abi_ulong page;
+    int flags;
+    bool ret = false;
+
+    if (QLIST_EMPTY(&mmap_lazy_regions)) {
+        return false;
+    }
+    mmap_lock();
+    r = mmap_lazy_find(address);
+    if (r) {
+        page = address & qemu_host_page_mask;
+        flags = page_get_flags(address);
+        if (flags & PAGE_LAZY) {
+            ret = mmap_lazy_load(r, page) == 0;
+        } else {
+            /* another thread may have loaded it in the meantime */
+            ret = (flags & (is_write ? PAGE_WRITE : PAGE_READ)) != 0;
+        }
+    }
+    mmap_unlock();
+    return ret;
+}
+
+/* The guest range [start, end) is about to be unmapped or replaced.
+   Host pages it only partly covers keep the rest of their contents, so
+   read those in; forget about the lazy pages it covers entirely.  */
+static void mmap_lazy_drop(abi_ulong start, abi_ulong end)
+{
+    MmapLazyRegion *r, *next;
+    abi_ulong real_start, real_end, addr;
+
+    if (QLIST_EMPTY(&mmap_lazy_regions)) {
+        return;
+    }
+    real_start = HOST_PAGE_ALIGN(start);
+    real_end = end & qemu_host_page_mask;
+    if (start < real_start) {
+        mmap_populate(start, 1);
+    }
+    if (end > real_end) {
+        mmap_populate(real_end, 1);
+    }
+
+    QLIST_FOREACH(r, &mmap_lazy_regions, next) {
+        for (addr = MAX(r->start, real_start); addr < MIN(r->end, real_end);
+             addr += qemu_host_page_size) {
+            if ((page_get_flags(addr) & PAGE_LAZY)
+                && mmap_lazy_find(addr) == r && --r->nb_lazy == 0) {
+                mmap_lazy_release(r);
+            }
+        }
+    }
+    QLIST_FOREACH_SAFE(r, &mmap_lazy_regions, next, next) {
+        if (r->start >= real_start && r->end <= real_end) {
+            mmap_lazy_release(r);
+            QLIST_REMOVE(r, next);
+            g_free(r);
+        }
+    }
+}
+
 /* NOTE: all the constants are the HOST ones, but addresses are target. */
 int target_mprotect(abi_ulong start, abi_ulong len, int prot)
 {
@@ -91,6 +321,10 @@ int target_mprotect(abi_ulong start, abi_ulong len, int prot)
         return 0;
 
     mmap_lock();
+    if (mmap_populate(start, len) < 0) {
+        ret = -ENOMEM;
+        goto error;
+    }
     host_start = start & qemu_host_page_mask;
     host_end = HOST_PAGE_ALIGN(end);
     if (start > host_start) {
@@ -497,10 +731,16 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
             goto fail;
         }
 
+        mmap_lazy_drop(start, end);
+
         /* worst case: we cannot map the file because the offset is not
-           aligned, so we read it */
+           aligned, so we copy it.  Only the partial host pages at either
+           end are read now; the others are read in on first access.  */
         if (!(flags & MAP_ANONYMOUS) &&
             (offset & ~qemu_host_page_mask) != (start & ~qemu_host_page_mask)) {
+            MmapLazyRegion *lazy = NULL;
+            abi_ulong lazy_start, lazy_end;
+
             /* msync() won't work here, so we return an error if write is
                possible while it is a shared mapping */
             if ((flags & MAP_TYPE) == MAP_SHARED &&
@@ -508,21 +748,48 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
                 errno = EINVAL;
                 goto fail;
             }
+            lazy_start = HOST_PAGE_ALIGN(start);
+            lazy_end = end & qemu_host_page_mask;
+            if (lazy_start < lazy_end) {
+                lazy = mmap_lazy_new(lazy_start, lazy_end, fd,
+                                     offset + lazy_start - start);
+            }
             retaddr = target_mmap(start, len, prot | PROT_WRITE,
                                   MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS,
                                   -1, 0);
-            if (retaddr == -1)
-                goto fail;
-            if (pread(fd, g2h(start), len, offset) == -1)
+            if (retaddr == -1) {
+                goto fail_lazy;
+            }
+            if (lazy) {
+                if (pread(fd, g2h(start), lazy_start - start, offset) == -1 ||
+                    pread(fd, g2h(lazy_end), end - lazy_end,
+                          offset + lazy_end - start) == -1) {
+                    goto fail_lazy;
+                }
+            } else if (pread(fd, g2h(start), len, offset) == -1) {
                 goto fail;
+            }
             if (!(prot & PROT_WRITE)) {
                 ret = target_mprotect(start, len, prot);
                 if (ret != 0) {
+                    if (lazy) {
+                        mmap_lazy_release(lazy);
+                        g_free(lazy);
+                    }
                     start = ret;
                     goto the_end;
                 }
             }
+            if (lazy) {
+                mmap_lazy_install(lazy, prot);
+            }
             goto the_end;
+        fail_lazy:
+            if (lazy) {
+                mmap_lazy_release(lazy);
+                g_free(lazy);
+            }
+            goto fail;
         }
         
         /* handle the start of the mapping */
@@ -640,6 +907,7 @@ int target_munmap(abi_ulong start, abi_ulong len)
         return -EINVAL;
     mmap_lock();
     end = start + len;
+    mmap_lazy_drop(start, end);
     real_start = start & qemu_host_page_mask;
     real_end = HOST_PAGE_ALIGN(end);
 
@@ -694,7 +962,15 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
 
     mmap_lock();
 
+    /* the pages move or are resized on the host, so they cannot stay lazy */
+    if (mmap_populate(old_addr, old_size) < 0) {
+        mmap_unlock();
+        errno = ENOMEM;
+        return -1;
+    }
+
     if (flags & MREMAP_FIXED) {
+        mmap_lazy_drop(new_addr, new_addr + new_size);
         host_addr = (void *) syscall(__NR_mremap, g2h(old_addr),
                                      old_size, new_size,
                                      flags,
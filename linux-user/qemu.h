@@ -225,6 +225,13 @@ void print_syscall(int num,
 void print_syscall_ret(int num, abi_long arg1);
 extern int do_strace;
 
+/* libcall.c */
+extern int libcall_enabled;
+bool libcall_supported(void);
+void libcall_register_symbol(const char *name, abi_ulong addr);
+void libcall_insert_breakpoints(CPUState *cpu);
+bool libcall_dispatch(CPUArchState *env);
+
 /* signal.c */
 void process_pending_signals(CPUArchState *cpu_env);
 void signal_init(void);
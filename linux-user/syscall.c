@@ -1709,8 +1709,15 @@ static abi_long do_getsockopt(int sockfd, int level, int optname,
     return ret;
 }
 
+/* Number of iovec entries that lock_iovec() translates into the caller's
+   on-stack array before falling back to the heap.  */
+#define LOCK_IOVEC_STACK 16
+
+/* Translate a guest iovec array into a host one.  STACK_VEC must have room
+   for LOCK_IOVEC_STACK entries; it is used instead of a heap allocation
+   for small arrays.  The result must be released with unlock_iovec().  */
 static struct iovec *lock_iovec(int type, abi_ulong target_addr,
-                                int count, int copy)
+                                int count, int copy, struct iovec *stack_vec)
 {
     struct target_iovec *target_vec;
     struct iovec *vec;
@@ -1727,22 +1734,27 @@ static struct iovec *lock_iovec(int type, abi_ulong target_addr,
         return NULL;
     }
 
-    vec = calloc(count, sizeof(struct iovec));
-    if (vec == NULL) {
-        errno = ENOMEM;
-        return NULL;
-    }
-
     target_vec = lock_user(VERIFY_READ, target_addr,
                            count * sizeof(struct target_iovec), 1);
     if (target_vec == NULL) {
-        err = EFAULT;
-        goto fail2;
+        errno = EFAULT;
+        return NULL;
     }
 
     /* ??? If host page size > target page size, this will result in a
        value larger than what we can actually support.  */
     max_len = 0x7fffffff & TARGET_PAGE_MASK;
+
+    if (count <= LOCK_IOVEC_STACK) {
+        vec = stack_vec;
+    } else {
+        vec = calloc(count, sizeof(struct iovec));
+        if (vec == NULL) {
+            err = ENOMEM;
+            goto fail2;
+        }
+    }
+
     total_len = 0;
 
     for (i = 0; i < count; i++) {
@@ -1773,16 +1785,19 @@ static struct iovec *lock_iovec(int type, abi_ulong target_addr,
     return vec;
 
  fail:
-    unlock_user(target_vec, target_addr, 0);
+    if (vec != stack_vec) {
+        free(vec);
+    }
  fail2:
-    free(vec);
+    unlock_user(target_vec, target_addr, 0);
     errno = err;
     return NULL;
 }
 
 static void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
-                         int count, int copy)
+                         int count, int copy, struct iovec *stack_vec)
 {
+#ifdef DEBUG_REMAP
     struct target_iovec *target_vec;
     int i;
 
@@ -1791,7 +1806,7 @@ static void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
     if (target_vec) {
         for (i = 0; i < count; i++) {
             abi_ulong base = tswapal(target_vec[i].iov_base);
-            abi_long len = tswapal(target_vec[i].iov_base);
+            abi_long len = tswapal(target_vec[i].iov_len);
             if (len < 0) {
                 break;
             }
@@ -1799,8 +1814,11 @@ static void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
         }
         unlock_user(target_vec, target_addr, 0);
     }
+#endif
 
-    free(vec);
+    if (vec != stack_vec) {
+        free(vec);
+    }
 }
 
 static inline int target_to_host_sock_type(int *type)
@@ -1920,6 +1938,7 @@ static abi_long do_sendrecvmsg_locked(int fd, struct target_msghdr *msgp,
     struct msghdr msg;
     int count;
     struct iovec *vec;
+    struct iovec stack_vec[LOCK_IOVEC_STACK];
     abi_ulong target_vec;
 
     if (msgp->msg_name) {
@@ -1941,7 +1960,7 @@ static abi_long do_sendrecvmsg_locked(int fd, struct target_msghdr *msgp,
     count = tswapal(msgp->msg_iovlen);
     target_vec = tswapal(msgp->msg_iov);
     vec = lock_iovec(send ? VERIFY_READ : VERIFY_WRITE,
-                     target_vec, count, send);
+                     target_vec, count, send, stack_vec);
     if (vec == NULL) {
         ret = -host_to_target_errno(errno);
         goto out2;
@@ -1974,7 +1993,7 @@ static abi_long do_sendrecvmsg_locked(int fd, struct target_msghdr *msgp,
     }
 
 out:
-    unlock_iovec(vec, target_vec, count, !send);
+    unlock_iovec(vec, target_vec, count, !send, stack_vec);
 out2:
     return ret;
 }
@@ -2976,9 +2995,12 @@ static inline abi_ulong do_shmat(int shmid, abi_ulong shmaddr, int shmflg)
 
     mmap_lock();
 
-    if (shmaddr)
+    if (shmaddr) {
+        /* the kernel replaces the pages in place; read in any deferred
+           file data first so that the lazy bookkeeping stays right */
+        mmap_populate(shmaddr, shm_info.shm_segsz);
         host_raddr = shmat(shmid, (void *)g2h(shmaddr), shmflg);
-    else {
+    } else {
         abi_ulong mmap_start;
 
         mmap_start = mmap_find_vma(0, shm_info.shm_segsz);
@@ -4907,6 +4929,8 @@ static int do_futex(target_ulong uaddr, int op, int val, target_ulong timeout,
 #else
     base_op = op;
 #endif
+    /* the kernel accesses the futex words directly */
+    mmap_populate(uaddr, sizeof(uint32_t));
     switch (base_op) {
     case FUTEX_WAIT:
     case FUTEX_WAIT_BITSET:
@@ -4931,6 +4955,7 @@ static int do_futex(target_ulong uaddr, int op, int val, target_ulong timeout,
            to satisfy the compiler.  We do not need to tswap TIMEOUT
            since it's not compared to guest memory.  */
         pts = (struct timespec *)(uintptr_t) timeout;
+        mmap_populate(uaddr2, sizeof(uint32_t));
         return get_errno(sys_futex(g2h(uaddr), op, val, pts,
                                    g2h(uaddr2),
                                    (base_op == FUTEX_CMP_REQUEUE
@@ -5262,6 +5287,15 @@ static int do_open(void *cpu_env, const char *pathname, int flags, mode_t mode)
     return get_errno(open(path(pathname), flags, mode));
 }
 
+/* Report translation statistics before the whole process exits.  */
+static void log_exit_stats(void)
+{
+    if (qemu_loglevel_mask(CPU_LOG_TB_STATS)) {
+        dump_tb_stats(qemu_logfile, fprintf);
+        qemu_log_flush();
+    }
+}
+
 /* do_syscall() should always have a single exit point at the end so
    that actions, such as logging of syscall results, can be performed.
    All errnos that do_syscall() returns must be -TARGET_<errcode>. */
@@ -5311,6 +5345,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        log_exit_stats();
         gdb_exit(cpu_env, arg1);
         _exit(arg1);
         ret = 0; /* avoid warning */
@@ -6628,11 +6663,14 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         /* ??? msync/mlock/munlock are broken for softmmu.  */
 #ifdef TARGET_NR_msync
     case TARGET_NR_msync:
+        mmap_populate(arg1, arg2);
         ret = get_errno(msync(g2h(arg1), arg2, arg3));
         break;
 #endif
 #ifdef TARGET_NR_mlock
     case TARGET_NR_mlock:
+        /* a lazy page read in later would not be locked */
+        mmap_populate(arg1, arg2);
         ret = get_errno(mlock(g2h(arg1), arg2));
         break;
 #endif
@@ -7117,6 +7155,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef HAS_TRACEWRAP
         qemu_trace_finish(arg1);
 #endif //HAS_TRACEWRAP
+        log_exit_stats();
         gdb_exit(cpu_env, arg1);
         ret = get_errno(exit_group(arg1));
         break;
@@ -7453,10 +7492,12 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         break;
     case TARGET_NR_readv:
         {
-            struct iovec *vec = lock_iovec(VERIFY_WRITE, arg2, arg3, 0);
+            struct iovec stack_vec[LOCK_IOVEC_STACK];
+            struct iovec *vec = lock_iovec(VERIFY_WRITE, arg2, arg3, 0,
+                                           stack_vec);
             if (vec != NULL) {
                 ret = get_errno(readv(arg1, vec, arg3));
-                unlock_iovec(vec, arg2, arg3, 1);
+                unlock_iovec(vec, arg2, arg3, 1, stack_vec);
             } else {
                 ret = -host_to_target_errno(errno);
             }
@@ -7464,10 +7505,12 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         break;
     case TARGET_NR_writev:
         {
-            struct iovec *vec = lock_iovec(VERIFY_READ, arg2, arg3, 1);
+            struct iovec stack_vec[LOCK_IOVEC_STACK];
+            struct iovec *vec = lock_iovec(VERIFY_READ, arg2, arg3, 1,
+                                           stack_vec);
             if (vec != NULL) {
                 ret = get_errno(writev(arg1, vec, arg3));
-                unlock_iovec(vec, arg2, arg3, 0);
+                unlock_iovec(vec, arg2, arg3, 0, stack_vec);
             } else {
                 ret = -host_to_target_errno(errno);
             }
@@ -9024,10 +9067,12 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_NR_vmsplice
 	case TARGET_NR_vmsplice:
         {
-            struct iovec *vec = lock_iovec(VERIFY_READ, arg2, arg3, 1);
+            struct iovec stack_vec[LOCK_IOVEC_STACK];
+            struct iovec *vec = lock_iovec(VERIFY_READ, arg2, arg3, 1,
+                                           stack_vec);
             if (vec != NULL) {
                 ret = get_errno(vmsplice(arg1, vec, arg3, arg4));
-                unlock_iovec(vec, arg2, arg3, 0);
+                unlock_iovec(vec, arg2, arg3, 0, stack_vec);
             } else {
                 ret = -host_to_target_errno(errno);
             }
@@ -0,0 +1,142 @@
+/*
+ * QEMU live migration to and from a file with RAM at fixed offsets
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "qemu/bswap.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "block/block.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/*
+ * The file starts with a header, followed by an image of guest RAM in
+ * which every page has a fixed place, and then by the migration stream
+ * without the RAM pages:
+ *
+ *   0                  header
+ *   FILE_RAM_BASE      RAM image, see ram_file_area_size()
+ *   stream_offset      migration stream
+ *
+ * Pages dirtied again during the migration are overwritten in place, so
+ * the file does not grow beyond the size of RAM, and the destination can
+ * map the image instead of reading it.
+ */
+#define FILE_MAGIC      0x51454d46      /* "QEMF" */
+#define FILE_VERSION    1
+/* Keeps the RAM image aligned for mmap, even with huge host pages */
+#define FILE_RAM_BASE   (2 * 1024 * 1024)
+
+typedef struct QEMU_PACKED FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t stream_offset;
+} FileHeader;
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    FileHeader hdr;
+    uint64_t ram_size = ram_file_area_size();
+    uint64_t stream_offset = FILE_RAM_BASE + ROUND_UP(ram_size, FILE_RAM_BASE);
+    struct stat st;
+    int fd;
+
+    DPRINTF("Writing migration to %s\n", path);
+
+    /* Guest RAM may still be mapped from the file it was restored from,
+     * and truncating that file would take the pages away from the guest.
+     * Write a new file under the same name instead.
+     */
+    if (stat(path, &st) == 0 && ram_file_is_mapped(&st) && unlink(path) < 0) {
+        error_setg_errno(errp, errno, "failed to replace '%s'", path);
+        return;
+    }
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    hdr.magic = cpu_to_be32(FILE_MAGIC);
+    hdr.version = cpu_to_be32(FILE_VERSION);
+    hdr.stream_offset = cpu_to_be64(stream_offset);
+    if (qemu_write_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        lseek(fd, stream_offset, SEEK_SET) != stream_offset) {
+        error_setg_errno(errp, errno, "failed to write '%s'", path);
+        qemu_close(fd);
+        return;
+    }
+
+    s->ram_file_fd = fd;
+    s->ram_file_base = FILE_RAM_BASE;
+    s->ram_file_size = ram_size;
+    s->file = qemu_fdopen(fd, "wb");
+
+    migrate_fd_connect(s);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler2(qemu_get_fd(f), NULL, NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    FileHeader hdr;
+    uint64_t stream_offset;
+    QEMUFile *f;
+    int fd;
+
+    DPRINTF("Attempting to start an incoming migration from %s\n", path);
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        be32_to_cpu(hdr.magic) != FILE_MAGIC) {
+        error_setg(errp, "'%s' is not a migration file", path);
+        qemu_close(fd);
+        return;
+    }
+    if (be32_to_cpu(hdr.version) != FILE_VERSION) {
+        error_setg(errp, "'%s' has unsupported version %" PRIu32, path,
+                   be32_to_cpu(hdr.version));
+        qemu_close(fd);
+        return;
+    }
+
+    stream_offset = be64_to_cpu(hdr.stream_offset);
+    if (lseek(fd, stream_offset, SEEK_SET) != stream_offset) {
+        error_setg_errno(errp, errno, "failed to read '%s'", path);
+        qemu_close(fd);
+        return;
+    }
+
+    ram_file_incoming(fd, FILE_RAM_BASE);
+    f = qemu_fdopen(fd, "rb");
+    qemu_set_fd_handler2(fd, NULL, file_accept_incoming_migration, NULL, f);
+}
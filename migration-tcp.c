@@ -19,6 +19,7 @@
 #include "migration/qemu-file.h"
 #include "block/block.h"
 #include "qemu/main-loop.h"
+#include "qemu/error-report.h"
 
 //#define DEBUG_MIGRATION_TCP
 
@@ -30,6 +31,39 @@
     do { } while (0)
 #endif
 
+/*
+ * With more than one channel configured, RAM pages travel on that many
+ * extra connections, opened once the main one is established.  The
+ * destination tells them apart by the order in which it accepts them.
+ */
+
+static char *outgoing_host_port;
+
+static int tcp_open_ram_channels(MigrationState *s)
+{
+    Error *local_err = NULL;
+    QEMUFile *f;
+    int i, fd;
+
+    s->ram_channels = g_new0(QEMUFile *, s->channels);
+    for (i = 0; i < s->channels; i++) {
+        fd = inet_connect(outgoing_host_port, &local_err);
+        if (fd < 0) {
+            error_report("migration: could not open RAM channel %d: %s",
+                         i, error_get_pretty(local_err));
+            error_free(local_err);
+            return -1;
+        }
+
+        f = qemu_fopen_socket(fd, "wb");
+        qemu_put_be32(f, QEMU_VM_CHANNEL_MAGIC);
+        qemu_put_be32(f, i);
+        qemu_fflush(f);
+        s->ram_channels[s->nb_ram_channels++] = f;
+    }
+    return 0;
+}
+
 static void tcp_wait_for_connect(int fd, void *opaque)
 {
     MigrationState *s = opaque;
@@ -41,15 +75,54 @@ static void tcp_wait_for_connect(int fd, void *opaque)
     } else {
         DPRINTF("migrate connect success\n");
         s->file = qemu_fopen_socket(fd, "wb");
+        if (s->channels > 1 && tcp_open_ram_channels(s) < 0) {
+            migrate_close_ram_channels(s);
+            qemu_fclose(s->file);
+            s->file = NULL;
+            migrate_fd_error(s);
+            return;
+        }
         migrate_fd_connect(s);
     }
 }
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    g_free(outgoing_host_port);
+    outgoing_host_port = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+/* The main connection, held back until all RAM channels are accepted */
+static QEMUFile *incoming_file;
+static int incoming_channels;
+
+static int tcp_accept_ram_channel(int c)
+{
+    QEMUFile *f;
+    uint32_t magic, nr;
+
+    qemu_set_block(c);
+    f = qemu_fopen_socket(c, "rb");
+    if (f == NULL) {
+        closesocket(c);
+        return -1;
+    }
+
+    magic = qemu_get_be32(f);
+    nr = qemu_get_be32(f);
+    if (qemu_file_get_error(f) || magic != QEMU_VM_CHANNEL_MAGIC ||
+        nr != incoming_channels) {
+        fprintf(stderr, "invalid migration RAM channel\n");
+        qemu_fclose(f);
+        return -1;
+    }
+
+    ram_channel_incoming(f);
+    incoming_channels++;
+    return 0;
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -61,27 +134,56 @@ static void tcp_accept_incoming_migration(void *opaque)
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && socket_error() == EINTR);
-    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c == -1) {
         fprintf(stderr, "could not accept migration connection\n");
-        goto out;
+        goto fail;
+    }
+
+    if (incoming_file) {
+        if (tcp_accept_ram_channel(c) < 0) {
+            goto fail;
+        }
+        if (incoming_channels < migrate_channels()) {
+            return;
+        }
+        qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+        closesocket(s);
+        f = incoming_file;
+        incoming_file = NULL;
+        process_incoming_migration(f);
+        return;
     }
 
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         fprintf(stderr, "could not qemu_fopen socket\n");
-        goto out;
+        closesocket(c);
+        goto fail;
     }
 
+    if (migrate_channels() > 1) {
+        /* keep listening for the RAM channels */
+        incoming_file = f;
+        incoming_channels = 0;
+        return;
+    }
+
+    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+    closesocket(s);
     process_incoming_migration(f);
     return;
 
-out:
-    closesocket(c);
+fail:
+    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+    closesocket(s);
+    if (incoming_file) {
+        qemu_fclose(incoming_file);
+        incoming_file = NULL;
+        ram_load_cleanup();
+    }
 }
 
 void tcp_start_incoming_migration(const char *host_port, Error **errp)
@@ -16,6 +16,7 @@
 #include "qemu-common.h"
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
+#include "migration/page_compress.h"
 #include "monitor/monitor.h"
 #include "migration/qemu-file.h"
 #include "sysemu/sysemu.h"
@@ -23,6 +24,7 @@
 #include "qemu/sockets.h"
 #include "migration/block.h"
 #include "qemu/thread.h"
+#include "qemu/error-report.h"
 #include "qmp-commands.h"
 #include "trace.h"
 
@@ -34,6 +36,7 @@ enum {
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
     MIG_STATE_COMPLETED,
+    MIG_STATE_POSTCOPY_ACTIVE,
 };
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
@@ -46,6 +49,12 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Upper limit on the number of RAM save/load threads */
+#define MAX_MIGRATE_RAM_THREADS 64
+
+/* Upper limit on the number of RAM channels */
+#define MAX_MIGRATE_CHANNELS 16
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -59,7 +68,12 @@ MigrationState *migrate_get_current(void)
         .state = MIG_STATE_NONE,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .ram_threads = 1,
+        .channels = 1,
+        .compress_level = 1,
+        .compress_method = MIGRATION_COMPRESS_METHOD_ZLIB,
         .mbps = -1,
+        .ram_file_fd = -1,
     };
 
     return &current_migration;
@@ -82,6 +96,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     else if (strstart(uri, "fd:", &p))
         fd_start_incoming_migration(p, errp);
+    else if (strstart(uri, "file:", &p))
+        file_start_incoming_migration(p, errp);
 #endif
     else {
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -95,8 +111,11 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
-    qemu_fclose(f);
-    free_xbzrle_decoded_buf();
+    /* with post-copy, the rest of the stream carries RAM pages */
+    if (!ram_postcopy_incoming_started()) {
+        qemu_fclose(f);
+    }
+    ram_load_cleanup();
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(EXIT_FAILURE);
@@ -165,15 +184,47 @@ MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
     return head;
 }
 
+static void get_ram_thread_stats(MigrationInfo *info)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->ram_threads > 1) {
+        info->has_ram_threads = true;
+        info->ram_threads = g_malloc0(sizeof(*info->ram_threads));
+        info->ram_threads->threads = s->ram_threads;
+        info->ram_threads->pages = ram_thread_pages_transferred();
+        info->ram_threads->bytes = ram_thread_bytes_transferred();
+        info->ram_threads->wait_time = ram_thread_wait_time();
+    }
+}
+
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->bytes = compress_mig_bytes_transferred();
+        info->compression->compression_rate = compress_mig_rate();
+    }
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
+    uint64_t lookups;
+
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        lookups = info->xbzrle_cache->cache_hit +
+                  info->xbzrle_cache->cache_miss;
+        info->xbzrle_cache->cache_hit_rate =
+            lookups ? (double)info->xbzrle_cache->cache_hit / lookups : 0;
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
@@ -194,8 +245,13 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
     case MIG_STATE_CANCELLING:
+    case MIG_STATE_POSTCOPY_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        if (s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+            info->status = g_strdup("postcopy-active");
+        } else {
+            info->status = g_strdup("active");
+        }
         info->has_total_time = true;
         info->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
             - s->total_time;
@@ -215,6 +271,12 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
         info->ram->mbps = s->mbps;
+        info->ram->dirty_sync_count = ram_dirty_sync_count();
+        info->ram->dirty_sync_time = ram_dirty_sync_time();
+        if (s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+            info->ram->has_postcopy_requests = true;
+            info->ram->postcopy_requests = ram_postcopy_requests();
+        }
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -225,9 +287,13 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_ram_thread_stats(info);
+        get_compression_stats(info);
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_ram_thread_stats(info);
+        get_compression_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -248,6 +314,12 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->mbps = s->mbps;
+        info->ram->dirty_sync_count = ram_dirty_sync_count();
+        info->ram->dirty_sync_time = ram_dirty_sync_time();
+        if (s->start_postcopy) {
+            info->ram->has_postcopy_requests = true;
+            info->ram->postcopy_requests = ram_postcopy_requests();
+        }
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -268,7 +340,8 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -313,9 +386,24 @@ static void migrate_fd_cleanup(void *opaque)
         }
     }
 
+    /* only after qemu_savevm_state_cancel, which stops the RAM threads */
+    migrate_close_ram_channels(s);
+
     notifier_list_notify(&migration_state_notifiers, s);
 }
 
+void migrate_close_ram_channels(MigrationState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_ram_channels; i++) {
+        qemu_fclose(s->ram_channels[i]);
+    }
+    g_free(s->ram_channels);
+    s->ram_channels = NULL;
+    s->nb_ram_channels = 0;
+}
+
 void migrate_fd_error(MigrationState *s)
 {
     trace_migrate_fd_error();
@@ -371,6 +459,10 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int ram_threads = s->ram_threads;
+    int channels = s->channels;
+    int compress_level = s->compress_level;
+    MigrationCompressMethod compress_method = s->compress_method;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -380,6 +472,11 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->ram_threads = ram_threads;
+    s->channels = channels;
+    s->compress_level = compress_level;
+    s->compress_method = compress_method;
+    s->ram_file_fd = -1;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -414,7 +511,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.shared = has_inc && inc;
 
     if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
-        s->state == MIG_STATE_CANCELLING) {
+        s->state == MIG_STATE_CANCELLING ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -443,6 +541,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -462,6 +562,22 @@ void qmp_migrate_cancel(Error **errp)
     migrate_fd_cancel(migrate_get_current());
 }
 
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_ram()) {
+        error_setg(errp, "Enable the postcopy-ram migration capability first");
+        return;
+    }
+    if (s->state != MIG_STATE_ACTIVE) {
+        error_setg(errp, "No migration is in its pre-copy phase");
+        return;
+    }
+
+    s->start_postcopy = true;
+}
+
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -496,6 +612,98 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
     return migrate_xbzrle_cache_size();
 }
 
+void qmp_migrate_set_threads(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (value < 1 || value > MAX_MIGRATE_RAM_THREADS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a number of threads between 1 and 64");
+        return;
+    }
+
+    s->ram_threads = value;
+}
+
+void qmp_migrate_set_channels(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (value < 1 || value > MAX_MIGRATE_CHANNELS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a number of channels between 1 and 16");
+        return;
+    }
+
+    s->channels = value;
+}
+
+void qmp_migrate_set_parameters(bool has_compress_level, int64_t compress_level,
+                                bool has_compress_method,
+                                MigrationCompressMethod compress_method,
+                                bool has_threads, int64_t threads,
+                                Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (has_compress_level && (compress_level < 1 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "a level between 1 and 9");
+        return;
+    }
+    if (has_compress_method &&
+        !page_compress_supported((PageCompressMethod)compress_method)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-method",
+                  "a method this QEMU was built with");
+        return;
+    }
+    if (has_threads && (threads < 1 || threads > MAX_MIGRATE_RAM_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "threads",
+                  "a number of threads between 1 and 64");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->compress_level = compress_level;
+    }
+    if (has_compress_method) {
+        s->compress_method = compress_method;
+    }
+    if (has_threads) {
+        s->ram_threads = threads;
+    }
+}
+
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationParameters *params = g_malloc0(sizeof(*params));
+
+    params->compress_level = s->compress_level;
+    params->compress_method = s->compress_method;
+    params->threads = s->ram_threads;
+
+    return params;
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -539,6 +747,24 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+}
+
+bool migrate_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -548,6 +774,33 @@ bool migrate_zero_blocks(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
 }
 
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_level;
+}
+
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_method;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -566,8 +819,98 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+int migrate_ram_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->ram_threads;
+}
+
+int migrate_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->channels;
+}
+
+/* The file that RAM goes to at fixed offsets, if the outgoing stream f
+   is part of one, or -1 */
+int migrate_get_ram_file(QEMUFile *f, uint64_t *base, uint64_t *size)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+    if (f != s->file) {
+        return -1;
+    }
+
+    *base = s->ram_file_base;
+    *size = s->ram_file_size;
+    return s->ram_file_fd;
+}
+
+/* The extra RAM channels opened alongside the outgoing stream f */
+int migrate_get_ram_channels(QEMUFile *f, QEMUFile ***channels)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+    if (f != s->file) {
+        return 0;
+    }
+
+    *channels = s->ram_channels;
+    return s->nb_ram_channels;
+}
+
 /* migration thread support */
 
+/*
+ * Stops the guest for good and hands it over to the destination, which
+ * fetches the pages still dirty as it needs them.  Returns false if the
+ * guest did not leave, true once the migration has ended either way.
+ */
+static bool migration_postcopy(MigrationState *s, QEMUFile *rp,
+                               int64_t *start_time)
+{
+    int ret;
+
+    qemu_mutex_lock_iothread();
+    *start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+
+    ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    if (ret >= 0) {
+        /* The destination takes over the persistent dirty bitmaps */
+        bdrv_store_dirty_bitmaps_all();
+        s->start_postcopy = true;
+        qemu_file_set_rate_limit(s->file, INT64_MAX);
+        ram_postcopy_begin();
+        qemu_savevm_state_complete_postcopy(s->file);
+    }
+    qemu_mutex_unlock_iothread();
+
+    if (ret < 0 || qemu_file_get_error(s->file)) {
+        migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+        return false;
+    }
+
+    /* the guest runs on the destination from now on */
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - *start_time;
+    migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_POSTCOPY_ACTIVE);
+
+    if (ram_postcopy_save(s->file, rp) < 0) {
+        migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE, MIG_STATE_ERROR);
+    } else {
+        migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE, MIG_STATE_COMPLETED);
+    }
+    return true;
+}
+
 static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -577,6 +920,16 @@ static void *migration_thread(void *opaque)
     int64_t max_size = 0;
     int64_t start_time = initial_time;
     bool old_vm_running = false;
+    bool postcopy = false;
+    QEMUFile *rp = NULL;
+
+    if (migrate_postcopy_ram()) {
+        rp = qemu_file_get_return_path(s->file);
+        if (!rp) {
+            error_report("migration: post-copy needs a socket transport");
+            qemu_file_set_error(s->file, -ENOTSUP);
+        }
+    }
 
     qemu_savevm_state_begin(s->file, &s->params);
 
@@ -590,7 +943,12 @@ static void *migration_thread(void *opaque)
         if (!qemu_file_rate_limit(s->file)) {
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             trace_migrate_pending(pending_size, max_size);
-            if (pending_size && pending_size >= max_size) {
+            if (pending_size && pending_size >= max_size && rp &&
+                (s->start_postcopy || ram_postcopy_ready())) {
+                old_vm_running = runstate_is_running();
+                postcopy = migration_postcopy(s, rp, &start_time);
+                break;
+            } else if (pending_size && pending_size >= max_size) {
                 qemu_savevm_state_iterate(s->file);
             } else {
                 int ret;
@@ -602,6 +960,9 @@ static void *migration_thread(void *opaque)
 
                 ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
                 if (ret >= 0) {
+                    /* The destination takes over the persistent dirty
+                     * bitmaps */
+                    bdrv_store_dirty_bitmaps_all();
                     qemu_file_set_rate_limit(s->file, INT64_MAX);
                     qemu_savevm_state_complete(s->file);
                 }
@@ -651,11 +1012,25 @@ static void *migration_thread(void *opaque)
         }
     }
 
+    if (rp) {
+        qemu_fclose(rp);
+    }
+
     qemu_mutex_lock_iothread();
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (!postcopy) {
+            s->downtime = end_time - start_time;
+        }
+        if (s->ram_file_fd >= 0 && old_vm_running) {
+            /* A snapshot to a file leaves the guest running here */
+            vm_start();
+        } else {
+            runstate_set(RUN_STATE_POSTMIGRATE);
+        }
+    } else if (postcopy) {
+        /* the guest may have run on the destination already */
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
         if (old_vm_running) {
@@ -680,6 +1055,10 @@ void migrate_fd_connect(MigrationState *s)
     qemu_file_set_rate_limit(s->file,
                              s->bandwidth_limit / XFER_LIMIT_RATIO);
 
+    if (migrate_zero_copy_send() && !qemu_file_enable_zerocopy(s->file)) {
+        error_report("zero-copy-send is not supported here, copying pages");
+    }
+
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
 
@@ -2923,6 +2923,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration xbzrle cache size",
         .mhandler.cmd = hmp_info_migrate_cache_size,
     },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .mhandler.cmd = hmp_info_migrate_parameters,
+    },
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the dirty page rate measured by migration",
+        .mhandler.cmd = hmp_info_dirty_rate,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
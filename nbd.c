@@ -60,10 +60,11 @@
 
 #define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_CHUNK_HEADER_SIZE   (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
-#define NBD_REPLY_MAGIC         0x67446698
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
 #define NBD_CLIENT_MAGIC        0x0000420281861253LL
+#define NBD_REP_MAGIC           0x0003e889045565a9LL
 
 #define NBD_SET_SOCK            _IO(0xab, 0)
 #define NBD_SET_BLKSIZE         _IO(0xab, 1)
@@ -78,6 +79,14 @@
 #define NBD_SET_FLAGS           _IO(0xab, 10)
 
 #define NBD_OPT_EXPORT_NAME     (1 << 0)
+#define NBD_OPT_STRUCTURED_REPLY 8
+
+#define NBD_REP_ACK             1
+#define NBD_REP_ERR_UNSUP       ((1U << 31) | 1)
+#define NBD_REP_ERR_INVALID     ((1U << 31) | 3)
+
+/* Longest option payload that the server is willing to skip */
+#define NBD_MAX_OPTION_SIZE     4096
 
 /* Definitions for opaque data types */
 
@@ -119,6 +128,7 @@ struct NBDClient {
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
+    bool structured_reply;
 };
 
 /* That's all folks */
@@ -215,20 +225,70 @@ static ssize_t write_sync(int fd, void *buffer, size_t size)
 
 */
 
+static int nbd_send_rep(int csock, uint32_t opt, uint32_t type)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+
+    /* Option reply (fixed newstyle only):
+        [ 0 ..   7]   NBD_REP_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   reply type
+        [16 ..  19]   length (0, no payload is ever sent)
+     */
+    cpu_to_be64w((uint64_t*)buf, NBD_REP_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), opt);
+    cpu_to_be32w((uint32_t*)(buf + 12), type);
+    cpu_to_be32w((uint32_t*)(buf + 16), 0);
+
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (rep)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_drop_option(int csock, uint32_t length)
+{
+    char buf[256];
+    uint32_t len;
+
+    if (length > NBD_MAX_OPTION_SIZE) {
+        LOG("Option too long");
+        return -EINVAL;
+    }
+    while (length) {
+        len = MIN(length, sizeof(buf));
+        if (read_sync(csock, buf, len) != len) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        length -= len;
+    }
+    return 0;
+}
+
 static int nbd_receive_options(NBDClient *client)
 {
     int csock = client->sock;
     char name[256];
-    uint32_t tmp, length;
+    uint32_t tmp, opt, length;
     uint64_t magic;
+    bool fixed;
     int rc;
 
     /* Client sends:
-        [ 0 ..   3]   reserved (0)
-        [ 4 ..  11]   NBD_OPTS_MAGIC
-        [12 ..  15]   NBD_OPT_EXPORT_NAME
-        [16 ..  19]   length
-        [20 ..  xx]   export name (length bytes)
+        [ 0 ..   3]   client flags (NBD_FLAG_C_FIXED_NEWSTYLE or 0)
+
+       followed by any number of options, the last one being
+       NBD_OPT_EXPORT_NAME:
+        [ 0 ..   7]   NBD_OPTS_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   length
+        [16 ..  xx]   option data (length bytes, the export name for
+                      NBD_OPT_EXPORT_NAME)
+
+       Options other than NBD_OPT_EXPORT_NAME are answered with an option
+       reply, and are only accepted from fixed newstyle clients.
      */
 
     rc = -EINVAL;
@@ -236,38 +296,71 @@ static int nbd_receive_options(NBDClient *client)
         LOG("read failed");
         goto fail;
     }
-    TRACE("Checking reserved");
-    if (tmp != 0) {
-        LOG("Bad reserved received");
+    TRACE("Checking client flags");
+    tmp = be32_to_cpu(tmp);
+    if (tmp & ~NBD_FLAG_C_FIXED_NEWSTYLE) {
+        LOG("Bad client flags received");
         goto fail;
     }
+    fixed = tmp & NBD_FLAG_C_FIXED_NEWSTYLE;
 
-    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
-        LOG("read failed");
-        goto fail;
-    }
-    TRACE("Checking reserved");
-    if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
-        LOG("Bad magic received");
-        goto fail;
-    }
+    for (;;) {
+        if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+            LOG("read failed");
+            goto fail;
+        }
+        TRACE("Checking opts magic");
+        if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
+            LOG("Bad magic received");
+            goto fail;
+        }
 
-    if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
-        LOG("read failed");
-        goto fail;
-    }
-    TRACE("Checking option");
-    if (tmp != be32_to_cpu(NBD_OPT_EXPORT_NAME)) {
-        LOG("Bad option received");
-        goto fail;
-    }
+        if (read_sync(csock, &opt, sizeof(opt)) != sizeof(opt)) {
+            LOG("read failed");
+            goto fail;
+        }
+        opt = be32_to_cpu(opt);
 
-    if (read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
-        LOG("read failed");
-        goto fail;
+        if (read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
+            LOG("read failed");
+            goto fail;
+        }
+        length = be32_to_cpu(length);
+
+        TRACE("Checking option %" PRIu32, opt);
+        if (opt == NBD_OPT_EXPORT_NAME) {
+            break;
+        }
+        if (!fixed) {
+            LOG("Bad option received");
+            goto fail;
+        }
+
+        switch (opt) {
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (length) {
+                if (nbd_drop_option(csock, length) < 0) {
+                    goto fail;
+                }
+                tmp = NBD_REP_ERR_INVALID;
+            } else {
+                client->structured_reply = true;
+                tmp = NBD_REP_ACK;
+            }
+            break;
+        default:
+            if (nbd_drop_option(csock, length) < 0) {
+                goto fail;
+            }
+            tmp = NBD_REP_ERR_UNSUP;
+            break;
+        }
+        if (nbd_send_rep(csock, opt, tmp) < 0) {
+            goto fail;
+        }
     }
+
     TRACE("Checking length");
-    length = be32_to_cpu(length);
     if (length > 255) {
         LOG("Bad length received");
         goto fail;
@@ -312,7 +405,7 @@ static int nbd_send_negotiate(NBDClient *client)
        Negotiation header with options, part 1:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
         [ 8 ..  15]   magic        (NBD_OPTS_MAGIC)
-        [16 ..  17]   server flags (0)
+        [16 ..  17]   server flags (NBD_FLAG_FIXED_NEWSTYLE)
 
        part 2 (after options are sent):
         [18 ..  25]   size
@@ -333,6 +426,7 @@ static int nbd_send_negotiate(NBDClient *client)
         cpu_to_be16w((uint16_t*)(buf + 26), client->exp->nbdflags | myflags);
     } else {
         cpu_to_be64w((uint64_t*)(buf + 8), NBD_OPTS_MAGIC);
+        cpu_to_be16w((uint16_t*)(buf + 16), NBD_FLAG_FIXED_NEWSTYLE);
     }
 
     if (client->exp) {
@@ -367,8 +461,51 @@ fail:
     return rc;
 }
 
+/* Ask a fixed newstyle server for structured replies.  Returns 1 if the
+ * server agreed, 0 if it refused and a negative errno if the connection
+ * broke.
+ */
+static int nbd_request_structured_reply(int csock)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+    uint64_t magic;
+    uint32_t opt, type, length;
+
+    cpu_to_be64w((uint64_t*)buf, NBD_OPTS_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), NBD_OPT_STRUCTURED_REPLY);
+    cpu_to_be32w((uint32_t*)(buf + 12), 0);
+    if (write_sync(csock, buf, 16) != 16) {
+        LOG("write failed (option)");
+        return -EINVAL;
+    }
+
+    if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("read failed (option reply)");
+        return -EINVAL;
+    }
+    magic = be64_to_cpup((uint64_t*)buf);
+    opt = be32_to_cpup((uint32_t*)(buf + 8));
+    type = be32_to_cpup((uint32_t*)(buf + 12));
+    length = be32_to_cpup((uint32_t*)(buf + 16));
+    if (magic != NBD_REP_MAGIC || opt != NBD_OPT_STRUCTURED_REPLY) {
+        LOG("Bad option reply received");
+        return -EINVAL;
+    }
+    if (nbd_drop_option(csock, length) < 0) {
+        return -EINVAL;
+    }
+
+    TRACE("Structured replies %s", type == NBD_REP_ACK ? "on" : "refused");
+    return type == NBD_REP_ACK;
+}
+
+/* If structured_reply is not NULL, structured replies are requested from
+ * servers that support option replies, and *structured_reply tells whether
+ * they were granted.
+ */
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize)
+                          off_t *size, size_t *blocksize,
+                          bool *structured_reply)
 {
     char buf[256];
     uint64_t magic, s;
@@ -412,8 +549,12 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     magic = be64_to_cpu(magic);
     TRACE("Magic is 0x%" PRIx64, magic);
 
+    if (structured_reply) {
+        *structured_reply = false;
+    }
+
     if (name) {
-        uint32_t reserved = 0;
+        uint32_t client_flags = 0;
         uint32_t opt;
         uint32_t namesize;
 
@@ -427,12 +568,22 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             goto fail;
         }
         *flags = be16_to_cpu(tmp) << 16;
-        /* reserved for future use */
-        if (write_sync(csock, &reserved, sizeof(reserved)) !=
-            sizeof(reserved)) {
-            LOG("write failed (reserved)");
+        if (be16_to_cpu(tmp) & NBD_FLAG_FIXED_NEWSTYLE) {
+            client_flags = cpu_to_be32(NBD_FLAG_C_FIXED_NEWSTYLE);
+        }
+        if (write_sync(csock, &client_flags, sizeof(client_flags)) !=
+            sizeof(client_flags)) {
+            LOG("write failed (client flags)");
             goto fail;
         }
+        if (structured_reply && client_flags) {
+            rc = nbd_request_structured_reply(csock);
+            if (rc < 0) {
+                goto fail;
+            }
+            *structured_reply = rc;
+            rc = -EINVAL;
+        }
         /* write the export name */
         magic = cpu_to_be64(magic);
         if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -482,7 +633,7 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             LOG("read failed (tmp)");
             goto fail;
         }
-        *flags |= be32_to_cpu(tmp);
+        *flags |= be16_to_cpu(tmp);
     }
     if (read_sync(csock, &buf, 124) != 124) {
         LOG("read failed (buf)");
@@ -664,37 +815,92 @@ static ssize_t nbd_receive_request(int csock, struct nbd_request *request)
     return 0;
 }
 
+ssize_t nbd_receive_chunk_length(int csock, struct nbd_reply *reply)
+{
+    uint8_t buf[NBD_CHUNK_HEADER_SIZE - NBD_REPLY_SIZE];
+    ssize_t ret;
+
+    /* The rest of a structured reply chunk header.  The header is sent in
+     * one piece, but it may still straddle two reads; the caller then
+     * keeps what nbd_receive_reply decoded and calls us again once the
+     * socket is readable.
+     */
+    ret = read_sync(csock, buf, sizeof(buf));
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (ret != sizeof(buf)) {
+        LOG("read failed");
+        return -EINVAL;
+    }
+
+    reply->length = be32_to_cpup((uint32_t*)buf);
+
+    TRACE("Got chunk: "
+          "{ .flags = 0x%x, .type = %d, handle = %" PRIu64
+          ", .length = %u }",
+          reply->flags, reply->type, reply->handle, reply->length);
+    return 0;
+}
+
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
 {
     uint8_t buf[NBD_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(csock, buf, sizeof(buf));
+    /* Simple replies and structured reply chunks share the first sixteen
+     * bytes in size, so read those first.
+     */
+    ret = read_sync(csock, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
     /* Reply
-       [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
+       [ 0 ..  3]    magic   (NBD_SIMPLE_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
+
+       Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload that follows
      */
 
     magic = be32_to_cpup((uint32_t*)buf);
-    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
+    reply->magic = magic;
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        reply->error  = 0;
+        reply->flags  = be16_to_cpup((uint16_t*)(buf + 4));
+        reply->type   = be16_to_cpup((uint16_t*)(buf + 6));
+        reply->length = 0;
+
+        /* -EAGAIN here leaves a partial header in *reply, to be finished
+         * by nbd_receive_chunk_length.  */
+        return nbd_receive_chunk_length(csock, reply);
+    }
+
+    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
+    reply->flags  = NBD_REPLY_FLAG_DONE;
+    reply->type   = NBD_REPLY_TYPE_NONE;
+    reply->length = 0;
+
     TRACE("Got reply: "
           "{ magic = 0x%x, .error = %d, handle = %" PRIu64" }",
           magic, reply->error, reply->handle);
 
-    if (magic != NBD_REPLY_MAGIC) {
+    if (magic != NBD_SIMPLE_REPLY_MAGIC) {
         LOG("invalid magic (got 0x%x)", magic);
         return -EINVAL;
     }
@@ -707,11 +913,11 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     ssize_t ret;
 
     /* Reply
-       [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
+       [ 0 ..  3]    magic   (NBD_SIMPLE_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
-    cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
+    cpu_to_be32w((uint32_t*)buf, NBD_SIMPLE_REPLY_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
     cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
 
@@ -941,6 +1147,60 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+static ssize_t nbd_co_send_chunk(NBDClient *client, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 const void *payload, size_t payload_len,
+                                 uint8_t *data, int len)
+{
+    int csock = client->sock;
+    uint8_t buf[NBD_CHUNK_HEADER_SIZE + 12];
+    size_t size = NBD_CHUNK_HEADER_SIZE + payload_len;
+    ssize_t rc, ret;
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length  (payload_len + len)
+       [20 .. xx]    payload, followed by len bytes of data
+     */
+    assert(payload_len <= sizeof(buf) - NBD_CHUNK_HEADER_SIZE);
+    cpu_to_be32w((uint32_t*)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t*)(buf + 4), flags);
+    cpu_to_be16w((uint16_t*)(buf + 6), type);
+    cpu_to_be64w((uint64_t*)(buf + 8), handle);
+    cpu_to_be32w((uint32_t*)(buf + 16), payload_len + len);
+    memcpy(buf + NBD_CHUNK_HEADER_SIZE, payload, payload_len);
+
+    qemu_co_mutex_lock(&client->send_lock);
+    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
+                         nbd_restart_write, client);
+    client->send_coroutine = qemu_coroutine_self();
+
+    if (len) {
+        socket_set_cork(csock, 1);
+    }
+    rc = write_sync(csock, buf, size);
+    if (rc >= 0 && rc != size) {
+        rc = -EIO;
+    }
+    if (rc >= 0 && len) {
+        ret = qemu_co_send(csock, data, len);
+        if (ret != len) {
+            rc = -EIO;
+        }
+    }
+    if (len) {
+        socket_set_cork(csock, 0);
+    }
+
+    client->send_coroutine = NULL;
+    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -974,7 +1234,9 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
     TRACE("Decoding type");
 
     command = request->type & NBD_CMD_MASK_COMMAND;
-    if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
+    if (command == NBD_CMD_WRITE ||
+        (command == NBD_CMD_READ && !client->structured_reply)) {
+        /* Structured reads allocate the buffer once they find data.  */
         req->data = qemu_blockalign(client->exp->bs, request->len);
     }
     if (command == NBD_CMD_WRITE) {
@@ -993,6 +1255,87 @@ out:
     return rc;
 }
 
+static ssize_t nbd_co_send_error_chunk(NBDClient *client, uint64_t handle,
+                                       int error)
+{
+    uint8_t payload[4 + 2];
+
+    /* [ 0 ..  3] error, [ 4 ..  5] message length (no message) */
+    cpu_to_be32w((uint32_t*)payload, error);
+    cpu_to_be16w((uint16_t*)(payload + 4), 0);
+    return nbd_co_send_chunk(client, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, payload, sizeof(payload),
+                             NULL, 0);
+}
+
+/* Serve a read as a series of chunks, one per extent reported by
+ * bdrv_get_block_status.  Extents that read as zeroes are described with
+ * a hole chunk and are neither read from the image nor sent.  Read errors
+ * are reported to the client with an error chunk; the return value is
+ * negative only if the connection broke.
+ */
+static ssize_t nbd_co_read_structured(NBDRequest *req,
+                                      struct nbd_request *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    uint8_t payload[8 + 4];
+    uint64_t offset;
+    uint16_t flags;
+    int64_t status;
+    ssize_t rc;
+    int pnum, ret;
+
+    while (nb_sectors > 0) {
+        status = bdrv_get_block_status(exp->bs, sector_num, nb_sectors, &pnum);
+        if (status < 0 || pnum <= 0) {
+            /* Fall back to reading the whole rest of the request.  */
+            status = BDRV_BLOCK_DATA;
+            pnum = nb_sectors;
+        }
+        pnum = MIN(pnum, nb_sectors);
+
+        offset = sector_num * 512 - exp->dev_offset;
+        flags = pnum == nb_sectors ? NBD_REPLY_FLAG_DONE : 0;
+        cpu_to_be64w((uint64_t*)payload, offset);
+
+        if (status & BDRV_BLOCK_ZERO) {
+            TRACE("Hole at %" PRIu64 ", %d sector(s)", offset, pnum);
+            cpu_to_be32w((uint32_t*)(payload + 8), pnum * 512);
+            rc = nbd_co_send_chunk(client, request->handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_HOLE,
+                                   payload, 8 + 4, NULL, 0);
+        } else {
+            uint8_t *buf;
+
+            if (!req->data) {
+                req->data = qemu_blockalign(exp->bs, request->len);
+            }
+            buf = req->data + (offset - request->from);
+            ret = bdrv_read(exp->bs, sector_num, buf, pnum);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_error_chunk(client, request->handle,
+                                               -ret);
+            }
+            TRACE("Data at %" PRIu64 ", %d sector(s)", offset, pnum);
+            rc = nbd_co_send_chunk(client, request->handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_DATA,
+                                   payload, 8, buf, pnum * 512);
+        }
+        if (rc < 0) {
+            return rc;
+        }
+
+        sector_num += pnum;
+        nb_sectors -= pnum;
+    }
+
+    return 0;
+}
+
 static void nbd_trip(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1046,6 +1389,19 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            /* Chunks are built a sector at a time, and their data is
+             * read straight into req->data at the chunk's offset.  */
+            if (request.len % 512 || request.len == 0 ||
+                (request.from + exp->dev_offset) % 512) {
+                goto invalid_request;
+            }
+            if (nbd_co_read_structured(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
                         req->data, request.len / 512);
         if (ret < 0) {
@@ -1121,9 +1477,15 @@ static void nbd_trip(void *opaque)
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
-        reply.error = -EINVAL;
+        reply.error = EINVAL;
     error_reply:
-        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+        if (client->structured_reply &&
+            (request.type & NBD_CMD_MASK_COMMAND) == NBD_CMD_READ) {
+            ret = nbd_co_send_error_chunk(client, reply.handle, reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0) {
             goto out;
         }
         break;
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -33,65 +33,103 @@
     do { } while (0)
 #endif
 
+/*
+ * The cache is set associative: a page can only live in the set selected
+ * by its address, in any of the set's ways.  Replacement within a set
+ * follows 2Q: a new page is probationary and is evicted first in first
+ * out, unless it is looked up again, which makes it hot.  Pages used only
+ * once, as in a scan of memory larger than the cache, thus only evict
+ * each other.  At most CACHE_HOT_WAYS pages of a set are hot; beyond
+ * that, CLOCK picks one not looked up lately and puts it back on
+ * probation.
+ */
+
+/* Number of ways of a set */
+#define CACHE_WAYS 8
+#define CACHE_HOT_WAYS 6
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    bool it_hot;
+    bool it_referenced;
 };
 
 struct PageCache {
+    /* num_sets * ways items, one set after the other */
     CacheItem *page_cache;
-    unsigned int page_size;
+    /* the CLOCK hand over the hot pages of each set */
+    uint8_t *hands;
+    size_t page_size;
+    int64_t num_sets;
+    unsigned int ways;
+    unsigned int hot_ways;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+/* Allocates the sets for a cache of size bytes */
+static int cache_alloc_sets(PageCache *cache, int64_t size)
 {
+    int64_t num_pages = size / cache->page_size;
     int64_t i;
 
-    PageCache *cache;
-
     if (num_pages <= 0) {
         DPRINTF("invalid number of pages\n");
-        return NULL;
+        return -1;
     }
 
-    /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
-    if (!cache) {
-        DPRINTF("Failed to allocate cache\n");
-        return NULL;
-    }
-    /* round down to the nearest power of 2 */
-    if (!is_power_of_2(num_pages)) {
-        num_pages = pow2floor(num_pages);
-        DPRINTF("rounding down to %" PRId64 "\n", num_pages);
-    }
-    cache->page_size = page_size;
+    cache->ways = MIN(CACHE_WAYS, num_pages);
+    cache->hot_ways = cache->ways * CACHE_HOT_WAYS / CACHE_WAYS;
+    cache->num_sets = num_pages / cache->ways;
+    cache->max_num_items = cache->num_sets * cache->ways;
     cache->num_items = 0;
-    cache->max_item_age = 0;
-    cache->max_num_items = num_pages;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache sets to %" PRId64 " of %u pages\n",
+            cache->num_sets, cache->ways);
 
     /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
+    cache->page_cache = g_try_malloc(cache->max_num_items *
                                      sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    cache->hands = g_try_malloc0(cache->num_sets);
+    if (!cache->page_cache || !cache->hands) {
         DPRINTF("Failed to allocate cache->page_cache\n");
-        g_free(cache);
-        return NULL;
+        g_free(cache->page_cache);
+        g_free(cache->hands);
+        return -1;
     }
 
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hot = false;
+        cache->page_cache[i].it_referenced = false;
         cache->page_cache[i].it_addr = -1;
     }
+    return 0;
+}
+
+PageCache *cache_init(int64_t size, size_t page_size)
+{
+    PageCache *cache;
+
+    /* We prefer not to abort if there is no memory */
+    cache = g_try_malloc(sizeof(*cache));
+    if (!cache) {
+        DPRINTF("Failed to allocate cache\n");
+        return NULL;
+    }
+    cache->page_size = page_size;
+    cache->max_item_age = 0;
+
+    if (cache_alloc_sets(cache, size) < 0) {
+        g_free(cache);
+        return NULL;
+    }
 
     return cache;
 }
@@ -108,83 +146,169 @@ void cache_fini(PageCache *cache)
     }
 
     g_free(cache->page_cache);
+    g_free(cache->hands);
     cache->page_cache = NULL;
+    cache->hands = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static int64_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
-
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+    return (address / cache->page_size) % cache->num_sets;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    set = &cache->page_cache[cache_get_set(cache, addr) * cache->ways];
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Makes it hot, putting another hot page of set number nr on probation
+   if there are too many */
+static void cache_promote(PageCache *cache, int64_t nr, CacheItem *it)
 {
-    size_t pos;
+    CacheItem *set = &cache->page_cache[nr * cache->ways];
+    uint8_t *hand = &cache->hands[nr];
+    unsigned int i, hot = 0;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->ways; i++) {
+        hot += set[i].it_hot;
+    }
+    it->it_hot = true;
+    it->it_referenced = true;
+    if (hot < cache->hot_ways) {
+        return;
+    }
 
-    pos = cache_get_cache_pos(cache, addr);
+    while (true) {
+        CacheItem *victim = &set[*hand];
 
-    return &cache->page_cache[pos];
+        *hand = (*hand + 1) % cache->ways;
+        if (!victim->it_hot || victim == it) {
+            continue;
+        }
+        if (!victim->it_referenced) {
+            victim->it_hot = false;
+            victim->it_age = ++cache->max_item_age;
+            break;
+        }
+        victim->it_referenced = false;
+    }
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+bool cache_is_cached(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it) {
+        return false;
+    }
+    if (it->it_hot) {
+        it->it_referenced = true;
+    } else if (cache->hot_ways) {
+        cache_promote(cache, cache_get_set(cache, addr), it);
+    }
+    return true;
 }
 
-int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
+uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
+}
 
+/* Picks the item of set number nr that a new page goes to: a free one,
+   or else the oldest page on probation */
+static CacheItem *cache_get_victim(PageCache *cache, int64_t nr)
+{
+    CacheItem *set = &cache->page_cache[nr * cache->ways];
     CacheItem *it = NULL;
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == -1) {
+            return &set[i];
+        }
+        if (!set[i].it_hot && (!it || set[i].it_age < it->it_age)) {
+            it = &set[i];
+        }
+    }
+
+    /* at most hot_ways < ways pages are hot */
+    g_assert(it);
+    return it;
+}
+
+int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
+{
+    CacheItem *it;
 
-    /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        it = cache_get_victim(cache, cache_get_set(cache, addr));
+        it->it_hot = false;
+        it->it_referenced = false;
+        it->it_age = ++cache->max_item_age;
+    }
 
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
         if (!it->it_data) {
             DPRINTF("Error allocating page\n");
+            it->it_addr = -1;
             return -1;
         }
         cache->num_items++;
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
-
-    it->it_age = ++cache->max_item_age;
     it->it_addr = addr;
 
     return 0;
 }
 
-int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
+/* Moves old_it into a free way of its set, keeping its state as far as
+   the set allows.  Returns false if the set is full. */
+static bool cache_move_item(PageCache *cache, CacheItem *old_it)
 {
-    PageCache *new_cache;
-    int64_t i;
+    CacheItem *set;
+    unsigned int i, hot = 0;
+
+    set = &cache->page_cache[cache_get_set(cache, old_it->it_addr) *
+                             cache->ways];
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == -1) {
+            set[i] = *old_it;
+            set[i].it_hot = old_it->it_hot && hot < cache->hot_ways;
+            cache->num_items++;
+            return true;
+        }
+        hot += set[i].it_hot;
+    }
+    return false;
+}
 
-    CacheItem *old_it, *new_it;
+int64_t cache_resize(PageCache *cache, int64_t new_size)
+{
+    CacheItem *old_cache;
+    uint8_t *old_hands;
+    int64_t old_num_items, old_num_sets;
+    unsigned int old_ways, old_hot_ways;
+    int64_t i;
+    int pass;
 
     g_assert(cache);
 
@@ -193,44 +317,41 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
-    /* same size */
-    if (pow2floor(new_num_pages) == cache->max_num_items) {
-        return cache->max_num_items;
-    }
+    old_cache = cache->page_cache;
+    old_hands = cache->hands;
+    old_num_items = cache->max_num_items;
+    old_num_sets = cache->num_sets;
+    old_ways = cache->ways;
+    old_hot_ways = cache->hot_ways;
 
-    new_cache = cache_init(new_num_pages, cache->page_size);
-    if (!(new_cache)) {
+    if (cache_alloc_sets(cache, new_size) < 0) {
         DPRINTF("Error creating new cache\n");
+        cache->page_cache = old_cache;
+        cache->hands = old_hands;
+        cache->max_num_items = old_num_items;
+        cache->num_sets = old_num_sets;
+        cache->ways = old_ways;
+        cache->hot_ways = old_hot_ways;
         return -1;
     }
 
-    /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
+    /* Move the pages over without copying them, hot ones first so that
+       they win if a set overflows; the others are dropped */
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < old_num_items; i++) {
+            CacheItem *old_it = &old_cache[i];
+
+            if (old_it->it_addr == -1 || old_it->it_hot != (pass == 0)) {
+                continue;
+            }
+            if (!cache_move_item(cache, old_it)) {
                 g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
             }
         }
     }
 
-    g_free(cache->page_cache);
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
-
-    g_free(new_cache);
+    g_free(old_cache);
+    g_free(old_hands);
 
-    return cache->max_num_items;
+    return cache->max_num_items * cache->page_size;
 }
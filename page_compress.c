@@ -0,0 +1,211 @@
+/*
+ * Page compression for QEMU migration
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <zlib.h>
+
+#include "qemu-common.h"
+#include "migration/page_compress.h"
+
+#ifdef CONFIG_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef CONFIG_SNAPPY
+#include <snappy-c.h>
+#endif
+
+struct PageCompressor {
+    PageCompressMethod method;
+    size_t page_size;
+    z_stream stream;
+    /* lzo and snappy may need more room than a page for the output */
+    uint8_t *out;
+    void *wrkmem;
+};
+
+bool page_compress_supported(PageCompressMethod method)
+{
+    switch (method) {
+    case PAGE_COMPRESS_ZLIB:
+        return true;
+#ifdef CONFIG_LZO
+    case PAGE_COMPRESS_LZO:
+        return true;
+#endif
+#ifdef CONFIG_SNAPPY
+    case PAGE_COMPRESS_SNAPPY:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+PageCompressor *page_compressor_new(PageCompressMethod method, int level,
+                                    size_t page_size)
+{
+    PageCompressor *c;
+    size_t out_len = page_size;
+
+    if (!page_compress_supported(method)) {
+        return NULL;
+    }
+
+    c = g_malloc0(sizeof(*c));
+    c->method = method;
+    c->page_size = page_size;
+
+    switch (method) {
+    case PAGE_COMPRESS_ZLIB:
+        if (deflateInit(&c->stream, level) != Z_OK) {
+            g_free(c);
+            return NULL;
+        }
+        break;
+#ifdef CONFIG_LZO
+    case PAGE_COMPRESS_LZO:
+        if (lzo_init() != LZO_E_OK) {
+            g_free(c);
+            return NULL;
+        }
+        /* see http://www.oberhumer.com/opensource/lzo/lzofaq.php */
+        out_len = page_size + page_size / 16 + 64 + 3;
+        c->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+        break;
+#endif
+#ifdef CONFIG_SNAPPY
+    case PAGE_COMPRESS_SNAPPY:
+        out_len = snappy_max_compressed_length(page_size);
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    c->out = g_malloc(out_len);
+    return c;
+}
+
+void page_compressor_free(PageCompressor *c)
+{
+    if (!c) {
+        return;
+    }
+    if (c->method == PAGE_COMPRESS_ZLIB) {
+        deflateEnd(&c->stream);
+    }
+    g_free(c->wrkmem);
+    g_free(c->out);
+    g_free(c);
+}
+
+PageCompressMethod page_compressor_method(PageCompressor *c)
+{
+    return c->method;
+}
+
+int page_compress(PageCompressor *c, const uint8_t *page, const uint8_t **out)
+{
+    size_t len;
+
+    switch (c->method) {
+    case PAGE_COMPRESS_ZLIB:
+        if (deflateReset(&c->stream) != Z_OK) {
+            return -1;
+        }
+        c->stream.next_in = (uint8_t *)page;
+        c->stream.avail_in = c->page_size;
+        c->stream.next_out = c->out;
+        c->stream.avail_out = c->page_size - 1;
+        if (deflate(&c->stream, Z_FINISH) != Z_STREAM_END) {
+            return -1;
+        }
+        len = c->stream.total_out;
+        break;
+#ifdef CONFIG_LZO
+    case PAGE_COMPRESS_LZO: {
+        lzo_uint lzo_len;
+
+        if (lzo1x_1_compress(page, c->page_size, c->out, &lzo_len,
+                             c->wrkmem) != LZO_E_OK) {
+            return -1;
+        }
+        len = lzo_len;
+        break;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    case PAGE_COMPRESS_SNAPPY:
+        len = snappy_max_compressed_length(c->page_size);
+        if (snappy_compress((const char *)page, c->page_size,
+                            (char *)c->out, &len) != SNAPPY_OK) {
+            return -1;
+        }
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    if (len >= c->page_size) {
+        return -1;
+    }
+    *out = c->out;
+    return len;
+}
+
+int page_decompress(PageCompressMethod method, const uint8_t *src, int slen,
+                    uint8_t *page, size_t page_size)
+{
+    switch (method) {
+    case PAGE_COMPRESS_ZLIB: {
+        z_stream stream;
+        int ret;
+
+        memset(&stream, 0, sizeof(stream));
+        if (inflateInit(&stream) != Z_OK) {
+            return -1;
+        }
+        stream.next_in = (uint8_t *)src;
+        stream.avail_in = slen;
+        stream.next_out = page;
+        stream.avail_out = page_size;
+        ret = inflate(&stream, Z_FINISH);
+        inflateEnd(&stream);
+        if (ret != Z_STREAM_END || stream.total_out != page_size) {
+            return -1;
+        }
+        return 0;
+    }
+#ifdef CONFIG_LZO
+    case PAGE_COMPRESS_LZO: {
+        lzo_uint len = page_size;
+
+        if (lzo1x_decompress_safe(src, slen, page, &len, NULL) != LZO_E_OK ||
+            len != page_size) {
+            return -1;
+        }
+        return 0;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    case PAGE_COMPRESS_SNAPPY: {
+        size_t len = page_size;
+
+        if (snappy_uncompress((const char *)src, slen, (char *)page,
+                              &len) != SNAPPY_OK || len != page_size) {
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
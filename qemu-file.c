@@ -1,13 +1,20 @@
 #include "qemu-common.h"
 #include "qemu/iov.h"
+#include "qemu/queue.h"
 #include "qemu/sockets.h"
 #include "block/coroutine.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "trace.h"
 
+#if defined(CONFIG_LINUX) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <poll.h>
+#include <linux/errqueue.h>
+#define SOCKET_ZEROCOPY
+#endif
+
 #define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+#define MAX_IOV_SIZE MIN(IOV_MAX, 1024)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -24,6 +31,7 @@ struct QEMUFile {
 
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
+    bool zerocopy;
 
     int last_error;
 };
@@ -33,11 +41,153 @@ typedef struct QEMUFileStdio {
     QEMUFile *file;
 } QEMUFileStdio;
 
+typedef struct SocketHeldBuffer {
+    void *buf;
+    uint32_t seq;               /* zero copy sends it is part of */
+    QSIMPLEQ_ENTRY(SocketHeldBuffer) next;
+} SocketHeldBuffer;
+
 typedef struct QEMUFileSocket {
     int fd;
     QEMUFile *file;
+    bool zerocopy;
+    uint32_t zerocopy_sent;     /* sendmsg calls with MSG_ZEROCOPY */
+    uint32_t zerocopy_done;     /* of those, how many the kernel is done with */
+    QSIMPLEQ_HEAD(, SocketHeldBuffer) held;
 } QEMUFileSocket;
 
+/*
+ * Zero copy sends
+ *
+ * With MSG_ZEROCOPY, the kernel reads the data after sendmsg returns, and
+ * tells when it is done through the socket's error queue, one count per
+ * sendmsg call.  The guest pages can stay where they are: if the guest
+ * writes to one meanwhile, it is dirty again and will be sent again.  The
+ * buffers QEMUFile copied small writes into are held until then.
+ */
+
+static void socket_free_held(QEMUFileSocket *s, bool all)
+{
+    SocketHeldBuffer *hb;
+
+    while ((hb = QSIMPLEQ_FIRST(&s->held)) != NULL) {
+        if (!all && (int32_t)(s->zerocopy_done - hb->seq) < 0) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&s->held, next);
+        g_free(hb->buf);
+        g_free(hb);
+    }
+}
+
+static void socket_hold_buffer(void *opaque, void *buf)
+{
+    QEMUFileSocket *s = opaque;
+    SocketHeldBuffer *hb = g_new(SocketHeldBuffer, 1);
+
+    hb->buf = buf;
+    hb->seq = s->zerocopy_sent;
+    QSIMPLEQ_INSERT_TAIL(&s->held, hb, next);
+}
+
+#ifdef SOCKET_ZEROCOPY
+static bool socket_enable_zerocopy(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    int one = 1;
+
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        return false;
+    }
+    s->zerocopy = true;
+    return true;
+}
+
+/* Reads the completions queued on the socket.  With WAIT, waits for at
+ * least one first.  Returns -1 if none can come anymore.
+ */
+static int socket_zerocopy_reap(QEMUFileSocket *s, bool wait)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    struct pollfd pfd;
+    int ret = 0;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(s->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN || !wait) {
+                ret = errno == EAGAIN ? 0 : -1;
+                break;
+            }
+            /* the error queue is reported as POLLERR */
+            pfd.fd = s->fd;
+            pfd.events = 0;
+            if ((poll(&pfd, 1, -1) < 0 && errno != EINTR) ||
+                (pfd.revents & (POLLHUP | POLLNVAL) &&
+                 !(pfd.revents & POLLERR))) {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm) {
+            continue;
+        }
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+            s->zerocopy_done += serr->ee_data - serr->ee_info + 1;
+            wait = false;
+        }
+    }
+    socket_free_held(s, false);
+    return ret;
+}
+
+static ssize_t socket_writev_zerocopy(QEMUFileSocket *s, struct iovec *iov,
+                                      unsigned int iovcnt)
+{
+    struct msghdr msg;
+    ssize_t size = iov_size(iov, iovcnt);
+    ssize_t done = 0, len;
+    int flags = MSG_ZEROCOPY;
+
+    while (done < size) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        len = sendmsg(s->fd, &msg, flags);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS && flags) {
+                /* too many sends in flight, copy this one */
+                socket_zerocopy_reap(s, false);
+                flags = 0;
+                continue;
+            }
+            return -socket_error();
+        }
+        if (flags) {
+            s->zerocopy_sent++;
+        }
+        done += len;
+        iov_discard_front(&iov, &iovcnt, len);
+    }
+    socket_zerocopy_reap(s, false);
+    return done;
+}
+#endif
+
 static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                                     int64_t pos)
 {
@@ -45,6 +195,11 @@ static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
     ssize_t len;
     ssize_t size = iov_size(iov, iovcnt);
 
+#ifdef SOCKET_ZEROCOPY
+    if (s->zerocopy) {
+        return socket_writev_zerocopy(s, iov, iovcnt);
+    }
+#endif
     len = iov_send(s->fd, iov, iovcnt, 0, size);
     if (len < size) {
         len = -socket_error();
@@ -59,6 +214,22 @@ static int socket_get_fd(void *opaque)
     return s->fd;
 }
 
+static const QEMUFileOps socket_read_ops;
+
+/* The return path is a second QEMUFile on a dup of the socket */
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    int fd;
+
+    fd = dup(s->fd);
+    if (fd < 0) {
+        return NULL;
+    }
+    return qemu_fopen_socket(fd, s->file->ops == &socket_read_ops ?
+                                 "wb" : "rb");
+}
+
 static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 {
     QEMUFileSocket *s = opaque;
@@ -85,6 +256,14 @@ static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 static int socket_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
+
+#ifdef SOCKET_ZEROCOPY
+    /* the kernel may still be sending from the held buffers */
+    while (s->zerocopy_done != s->zerocopy_sent &&
+           socket_zerocopy_reap(s, true) == 0) {
+    }
+#endif
+    socket_free_held(s, true);
     closesocket(s->fd);
     g_free(s);
     return 0;
@@ -336,13 +515,19 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
 
 static const QEMUFileOps socket_read_ops = {
     .get_fd =     socket_get_fd,
+    .get_return_path = socket_get_return_path,
     .get_buffer = socket_get_buffer,
     .close =      socket_close
 };
 
 static const QEMUFileOps socket_write_ops = {
     .get_fd =     socket_get_fd,
+    .get_return_path = socket_get_return_path,
     .writev_buffer = socket_writev_buffer,
+#ifdef SOCKET_ZEROCOPY
+    .enable_zerocopy = socket_enable_zerocopy,
+#endif
+    .hold_buffer = socket_hold_buffer,
     .close =      socket_close
 };
 
@@ -368,6 +553,7 @@ QEMUFile *qemu_fopen_socket(int fd, const char *mode)
 
     s = g_malloc0(sizeof(QEMUFileSocket));
     s->fd = fd;
+    QSIMPLEQ_INIT(&s->held);
     if (mode[0] == 'w') {
         qemu_set_block(s->fd);
         s->file = qemu_fopen_ops(s, &socket_write_ops);
@@ -438,6 +624,29 @@ static inline bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer || f->ops->put_buffer;
 }
 
+/* With zero copy, the transport reads the data after writev_buffer has
+ * returned, so what is in f->buf has to outlive the next writes to it.
+ * Only that is copied, not the buffers added with qemu_put_buffer_async.
+ */
+static uint8_t *qemu_file_copy_buf(QEMUFile *f)
+{
+    uint8_t *copy, *base;
+    int i;
+
+    if (!f->buf_index) {
+        return NULL;
+    }
+
+    copy = g_memdup(f->buf, f->buf_index);
+    for (i = 0; i < f->iovcnt; i++) {
+        base = f->iov[i].iov_base;
+        if (base >= f->buf && base < f->buf + IO_BUF_SIZE) {
+            f->iov[i].iov_base = copy + (base - f->buf);
+        }
+    }
+    return copy;
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -447,6 +656,7 @@ static inline bool qemu_file_is_writable(QEMUFile *f)
 void qemu_fflush(QEMUFile *f)
 {
     ssize_t ret = 0;
+    uint8_t *copy;
 
     if (!qemu_file_is_writable(f)) {
         return;
@@ -454,7 +664,11 @@ void qemu_fflush(QEMUFile *f)
 
     if (f->ops->writev_buffer) {
         if (f->iovcnt > 0) {
+            copy = f->zerocopy ? qemu_file_copy_buf(f) : NULL;
             ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
+            if (copy) {
+                f->ops->hold_buffer(f->opaque, copy);
+            }
         }
     } else {
         if (f->buf_index > 0) {
@@ -530,6 +744,12 @@ size_t ram_control_save_page(QEMUFile *f, ram_addr_t block_offset,
     return RAM_SAVE_CONTROL_NOT_SUPP;
 }
 
+/* Whether pages are sent by the save_page hook rather than the stream */
+bool ram_control_has_save_page(QEMUFile *f)
+{
+    return f->ops->save_page != NULL;
+}
+
 static void qemu_fill_buffer(QEMUFile *f)
 {
     int len;
@@ -564,6 +784,14 @@ int qemu_get_fd(QEMUFile *f)
     return -1;
 }
 
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (f->ops->get_return_path) {
+        return f->ops->get_return_path(f->opaque);
+    }
+    return NULL;
+}
+
 void qemu_update_position(QEMUFile *f, size_t size)
 {
     f->pos += size;
@@ -616,6 +844,16 @@ static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
     }
 }
 
+bool qemu_file_enable_zerocopy(QEMUFile *f)
+{
+    if (!f->ops->enable_zerocopy || !f->ops->hold_buffer) {
+        return false;
+    }
+    qemu_fflush(f);
+    f->zerocopy = f->ops->enable_zerocopy(f->opaque);
+    return f->zerocopy;
+}
+
 void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
 {
     if (!f->ops->writev_buffer) {
@@ -788,6 +1026,12 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/* Account for len bytes sent on behalf of f through another channel */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
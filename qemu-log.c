@@ -117,6 +117,9 @@ const QEMULogItem qemu_log_items[] = {
     { LOG_GUEST_ERROR, "guest_errors",
       "log when the guest OS does something invalid (eg accessing a\n"
       "non-existent register)" },
+    { CPU_LOG_TB_STATS, "tb_stats",
+      "user mode only: show translation buffer size and flush count\n"
+      "at exit" },
     { 0, NULL, NULL },
 };
 
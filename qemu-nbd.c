@@ -46,6 +46,7 @@ static NBDExport *exp;
 static int verbose;
 static char *srcpath;
 static char *sockpath;
+static char *export_name;
 static int persistent = 0;
 static enum { RUNNING, TERMINATE, TERMINATING, TERMINATED } state;
 static int shared = 1;
@@ -66,6 +67,7 @@ static void usage(const char *name)
 "  -k, --socket=PATH    path to the unix socket\n"
 "                       (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
+"  -x, --export-name=NAME  expose export by name\n"
 "  -t, --persistent     don't exit on the last connection\n"
 "  -v, --verbose        display extra debugging information\n"
 "\n"
@@ -285,8 +287,8 @@ static void *nbd_client_thread(void *arg)
         goto out;
     }
 
-    ret = nbd_receive_negotiate(sock, NULL, &nbdflags,
-                                &size, &blocksize);
+    ret = nbd_receive_negotiate(sock, export_name, &nbdflags,
+                                &size, &blocksize, NULL);
     if (ret < 0) {
         goto out_socket;
     }
@@ -369,7 +371,9 @@ static void nbd_accept(void *opaque)
         return;
     }
 
-    if (fd >= 0 && nbd_client_new(exp, fd, nbd_client_closed)) {
+    /* Named exports are looked up during negotiation.  */
+    if (fd >= 0 && nbd_client_new(export_name ? NULL : exp, fd,
+                                  nbd_client_closed)) {
         nb_fds++;
     }
 }
@@ -387,7 +391,7 @@ int main(int argc, char **argv)
     off_t fd_size;
     QemuOpts *sn_opts = NULL;
     const char *sn_id_or_name = NULL;
-    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:f:tl:";
+    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:f:tl:x:";
     struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -408,6 +412,7 @@ int main(int argc, char **argv)
 #endif
         { "discard", 1, NULL, QEMU_NBD_OPT_DISCARD },
         { "shared", 1, NULL, 'e' },
+        { "export-name", 1, NULL, 'x' },
         { "format", 1, NULL, 'f' },
         { "persistent", 0, NULL, 't' },
         { "verbose", 0, NULL, 'v' },
@@ -544,6 +549,9 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Shared device number must be greater than 0\n");
             }
             break;
+        case 'x':
+            export_name = optarg;
+            break;
         case 'f':
             fmt = optarg;
             break;
@@ -692,7 +700,15 @@ int main(int argc, char **argv)
         }
     }
 
+    /* All clients share one BlockDriverState, so a flush on any of their
+     * connections covers the writes of all of them.  */
+    if (shared > 1) {
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
+    if (export_name) {
+        nbd_export_set_name(exp, export_name);
+    }
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
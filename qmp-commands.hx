@@ -639,6 +639,8 @@ Notes:
 (2) All boolean arguments default to false
 (3) The user Monitor's "detach" argument is invalid in QMP and should not
     be used
+(4) With a "file:PATH" URI, the state goes to a file that "-incoming
+    file:PATH" loads; see docs/migration.txt
 
 EQMP
 
@@ -661,6 +663,29 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch the current migration to post-copy without waiting for the end of
+the first pass over guest RAM.  The postcopy-ram capability must be
+enabled.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 {
         .name       = "migrate-set-cache-size",
@@ -673,7 +698,8 @@ migrate-set-cache-size
 ----------------------
 
 Set cache size to be used by XBZRLE migration, the cache size will be rounded
-down to the nearest power of 2
+down to a multiple of 8 pages.  Resizing the cache during a migration keeps
+its contents, as far as they fit
 
 Arguments:
 
@@ -684,6 +710,107 @@ Example:
 -> { "execute": "migrate-set-cache-size", "arguments": { "value": 536870912 } }
 <- { "return": {} }
 
+EQMP
+    {
+        .name       = "migrate-set-threads",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_threads,
+    },
+
+SQMP
+migrate-set-threads
+-------------------
+
+Set the number of threads encoding RAM pages on the source and decoding
+them on the destination of a migration.  It cannot be changed while a
+migration is in progress.
+
+Arguments:
+
+- "value": number of threads, between 1 and 64 (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-threads", "arguments": { "value": 4 } }
+<- { "return": {} }
+
+EQMP
+    {
+        .name       = "migrate-set-channels",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_channels,
+    },
+
+SQMP
+migrate-set-channels
+--------------------
+
+Set the number of channels carrying RAM pages in a TCP migration.  With
+more than one, that many extra connections are opened for RAM pages and
+the main connection only carries device state.  It must be set to the
+same value on both sides before the migration starts.
+
+Arguments:
+
+- "value": number of channels, between 1 and 16 (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-channels", "arguments": { "value": 4 } }
+<- { "return": {} }
+
+EQMP
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  = "compress-level:i?,compress-method:s?,threads:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+
+SQMP
+migrate-set-parameters
+----------------------
+
+Set tuning parameters of migration.  Those left out are not changed.  They
+cannot be changed while a migration is in progress.
+
+Arguments:
+
+- "compress-level": compression level from 1 to 9, used by zlib
+  (json-int, optional)
+- "compress-method": "zlib", "lzo" or "snappy" (json-string, optional)
+- "threads": number of RAM threads, as set by migrate-set-threads
+  (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-parameters",
+     "arguments": { "compress-method": "zlib", "compress-level": 6 } }
+<- { "return": {} }
+
+EQMP
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
+SQMP
+query-migrate-parameters
+------------------------
+
+Show the tuning parameters of migration
+
+returns a json-object with the following information:
+- "compress-level": compression level (json-int)
+- "compress-method": compression method (json-string)
+- "threads": number of RAM threads (json-int)
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- { "return": { "compress-level": 1, "compress-method": "zlib",
+                 "threads": 4 } }
+
 EQMP
     {
         .name       = "query-migrate-cache-size",
@@ -705,6 +832,41 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the dirty page rate of the guest, as measured by the last migration
+
+returns a json-object with the following information:
+- "dirty-pages-rate": number of pages dirtied by second (json-int)
+- "throttle-percentage": share of the time the vCPUs are kept out of the
+  guest by auto-converge (json-int)
+- "blocks": a json-array of json-objects, one per RAM block:
+         - "id": the name of the block (json-string)
+         - "size": the size of the block in bytes (json-int)
+         - "dirty-pages-rate": number of pages of the block dirtied by
+            second (json-int)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "dirty-pages-rate": 12800,
+        "throttle-percentage": 20,
+        "blocks": [ { "id": "pc.ram", "size": 1073741824,
+                      "dirty-pages-rate": 12736 },
+                    { "id": "vga.vram", "size": 16777216,
+                      "dirty-pages-rate": 64 } ] } }
+
 EQMP
 
     {
@@ -1031,7 +1193,7 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "bitmap:s?,on-source-error:s?,on-target-error:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_backup,
     },
 
@@ -1058,11 +1220,14 @@ Arguments:
             (json-string, optional)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
-  allocated in the topmost image, or "none" to only replicate new I/O
-  (MirrorSyncMode).
+  allocated in the topmost image, "none" to only replicate new I/O, or
+  "incremental" for the sectors that are dirty in "bitmap" (MirrorSyncMode).
 - "mode": whether and how QEMU should create a new image
           (NewImageMode, optional, default 'absolute-paths')
 - "speed": the maximum speed, in bytes per second (json-int, optional)
+- "bitmap": the dirty bitmap to copy, required with "incremental" sync and
+            not allowed otherwise.  It is cleared if the backup succeeds.
+            (json-string, optional)
 - "on-source-error": the action to take on an error on the source, default
                      'report'.  'stop' and 'enospc' can only be used
                      if the block device supports io-status.
@@ -1077,6 +1242,90 @@ Example:
                                                "sync": "full",
                                                "target": "backup.img" } }
 <- { "return": {} }
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Create a dirty bitmap that tracks the writes to a block device from now on.
+
+Arguments:
+
+- "node": device or node name (json-string)
+- "name": name of the new dirty bitmap (json-string)
+- "granularity": granularity in bytes, a power of 2 between 512 and 64M,
+                 default is the cluster size but at least 64k
+                 (json-int, optional)
+- "persistent": store the bitmap in the image when it is closed; only
+                qcow2 images with compat=1.1 support this, default false
+                (json-bool, optional)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "node": "drive0",
+                                                   "name": "bitmap0",
+                                                   "persistent": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "node:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Stop tracking writes with a dirty bitmap and free it.  Bitmaps that are in
+use by a backup cannot be removed.
+
+Arguments:
+
+- "node": device or node name (json-string)
+- "name": name of the dirty bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "node": "drive0",
+                                                      "name": "bitmap0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-clear",
+        .args_type  = "node:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_clear,
+    },
+
+SQMP
+block-dirty-bitmap-clear
+------------------------
+
+Mark all the sectors of a dirty bitmap as clean.  Bitmaps that are in use by
+a backup cannot be cleared.
+
+Arguments:
+
+- "node": device or node name (json-string)
+- "name": name of the dirty bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-clear", "arguments": { "node": "drive0",
+                                                     "name": "bitmap0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2192,6 +2441,12 @@ Each json-object contain the following:
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "driver-specific": Statistics specific to the image format, omitted if
+                     the format has none (json-object, optional). For qcow2
+                     it contains "l2-cache" and "refcount-cache", each with:
+    - "size": maximum size of the cache in bytes (json-int)
+    - "hits": lookups that were served by the cache (json-int)
+    - "misses": lookups that read the table from the image (json-int)
 
 Example:
 
@@ -2340,6 +2595,10 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum busy polling time in ns, 0 if disabled (json-int)
+- "poll-ns": current adaptive polling time in ns (json-int)
+- "poll-hits": number of polling windows in which an event arrived (json-int)
+- "poll-misses": number of polling windows without an event (json-int)
 
 Example:
 
@@ -2348,11 +2607,19 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-ns":8000,
+            "poll-hits":5471,
+            "poll-misses":312
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":0,
+            "poll-ns":0,
+            "poll-hits":0,
+            "poll-misses":0
          }
       ]
    }
@@ -2937,7 +3204,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+       "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -2967,6 +3235,13 @@ The main json-object contains the following:
             pages. This is just normal pages times size of one page,
             but this way upper levels don't need to care about page
             size (json-int)
+         - "postcopy-requests": only present once post-copy has started,
+            number of pages the destination asked for because the guest
+            touched them (json-int)
+         - "dirty-sync-count": number of times the dirty bitmap was
+            synced (json-int)
+         - "dirty-sync-time": total amount of ms spent syncing the dirty
+            bitmap (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -2977,11 +3252,27 @@ The main json-object contains the following:
          - "cache-size": XBZRLE cache size in bytes
          - "bytes": number of bytes transferred for XBZRLE compressed pages
          - "pages": number of XBZRLE compressed pages
+         - "cache-hit": number of XBZRLE page cache hits
          - "cache-miss": number of XBRZRLE page cache misses
+         - "cache-hit-rate": ratio of cache hits to cache lookups
+           (json-number)
          - "overflow": number of times XBZRLE overflows.  This means
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+- "ram-threads": only present if more than one RAM migration thread is
+  configured.  It is a json-object with the following information:
+         - "threads": number of threads (json-int)
+         - "pages": number of dirty pages handed to the threads (json-int)
+         - "bytes": number of bytes they produced (json-int)
+         - "wait-time": total amount of ms the migration thread spent
+           waiting for them (json-int)
+- "compression": only present if the compress capability is on.
+  It is a json-object with the following information:
+         - "pages": number of pages sent compressed (json-int)
+         - "bytes": number of compressed bytes sent for them (json-int)
+         - "compression-rate": ratio between the size of those pages and
+           the compressed bytes (json-number)
 
 Examples:
 
@@ -3081,7 +3372,9 @@ Examples:
             "cache-size":67108864,
             "bytes":20971520,
             "pages":2444343,
+            "cache-hit":2439113,
             "cache-miss":2244,
+            "cache-hit-rate":0.999,
             "overflow":34434
          }
       }
@@ -3102,6 +3395,9 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": XBZRLE support
+- "postcopy-ram": switch to post-copy when pre-copy does not converge
+- "zero-copy-send": send RAM pages without copying them, if possible
+- "compress": compress RAM pages, see migrate-set-parameters
 
 Arguments:
 
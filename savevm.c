@@ -554,15 +554,11 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+static int qemu_savevm_state_complete_live(QEMUFile *f)
 {
     SaveStateEntry *se;
     int ret;
 
-    trace_savevm_state_complete();
-
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -581,9 +577,15 @@ void qemu_savevm_state_complete(QEMUFile *f)
         trace_savevm_section_end(se->idstr, se->section_id);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return;
+            return ret;
         }
     }
+    return 0;
+}
+
+static void qemu_savevm_state_save_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -609,7 +611,83 @@ void qemu_savevm_state_complete(QEMUFile *f)
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
+}
+
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    trace_savevm_state_complete();
+
+    cpu_synchronize_all_states();
+
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        return;
+    }
+    qemu_savevm_state_save_devices(f);
+    qemu_fflush(f);
+}
+
+/*
+ * Post-copy packages
+ *
+ * On a switch to post-copy, the device state goes in a single package
+ * that the destination reads in whole before loading it.  It can thus
+ * start loading RAM pages from the rest of the stream first, which it
+ * must, as the devices' post_load hooks may touch pages still missing.
+ */
+
+static int package_put_buffer(void *opaque, const uint8_t *buf,
+                              int64_t pos, int size)
+{
+    g_byte_array_append(opaque, buf, size);
+    return size;
+}
+
+static int package_get_buffer(void *opaque, uint8_t *buf,
+                              int64_t pos, int size)
+{
+    GByteArray *package = opaque;
+
+    if (pos >= package->len) {
+        return 0;
+    }
+    size = MIN(size, package->len - pos);
+    memcpy(buf, package->data + pos, size);
+    return size;
+}
+
+static const QEMUFileOps package_write_ops = {
+    .put_buffer = package_put_buffer,
+};
+
+static const QEMUFileOps package_read_ops = {
+    .get_buffer = package_get_buffer,
+};
+
+/* Like qemu_savevm_state_complete, but the live sections switch to
+ * post-copy and what follows belongs to them */
+void qemu_savevm_state_complete_postcopy(QEMUFile *f)
+{
+    GByteArray *package;
+    QEMUFile *pf;
+
+    trace_savevm_state_complete();
+
+    cpu_synchronize_all_states();
+
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        return;
+    }
+
+    package = g_byte_array_new();
+    pf = qemu_fopen_ops(package, &package_write_ops);
+    qemu_savevm_state_save_devices(pf);
+    qemu_fclose(pf);
+
+    qemu_put_byte(f, QEMU_VM_POSTCOPY_PACKAGE);
+    qemu_put_be32(f, package->len);
+    qemu_put_buffer(f, package->data, package->len);
     qemu_fflush(f);
+    g_byte_array_free(package, TRUE);
 }
 
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
@@ -742,33 +820,20 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntryList;
+
+static int qemu_loadvm_postcopy_package(QEMUFile *f,
+                                        LoadStateEntryList *handlers);
+
+/* Loads sections from f up to the end of the state.  Returns 1 if that
+ * came in a post-copy package, after which f belongs to the post-copy
+ * page loader. */
+static int qemu_loadvm_sections(QEMUFile *f, LoadStateEntryList *handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
-    LoadStateEntry *le, *new_le;
+    LoadStateEntry *le;
     uint8_t section_type;
-    unsigned int v;
     int ret;
 
-    if (qemu_savevm_state_blocked(NULL)) {
-        return -EINVAL;
-    }
-
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC) {
-        return -EINVAL;
-    }
-
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
-    }
-    if (v != QEMU_VM_FILE_VERSION) {
-        return -ENOTSUP;
-    }
-
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
@@ -790,16 +855,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -808,47 +871,122 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
             }
             break;
+        case QEMU_VM_POSTCOPY_PACKAGE:
+            ret = qemu_loadvm_postcopy_package(f, handlers);
+            return ret < 0 ? ret : 1;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
+    return 0;
+}
+
+static int qemu_loadvm_postcopy_package(QEMUFile *f,
+                                        LoadStateEntryList *handlers)
+{
+    GByteArray *package;
+    QEMUFile *pf;
+    uint32_t len;
+    int ret;
+
+    len = qemu_get_be32(f);
+    if (len > INT_MAX) {
+        return -EINVAL;
+    }
+    package = g_byte_array_sized_new(len);
+    g_byte_array_set_size(package, len);
+    if (qemu_get_buffer(f, package->data, len) != len) {
+        g_byte_array_free(package, TRUE);
+        return -EINVAL;
+    }
+
+    ret = ram_postcopy_incoming_start(f);
+    if (ret < 0) {
+        g_byte_array_free(package, TRUE);
+        return ret;
+    }
+
+    pf = qemu_fopen_ops(package, &package_read_ops);
+    ret = qemu_loadvm_sections(pf, handlers);
+    if (ret > 0) {
+        fprintf(stderr, "Nested post-copy package\n");
+        ret = -EINVAL;
+    } else if (ret == 0) {
+        ret = qemu_file_get_error(pf);
+    }
+    qemu_fclose(pf);
+    g_byte_array_free(package, TRUE);
+
+    return ret;
+}
+
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateEntryList loadvm_handlers =
+        QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    LoadStateEntry *le, *new_le;
+    unsigned int v;
+    int ret;
+
+    if (qemu_savevm_state_blocked(NULL)) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION) {
+        return -ENOTSUP;
+    }
+
+    ret = qemu_loadvm_sections(f, &loadvm_handlers);
+    if (ret < 0) {
+        goto out;
+    }
+
     cpu_synchronize_all_post_init();
 
-    ret = 0;
+    /* f now belongs to the post-copy page loader, if any */
+    ret = ret ? 0 : qemu_file_get_error(f);
 
 out:
     QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
@@ -856,10 +994,6 @@ out:
         g_free(le);
     }
 
-    if (ret == 0) {
-        ret = qemu_file_get_error(f);
-    }
-
     return ret;
 }
 
@@ -1099,6 +1233,7 @@ int load_vmstate(const char *name)
     ret = qemu_loadvm_state(f);
 
     qemu_fclose(f);
+    ram_load_cleanup();
     if (ret < 0) {
         error_report("Error %d while loading VM state", ret);
         return ret;
@@ -0,0 +1,132 @@
+#!/usr/bin/env python
+# NBD client - send raw structured reads
+#
+# Negotiates structured replies with a fixed newstyle server, then sends
+# one READ per offset/length pair given on the command line and prints
+# the chunks of each reply.  Unlike qemu-io, it does not align requests,
+# so it can be used to check how the server copes with bad ones.
+#
+# Usage: nbd-structured-read.py HOST:PORT EXPORT OFFSET LENGTH...
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import sys
+import socket
+import struct
+
+# Protocol constants
+NBD_CMD_READ = 0
+NBD_CMD_DISC = 2
+NBD_REQUEST_MAGIC = 0x25609513
+NBD_STRUCTURED_REPLY_MAGIC = 0x668e33ef
+NBD_PASSWD = 0x4e42444d41474943
+NBD_OPTS_MAGIC = 0x49484156454F5054
+NBD_REP_MAGIC = 0x0003e889045565a9
+NBD_FLAG_FIXED_NEWSTYLE = 1 << 0
+NBD_FLAG_C_FIXED_NEWSTYLE = 1 << 0
+NBD_OPT_EXPORT_NAME = 1 << 0
+NBD_OPT_STRUCTURED_REPLY = 8
+NBD_REP_ACK = 1
+NBD_REPLY_FLAG_DONE = 1 << 0
+
+chunk_types = { 0: 'none', 1: 'data', 2: 'hole', (1 << 15) + 1: 'error' }
+
+# Protocol structs
+neg1_struct = struct.Struct('>QQH')
+option_struct = struct.Struct('>QII')
+option_reply_struct = struct.Struct('>QIII')
+neg2_struct = struct.Struct('>QH124x')
+request_struct = struct.Struct('>IIQQI')
+chunk_struct = struct.Struct('>IHHQI')
+
+def err(msg):
+    sys.stderr.write(msg + '\n')
+    sys.exit(1)
+
+def parse_size(s):
+    suffixes = { 'k': 1 << 10, 'M': 1 << 20, 'G': 1 << 30 }
+    if s[-1] in suffixes:
+        return int(s[:-1]) * suffixes[s[-1]]
+    return int(s)
+
+def recvall(sock, bufsize):
+    received = 0
+    chunks = []
+    while received < bufsize:
+        chunk = sock.recv(bufsize - received)
+        if len(chunk) == 0:
+            raise Exception('unexpected disconnect')
+        chunks.append(chunk)
+        received += len(chunk)
+    return b''.join(chunks)
+
+def negotiate(sock, name):
+    passwd, magic, flags = neg1_struct.unpack(recvall(sock, neg1_struct.size))
+    if passwd != NBD_PASSWD or magic != NBD_OPTS_MAGIC:
+        err('not a newstyle server')
+    if not flags & NBD_FLAG_FIXED_NEWSTYLE:
+        err('not a fixed newstyle server')
+    sock.sendall(struct.pack('>I', NBD_FLAG_C_FIXED_NEWSTYLE))
+
+    sock.sendall(option_struct.pack(NBD_OPTS_MAGIC,
+                                    NBD_OPT_STRUCTURED_REPLY, 0))
+    magic, opt, type_, length = option_reply_struct.unpack(
+        recvall(sock, option_reply_struct.size))
+    recvall(sock, length)
+    if magic != NBD_REP_MAGIC or opt != NBD_OPT_STRUCTURED_REPLY:
+        err('bad option reply')
+    if type_ != NBD_REP_ACK:
+        err('structured replies refused')
+
+    name = name.encode('ascii')
+    sock.sendall(option_struct.pack(NBD_OPTS_MAGIC, NBD_OPT_EXPORT_NAME,
+                                    len(name)) + name)
+    recvall(sock, neg2_struct.size)
+
+def read(sock, handle, offset, length):
+    sock.sendall(request_struct.pack(NBD_REQUEST_MAGIC, NBD_CMD_READ,
+                                     handle, offset, length))
+    while True:
+        magic, flags, type_, handle_, length = chunk_struct.unpack(
+            recvall(sock, chunk_struct.size))
+        if magic != NBD_STRUCTURED_REPLY_MAGIC or handle_ != handle:
+            err('bad chunk header')
+        payload = recvall(sock, length)
+
+        desc = chunk_types.get(type_, 'type %d' % type_)
+        if desc == 'data':
+            desc += ' %d/%d' % (struct.unpack('>Q', payload[:8])[0],
+                                length - 8)
+        elif desc == 'hole':
+            desc += ' %d/%d' % struct.unpack('>QI', payload)
+        elif desc == 'error':
+            desc += ' %d' % struct.unpack('>I', payload[:4])
+        if flags & NBD_REPLY_FLAG_DONE:
+            desc += ' (done)'
+        print('  ' + desc)
+
+        if flags & NBD_REPLY_FLAG_DONE:
+            return
+
+def main():
+    if len(sys.argv) < 5 or len(sys.argv) % 2 == 0:
+        err('usage: %s <host:port> <export> <offset> <length>...' %
+            sys.argv[0])
+
+    host, port = sys.argv[1].split(':')
+    sock = socket.create_connection((host, int(port)))
+    negotiate(sock, sys.argv[2])
+
+    args = sys.argv[3:]
+    for i in range(0, len(args), 2):
+        offset, length = parse_size(args[i]), parse_size(args[i + 1])
+        print('read %d/%d' % (offset, length))
+        read(sock, i + 1, offset, length)
+
+    sock.sendall(request_struct.pack(NBD_REQUEST_MAGIC, NBD_CMD_DISC,
+                                     0, 0, 0))
+    sock.close()
+
+if __name__ == '__main__':
+    main()
@@ -429,6 +429,108 @@ static void test_wait_event_notifier_noflush(void)
 
 #if !defined(_WIN32)
 
+static void test_many_event_notifiers(void)
+{
+    const int n = 200;
+    EventNotifierTestData *data = g_new0(EventNotifierTestData, n);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+#ifdef CONFIG_EPOLL_CREATE1
+    /* Many handlers make the AioContext switch to epoll if it can */
+    g_assert(ctx->epoll_enabled || !ctx->epoll_available);
+#endif
+    g_assert(!aio_poll(ctx, false));
+
+    event_notifier_set(&data[37].e);
+    event_notifier_set(&data[150].e);
+    g_assert(aio_poll(ctx, true));
+    while (aio_poll(ctx, false));
+    for (i = 0; i < n; i++) {
+        g_assert_cmpint(data[i].n, ==, i == 37 || i == 150);
+    }
+
+    /* Removed handlers are not called anymore, the others still are */
+    for (i = 0; i < n; i += 2) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_set(&data[i].e);
+    }
+    event_notifier_set(&data[151].e);
+    g_assert(aio_poll(ctx, true));
+    while (aio_poll(ctx, false));
+    g_assert_cmpint(data[150].n, ==, 1);
+    g_assert_cmpint(data[151].n, ==, 1);
+
+    for (i = 0; i < n; i++) {
+        if (i % 2) {
+            aio_set_event_notifier(ctx, &data[i].e, NULL);
+        }
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_assert(!aio_poll(ctx, false));
+    g_free(data);
+}
+
+typedef struct {
+    EventNotifierTestData data;
+    bool ready;
+    int polled;
+} PollTestData;
+
+static bool poll_ready_cb(void *opaque)
+{
+    PollTestData *poll = container_of(opaque, PollTestData, data.e);
+
+    if (!poll->ready) {
+        return false;
+    }
+    poll->ready = false;
+    poll->polled++;
+    return true;
+}
+
+static void test_poll_adaptive(void)
+{
+    PollTestData poll = { .data = { .n = 0 } };
+
+    event_notifier_init(&poll.data.e, false);
+    aio_set_event_notifier(ctx, &poll.data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &poll.data.e, poll_ready_cb);
+    aio_context_set_poll_params(ctx, 1000000000, 0, 0);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(ctx->poll_ns, ==, 0);
+
+    /* An event that arrives after a short wait enables polling */
+    event_notifier_set(&poll.data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(poll.data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* Polling finds work without the event notifier */
+    poll.ready = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(poll.polled, ==, 1);
+    g_assert_cmpint(poll.data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_hits, ==, 1);
+    g_assert_cmpint(ctx->poll_misses, ==, 0);
+
+    /* The window expires and aio_poll() waits for the event notifier */
+    event_notifier_set(&poll.data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(poll.polled, ==, 1);
+    g_assert_cmpint(poll.data.n, ==, 2);
+    g_assert_cmpint(ctx->poll_hits, ==, 1);
+    g_assert_cmpint(ctx->poll_misses, ==, 1);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0);
+    aio_set_event_notifier(ctx, &poll.data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&poll.data.e);
+}
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -830,6 +932,54 @@ static void test_source_timer_schedule(void)
 
 /* End of tests.  */
 
+/*
+ * Benchmarks, run with -m perf
+ */
+
+#if !defined(_WIN32)
+/* Cost of an aio_poll() that dispatches one event, depending on the number
+ * of idle handlers in the same AioContext
+ */
+static void perf_event_notifiers(void)
+{
+    static const int handlers[] = { 1, 10, 100, 1000 };
+    const int iterations = 100000;
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(handlers); i++) {
+        AioContext *perf_ctx = aio_context_new();
+        EventNotifierTestData *data;
+        double duration;
+        int n = handlers[i];
+
+        data = g_new0(EventNotifierTestData, n);
+        for (j = 0; j < n; j++) {
+            event_notifier_init(&data[j].e, false);
+            aio_set_event_notifier(perf_ctx, &data[j].e, event_ready_cb);
+        }
+        while (aio_poll(perf_ctx, false));
+
+        g_test_timer_start();
+        for (j = 0; j < iterations; j++) {
+            event_notifier_set(&data[n / 2].e);
+            aio_poll(perf_ctx, true);
+        }
+        duration = g_test_timer_elapsed();
+        g_assert_cmpint(data[n / 2].n, ==, iterations);
+
+        g_test_message("%d handlers: %d iterations in %f s, %f us each\n",
+                       n, iterations, duration, duration * 1e6 / iterations);
+
+        for (j = 0; j < n; j++) {
+            aio_set_event_notifier(perf_ctx, &data[j].e, NULL);
+            event_notifier_cleanup(&data[j].e);
+        }
+        g_free(data);
+        aio_context_unref(perf_ctx);
+    }
+}
+#endif
+
 int main(int argc, char **argv)
 {
     GSource *src;
@@ -858,6 +1008,8 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
 #if !defined(_WIN32)
+    g_test_add_func("/aio/event/many",              test_many_event_notifiers);
+    g_test_add_func("/aio/poll/adaptive",           test_poll_adaptive);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 #endif
 
@@ -876,6 +1028,11 @@ int main(int argc, char **argv)
     g_test_add_func("/aio-gsource/event/flush",             test_source_flush_event_notifier);
 #if !defined(_WIN32)
     g_test_add_func("/aio-gsource/timer/schedule",          test_source_timer_schedule);
+#endif
+#if !defined(_WIN32)
+    if (g_test_perf()) {
+        g_test_add_func("/aio/perf/event-notifiers", perf_event_notifiers);
+    }
 #endif
     return g_test_run();
 }
@@ -0,0 +1,121 @@
+/*
+ * Auto-converge throttle controller unit tests
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include "qemu-common.h"
+#include "migration/auto_converge.h"
+
+/* Dirty ratio of a guest that gives RATIO0 when not throttled */
+static double guest_ratio(double ratio0, int pct)
+{
+    return ratio0 * (100 - pct) / 100;
+}
+
+static void test_target(void)
+{
+    /* 300 ms of downtime over a 1 s period fits less than half */
+    g_assert_cmpfloat(auto_converge_target(300000000, 1000), ==, 0.5);
+    g_assert_cmpfloat(auto_converge_target(800000000, 1000), ==, 0.8);
+    g_assert_cmpfloat(auto_converge_target(5000000000ULL, 1000), ==, 1);
+}
+
+static void test_raise(void)
+{
+    /* four times too fast: the ideal throttle is 75%, go half way */
+    g_assert_cmpint(auto_converge_throttle(0, 2, 0.5), ==, 37);
+    g_assert_cmpint(auto_converge_throttle(37, guest_ratio(2, 37), 0.5),
+                    ==, 56);
+}
+
+static void test_hold(void)
+{
+    int pct;
+
+    /* a throttle that meets the target exactly is kept */
+    for (pct = 0; pct <= 90; pct += 10) {
+        g_assert_cmpint(auto_converge_throttle(pct, 0.5, 0.5), ==, pct);
+    }
+
+    /* and so is one that is within rounding of it */
+    g_assert_cmpint(auto_converge_throttle(60, 0.499, 0.5), ==, 60);
+    g_assert_cmpint(auto_converge_throttle(60, 0.501, 0.5), ==, 60);
+}
+
+static void test_ease_off(void)
+{
+    /* slightly under target: a small step down, not half the throttle */
+    g_assert_cmpint(auto_converge_throttle(60, 0.45, 0.5), ==, 58);
+
+    /* further under target: a bigger step */
+    g_assert_cmpint(auto_converge_throttle(60, 0.25, 0.5), ==, 40);
+
+    /* an idle guest releases the throttle geometrically */
+    g_assert_cmpint(auto_converge_throttle(60, 0, 0.5), ==, 30);
+    g_assert_cmpint(auto_converge_throttle(1, 0, 0.5), ==, 0);
+    g_assert_cmpint(auto_converge_throttle(0, 0, 0.5), ==, 0);
+}
+
+static void test_max(void)
+{
+    g_assert_cmpint(auto_converge_throttle(98, 1000, 0.5), ==,
+                    AUTO_CONVERGE_MAX_PCT);
+    g_assert_cmpint(auto_converge_throttle(AUTO_CONVERGE_MAX_PCT, 1000, 0.5),
+                    ==, AUTO_CONVERGE_MAX_PCT);
+}
+
+/* A guest with a steady dirty rate settles on the throttle that meets the
+ * target and stays there, without the controller cutting it back and
+ * having to climb again.
+ */
+static void test_steady_guest(void)
+{
+    int i, pct = 0, prev;
+
+    for (i = 0; i < 20; i++) {
+        prev = pct;
+        pct = auto_converge_throttle(pct, guest_ratio(2, pct), 0.5);
+        g_assert_cmpint(pct, >=, prev);
+    }
+    g_assert_cmpint(pct, >=, 74);
+    g_assert_cmpint(pct, <=, 75);
+
+    for (i = 0; i < 20; i++) {
+        g_assert_cmpint(auto_converge_throttle(pct, guest_ratio(2, pct), 0.5),
+                        ==, pct);
+    }
+}
+
+/* When the guest calms down, the throttle goes down to what the new dirty
+ * rate needs rather than to zero.
+ */
+static void test_calmer_guest(void)
+{
+    int i, pct = 75, prev;
+
+    for (i = 0; i < 20; i++) {
+        prev = pct;
+        pct = auto_converge_throttle(pct, guest_ratio(1, pct), 0.5);
+        g_assert_cmpint(pct, <=, prev);
+    }
+    g_assert_cmpint(pct, >=, 50);
+    g_assert_cmpint(pct, <=, 51);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/auto-converge/target", test_target);
+    g_test_add_func("/auto-converge/raise", test_raise);
+    g_test_add_func("/auto-converge/hold", test_hold);
+    g_test_add_func("/auto-converge/ease-off", test_ease_off);
+    g_test_add_func("/auto-converge/max", test_max);
+    g_test_add_func("/auto-converge/steady-guest", test_steady_guest);
+    g_test_add_func("/auto-converge/calmer-guest", test_calmer_guest);
+    return g_test_run();
+}
@@ -369,6 +369,70 @@ static void test_hbitmap_iter_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
 }
 
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *b;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    hbitmap_test_set(data, 25, 10);
+    hbitmap_test_set(data, L3 * 2 - 1, 1);
+
+    b = hbitmap_alloc(L3 * 2, 0);
+    hbitmap_set(b, 10, 20);
+    g_assert(hbitmap_merge(data->hb, b));
+    hbitmap_free(b);
+
+    /* The HBitmap has the bits already, update the shadow bitmap too */
+    hbitmap_test_set(data, 10, 20);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 26);
+
+    /* Bitmaps of different sizes cannot be merged */
+    b = hbitmap_alloc(L3, 0);
+    hbitmap_set(b, 0, 1);
+    g_assert(!hbitmap_merge(data->hb, b));
+    hbitmap_free(b);
+    hbitmap_test_check(data, 0);
+}
+
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    uint64_t size = L3 + 23;
+    uint64_t gran;
+    uint64_t len;
+    uint8_t *buf;
+    HBitmap *b;
+
+    hbitmap_test_init(data, size, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, 70, 200);
+    hbitmap_test_set(data, size - 1, 1);
+
+    gran = hbitmap_serialization_granularity(data->hb);
+    g_assert_cmpint(gran, ==, 64);
+
+    len = hbitmap_serialization_size(data->hb, 0, size);
+    g_assert_cmpint(len, ==, (size + 63) / 64 * 8);
+    buf = g_malloc0(len);
+    hbitmap_serialize_part(data->hb, buf, 0, size);
+
+    /* Bits are stored in little-endian order */
+    g_assert_cmpint(buf[0], ==, 0x01);
+    g_assert_cmpint(buf[8], ==, 0xc0);
+
+    /* Deserialize in two chunks */
+    b = hbitmap_alloc(size, 0);
+    hbitmap_deserialize_part(b, buf, 0, gran * 2, false);
+    hbitmap_deserialize_part(b, buf + 16, gran * 2, size - gran * 2, true);
+    g_free(buf);
+
+    hbitmap_free(data->hb);
+    data->hb = b;
+    hbitmap_test_check(data, 0);
+    g_assert_cmpint(hbitmap_count(b), ==, 202);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -395,6 +459,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
+    hbitmap_test_add("/hbitmap/serialize", test_hbitmap_serialize);
     g_test_run();
 
     return 0;
@@ -0,0 +1,132 @@
+/*
+ * Page cache unit tests
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+/* 16 sets of 8 pages */
+#define CACHE_PAGES 128
+
+static void fill_page(uint8_t *page, uint64_t addr)
+{
+    memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+}
+
+static bool page_is(PageCache *cache, uint64_t addr)
+{
+    uint8_t page[PAGE_SIZE];
+
+    if (!cache_is_cached(cache, addr)) {
+        return false;
+    }
+    fill_page(page, addr);
+    return memcmp(get_cached_data(cache, addr), page, PAGE_SIZE) == 0;
+}
+
+static void insert_page(PageCache *cache, uint64_t addr)
+{
+    uint8_t page[PAGE_SIZE];
+
+    fill_page(page, addr);
+    g_assert_cmpint(cache_insert(cache, addr, page), ==, 0);
+}
+
+static void test_insert(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE);
+    uint64_t addr;
+
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(!cache_is_cached(cache, addr));
+        g_assert(get_cached_data(cache, addr) == NULL);
+        insert_page(cache, addr);
+    }
+
+    /* consecutive pages spread over all sets, so nothing was evicted */
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(page_is(cache, addr));
+    }
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_scan_resistance(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE);
+    uint64_t addr;
+    int i;
+
+    /* a working set of half the cache, used twice */
+    for (i = 0; i < 2; i++) {
+        for (addr = 0; addr < CACHE_PAGES / 2 * PAGE_SIZE;
+             addr += PAGE_SIZE) {
+            if (!cache_is_cached(cache, addr)) {
+                insert_page(cache, addr);
+            }
+        }
+    }
+
+    /* a scan over four times the cache, each page used once */
+    for (addr = CACHE_PAGES * PAGE_SIZE; addr < 5 * CACHE_PAGES * PAGE_SIZE;
+         addr += PAGE_SIZE) {
+        g_assert(!cache_is_cached(cache, addr));
+        insert_page(cache, addr);
+    }
+
+    for (addr = 0; addr < CACHE_PAGES / 2 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(page_is(cache, addr));
+    }
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE);
+    uint64_t addr;
+
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        insert_page(cache, addr);
+    }
+
+    /* the size is rounded down to whole sets */
+    g_assert_cmpint(cache_resize(cache, 4 * CACHE_PAGES * PAGE_SIZE + 1),
+                    ==, 4 * CACHE_PAGES * PAGE_SIZE);
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(page_is(cache, addr));
+    }
+
+    /* shrinking keeps the recently used pages */
+    for (addr = 0; addr < CACHE_PAGES / 4 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr));
+    }
+    g_assert_cmpint(cache_resize(cache, CACHE_PAGES / 2 * PAGE_SIZE),
+                    ==, CACHE_PAGES / 2 * PAGE_SIZE);
+    for (addr = 0; addr < CACHE_PAGES / 4 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(page_is(cache, addr));
+    }
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/insert", test_insert);
+    g_test_add_func("/page-cache/scan_resistance", test_scan_resistance);
+    g_test_add_func("/page-cache/resize", test_resize);
+
+    return g_test_run();
+}
@@ -0,0 +1,107 @@
+/*
+ * Page compression unit tests
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "migration/page_compress.h"
+
+#define PAGE_SIZE 4096
+
+static void test_roundtrip(gconstpointer opaque)
+{
+    PageCompressMethod method = GPOINTER_TO_INT(opaque);
+    PageCompressor *c;
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint8_t *dest = g_malloc0(PAGE_SIZE);
+    const uint8_t *out;
+    int i, len;
+
+    if (!page_compress_supported(method)) {
+        g_free(page);
+        g_free(dest);
+        return;
+    }
+
+    /* a page with some structure compresses well */
+    for (i = 0; i < PAGE_SIZE; i += 64) {
+        strcpy((char *)page + i, "QEMU page compression");
+    }
+
+    c = page_compressor_new(method, 1, PAGE_SIZE);
+    g_assert(c);
+
+    len = page_compress(c, page, &out);
+    g_assert_cmpint(len, >, 0);
+    g_assert_cmpint(len, <, PAGE_SIZE);
+    g_assert_cmpint(page_decompress(method, out, len, dest, PAGE_SIZE), ==, 0);
+    g_assert(memcmp(page, dest, PAGE_SIZE) == 0);
+
+    /* the compressor can be reused for the next page */
+    page[100] ^= 0xff;
+    len = page_compress(c, page, &out);
+    g_assert_cmpint(len, >, 0);
+    g_assert_cmpint(page_decompress(method, out, len, dest, PAGE_SIZE), ==, 0);
+    g_assert(memcmp(page, dest, PAGE_SIZE) == 0);
+
+    /* truncated data is rejected */
+    g_assert_cmpint(page_decompress(method, out, len / 2, dest, PAGE_SIZE),
+                    ==, -1);
+
+    page_compressor_free(c);
+    g_free(page);
+    g_free(dest);
+}
+
+static void test_incompressible(gconstpointer opaque)
+{
+    PageCompressMethod method = GPOINTER_TO_INT(opaque);
+    PageCompressor *c;
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    const uint8_t *out;
+    int i;
+
+    if (!page_compress_supported(method)) {
+        g_free(page);
+        return;
+    }
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        page[i] = g_test_rand_int();
+    }
+
+    c = page_compressor_new(method, 9, PAGE_SIZE);
+    g_assert(c);
+    g_assert_cmpint(page_compress(c, page, &out), ==, -1);
+
+    page_compressor_free(c);
+    g_free(page);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_rand_int();
+    g_test_add_data_func("/page-compress/zlib/roundtrip",
+                         GINT_TO_POINTER(PAGE_COMPRESS_ZLIB), test_roundtrip);
+    g_test_add_data_func("/page-compress/zlib/incompressible",
+                         GINT_TO_POINTER(PAGE_COMPRESS_ZLIB),
+                         test_incompressible);
+    g_test_add_data_func("/page-compress/lzo/roundtrip",
+                         GINT_TO_POINTER(PAGE_COMPRESS_LZO), test_roundtrip);
+    g_test_add_data_func("/page-compress/lzo/incompressible",
+                         GINT_TO_POINTER(PAGE_COMPRESS_LZO),
+                         test_incompressible);
+    g_test_add_data_func("/page-compress/snappy/roundtrip",
+                         GINT_TO_POINTER(PAGE_COMPRESS_SNAPPY), test_roundtrip);
+    g_test_add_data_func("/page-compress/snappy/incompressible",
+                         GINT_TO_POINTER(PAGE_COMPRESS_SNAPPY),
+                         test_incompressible);
+    return g_test_run();
+}
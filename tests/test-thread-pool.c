@@ -132,6 +132,32 @@ static void test_submit_many(void)
     }
 }
 
+static void test_submit_many_completions(void)
+{
+    const int num = 1000;
+    WorkerTestData *data = g_new(WorkerTestData, num);
+    int i;
+
+    /* More requests than there are workers, so that they complete in
+     * batches while others are still queued
+     */
+    for (i = 0; i < num; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio(pool, worker_cb, &data[i], done_cb, &data[i]);
+    }
+
+    active = num;
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    for (i = 0; i < num; i++) {
+        g_assert_cmpint(data[i].n, ==, 1);
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+    g_free(data);
+}
+
 static void test_cancel(void)
 {
     WorkerTestData data[100];
@@ -202,6 +228,58 @@ static void test_cancel(void)
     }
 }
 
+/*
+ * Benchmarks, run with -m perf
+ */
+
+typedef struct {
+    int remaining;
+    int completed;
+} PerfTestData;
+
+static int null_cb(void *opaque)
+{
+    return 0;
+}
+
+static void perf_done_cb(void *opaque, int ret)
+{
+    PerfTestData *data = opaque;
+
+    data->completed++;
+    if (data->remaining > 0) {
+        data->remaining--;
+        thread_pool_submit_aio(pool, null_cb, NULL, perf_done_cb, data);
+    }
+}
+
+/* Throughput of requests that do no work, with a fixed number of them in
+ * flight, so that only the cost of the pool itself is measured
+ */
+static void perf_submit(void)
+{
+    static const int depths[] = { 1, 16, 64, 256, 1024 };
+    const int requests = 200000;
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(depths); i++) {
+        PerfTestData data = { .remaining = requests - depths[i] };
+        double duration;
+
+        g_test_timer_start();
+        for (j = 0; j < depths[i]; j++) {
+            thread_pool_submit_aio(pool, null_cb, NULL, perf_done_cb, &data);
+        }
+        while (data.completed < requests) {
+            aio_poll(ctx, true);
+        }
+        duration = g_test_timer_elapsed();
+
+        g_test_message("depth %d: %d requests in %f s, %f requests/s\n",
+                       depths[i], requests, duration, requests / duration);
+    }
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -216,7 +294,12 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/submit-many-completions",
+                    test_submit_many_completions);
     g_test_add_func("/thread-pool/cancel", test_cancel);
+    if (g_test_perf()) {
+        g_test_add_func("/thread-pool/perf/submit", perf_submit);
+    }
 
     ret = g_test_run();
 
@@ -179,6 +179,226 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * The original word at a time encoder.  Whichever implementation the host
+ * CPU selects must produce exactly the same output.
+ */
+static int encode_reference(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                            uint8_t *dst, int dlen)
+{
+    uint32_t zrun_len = 0, nzrun_len = 0;
+    int d = 0, i = 0;
+    long res, xor;
+    long mask = (long)0x0101010101010101ULL;
+    uint8_t *nzrun_start;
+
+    while (i < slen) {
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        res = (slen - i) % sizeof(long);
+        while (res && old_buf[i] == new_buf[i]) {
+            zrun_len++;
+            i++;
+            res--;
+        }
+        if (!res) {
+            while (i < slen &&
+                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+                i += sizeof(long);
+                zrun_len += sizeof(long);
+            }
+            while (i < slen && old_buf[i] == new_buf[i]) {
+                zrun_len++;
+                i++;
+            }
+        }
+        if (zrun_len == slen) {
+            return 0;
+        }
+        if (i == slen) {
+            return d;
+        }
+        d += uleb128_encode_small(dst + d, zrun_len);
+        zrun_len = 0;
+        nzrun_start = new_buf + i;
+
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        res = (slen - i) % sizeof(long);
+        while (res && old_buf[i] != new_buf[i]) {
+            i++;
+            nzrun_len++;
+            res--;
+        }
+        if (!res) {
+            while (i < slen) {
+                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
+                if ((xor - mask) & ~xor & (mask << 7)) {
+                    while (old_buf[i] != new_buf[i]) {
+                        nzrun_len++;
+                        i++;
+                    }
+                    break;
+                }
+                i += sizeof(long);
+                nzrun_len += sizeof(long);
+            }
+        }
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, nzrun_start, nzrun_len);
+        d += nzrun_len;
+        nzrun_len = 0;
+    }
+
+    return d;
+}
+
+/* Dirty a copy of old in up to max_runs runs of up to max_len bytes.
+   Some bytes of a run keep their value, so runs get split. */
+static void dirty_page(const uint8_t *old, uint8_t *new, int max_runs,
+                       int max_len)
+{
+    int runs = g_test_rand_int_range(0, max_runs + 1);
+    int pos, len;
+
+    memcpy(new, old, PAGE_SIZE);
+    while (runs--) {
+        pos = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, max_len + 1);
+        for (; len && pos < PAGE_SIZE; len--, pos++) {
+            if (g_test_rand_int_range(0, 5)) {
+                new[pos] = old[pos] + g_test_rand_int_range(1, 256);
+            }
+        }
+    }
+}
+
+static void test_encode_reference(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE + sizeof(long));
+    uint8_t *new = g_malloc(PAGE_SIZE + sizeof(long));
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    static const int max_len[] = { 4, 64, 1024 };
+    int i, j, dlen, ret, ref;
+
+    for (i = 0; i < 30000; i++) {
+        /* only long alignment is guaranteed */
+        uint8_t *o = old + (i & 1) * sizeof(long);
+        uint8_t *n = new + (i & 1) * sizeof(long);
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            o[j] = g_test_rand_int_range(0, 8) ? 0 : g_test_rand_int();
+        }
+        dirty_page(o, n, 64, max_len[i % ARRAY_SIZE(max_len)]);
+        dlen = i % 3 ? PAGE_SIZE : g_test_rand_int_range(2, PAGE_SIZE);
+
+        ref = encode_reference(o, n, PAGE_SIZE, expected, dlen);
+        ret = xbzrle_encode_buffer(o, n, PAGE_SIZE, compressed, dlen);
+        g_assert_cmpint(ret, ==, ref);
+        if (ret > 0) {
+            g_assert(memcmp(compressed, expected, ret) == 0);
+        }
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(expected);
+    g_free(compressed);
+}
+
+/*
+ * Benchmarks, run with -m perf
+ */
+
+#define PERF_PAGES 1024
+#define PERF_ROUNDS 64
+
+static void perf_encode(int max_runs, int max_len, const char *name)
+{
+    uint8_t *old = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *new = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    double duration;
+    int i, j;
+
+    for (i = 0; i < PERF_PAGES * PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int_range(0, 8) ? 0 : g_test_rand_int();
+    }
+    for (i = 0; i < PERF_PAGES; i++) {
+        dirty_page(old + i * PAGE_SIZE, new + i * PAGE_SIZE, max_runs,
+                   max_len);
+    }
+
+    g_test_timer_start();
+    for (j = 0; j < PERF_ROUNDS; j++) {
+        for (i = 0; i < PERF_PAGES; i++) {
+            xbzrle_encode_buffer(old + i * PAGE_SIZE, new + i * PAGE_SIZE,
+                                 PAGE_SIZE, compressed, PAGE_SIZE);
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Encode %s: %f GB/s\n", name,
+                   (double)PERF_ROUNDS * PERF_PAGES * PAGE_SIZE / duration /
+                   1e9);
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+}
+
+static void perf_encode_unchanged(void)
+{
+    perf_encode(0, 0, "unchanged pages");
+}
+
+static void perf_encode_sparse(void)
+{
+    /* a few counters and pointers updated */
+    perf_encode(8, 8, "sparse writes");
+}
+
+static void perf_encode_clustered(void)
+{
+    /* a few structures rewritten */
+    perf_encode(4, 256, "clustered writes");
+}
+
+static void perf_find_nonzero(void)
+{
+    uint8_t *buf = g_malloc0(PERF_PAGES * PAGE_SIZE);
+    double duration;
+    size_t total = 0;
+    int i, j;
+
+    /* a nonzero byte at the end of every other page */
+    for (i = 0; i < PERF_PAGES; i += 2) {
+        buf[(i + 1) * PAGE_SIZE - 1] = 1;
+    }
+
+    g_test_timer_start();
+    for (j = 0; j < PERF_ROUNDS; j++) {
+        for (i = 0; i < PERF_PAGES; i++) {
+            total += buffer_find_nonzero_offset(buf + i * PAGE_SIZE,
+                                                PAGE_SIZE);
+        }
+    }
+    duration = g_test_timer_elapsed();
+    g_assert(total);
+
+    g_test_message("Zero page detection: %f GB/s\n",
+                   (double)PERF_ROUNDS * PERF_PAGES * PAGE_SIZE / duration /
+                   1e9);
+
+    g_free(buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +411,15 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_reference", test_encode_reference);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/encode_unchanged",
+                        perf_encode_unchanged);
+        g_test_add_func("/xbzrle/perf/encode_sparse", perf_encode_sparse);
+        g_test_add_func("/xbzrle/perf/encode_clustered",
+                        perf_encode_clustered);
+        g_test_add_func("/xbzrle/perf/find_nonzero", perf_find_nonzero);
+    }
 
     return g_test_run();
 }
@@ -49,9 +49,17 @@ struct ThreadPoolElement {
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Access to these lists is protected by lock.  A request is on
+     * request_list while it is queued, and on completed once it is
+     * done or canceled.
+     */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Completed requests whose callback has not run yet, accessed
+     * from the AioContext.
+     */
+    QSIMPLEQ_ENTRY(ThreadPoolElement) done;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
@@ -64,13 +72,16 @@ struct ThreadPool {
     QemuCond worker_stopped;
     QemuSemaphore sem;
     int max_threads;
+    int idle_timeout_ms;
     QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) done;
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    QTAILQ_HEAD(, ThreadPoolElement) completed;
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
@@ -79,6 +90,20 @@ struct ThreadPool {
     bool stopping;
 };
 
+/* Hands a finished or canceled request to the AioContext.  Runs with lock
+ * taken.
+ */
+static void thread_pool_complete(ThreadPool *pool, ThreadPoolElement *req)
+{
+    /* If the list was not empty, the AioContext has not taken the
+     * requests yet and has been notified already.
+     */
+    if (QTAILQ_EMPTY(&pool->completed)) {
+        event_notifier_set(&pool->notifier);
+    }
+    QTAILQ_INSERT_TAIL(&pool->completed, req, reqs);
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -94,7 +119,7 @@ static void *worker_thread(void *opaque)
         do {
             pool->idle_threads++;
             qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
+            ret = qemu_sem_timedwait(&pool->sem, pool->idle_timeout_ms);
             qemu_mutex_lock(&pool->lock);
             pool->idle_threads--;
         } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
@@ -119,7 +144,7 @@ static void *worker_thread(void *opaque)
             qemu_cond_broadcast(&pool->check_cancel);
         }
 
-        event_notifier_set(&pool->notifier);
+        thread_pool_complete(pool, req);
     }
 
     pool->cur_threads--;
@@ -171,30 +196,35 @@ static void spawn_thread(ThreadPool *pool)
 static void event_notifier_ready(EventNotifier *notifier)
 {
     ThreadPool *pool = container_of(notifier, ThreadPool, notifier);
-    ThreadPoolElement *elem, *next;
+    ThreadPoolElement *elem;
 
     event_notifier_test_and_clear(notifier);
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_CANCELED && elem->state != THREAD_DONE) {
-            continue;
-        }
+
+    /* Only look at the requests that completed, instead of every request
+     * in flight.  They go to the end of pool->done, so that a callback
+     * that waits for another request from a nested aio_poll() can still
+     * complete it.
+     */
+    qemu_mutex_lock(&pool->lock);
+    while ((elem = QTAILQ_FIRST(&pool->completed))) {
+        QTAILQ_REMOVE(&pool->completed, elem, reqs);
+        QSIMPLEQ_INSERT_TAIL(&pool->done, elem, done);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    while ((elem = QSIMPLEQ_FIRST(&pool->done))) {
+        QSIMPLEQ_REMOVE_HEAD(&pool->done, done);
+        QLIST_REMOVE(elem, all);
         if (elem->state == THREAD_DONE) {
             trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                        elem->ret);
+            if (elem->common.cb) {
+                /* Read state before ret.  */
+                smp_rmb();
+                elem->common.cb(elem->common.opaque, elem->ret);
+            }
         }
-        if (elem->state == THREAD_DONE && elem->common.cb) {
-            QLIST_REMOVE(elem, all);
-            /* Read state before ret.  */
-            smp_rmb();
-            elem->common.cb(elem->common.opaque, elem->ret);
-            qemu_aio_release(elem);
-            goto restart;
-        } else {
-            /* remove the request */
-            QLIST_REMOVE(elem, all);
-            qemu_aio_release(elem);
-        }
+        qemu_aio_release(elem);
     }
 }
 
@@ -215,7 +245,7 @@ static void thread_pool_cancel(BlockDriverAIOCB *acb)
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
         elem->state = THREAD_CANCELED;
-        event_notifier_set(&pool->notifier);
+        thread_pool_complete(pool, elem);
     } else {
         pool->pending_cancellations++;
         while (elem->state != THREAD_CANCELED && elem->state != THREAD_DONE) {
@@ -298,11 +328,14 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_cond_init(&pool->check_cancel);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
+    pool->max_threads = THREAD_POOL_MAX_THREADS;
+    pool->idle_timeout_ms = THREAD_POOL_IDLE_TIMEOUT_MS;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
+    QSIMPLEQ_INIT(&pool->done);
     QTAILQ_INIT(&pool->request_list);
+    QTAILQ_INIT(&pool->completed);
 
     aio_set_event_notifier(ctx, &pool->notifier, event_notifier_ready);
 }
@@ -314,6 +347,16 @@ ThreadPool *thread_pool_new(AioContext *ctx)
     return pool;
 }
 
+void thread_pool_set_params(ThreadPool *pool, int max_threads,
+                            int idle_timeout_ms)
+{
+    qemu_mutex_lock(&pool->lock);
+    pool->max_threads = max_threads ? max_threads : THREAD_POOL_MAX_THREADS;
+    pool->idle_timeout_ms =
+        idle_timeout_ms ? idle_timeout_ms : THREAD_POOL_IDLE_TIMEOUT_MS;
+    qemu_mutex_unlock(&pool->lock);
+}
+
 void thread_pool_free(ThreadPool *pool)
 {
     if (!pool) {
@@ -440,14 +440,6 @@ static inline PageDesc *page_find(tb_page_addr_t index)
 #define mmap_unlock() do { } while (0)
 #endif
 
-#if defined(CONFIG_USER_ONLY)
-/* Currently it is not recommended to allocate big chunks of data in
-   user mode. It will change when a dedicated libc will be used.  */
-/* ??? 64-bit hosts ought to have no problem mmaping data outside the
-   region in which the guest needs to run.  Revisit this.  */
-#define USE_STATIC_CODE_GEN_BUFFER
-#endif
-
 /* ??? Should configure for this, not list operating systems here.  */
 #if (defined(__linux__) \
     || defined(__FreeBSD__) || defined(__FreeBSD_kernel__) \
@@ -456,6 +448,19 @@ static inline PageDesc *page_find(tb_page_addr_t index)
 # define USE_MMAP
 #endif
 
+#if defined(CONFIG_USER_ONLY)
+# if HOST_LONG_BITS == 64 && defined(USE_MMAP)
+/* 64-bit hosts have no problem mmaping data outside the region in which
+   the guest needs to run.  Reserve a large region up front, but only make
+   as much of it usable as the guest's translated code needs.  */
+#  define USE_GROWABLE_CODE_GEN_BUFFER
+# else
+/* Currently it is not recommended to allocate big chunks of data in
+   user mode. It will change when a dedicated libc will be used.  */
+#  define USE_STATIC_CODE_GEN_BUFFER
+# endif
+#endif
+
 /* Minimum size of the code gen buffer.  This number is randomly chosen,
    but not so small that we can't have a fair number of TB's live.  */
 #define MIN_CODE_GEN_BUFFER_SIZE     (1024u * 1024)
@@ -484,11 +489,38 @@ static inline PageDesc *page_find(tb_page_addr_t index)
   (DEFAULT_CODE_GEN_BUFFER_SIZE_1 < MAX_CODE_GEN_BUFFER_SIZE \
    ? DEFAULT_CODE_GEN_BUFFER_SIZE_1 : MAX_CODE_GEN_BUFFER_SIZE)
 
+#ifdef USE_GROWABLE_CODE_GEN_BUFFER
+/* Address space reserved for a growable buffer.  The usable part starts
+   at DEFAULT_CODE_GEN_BUFFER_SIZE and doubles on each flush caused by
+   running out of space.  */
+#define GROWABLE_CODE_GEN_BUFFER_SIZE_1 (1024ul * 1024 * 1024)
+
+#define GROWABLE_CODE_GEN_BUFFER_SIZE \
+  (GROWABLE_CODE_GEN_BUFFER_SIZE_1 < MAX_CODE_GEN_BUFFER_SIZE \
+   ? GROWABLE_CODE_GEN_BUFFER_SIZE_1 : MAX_CODE_GEN_BUFFER_SIZE)
+
+/* Rough ratio of host code to guest code, used to turn the size of the
+   guest's text segments into a buffer size.  */
+#define CODE_GEN_TEXT_RATIO 4
+
+/* Whether the size was left to us, or fixed with -tb-size.  */
+static bool code_gen_buffer_growable;
+/* Largest usable size, i.e. the reservation minus the prologue.  */
+static size_t code_gen_buffer_limit;
+/* Usable size wanted at the next opportunity to grow the buffer.  */
+static size_t code_gen_buffer_target;
+#endif
+
 static inline size_t size_code_gen_buffer(size_t tb_size)
 {
     /* Size the buffer.  */
     if (tb_size == 0) {
-#ifdef USE_STATIC_CODE_GEN_BUFFER
+#if defined(USE_GROWABLE_CODE_GEN_BUFFER)
+        /* Reserve the whole region; code_gen_alloc() decides how much
+           of it is usable to begin with.  */
+        code_gen_buffer_growable = true;
+        tb_size = GROWABLE_CODE_GEN_BUFFER_SIZE;
+#elif defined(USE_STATIC_CODE_GEN_BUFFER)
         tb_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
 #else
         /* ??? Needs adjustments.  */
@@ -521,9 +553,17 @@ static inline void *alloc_code_gen_buffer(void)
 static inline void *alloc_code_gen_buffer(void)
 {
     int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    int prot = PROT_WRITE | PROT_READ | PROT_EXEC;
     uintptr_t start = 0;
     void *buf;
 
+#ifdef USE_GROWABLE_CODE_GEN_BUFFER
+    /* Only reserve the address space here; pages are made accessible
+       by code_gen_alloc() and code_gen_buffer_grow().  */
+    flags |= MAP_NORESERVE;
+    prot = PROT_NONE;
+#endif
+
     /* Constrain the position of the buffer based on the host cpu.
        Note that these addresses are chosen in concert with the
        addresses assigned in the relevant linker script file.  */
@@ -547,7 +587,7 @@ static inline void *alloc_code_gen_buffer(void)
 # endif
 
     buf = mmap((void *)start, tcg_ctx.code_gen_buffer_size,
-               PROT_WRITE | PROT_READ | PROT_EXEC, flags, -1, 0);
+               prot, flags, -1, 0);
     return buf == MAP_FAILED ? NULL : buf;
 }
 #else
@@ -562,6 +602,40 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, USE_MMAP */
 
+/* Allocate the TB array for a buffer of at most SIZE bytes.  The array
+   is never reallocated afterwards, because other threads may hold
+   pointers into it.  */
+static void alloc_tbs(size_t size)
+{
+    size_t nb_tbs = size / CODE_GEN_AVG_BLOCK_SIZE;
+
+#ifdef USE_GROWABLE_CODE_GEN_BUFFER
+    /* Like the buffer itself, only the part that is used gets backed
+       by memory.  */
+    void *tbs = mmap(NULL, nb_tbs * sizeof(TranslationBlock),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (tbs == MAP_FAILED) {
+        fprintf(stderr, "Could not allocate translation block array\n");
+        exit(1);
+    }
+    tcg_ctx.tb_ctx.tbs = tbs;
+#else
+    tcg_ctx.tb_ctx.tbs = g_new(TranslationBlock, nb_tbs);
+#endif
+}
+
+/* Set the usable size of the buffer.  */
+static void code_gen_buffer_set_size(size_t size)
+{
+#ifdef USE_GROWABLE_CODE_GEN_BUFFER
+    map_exec(tcg_ctx.code_gen_buffer, size);
+#endif
+    tcg_ctx.code_gen_buffer_size = size;
+    tcg_ctx.code_gen_buffer_max_size = size - (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+    tcg_ctx.code_gen_max_blocks = size / CODE_GEN_AVG_BLOCK_SIZE;
+}
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -583,14 +657,60 @@ static inline void code_gen_alloc(size_t tb_size)
             tcg_ctx.code_gen_buffer_size - 1024;
     tcg_ctx.code_gen_buffer_size -= 1024;
 
-    tcg_ctx.code_gen_buffer_max_size = tcg_ctx.code_gen_buffer_size -
-        (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
-    tcg_ctx.code_gen_max_blocks = tcg_ctx.code_gen_buffer_size /
-            CODE_GEN_AVG_BLOCK_SIZE;
-    tcg_ctx.tb_ctx.tbs =
-            g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+    alloc_tbs(tcg_ctx.code_gen_buffer_size);
+
+#ifdef USE_GROWABLE_CODE_GEN_BUFFER
+    code_gen_buffer_limit = tcg_ctx.code_gen_buffer_size;
+    map_exec(tcg_ctx.code_gen_prologue, 1024);
+    if (code_gen_buffer_growable) {
+        code_gen_buffer_set_size(MIN(DEFAULT_CODE_GEN_BUFFER_SIZE,
+                                     code_gen_buffer_limit));
+    } else {
+        code_gen_buffer_set_size(code_gen_buffer_limit);
+    }
+#else
+    code_gen_buffer_set_size(tcg_ctx.code_gen_buffer_size);
+#endif
 }
 
+#ifdef USE_GROWABLE_CODE_GEN_BUFFER
+/* Enlarge the usable part of a growable buffer to code_gen_buffer_target,
+   or double it if FULL is set.  Neither the buffer nor the TB array move,
+   so this is safe while translation blocks are live.  */
+static void code_gen_buffer_grow(bool full)
+{
+    size_t size = tcg_ctx.code_gen_buffer_size;
+
+    if (!code_gen_buffer_growable) {
+        return;
+    }
+    if (full) {
+        size *= 2;
+    }
+    size = MIN(MAX(size, code_gen_buffer_target), code_gen_buffer_limit);
+    if (size > tcg_ctx.code_gen_buffer_size) {
+        code_gen_buffer_set_size(size);
+    }
+}
+
+/* Called by the user mode loader with the size of each executable segment
+   it maps, so that large programs start with a buffer big enough for
+   their code instead of having to grow into it one flush at a time.  */
+void tcg_exec_text_hint(unsigned long text_size)
+{
+    code_gen_buffer_target += text_size * CODE_GEN_TEXT_RATIO;
+    code_gen_buffer_grow(false);
+}
+#else
+static inline void code_gen_buffer_grow(bool full)
+{
+}
+
+void tcg_exec_text_hint(unsigned long text_size)
+{
+}
+#endif
+
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
@@ -599,7 +719,11 @@ void tcg_exec_init(unsigned long tb_size)
     cpu_gen_init();
     code_gen_alloc(tb_size);
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+#ifdef USE_GROWABLE_CODE_GEN_BUFFER
+    tcg_register_jit(tcg_ctx.code_gen_buffer, code_gen_buffer_limit);
+#else
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
+#endif
     page_init();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
@@ -713,7 +837,12 @@ void tb_flush(CPUArchState *env1)
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
-    tcg_ctx.tb_ctx.tb_flush_count++;
+    /* Lockless jump cache lookups compare the flush count before and
+       after probing; make the new count visible before any TB can be
+       reused.  */
+    atomic_set(&tcg_ctx.tb_ctx.tb_flush_count,
+               tcg_ctx.tb_ctx.tb_flush_count + 1);
+    smp_wmb();
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -938,6 +1067,10 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
+/* Not reentrant: tcg_ctx and the TCG globals of the target translators
+   are shared by all CPUs, so two TBs cannot be generated at once.  In
+   user mode, cpu_exec() translates under tb_lock; only lookups of TBs
+   that already exist run without it.  */
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -954,6 +1087,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (!tb) {
         /* flush must be done */
         tb_flush(env);
+        /* the buffer is empty now, so it may grow */
+        code_gen_buffer_grow(true);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -1565,6 +1700,19 @@ void cpu_interrupt(CPUState *cpu, int mask)
     cpu->tcg_exit_req = 1;
 }
 
+void dump_tb_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+    cpu_fprintf(f, "Translation buffer state:\n");
+    cpu_fprintf(f, "gen code size       %td/%zd\n",
+                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
+                tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "TB count            %d/%d\n",
+                tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
+    cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB invalidate count %d\n",
+                tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+}
+
 /*
  * Walks guest process memory "regions" one by one
  * and calls callback function 'fn' for each region.
@@ -1762,6 +1910,13 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
         if (!(p->flags & PAGE_VALID)) {
             return -1;
         }
+        /* the caller is going to access the page directly, so read in
+           its contents if this has been deferred */
+        if (p->flags & PAGE_LAZY) {
+            if (mmap_populate(addr, TARGET_PAGE_SIZE) < 0) {
+                return -1;
+            }
+        }
 
         if ((flags & PAGE_READ) && !(p->flags & PAGE_READ)) {
             return -1;
@@ -98,6 +98,9 @@ static inline int handle_cpu_signal(uintptr_t pc, unsigned long address,
                 pc, address, is_write, *(unsigned long *)old_set);
 #endif
     /* XXX: locking issue */
+    if (h2g_valid(address) && mmap_populate_fault(h2g(address), is_write)) {
+        return 1;
+    }
     if (is_write && h2g_valid(address)
         && page_unprotect(h2g(address), pc, puc)) {
         return 1;
@@ -15,6 +15,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -400,3 +401,160 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
     return hb;
 }
+
+/* Number of words in each level of a bitmap with size bits at the bottom */
+static void hb_level_sizes(uint64_t size, uint64_t *sizes)
+{
+    unsigned i;
+
+    for (i = HBITMAP_LEVELS; i-- > 0; ) {
+        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        sizes[i] = size;
+    }
+}
+
+/* Recompute the upper levels and the count from the bottom level */
+static void hb_rebuild(HBitmap *hb)
+{
+    uint64_t sizes[HBITMAP_LEVELS];
+    uint64_t i;
+    unsigned lev;
+
+    hb_level_sizes(hb->size, sizes);
+    for (lev = HBITMAP_LEVELS - 1; lev > 0; lev--) {
+        memset(hb->levels[lev - 1], 0, sizes[lev - 1] * sizeof(unsigned long));
+        for (i = 0; i < sizes[lev]; i++) {
+            if (hb->levels[lev][i]) {
+                hb->levels[lev - 1][i >> BITS_PER_LEVEL] |=
+                    1UL << (i & (BITS_PER_LONG - 1));
+            }
+        }
+    }
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+
+    hb->count = 0;
+    for (i = 0; i < sizes[HBITMAP_LEVELS - 1]; i++) {
+        hb->count += popcountl(hb->levels[HBITMAP_LEVELS - 1][i]);
+    }
+}
+
+void hbitmap_reset_all(HBitmap *hb)
+{
+    uint64_t sizes[HBITMAP_LEVELS];
+    unsigned i;
+
+    hb_level_sizes(hb->size, sizes);
+    for (i = 0; i < HBITMAP_LEVELS; i++) {
+        memset(hb->levels[i], 0, sizes[i] * sizeof(unsigned long));
+    }
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    hb->count = 0;
+}
+
+bool hbitmap_merge(HBitmap *a, const HBitmap *b)
+{
+    uint64_t sizes[HBITMAP_LEVELS];
+    uint64_t i;
+
+    if (a->size != b->size || a->granularity != b->granularity) {
+        return false;
+    }
+
+    hb_level_sizes(a->size, sizes);
+    for (i = 0; i < sizes[HBITMAP_LEVELS - 1]; i++) {
+        a->levels[HBITMAP_LEVELS - 1][i] |= b->levels[HBITMAP_LEVELS - 1][i];
+    }
+    hb_rebuild(a);
+    return true;
+}
+
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb)
+{
+    /* Serialized data is made of 64-bit words even if longs are smaller */
+    return 64ULL << hb->granularity;
+}
+
+/* Range of bottom level words, in 64-bit units, that covers the items
+ * from start to start + count - 1
+ */
+static void serialization_chunk(const HBitmap *hb, uint64_t start,
+                                uint64_t count, uint64_t *first_el,
+                                uint64_t *el_count)
+{
+    uint64_t last = start + count - 1;
+    uint64_t gran = hbitmap_serialization_granularity(hb);
+
+    assert((start & (gran - 1)) == 0);
+    assert((last >> hb->granularity) < hb->size);
+    if ((last >> hb->granularity) != hb->size - 1) {
+        assert((count & (gran - 1)) == 0);
+    }
+
+    start = (start >> hb->granularity) >> 6;
+    last = (last >> hb->granularity) >> 6;
+    *first_el = start * (64 / BITS_PER_LONG);
+    *el_count = (last - start + 1) * (64 / BITS_PER_LONG);
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count)
+{
+    uint64_t el_count, first_el;
+
+    if (count == 0) {
+        return 0;
+    }
+    serialization_chunk(hb, start, count, &first_el, &el_count);
+    return el_count * sizeof(unsigned long);
+}
+
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    uint64_t el_count, first_el, i, len;
+    unsigned long *out = (unsigned long *)buf;
+
+    if (count == 0) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &first_el, &el_count);
+
+    len = (hb->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL;
+    for (i = 0; i < el_count; i++) {
+        unsigned long el = 0;
+
+        /* With 32-bit longs, the last 64-bit word may not exist */
+        if (first_el + i < len) {
+            el = hb->levels[HBITMAP_LEVELS - 1][first_el + i];
+        }
+        out[i] = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
+    }
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count,
+                              bool finish)
+{
+    uint64_t el_count, first_el, i, len;
+    unsigned long *in = (unsigned long *)buf;
+
+    if (count == 0) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &first_el, &el_count);
+
+    len = (hb->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL;
+    for (i = 0; i < el_count && first_el + i < len; i++) {
+        hb->levels[HBITMAP_LEVELS - 1][first_el + i] =
+            (BITS_PER_LONG == 32 ? le32_to_cpu(in[i]) : le64_to_cpu(in[i]));
+    }
+
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_finish(HBitmap *hb)
+{
+    hb_rebuild(hb);
+}
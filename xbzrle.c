@@ -11,8 +11,179 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Run boundaries
+ *
+ * zrun_end returns the offset of the first byte from i on that differs
+ * between old_buf and new_buf, nzrun_end the offset of the first one that
+ * is equal in both; either returns slen if there is none.  The vector
+ * versions compare 16 or 32 bytes at once and take the boundary from the
+ * movemask of the comparison; they find exactly the same boundaries as
+ * the word at a time ones, so the encoding does not depend on the host.
+ */
+
+static int zrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+    if (res) {
+        return i;
+    }
+
+    /* word at a time for speed */
+    while (i < slen &&
+           (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int nzrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    /* truncation to 32-bit long okay */
+    long mask = (long)0x0101010101010101ULL;
+    long res = (slen - i) % sizeof(long);
+    long xor;
+
+    /* not aligned to sizeof(long) */
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+    if (res) {
+        return i;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    while (i < slen) {
+        xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* found the end of an nzrun within the current long */
+            while (old_buf[i] != new_buf[i]) {
+                i++;
+            }
+            break;
+        }
+        i += sizeof(long);
+    }
+    return i;
+}
+
+#if defined __SSE2__
+static int zrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    uint32_t neq;
+
+    for (; i + 16 <= slen; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+
+        neq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+        if (neq) {
+            return i + ctz32(neq);
+        }
+    }
+    return zrun_end_long(old_buf, new_buf, i, slen);
+}
+
+static int nzrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    uint32_t eq;
+
+    for (; i + 16 <= slen; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+
+        eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return nzrun_end_long(old_buf, new_buf, i, slen);
+}
+
+#define zrun_end_default  zrun_end_sse2
+#define nzrun_end_default nzrun_end_sse2
+#else
+#define zrun_end_default  zrun_end_long
+#define nzrun_end_default nzrun_end_long
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+static int __attribute__((target("avx2")))
+zrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t neq;
+
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+
+        neq = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        if (neq) {
+            return i + ctz32(neq);
+        }
+    }
+    return zrun_end_default(old_buf, new_buf, i, slen);
+}
+
+static int __attribute__((target("avx2")))
+nzrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t eq;
+
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+
+        eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return nzrun_end_default(old_buf, new_buf, i, slen);
+}
+#endif
+
+static int (*zrun_end)(const uint8_t *old_buf, const uint8_t *new_buf,
+                       int i, int slen) = zrun_end_default;
+static int (*nzrun_end)(const uint8_t *old_buf, const uint8_t *new_buf,
+                        int i, int slen) = nzrun_end_default;
+
+#ifdef CONFIG_AVX2_OPT
+static void __attribute__((constructor)) xbzrle_init(void)
+{
+    if (host_cpu_has_avx2()) {
+        zrun_end = zrun_end_avx2;
+        nzrun_end = nzrun_end_avx2;
+    }
+}
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -27,8 +198,7 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res, xor;
+    int d = 0, i = 0, end;
     uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
@@ -40,28 +210,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        end = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,40 +226,16 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = (long)0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        end = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
+        i = end;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -117,7 +244,6 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;